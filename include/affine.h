@@ -0,0 +1,51 @@
+#pragma once
+
+// ====================================================== //
+// ========= Affine background layer ("mode 7") ========= //
+// ====================================================== //
+
+#include "vga.h"
+
+// Maps screen (x, y) to source (u, v) in 16.16 fixed point:
+//   u = a * x + b * y + tx
+//   v = c * x + d * y + ty
+// The offsets are 64-bit: perspective starts the lines just below the
+// horizon hundreds of thousands of pixels away
+struct AffineMatrix
+{
+    int32_t a, b;
+    int32_t c, d;
+    int64_t tx, ty;
+};
+
+enum class AffineEdge
+{
+    Wrap,
+    Clamp
+};
+
+// Rewrites the matrix for scanline `y` before it is sampled, e.g. for
+// perspective; returning false leaves the line black
+typedef bool (*AffineLineHook)(AffineMatrix &m, int y, int width, int height);
+
+struct AffineLayer
+{
+    const Image   *source;
+    AffineMatrix   matrix;
+    AffineEdge     edge;
+    AffineLineHook lineHook;
+};
+
+extern AffineLayer affineLayer;
+
+AffineMatrix affineIdentity();
+AffineMatrix affineRotateZoom(
+        double angle, double zoom, double u, double v, double x, double y);
+bool affinePerspective(AffineMatrix &m, int y, int width, int height);
+void affineSampleLine(const Image &source, const AffineMatrix &m,
+        AffineEdge edge, Color *line, int y, int width, int step = 1);
+void affineLine(Color *line, int y, int width, int height, uint32_t frame,
+        int step);
+void setAffineMatrix(const AffineMatrix &m);
+bool testAffine();
+void benchmarkAffine(const Image &source, const VGAMode &mode);
@@ -0,0 +1,112 @@
+#pragma once
+
+// ====================================================== //
+// ======= Memory placement aware frame/line buffers ==== //
+// ====================================================== //
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_POOL_FRAMES 4             // 640x480 frames carved out of PSRAM
+#define LINE_POOL_BLOCKS  16            // DMA-capable internal line buffers
+#define LINE_POOL_BLOCK   (640 * 3)     // one RGB scanline
+#define SCRATCH_ARENA     (64 * 1024)   // reset after every request
+#define CHUNK_POOL_BLOCKS 8             // file streaming chunks
+#define CHUNK_POOL_BLOCK  4096
+#define SEND_POOL_BLOCKS  4             // two double-buffered downloads
+#define SEND_POOL_BLOCK   (16 * 1024)
+
+enum class MemoryRegion
+{
+    Psram,
+    Internal,
+    InternalDma
+};
+
+// Every allocator registers itself so its watermarks can be listed
+class Allocator
+{
+protected:
+    size_t inUse{};
+    size_t peak{};
+
+    void track(ptrdiff_t bytes);
+
+public:
+    const char        *name;
+    const MemoryRegion region;
+    Allocator         *next;
+
+    Allocator(const char *name, MemoryRegion region);
+    virtual ~Allocator();
+
+    virtual void  *allocate(size_t size, size_t align = 16) = 0;
+    virtual void   deallocate(void *p)                      = 0;
+    virtual size_t capacity() const;
+
+    size_t used() const
+    {
+        return inUse;
+    }
+
+    size_t highWater() const
+    {
+        return peak;
+    }
+};
+
+// Plain heap allocations placed in one region
+class HeapAllocator : public Allocator
+{
+public:
+    HeapAllocator(const char *name, MemoryRegion region);
+
+    void *allocate(size_t size, size_t align = 16) override;
+    void  deallocate(void *p) override;
+};
+
+// Fixed-size blocks carved out of one allocation made at boot, so long
+// uptimes cannot fragment them; requests that do not fit go to `fallback`
+class BlockPool : public Allocator
+{
+private:
+    uint8_t   *base;
+    size_t     blockSize;
+    size_t     blocks;
+    void      *freeList;
+    Allocator *fallback;
+
+public:
+    BlockPool(const char *name, size_t blockSize, size_t blocks,
+            MemoryRegion region, Allocator *fallback);
+
+    void  *allocate(size_t size, size_t align = 16) override;
+    void   deallocate(void *p) override;
+    size_t capacity() const override;
+};
+
+// Bump allocator: individual frees are no-ops, reset() drops everything
+class Arena : public Allocator
+{
+private:
+    uint8_t *base;
+    size_t   size;
+
+public:
+    Arena(const char *name, size_t size, MemoryRegion region);
+
+    void  *allocate(size_t size, size_t align = 16) override;
+    void   deallocate(void *p) override;
+    size_t capacity() const override;
+    void   reset();
+};
+
+void      *regionAlloc(size_t size, size_t align, MemoryRegion region);
+void       regionFree(void *p);
+Allocator *firstAllocator();
+Allocator &heapAllocator(MemoryRegion region);
+Allocator &frameAllocator();
+Allocator &lineAllocator();
+Allocator &chunkAllocator(size_t chunkSize = CHUNK_POOL_BLOCK);
+Arena     &scratchArena();
+bool       testAllocator(int cycles);
@@ -0,0 +1,225 @@
+#pragma once
+
+// ====================================================== //
+// ======= Logic-analyzer captures of the VGA signal ===== //
+// ====================================================== //
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "http.h"
+#include "image.h"
+#include "metrics.h"
+#include "monitor.h"
+
+#define LOGIC_SIGNALS  15    // syncs, blank, DAC clock, latches, colour bus
+#define LOGIC_LINE_MAX 1024  // longest CSV line or VCD token read
+
+enum class LogicFormat
+{
+    Csv,  // sigrok/PulseView: a row per sample, or per change with times
+    Vcd
+};
+
+// The signals a capture is read into, bit n of the levels for signal n
+enum class LogicSignal
+{
+    Hsync,
+    Vsync,
+    Blank,
+    DacClk,
+    LatchR,
+    LatchG,
+    LatchB,
+    Bus0  // to Bus0 + 7
+};
+
+// Which capture channel carries each signal, matched without regard to
+// case; an empty name, or one the capture lacks, leaves the signal at
+// its idle level: high for the syncs and blank, low for the rest
+struct LogicChannels
+{
+    std::string names[LOGIC_SIGNALS];
+    double      sampleRate;  // Hz, for a CSV that gives neither
+};
+
+// HSYNC, VSYNC, BLANK, DACCLK, LE_R, LE_G, LE_B and C0 to C7, the names
+// LogicWriter gives them
+LogicChannels defaultLogicChannels();
+
+// Overrides `channels` from "hsync=D0,vsync=D1,c0=D8,rate=24e6"; signal
+// names are those of defaultLogicChannels(). False on an unknown one.
+bool parseLogicChannels(const char *text, LogicChannels &channels);
+
+// Where each signal lies among the levels a LogicReader hands over
+MonitorPins logicMonitorPins();
+
+// Every change of the signals, with the level of signal n in bit n
+typedef std::function<void(uint64_t atNs, uint64_t levels)> LogicSink;
+
+// Reads a capture in whatever pieces it arrives in, handing each change
+// of the wanted signals to a sink. CSV is what sigrok and PulseView
+// export: `;` comments, one of which may give the sample rate, a header
+// row of channel names, then either a row per sample or a first column
+// of times in seconds. VCD takes one-bit wires; changes that share a
+// timestamp are handed over together.
+class LogicReader
+{
+private:
+    enum class State
+    {
+        Header,
+        Data,
+        End,
+        Error
+    };
+
+    LogicFormat   format{};
+    LogicChannels channels;
+    LogicSink     sink;
+    State         state = State::End;
+    char          text[LOGIC_LINE_MAX];  // the line or token being read
+    size_t        used{};
+    uint32_t      lineNumber{};
+    int8_t        bits[64];  // signal of each capture channel, -1 for none
+    int           columns{};
+    uint64_t      levels{};
+    uint64_t      sent{};      // levels the sink has last been given
+    bool          sentAny{};
+    uint64_t      at{};        // ns of the changes being gathered
+    uint32_t      matched{};   // signals found in the capture
+
+    // CSV
+    bool     timed{};     // the first column holds times
+    double   sampleNs{};
+    uint64_t sample{};
+
+    // VCD
+    std::string section;  // keyword of the section being read
+    std::string words;    // its contents
+    std::string ids[64];  // identifier codes of the channels
+    double      unitNs{ 1 };
+    char        pending[LOGIC_LINE_MAX]{};  // a vector value, before its id
+
+    bool line();
+    bool token();
+    bool csvHeader(char *row);
+    bool csvRow(char *row);
+    bool vcdSection();
+    bool vcdChange(const char *value, const char *id);
+    bool channel(int column, const char *name);
+    void emit();
+    bool fail(const char *why);
+
+public:
+    // `channels` picks the capture channels that become signals
+    void begin(LogicFormat format, const LogicChannels &channels,
+            LogicSink sink);
+    bool write(const char *data, size_t size);
+    bool finish();
+
+    // Signals the capture has a channel for, bit n for signal n
+    uint32_t found() const
+    {
+        return matched;
+    }
+};
+
+// Writes signal changes as a capture, with the channels named after
+// `channels`: VCD records every change at its nanosecond, CSV has a row
+// per sample at `sampleRate`, as sigrok writes it, with each signal's
+// level at that instant
+class LogicWriter
+{
+private:
+    LogicFormat    format;
+    LogicChannels  channels;
+    ChunkedWriter &out;
+    double         sampleNs;
+    uint64_t       levels{};
+    uint64_t       sample{};
+    bool           started{};
+    char           row[2 * LOGIC_SIGNALS];  // levels and commas, newline
+
+    void header();
+    void writeRows(uint64_t untilNs);
+
+public:
+    LogicWriter(LogicFormat format, const LogicChannels &channels,
+            ChunkedWriter &out, double sampleRate = 100e6);
+
+    void signal(uint64_t atNs, uint64_t levels);
+
+    // Ends the capture at `atNs`, past the last change
+    void finish(uint64_t atNs);
+};
+
+// An ideal signal of `mode` showing `image`, as the scanout lays it out:
+// a frame is the vertical porches and sync, then lines of the horizontal
+// porches and sync followed by the picture, every `step`th pixel of it
+// latched and clocked into the DAC. The first frame starts at 0; a
+// closing vsync after the last makes `frames` complete ones. Returns the
+// ns the signal ends at.
+uint64_t synthesizeSignal(const VGAMode &mode, const ImageView &image,
+        int frames, int step, const LogicSink &sink);
+
+// Decodes a capture with a VirtualMonitor and measures what it leaves
+// out: how steady the syncs and the DAC clock are, and the pixel clock
+// the picture actually gets
+class SignalAnalyzer
+{
+private:
+    VGAMode        mode;
+    VirtualMonitor monitor;
+    uint64_t       levels;
+    uint64_t       hsyncFall{};
+    uint64_t       hsyncPeriod{};
+    uint64_t       vsyncFall{};
+    uint64_t       vsyncPeriod{};
+    uint64_t       dacRise{};
+    uint64_t       dacPeriod{};  // 0 when the last clock began a line
+    uint64_t       unblankedAt{};
+    uint64_t       visibleNs{};
+    uint32_t       visibleClocks{};
+
+    void period(Histogram &jitter, uint64_t at, uint64_t &last,
+            uint64_t &lastPeriod);
+
+public:
+    // Cycle-to-cycle jitter, ns between one period and the next
+    Histogram hsyncJitter;  // lines within a frame
+    Histogram vsyncJitter;
+    Histogram pixelJitter;  // DAC clocks within a line
+
+    explicit SignalAnalyzer(const VGAMode &mode);
+
+    void signal(uint64_t atNs, uint64_t levels);
+
+    // MHz of DAC clocks while unblanked, 0 before any
+    double pixelClock() const;
+
+    const VirtualMonitor &decoder() const
+    {
+        return monitor;
+    }
+
+    // The monitor's report, the pixel clock and the jitter histograms
+    void writeReport(std::string &out) const;
+};
+
+bool testAnalyzer();
+
+#ifndef ARDUINO
+// Analyzes a .vcd or .csv capture file into `out`; `last` gets the last
+// frame. False when it cannot be read.
+bool analyzeCaptureFile(const char *path, const LogicChannels &channels,
+        const VGAMode &mode, std::string &out, Image *last = nullptr);
+
+// Scans `frames` frames out through the simulated HAL into a capture
+// file, for PulseView or analyzeCaptureFile()
+bool writeScanoutCapture(const char *path, int frames);
+
+void benchmarkAnalyzer();
+#endif
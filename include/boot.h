@@ -0,0 +1,124 @@
+#pragma once
+
+// ====================================================== //
+// ============ Concurrent boot and snapshots =========== //
+// ====================================================== //
+
+#include <functional>
+#include <initializer_list>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#define BOOT_MAX_PHASES    8
+#define BOOT_TASK_STACK    8192
+#define SNAPSHOT_PATH      "/.snapshot.raw"
+#define SNAPSHOT_SETTLE_MS 2000  // a frame must stay this long to be saved
+
+// Returns false when the phase failed; phases after it are skipped
+typedef std::function<bool()> BootStep;
+
+enum class PhaseState
+{
+    Waiting,
+    Running,
+    Done,
+    Failed,
+    Skipped  // something it comes after failed or was skipped
+};
+
+struct BootPhase
+{
+    const char *name;
+    BootStep    step;
+    uint32_t    after;        // bit i: phase i must have succeeded first
+    PhaseState  state;
+    uint32_t    startMicros;  // since run()
+    uint32_t    endMicros;
+};
+
+// Runs each phase as a task of its own as soon as the phases it comes
+// after are done, so independent ones overlap and the slowest (usually
+// Wi-Fi) holds up nothing but what needs it. run() returns at once; the
+// phase that finishes last logs how long each took.
+class BootSequence
+{
+private:
+    struct Launch
+    {
+        BootSequence *sequence;
+        int           index;
+    };
+
+    BootPhase phases[BOOT_MAX_PHASES]{};
+    Launch    launches[BOOT_MAX_PHASES]{};
+    int       count{};
+    int       finished{};
+    uint32_t  start{};
+    uint32_t  firstFrame{};  // 0 until frameShown()
+#ifdef ARDUINO
+    SemaphoreHandle_t lock{};
+    SemaphoreHandle_t allDone{};
+#else
+    std::mutex              lock;
+    std::condition_variable allDone;
+    std::thread             workers[BOOT_MAX_PHASES];
+#endif
+
+    void        launchReady();
+    void        runPhase(int index);
+    static void phaseTask(void *args);
+
+public:
+    BootSequence();
+    ~BootSequence();
+
+    BootSequence(const BootSequence &)            = delete;
+    BootSequence &operator=(const BootSequence &) = delete;
+
+    // Returns the phase's index, for others to come after, or -1
+    int add(const char *name, BootStep step,
+            std::initializer_list<int> after = {});
+
+    void run();
+    bool wait(uint32_t timeoutMs);  // until every phase has finished
+    void frameShown();              // notes the time to the first frame
+    void log() const;
+
+    int phaseCount() const
+    {
+        return count;
+    }
+
+    const BootPhase &phase(int index) const
+    {
+        return phases[index];
+    }
+
+    uint32_t firstFrameMicros() const
+    {
+        return firstFrame;
+    }
+};
+
+// A snapshot is the frame's raw RGB888 rows behind a 16-byte header;
+// saving goes through a temporary file, so a reset midway never leaves a
+// torn one behind
+bool saveSnapshot(const char *path, const ImageView &frame);
+bool loadSnapshot(const char *path, const ImageView &frame);
+
+// Saves whatever is on screen once it has stayed for SNAPSHOT_SETTLE_MS
+// after the last request, from a task of its own
+bool setupSnapshots();
+void requestSnapshot();
+
+bool testBoot(const char *dir);
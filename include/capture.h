@@ -0,0 +1,103 @@
+#pragma once
+
+// ====================================================== //
+// ============ Framebuffer capture encoders ============ //
+// ====================================================== //
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "http.h"
+#include "image.h"
+
+#define CAPTURE_MAX_SCALE 16  // largest downscale factor
+
+enum class CaptureFormat
+{
+    Png,
+    Qoi,
+    Raw  // RGB888 rows, top to bottom, no header
+};
+
+// How PNG image data is deflated
+enum class PngDeflate
+{
+    Store,  // no compression, but the length is known up front
+    Fast    // Sub filter and runs of repeated bytes, fixed Huffman codes
+};
+
+// Encodes an image a row at a time straight from its pixels, so a frame
+// is never copied; only one output row is kept. With `scale` above 1
+// every `scale` x `scale` block is averaged into one pixel, which makes
+// quick previews. The pixels are read as the rows go out, so an image
+// that changes meanwhile may be captured half old and half new.
+class FrameEncoder
+{
+private:
+    ImageView            source;
+    CaptureFormat        format;
+    PngDeflate           deflate;
+    int                  factor;
+    int                  outWidth;
+    int                  outHeight;
+    int                  y{};
+    bool                 started{};
+    std::vector<Color>   line;      // the downscaled row
+    std::vector<uint8_t> filtered;  // PNG scanline with its filter byte
+    std::vector<uint8_t> packed;    // compressed bytes of one row
+
+    // Deflate and PNG state
+    uint32_t adler{ 1 };
+    uint32_t bits{};
+    int      bitCount{};
+    bool     havePrevious{};
+    uint8_t  previous{};
+
+    // QOI state
+    Color    index[64]{};
+    bool     indexUsed[64]{};
+    Color    last{ 0, 0, 0 };
+    int      run{};
+
+    const Color *nextLine();
+    void         writeChunk(ChunkedWriter &out, const char *type,
+                    const uint8_t *data, size_t size);
+    void         putBits(uint32_t value, int count);
+    void         putLiteral(int symbol);
+    void         putRun(int length);
+    void         alignBits();
+    void         pngHeader(ChunkedWriter &out);
+    void         pngStoredRow(ChunkedWriter &out, bool lastRow);
+    void         pngFastRow(ChunkedWriter &out, bool lastRow);
+    void         qoiRow(ChunkedWriter &out, const Color *pixels, bool lastRow);
+
+public:
+    FrameEncoder(const ImageView &source, CaptureFormat format, int scale = 1,
+            PngDeflate deflate = PngDeflate::Fast);
+
+    FrameEncoder(const FrameEncoder &)            = delete;
+    FrameEncoder &operator=(const FrameEncoder &) = delete;
+
+    // Writes the next row (the first call adds the header, the last the
+    // trailer) and returns false once the image is complete
+    bool next(ChunkedWriter &out);
+
+    // Size of the whole output, or 0 when it depends on the pixels
+    size_t length() const;
+
+    int width() const
+    {
+        return outWidth;
+    }
+
+    int height() const
+    {
+        return outHeight;
+    }
+};
+
+bool        parseCaptureFormat(const char *name, CaptureFormat &format);
+const char *captureMimeType(CaptureFormat format);
+bool        testCapture();
+void        benchmarkCapture(const ImageView &source);
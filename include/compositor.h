@@ -0,0 +1,38 @@
+#pragma once
+
+// ====================================================== //
+// ========== Multi-layer compositing at scanout ======== //
+// ====================================================== //
+
+#include "vga.h"
+
+#define MAX_LAYERS 4
+
+enum class MaskFormat
+{
+    None,
+    Bits1,  // 8 pixels per byte, leftmost pixel in the high bit
+    Bits4   // 2 pixels per byte, leftmost pixel in the high nibble
+};
+
+// Layers are blended bottom to top over black, each with a global alpha
+// and an optional per-pixel mask that scales it
+struct Layer
+{
+    const Image   *image;
+    uint8_t        alpha;
+    const uint8_t *mask;
+    MaskFormat     maskFormat;
+    bool           enabled;
+};
+
+extern Layer layers[MAX_LAYERS];
+
+size_t maskRowBytes(int width, MaskFormat format);
+bool   setLayer(int index, const Image *image, uint8_t alpha);
+bool   setLayerMask(int index, const uint8_t *mask, MaskFormat format);
+bool   loadLayerMask(int index, const char *path, MaskFormat format);
+void   compositeLine(Color *line, int y, int width, int height, uint32_t frame,
+          int step);
+bool   testCompositor();
+void   benchmarkCompositor(const VGAMode &mode);
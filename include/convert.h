@@ -0,0 +1,57 @@
+#pragma once
+
+// ====================================================== //
+// ============== Pixel format conversion =============== //
+// ====================================================== //
+
+#include "image.h"
+
+// Whole rows of `n` pixels at a time. Each kernel has a portable scalar
+// version and, on little-endian targets, a SWAR version that moves four
+// pixels per 32-bit load; CONVERT_SWAR picks one at compile time.
+#ifndef CONVERT_SWAR
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CONVERT_SWAR 1
+#else
+#define CONVERT_SWAR 0
+#endif
+#endif
+
+// RGB565 values are native-endian unless a kernel says otherwise; RGBA
+// rows are bytes in r, g, b, a order as PNG stores them; ARGB pixels are
+// 32-bit words with alpha in the top byte.
+
+void rgb888ToRgb565(const Color *src, uint16_t *dst, int n);
+void rgb565ToRgb888(const uint16_t *src, Color *dst, int n);
+void rgb888ToRgb332(const Color *src, uint8_t *dst, int n);
+void rgb332ToRgb888(const uint8_t *src, Color *dst, int n);
+void indexedToRgb888(
+        const uint8_t *src, const Color *palette, Color *dst, int n);
+void rgb888ToIndexed(const Color *src, const Color *palette, int colors,
+        uint8_t *dst, int n);
+void grayToRgb888(const uint8_t *src, Color *dst, int n);
+void rgbaToRgb888(const uint8_t *src, Color *dst, int n);
+void argbToRgb888(const uint32_t *src, Color *dst, int n);
+void premultiplyRgba(const uint8_t *src, Color *dst, int n);
+void byteSwap16(uint16_t *pixels, int n);
+
+namespace scalar
+{
+void rgb888ToRgb565(const Color *src, uint16_t *dst, int n);
+void rgb565ToRgb888(const uint16_t *src, Color *dst, int n);
+void rgb888ToRgb332(const Color *src, uint8_t *dst, int n);
+void premultiplyRgba(const uint8_t *src, Color *dst, int n);
+void byteSwap16(uint16_t *pixels, int n);
+}  // namespace scalar
+
+namespace swar
+{
+void rgb888ToRgb565(const Color *src, uint16_t *dst, int n);
+void rgb565ToRgb888(const uint16_t *src, Color *dst, int n);
+void rgb888ToRgb332(const Color *src, uint8_t *dst, int n);
+void premultiplyRgba(const uint8_t *src, Color *dst, int n);
+void byteSwap16(uint16_t *pixels, int n);
+}  // namespace swar
+
+bool testConvert();
+void benchmarkConvert();
@@ -0,0 +1,59 @@
+#pragma once
+
+// ====================================================== //
+// ============== Cached directory listings ============= //
+// ====================================================== //
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+class ChunkedWriter;
+
+#define DIR_CACHE_DIRS 4    // directories whose index is kept
+#define DIR_PATH_MAX   128  // longest directory path that gets cached
+
+enum class DirSort
+{
+    None,  // as stored on the card
+    Name,
+    Size,
+    Type  // directories first, then by name
+};
+
+struct DirEntry
+{
+    const char *name;
+    uint32_t    size;
+    bool        isDir;
+};
+
+typedef std::function<void(const DirEntry &entry)> DirVisitor;
+
+// Visits up to `limit` entries (0 for all) starting at `offset`, in `sort`
+// order. The directory is scanned once and kept until invalidated, so
+// pages of a large folder cost no further card access. Returns the total
+// number of entries, or -1 when `path` is not a directory. The cache is
+// locked while visiting, so `visit` must not change the card.
+long forEachEntry(const char *path, DirSort sort, bool descending,
+        size_t offset, size_t limit, const DirVisitor &visit);
+
+// Entry count of `path`, loading its index; -1 when not a directory
+long dirEntryCount(const char *path);
+
+// The objects of that array alone, for a listing sent a few at a time;
+// `first` leaves out the comma before the first of them
+long writeDirEntries(ChunkedWriter &out, const char *path, DirSort sort,
+        bool descending, size_t offset, size_t limit, bool first);
+
+// Streams a page of the listing as the JSON array /listDir answers with
+long writeDirJson(ChunkedWriter &out, const char *path, DirSort sort,
+        bool descending, size_t offset, size_t limit);
+
+// Drops the cached index of `path`, of everything below it and of the
+// directory holding it; call after anything that changes the card
+void invalidateDir(const char *path);
+
+DirSort parseDirSort(const char *name);
+bool    testDirCache(const char *dir);
+void    benchmarkDirCache(const char *dir, int files);
@@ -8,11 +8,19 @@
 #include <SD.h>
 #include <vector>
 
+#include "allocator.h"
+#include "dircache.h"
+#include "jobs.h"
+#include "walk.h"
+#include "stream.h"
+
 #define SD_CS   15
 #define SD_MOSI 5
 #define SD_MISO 4
 #define SD_SCK  47
 
+#define SD_MOUNT_TRIES 5  // 100 ms apart
+
 struct DirListingItem
 {
     String name;
@@ -25,7 +33,9 @@ size_t                      sizeInMbytes(size_t bytes);
 std::vector<DirListingItem> listDir(const char *dirname);
 bool                        createDir(const char *path);
 bool                        removeDir(const char *path);
-uint8_t                    *readFile(const char *path);
+// The buffer comes from `allocator`, by default the per-request scratch arena
+uint8_t *readFile(const char *path, Allocator &allocator = scratchArena(),
+        size_t *size = nullptr);
 bool writeFile(const char *path, const uint8_t *bytes, size_t size,
         bool append = false);
 bool renameFile(const char *path1, const char *path2);
@@ -33,4 +43,4 @@ bool deleteFile(const char *path);
 bool deleteItem(String path);
 void testFileIO(const char *path);
 void testSD();
-void setupSD();
\ No newline at end of file
+bool setupSD();
\ No newline at end of file
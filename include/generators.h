@@ -0,0 +1,22 @@
+#pragma once
+
+// ====================================================== //
+// ========= Procedural scanline generators ============= //
+// ====================================================== //
+
+#include "vga.h"
+
+struct Generator
+{
+    const char   *name;
+    LineGenerator fill;
+};
+
+extern const Generator generators[];
+extern const size_t    generatorCount;
+
+const Generator *findGenerator(const char *name);
+bool             selectGenerator(const char *name);
+const char      *activeGeneratorName();
+bool             testGenerators();
+void             benchmarkGenerators(const VGAMode &mode);
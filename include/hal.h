@@ -0,0 +1,123 @@
+#pragma once
+
+// ====================================================== //
+// =========== Hardware access of the scanout =========== //
+// ====================================================== //
+
+#include <stdint.h>
+
+// The scanout reaches pins and timers through here only. On the board
+// these are the registers and the Arduino timer driver; in the native
+// build they drive a simulated machine whose pin changes a virtual
+// monitor can decode (see monitor.h).
+
+#define HAL_TIMER_HZ 40000000  // APB clock divided by 2
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+typedef hw_timer_t HalTimer;
+
+// Pins 32 and up live in the second output register
+static inline void IRAM_ATTR halGpioSet(uint64_t mask)
+{
+    if ((uint32_t) mask) {
+        REG_WRITE(GPIO_OUT_W1TS_REG, (uint32_t) mask);
+    }
+    if (mask >> 32) {
+        REG_WRITE(GPIO_OUT1_W1TS_REG, (uint32_t) (mask >> 32));
+    }
+}
+
+static inline void IRAM_ATTR halGpioClear(uint64_t mask)
+{
+    if ((uint32_t) mask) {
+        REG_WRITE(GPIO_OUT_W1TC_REG, (uint32_t) mask);
+    }
+    if (mask >> 32) {
+        REG_WRITE(GPIO_OUT1_W1TC_REG, (uint32_t) (mask >> 32));
+    }
+}
+
+static inline void halPinOutput(int pin)
+{
+    pinMode(pin, OUTPUT);
+}
+
+static inline void IRAM_ATTR halPinWrite(int pin, bool high)
+{
+    digitalWrite(pin, high ? HIGH : LOW);
+}
+
+static inline HalTimer *halTimerBegin(int number)
+{
+    return timerBegin(number, APB_CLK_FREQ / HAL_TIMER_HZ, true);
+}
+
+// Calls `isr` every `ticks`, counting again from 0 each time
+static inline void halTimerAlarm(HalTimer *timer, void (*isr)(), uint64_t ticks)
+{
+    timerAttachInterrupt(timer, isr, false);
+    timerAlarmWrite(timer, ticks, true);
+    timerAlarmEnable(timer);
+}
+
+static inline uint64_t IRAM_ATTR halTimerRead(HalTimer *timer)
+{
+    return timerRead(timer);
+}
+
+static inline void IRAM_ATTR halTimerWrite(HalTimer *timer, uint64_t ticks)
+{
+    timerWrite(timer, ticks);
+}
+
+static inline void halTimerRestart(HalTimer *timer)
+{
+    timerRestart(timer);
+}
+#else
+#include <functional>
+
+#define IRAM_ATTR
+#define APB_CLK_FREQ 80000000
+
+struct HalTimer;
+
+// What each access costs the simulated CPU, in ns. Code between accesses
+// is free, so the simulation shows the signal the accesses alone allow;
+// the defaults are rough figures for the ESP32-S3 at 240 MHz.
+struct HalCosts
+{
+    uint32_t gpioWrite = 25;
+    uint32_t pinWrite  = 150;  // digitalWrite()
+    uint32_t timerRead = 100;
+};
+
+// Every change of the output pins, with the level of pin n in bit n
+typedef std::function<void(uint64_t atNs, uint64_t levels)> HalPinSink;
+
+void     halGpioSet(uint64_t mask);
+void     halGpioClear(uint64_t mask);
+void     halPinOutput(int pin);
+void     halPinWrite(int pin, bool high);
+HalTimer *halTimerBegin(int number);
+void     halTimerAlarm(HalTimer *timer, void (*isr)(), uint64_t ticks);
+uint64_t halTimerRead(HalTimer *timer);
+void     halTimerWrite(HalTimer *timer, uint64_t ticks);
+void     halTimerRestart(HalTimer *timer);
+
+// ─── Simulation ─────────────────────────────────────────────────────────
+
+// Back to time 0 with every pin low; timers keep their alarms and count
+// again from 0. The sink stays.
+void     halSimReset(const HalCosts &costs = HalCosts());
+void     halSimSink(HalPinSink sink);
+uint64_t halSimNow();
+
+// Calls `loop` over and over until `ns` have passed. A timer alarm runs
+// its handler after the access that reached it, as an interrupt would
+// take over between two instructions; handlers do not nest, and an alarm
+// due while one runs is taken after it returns.
+void halSimRun(void (*loop)(), uint64_t ns);
+#endif
@@ -0,0 +1,79 @@
+#pragma once
+
+// ====================================================== //
+// ========== HTTP ranges and cache validators ========== //
+// ====================================================== //
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "allocator.h"
+
+#define DOWNLOAD_CHUNK SEND_POOL_BLOCK  // bytes per send, double buffered
+#define CHUNK_BUFFER   1024             // bytes batched per streamed chunk
+
+struct ByteRange
+{
+    size_t first;
+    size_t last;  // inclusive
+};
+
+// What to answer a download with: 200 with the whole file, 206 with
+// `range`, 304 when the client's copy is current or 416
+struct DownloadPlan
+{
+    int       status;
+    ByteRange range;
+    size_t    length;
+};
+
+struct Validators
+{
+    char etag[32];
+    char lastModified[32];
+};
+
+// Where a streamed body goes, e.g. an HttpServer connection
+typedef std::function<void(const char *data, size_t size)> ChunkSink;
+
+// Batches small writes into chunks of a body of unknown length, so a
+// response of any size is produced in constant memory
+class ChunkedWriter
+{
+private:
+    char      buf[CHUNK_BUFFER];
+    size_t    used{};
+    size_t    total{};
+    ChunkSink sink;
+
+public:
+    explicit ChunkedWriter(ChunkSink sink);
+    ~ChunkedWriter();
+
+    ChunkedWriter(const ChunkedWriter &)            = delete;
+    ChunkedWriter &operator=(const ChunkedWriter &) = delete;
+
+    void write(const char *data, size_t size);
+    void print(const char *text);
+    void print(unsigned long value);
+    void printJsonString(const char *text);
+    void flush();
+
+    size_t bytes() const
+    {
+        return total;
+    }
+};
+
+void         makeValidators(Validators &out, size_t size, time_t modified);
+int          parseRange(const char *header, size_t size, ByteRange &range);
+bool         etagListMatches(const char *list, const char *etag);
+int          revalidate(const char *etag, const char *ifNoneMatch);
+bool         ifRangeMatches(const char *ifRange, const Validators &validators);
+DownloadPlan planDownload(size_t size, const Validators &validators,
+        const char *range, const char *ifRange, const char *ifNoneMatch);
+bool         testHttpRanges(const char *dir);
+bool         testChunkedWriter();
+bool         testRevalidate();
@@ -0,0 +1,176 @@
+#pragma once
+
+// ====================================================== //
+// ============ Event-driven HTTP/1.1 server ============ //
+// ====================================================== //
+
+#include <functional>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "http.h"
+
+#define HTTPD_MAX_CLIENTS    6      // lwIP has 10 sockets, one listens
+#define HTTPD_HEAD_MAX       2048   // request line and headers
+#define HTTPD_READ_CHUNK     1460   // bytes per recv(), one TCP segment
+#define HTTPD_OUT_LOW        4096   // a body writer runs while less is queued
+#define HTTPD_ROUND_BYTES    16384  // sent per connection and round
+#define HTTPD_IDLE_MS        5000   // silent connections are closed then
+#define HTTPD_UNKNOWN_LENGTH ((size_t) -1)
+
+enum class HttpMethod
+{
+    Get,
+    Head,
+    Post,
+    Put,
+    Delete,
+    Other
+};
+
+enum class UploadStatus
+{
+    Start,
+    Write,
+    End,
+    Aborted  // the client went away before the file was complete
+};
+
+// One file of a multipart/form-data body, handed over as it arrives
+struct HttpUpload
+{
+    UploadStatus   status;
+    std::string    name;  // of the form field
+    std::string    filename;
+    const uint8_t *buf;          // valid during the Write call
+    size_t         currentSize;  // bytes at `buf`
+    size_t         totalSize;    // of the file so far
+
+    // Whatever the handler keeps for this request, as several uploads
+    // may be under way at once; dropped after the request's answer
+    std::shared_ptr<void> context;
+
+    // Bytes the handler takes without blocking; while a read might not
+    // fit, the socket is left unread and TCP holds the client back
+    std::function<size_t()> room;
+};
+
+struct HttpStats
+{
+    uint32_t accepted;  // connections
+    uint32_t requests;
+    uint32_t active;    // connections open now
+    uint32_t timeouts;  // connections closed for being idle
+    uint32_t rejected;  // malformed or oversized requests
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+};
+
+typedef std::function<void()> HttpHandler;
+
+// Produces the next piece of a streamed body, a few KB at most, and
+// returns false once the body is complete. Runs from poll() whenever the
+// connection has drained, so it must keep whatever state it needs.
+typedef std::function<bool(ChunkedWriter &out)> BodyWriter;
+
+// Serves any number of routes to several clients at once from a single
+// task. Sockets never block: each connection is a small state machine
+// fed by select(), uploads reach their handler as they arrive and large
+// bodies are pulled from a BodyWriter only as fast as the client takes
+// them, so one slow transfer cannot hold up the others. While a handler
+// runs, the accessors below describe its request; handlers must answer
+// promptly, as every other connection waits meanwhile. Runs the same on
+// lwIP and on Linux.
+class HttpServer
+{
+private:
+    struct Route
+    {
+        std::string pattern;  // "{}" matches one path segment
+        HttpMethod  method;
+        HttpHandler handler;
+        HttpHandler upload;
+    };
+    struct Connection;
+
+    uint16_t                    listenPort;
+    int                         listener = -1;
+    std::vector<Route>          routes;
+    HttpHandler                 notFound;
+    std::unique_ptr<Connection> clients[HTTPD_MAX_CLIENTS];
+    Connection                 *current{};  // whose handler is running
+    HttpStats                   stats{};
+
+    void acceptClients();
+    void close(std::unique_ptr<Connection> &client);
+    bool held(Connection &c);
+    bool receive(Connection &c);
+    bool process(Connection &c);
+    bool parseHead(Connection &c, size_t end);
+    size_t feedBody(Connection &c, const char *data, size_t size);
+    void feedUpload(Connection &c, const char *data, size_t size);
+    void emitUpload(Connection &c, UploadStatus status, const char *data,
+            size_t size);
+    void dispatch(Connection &c);
+    void reject(Connection &c, int status, const char *message);
+    void startReply(Connection &c, int status, const char *type,
+            size_t length);
+    bool transmit(Connection &c);
+    void finishReply(Connection &c);
+    bool match(const Route &route, Connection &c) const;
+
+public:
+    explicit HttpServer(uint16_t port = 80);
+    ~HttpServer();
+
+    HttpServer(const HttpServer &)            = delete;
+    HttpServer &operator=(const HttpServer &) = delete;
+
+    void on(const char *pattern, HttpMethod method, HttpHandler handler,
+            HttpHandler upload = nullptr);
+    void onNotFound(HttpHandler handler);
+
+    // Port 0 picks a free one, see port()
+    bool     begin();
+    void     end();
+    uint16_t port() const;
+
+    // Waits up to `timeoutMs` for network events and handles them all
+    void poll(uint32_t timeoutMs);
+
+    const HttpStats &lastStats() const
+    {
+        return stats;
+    }
+
+    // ─── The Request Being Handled ──────────────────────────────────────
+
+    HttpMethod         method() const;
+    const std::string &uri() const;  // path only
+    bool               hasArg(const char *name) const;
+    const std::string &arg(const char *name) const;  // "" when missing
+    const std::string &pathArg(size_t index) const;
+    const std::string &header(const char *name) const;
+    HttpUpload        &upload();
+
+    // ─── Answers ────────────────────────────────────────────────────────
+
+    // Extra headers go before send() or sendStream(); the first answer
+    // to a request wins, later ones are dropped
+    void sendHeader(const char *name, const char *value);
+    void send(int status, const char *type = nullptr, const char *body = "");
+    void send(int status, const char *type, const std::string &body);
+    void send(int status, const char *type, const void *body, size_t size);
+
+    // Chunked when `length` is HTTPD_UNKNOWN_LENGTH; a HEAD request gets
+    // the headers and `writer` is never called
+    void sendStream(int status, const char *type, BodyWriter writer,
+            size_t length = HTTPD_UNKNOWN_LENGTH);
+};
+
+bool testHttpServer();
+void benchmarkHttpServer(int clients, int requests);
@@ -0,0 +1,166 @@
+#pragma once
+
+// ====================================================== //
+// ================ RGB Images in memory ================ //
+// ====================================================== //
+
+#include "allocator.h"
+
+struct Color
+{
+    unsigned char r, g, b;
+};
+
+// A window into pixels owned by someone else; rows are `stride` pixels
+// apart, so a view of a sub-rectangle needs no copy
+struct ImageView
+{
+    Color *pixels{};
+    int    stride{};
+    int    width{};
+    int    height{};
+
+    Color *row(int y) const
+    {
+        return pixels + y * stride;
+    }
+
+    Color get(int x, int y) const
+    {
+        return pixels[y * stride + x];
+    }
+
+    void set(int x, int y, Color c) const
+    {
+        pixels[y * stride + x] = c;
+    }
+
+    bool empty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+
+    // Clipped to this view, so the result never reaches outside of it
+    ImageView sub(int x, int y, int w, int h) const
+    {
+        if (x < 0) {
+            w += x;
+            x = 0;
+        }
+        if (y < 0) {
+            h += y;
+            y = 0;
+        }
+        w = x >= width ? 0 : (w < width - x ? w : width - x);
+        h = y >= height ? 0 : (h < height - y ? h : height - y);
+        if (w <= 0 || h <= 0) {
+            return ImageView{ pixels, stride, 0, 0 };
+        }
+        return ImageView{ pixels + y * stride + x, stride, w, h };
+    }
+};
+
+// Owns its pixels, which come from `allocator`; frames land in the PSRAM
+// frame pool unless asked otherwise. Images move but never copy.
+struct Image
+{
+    int        xres{};
+    int        yres{};
+    Color     *pixels{};
+    Allocator *allocator{};
+
+    Image(int xres = 640, int yres = 480,
+            Allocator &allocator = frameAllocator())
+        : xres(xres),
+          yres(yres),
+          pixels((Color *) allocator.allocate(xres * yres * sizeof(Color))),
+          allocator(&allocator)
+    {}
+
+    Image(const Image &)            = delete;
+    Image &operator=(const Image &) = delete;
+
+    Image(Image &&other) noexcept
+        : xres(other.xres),
+          yres(other.yres),
+          pixels(other.pixels),
+          allocator(other.allocator)
+    {
+        other.xres   = 0;
+        other.yres   = 0;
+        other.pixels = nullptr;
+    }
+
+    Image &operator=(Image &&other) noexcept
+    {
+        if (this != &other) {
+            allocator->deallocate(pixels);
+            xres         = other.xres;
+            yres         = other.yres;
+            pixels       = other.pixels;
+            allocator    = other.allocator;
+            other.xres   = 0;
+            other.yres   = 0;
+            other.pixels = nullptr;
+        }
+        return *this;
+    }
+
+    ~Image()
+    {
+        allocator->deallocate(pixels);
+    }
+
+    // Wraps pixels that were allocated from `owner`, which frees them
+    static Image adopt(int xres, int yres, Color *pixels, Allocator &owner)
+    {
+        return Image(xres, yres, pixels, &owner);
+    }
+
+    ImageView view() const
+    {
+        return ImageView{ pixels, xres, xres, yres };
+    }
+
+    ImageView view(int x, int y, int w, int h) const
+    {
+        return view().sub(x, y, w, h);
+    }
+
+    Color get(int x, int y) const
+    {
+        return pixels[y * xres + x];
+    }
+
+    void set(int x, int y, Color c)
+    {
+        pixels[y * xres + x] = c;
+    }
+
+private:
+    Image(int xres, int yres, Color *pixels, Allocator *allocator)
+        : xres(xres), yres(yres), pixels(pixels), allocator(allocator)
+    {}
+};
+
+// Blends `src` over `dst` by `a` in [0, 256]; red and blue share one
+// multiply since every 8.8 product stays below 1 << 16 and cannot carry
+// into the other field
+inline void blendPixel(Color &dst, Color src, uint32_t a)
+{
+    const uint32_t na = 256 - a;
+    const uint32_t rb = (((uint32_t) dst.r << 16 | dst.b) * na
+                                + ((uint32_t) src.r << 16 | src.b) * a)
+                        >> 8;
+    const uint32_t g  = (dst.g * na + src.g * a) >> 8;
+
+    dst.r = rb >> 16;
+    dst.g = g;
+    dst.b = rb;
+}
+
+void blit(const ImageView &dst, const ImageView &src);
+void fill(const ImageView &dst, Color c);
+void scale(const ImageView &dst, const ImageView &src);
+void downscaleRow(const ImageView &src, int factor, int y, Color *out);
+bool testImage();
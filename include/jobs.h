@@ -0,0 +1,65 @@
+#pragma once
+
+// ====================================================== //
+// ========== Background filesystem job queue =========== //
+// ====================================================== //
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_JOBS     8    // queued, running and recently finished jobs
+#define JOB_PATH_MAX 128
+#define WIPE_KEEP    "System Volume Information"
+
+enum class JobKind
+{
+    Delete,  // a file or a whole tree
+    Wipe     // everything on the card but the system folder
+};
+
+enum class JobState
+{
+    Queued,
+    Running,
+    Done,
+    Failed,  // finished, but some entries could not be removed
+    Cancelled
+};
+
+struct JobStatus
+{
+    uint32_t id;
+    JobKind  kind;
+    JobState state;
+    uint32_t removed;  // files and directories deleted so far
+    uint32_t errors;   // entries that could not be deleted
+    uint32_t micros;   // time spent running
+    char     path[JOB_PATH_MAX];
+};
+
+// Updated as a tree goes, so another task can watch it
+struct TreeProgress
+{
+    std::atomic<uint32_t>    removed{};
+    std::atomic<uint32_t>    errors{};
+    const std::atomic<bool> *cancel{};  // checked between entries
+};
+
+// Deletes `path` and everything below it without recursing: directories
+// wait on an explicit stack until their contents are gone. With
+// `keepRoot` only the contents go, sparing a top-level `keep` entry.
+bool removeTree(const char *path, bool keepRoot, const char *keep,
+        TreeProgress &progress);
+
+// These return the new job's id, or 0 when every slot is busy
+uint32_t submitDelete(const char *path);
+uint32_t submitWipe();
+
+bool        jobStatus(uint32_t id, JobStatus &status);
+size_t      listJobs(JobStatus *out, size_t max);
+bool        cancelJob(uint32_t id);
+const char *jobKindName(JobKind kind);
+const char *jobStateName(JobState state);
+bool        testJobs(const char *dir);
+void        benchmarkJobs(const char *dir, int files);
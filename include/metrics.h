@@ -0,0 +1,211 @@
+#pragma once
+
+// ====================================================== //
+// ============= Performance counters export ============ //
+// ====================================================== //
+
+#include <atomic>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+#define METRICS_CYCLE_HZ 240000000.0  // CPU clock, counted by CCOUNT
+#else
+#include <chrono>
+
+#define METRICS_CYCLE_HZ 1000000000.0  // nanoseconds stand in on the host
+#endif
+
+#define METRICS_CORES     2
+#define METRICS_MAX       48  // registered series
+#define HISTOGRAM_BUCKETS 24  // powers of two, the last one open-ended
+
+// Records must be cheap enough for the sync interrupts, so they are forced
+// inline into them, which also puts them in IRAM
+#define METRICS_INLINE inline __attribute__((always_inline))
+
+// The core running the caller; every counter keeps a slot per core so the
+// two never contend for one, and readers add the slots up
+METRICS_INLINE int metricsCore()
+{
+#ifdef ARDUINO
+    return xPortGetCoreID();
+#else
+    // Threads take turns at the slots, standing in for the two cores
+    static std::atomic<int> next{};
+    static thread_local int core = next++ % METRICS_CORES;
+    return core;
+#endif
+}
+
+METRICS_INLINE uint32_t cycleCount()
+{
+#ifdef ARDUINO
+    uint32_t cycles;
+    asm volatile("rsr %0, ccount" : "=a"(cycles));
+    return cycles;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+}
+
+// Counts events from any task or interrupt on either core without locks;
+// each core's slot wraps at 2^32, which Prometheus takes as a reset
+class Counter
+{
+private:
+    std::atomic<uint32_t> slots[METRICS_CORES]{};
+
+public:
+    METRICS_INLINE void add(uint32_t n = 1)
+    {
+        slots[metricsCore()].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+};
+
+// A histogram as read, every core's slot added up
+struct HistogramSnapshot
+{
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint32_t max;
+
+    // Largest value bucket `index` holds, UINT32_MAX for the last one
+    static uint32_t upperBound(int index);
+
+    // Upper bound of the bucket the `q` quantile falls in, at most max
+    uint32_t quantile(double q) const;
+};
+
+// Counts values into power-of-two buckets: bucket 0 holds 0, bucket i
+// holds [2^(i-1), 2^i). Each core has a slot of its own that only one
+// context may record into at a time, such as an interrupt, or tasks that
+// cannot run that code at once; readers on any core add the slots up.
+class Histogram
+{
+private:
+    struct Slot
+    {
+        volatile uint32_t buckets[HISTOGRAM_BUCKETS];
+        volatile uint64_t sum;
+        volatile uint32_t max;
+    };
+
+    Slot slots[METRICS_CORES]{};
+
+public:
+    METRICS_INLINE static int bucketOf(uint32_t value)
+    {
+        const int bucket = value ? 32 - __builtin_clz(value) : 0;
+        return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+    }
+
+    METRICS_INLINE void record(uint32_t value)
+    {
+        Slot     &slot   = slots[metricsCore()];
+        const int bucket = bucketOf(value);
+        slot.buckets[bucket] = slot.buckets[bucket] + 1;
+        slot.sum             = slot.sum + value;
+        if (value > slot.max) {
+            slot.max = value;
+        }
+    }
+
+    HistogramSnapshot read() const;
+};
+
+enum class MetricKind
+{
+    Counter,
+    Gauge,
+    Histogram
+};
+
+// Reads a counter or gauge when exported
+typedef std::function<double()> MetricRead;
+
+struct MetricEntry
+{
+    const char      *name;  // Prometheus name, shared by a family
+    const char      *help;
+    MetricKind       kind;
+    const char      *label;  // optional label name and value
+    const char      *labelValue;
+    MetricRead       read;  // counters and gauges
+    const Histogram *histogram;
+    double           scale;  // histogram units to exported units
+};
+
+// The series /metrics exports, registered once at startup and read
+// whenever scraped; series of a family must be registered one after the
+// other
+class MetricRegistry
+{
+private:
+    MetricEntry entries[METRICS_MAX];
+    int         count{};
+
+    bool add(const MetricEntry &entry);
+
+public:
+    bool addCounter(const char *name, const char *help, MetricRead read,
+            const char *label = nullptr, const char *labelValue = nullptr);
+    bool addCounter(const char *name, const char *help, const Counter &counter);
+    bool addGauge(const char *name, const char *help, MetricRead read,
+            const char *label = nullptr, const char *labelValue = nullptr);
+    bool addHistogram(const char *name, const char *help,
+            const Histogram &histogram, double scale);
+
+    // Prometheus text exposition format, version 0.0.4
+    void writePrometheus(std::string &out) const;
+
+    // {"name":value,...}; a labelled family becomes an object keyed by
+    // label value, a histogram one with its count, sum, max and quantiles
+    void writeJson(std::string &out) const;
+};
+
+// Bytes per second of an ever-growing total, measured between reads at
+// least a second apart
+class RateMeter
+{
+private:
+    uint64_t lastTotal{};
+    uint32_t lastMicros{};
+    bool     started{};
+    double   rate{};
+
+public:
+    double update(uint64_t total, uint32_t nowMicros);
+};
+
+// What the scanout path measures, all of it on core 1
+struct ScanoutCounters
+{
+    Histogram         hSyncCycles;  // spent in hSyncInt
+    Histogram         hSyncJitter;  // entry distance from the nominal period
+    Histogram         vSyncCycles;
+    Histogram         vSyncJitter;
+    Counter           frames;
+    Counter           shortFrames;   // fewer pixels emitted than expected
+    Counter           missedPixels;  // slots loop() was too late to write
+    volatile uint32_t pixels;        // emitted by loop(), only it writes
+    volatile uint32_t lastFramePixels;
+    uint32_t          expectedPixels;  // per frame, from the resolution
+};
+
+extern ScanoutCounters scanoutCounters;
+extern Histogram       decodeMicros;  // per image decoded
+
+MetricRegistry &metrics();
+bool            setupMetrics();
+bool            testMetrics();
+void            benchmarkMetrics();
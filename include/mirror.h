@@ -0,0 +1,119 @@
+#pragma once
+
+// ====================================================== //
+// ============ TFT mirror of the framebuffer =========== //
+// ====================================================== //
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+#define MIRROR_SCALE     4     // framebuffer pixels per display pixel, each way
+#define MIRROR_MAX_RECTS 8     // dirty rectangles kept before merging
+#define MIRROR_BAND      2048  // bytes of RGB565 per push
+#define MIRROR_FPS       10    // most display updates per second
+
+struct DirtyRect
+{
+    int x, y;
+    int w, h;
+};
+
+// A handful of rectangles covering everything marked. Rectangles that
+// overlap or share an edge are merged on the spot; once all slots are
+// taken a new one is merged with whichever wastes the least area.
+class DirtyRegion
+{
+private:
+    DirtyRect rects[MIRROR_MAX_RECTS];
+    int       count{};
+
+public:
+    void add(DirtyRect rect);
+
+    void clear()
+    {
+        count = 0;
+    }
+
+    int size() const
+    {
+        return count;
+    }
+
+    const DirtyRect &operator[](int index) const
+    {
+        return rects[index];
+    }
+
+    long area() const;
+};
+
+// Receives `w` x `h` RGB565 display pixels for position `x`, `y`. The
+// sink may start a DMA transfer and return: the mirror alternates
+// between two band buffers, so it only writes a band again after the
+// sink has been handed the other one.
+typedef std::function<void(int x, int y, int w, int h, uint16_t *pixels)>
+        MirrorSink;
+
+struct MirrorStats
+{
+    uint32_t updates;     // that pushed anything
+    uint32_t pushes;      // sink calls
+    uint32_t rects;       // dirty rectangles pushed
+    uint64_t bytes;       // of RGB565 pushed in total
+    uint32_t lastBytes;   // by the last update
+    uint32_t lastMicros;  // taken by the last update
+};
+
+// Keeps a downscaled copy of an image on a display by pushing only what
+// changed. Any task may mark regions dirty, in image pixels; update()
+// box-filters each dirty region from the image and sends it to the sink
+// in bands of up to `bandBytes`, a few rows per push. A different image
+// than last time, as after a page flip, is pushed whole.
+class FrameMirror
+{
+private:
+    MirrorSink   sink;
+    int          factor;
+    int          bandPixels;
+    uint16_t    *bands[2]{};
+    int          band{};
+    Color       *line{};
+    DirtyRegion  pending;  // display pixels, under the mirror lock
+    bool         everything{ true };
+    const Color *shown{};
+    int          shownWidth{};
+    int          shownHeight{};
+    MirrorStats  stats{};
+
+    size_t push(const ImageView &source, const DirtyRect &rect);
+
+public:
+    explicit FrameMirror(MirrorSink sink, int scale = MIRROR_SCALE,
+            size_t bandBytes = MIRROR_BAND);
+    ~FrameMirror();
+
+    FrameMirror(const FrameMirror &)            = delete;
+    FrameMirror &operator=(const FrameMirror &) = delete;
+
+    void markDirty(int x, int y, int w, int h);
+    void markAll();
+
+    // Pushes whatever is dirty in `source` and returns the bytes pushed
+    size_t update(const ImageView &source);
+
+    const MirrorStats &lastStats() const
+    {
+        return stats;
+    }
+};
+
+// The display's mirror of the image on screen, updated at MIRROR_FPS by a
+// task of its own; regions drawn into the front image are marked with
+// mirrorDirty(), anything else is ignored until it is flipped in
+bool setupMirror();
+void mirrorDirty(const ImageView &region);
+bool testMirror();
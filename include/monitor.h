@@ -0,0 +1,148 @@
+#pragma once
+
+// ====================================================== //
+// ====== Virtual VGA monitor for the native build ====== //
+// ====================================================== //
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+
+#include "image.h"
+#include "vga.h"
+
+// Where the monitor finds each signal among the pin levels
+struct MonitorPins
+{
+    int hsync;  // both syncs active low
+    int vsync;
+    int blank;  // low blanks the DAC
+    int dacClk;
+    int latchR;  // each latches the colour bus on its rising edge
+    int latchG;
+    int latchB;
+    int bus[8];  // bit 0 first
+};
+
+// A measured quantity over a run
+struct Spread
+{
+    uint32_t count;
+    double   min;
+    double   max;
+    double   sum;
+
+    void add(double value);
+
+    double mean() const
+    {
+        return count ? sum / count : 0;
+    }
+};
+
+// Horizontal times in µs, vertical ones in ms
+struct MonitorReport
+{
+    uint32_t frames;  // complete ones, vsync to vsync
+    Spread   hsyncPeriod;
+    Spread   hsyncWidth;
+    Spread   hFrontPorch;  // blank to sync
+    Spread   hBackPorch;   // sync to unblank
+    Spread   vsyncPeriod;
+    Spread   vsyncWidth;
+    Spread   vFrontPorch;
+    Spread   vBackPorch;
+    Spread   linesPerFrame;   // hsync pulses
+    Spread   pixelsPerLine;   // DAC clocks while unblanked
+    Spread   pixelsPerFrame;
+    uint32_t blankedPixels;  // DAC clocks while blanked
+};
+
+// Decodes pin changes the way a monitor behind the board's DAC would see
+// them: the three latches take the colour bus, the DAC puts them out on
+// its clock and holds them, and the beam draws whatever is out. Lines
+// start at hsync, frames at vsync, and the picture starts after the back
+// porches `mode` gives, which is how a monitor tuned to it would place it.
+class VirtualMonitor
+{
+private:
+    MonitorPins   pins;
+    VGAMode       mode;
+    Image         canvas;
+    Image         shown;
+    uint64_t      levels{};
+    uint64_t      paintedTo{};
+    uint8_t       latched[3]{};
+    Color         dac{ 0, 0, 0 };
+    bool          blanked{ true };
+    uint64_t      hsyncFall{};
+    uint64_t      hsyncRise{};
+    uint64_t      vsyncFall{};
+    uint64_t      vsyncRise{};
+    uint64_t      blankFall{};
+    bool          vsyncLast{};  // which sync the next unblank ends
+    bool          seenHsync{};
+    bool          seenVsync{};
+    double        lineStart{};  // ns where pixel 0 of the line is drawn
+    double        firstLine{};  // ns after which hsyncs start visible lines
+    int           y{ -1 };      // line being drawn, -1 outside the picture
+    int           nextY{};
+    uint32_t      lines{};
+    uint32_t      linePixels{};
+    uint32_t      framePixels{};
+    bool          lineOpen{};
+    MonitorReport stats{};
+
+    bool level(int pin) const
+    {
+        return levels >> pin & 1;
+    }
+
+    void paint(uint64_t until);
+    void endLine();
+
+public:
+    // Called with every complete frame
+    std::function<void(const Image &)> onFrame;
+
+    VirtualMonitor(const MonitorPins &pins, const VGAMode &mode,
+            Allocator &allocator = heapAllocator(MemoryRegion::Internal));
+
+    // Pin levels as of `atNs`, in time order, as HalPinSink hands them
+    void signal(uint64_t atNs, uint64_t levels);
+
+    // The last complete frame, black before the first
+    const Image &frame() const
+    {
+        return shown;
+    }
+
+    const MonitorReport &report() const
+    {
+        return stats;
+    }
+};
+
+// Periods of a signal with every timing of `mode`: a line is its porches,
+// sync and pixels, a frame its porches, sync and lines. VGA480p's lines
+// come out shorter than its vLine, its hsync being narrow.
+double modeLineUs(const VGAMode &mode);
+double modeFrameMs(const VGAMode &mode);
+
+// Human-readable timings, each beside what `mode` asks for
+void writeMonitorReport(
+        std::string &out, const MonitorReport &report, const VGAMode &mode);
+
+// The board's wiring, as vga.cpp drives it
+MonitorPins boardMonitorPins();
+
+bool testMonitor();
+
+#ifndef ARDUINO
+bool writePng(const ImageView &image, const char *path);
+
+// Scans `frames` frames out through the simulated HAL into a monitor,
+// returning its report; `last` gets the final frame
+MonitorReport simulateScanout(int frames, Image *last = nullptr);
+void          benchmarkScanout(int frames);
+#endif
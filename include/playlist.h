@@ -0,0 +1,134 @@
+#pragma once
+
+// ====================================================== //
+// ============= Slideshows of images on SD ============= //
+// ====================================================== //
+
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+#define PLAYLIST_MAX_ITEMS 64
+#define PLAYLIST_SHOW_MS   5000  // when an item gives no duration
+#define PLAYLIST_FADE_MS   1000  // when a transition gives no duration
+#define PLAYLIST_POLL_MS   50    // longest a stop request waits
+
+enum class Transition
+{
+    Cut,
+    Crossfade,
+    Wipe  // left to right
+};
+
+struct PlaylistItem
+{
+    std::string path;
+    uint32_t    showMs;        // after the transition into it has ended
+    Transition  transition;    // into this item from the one before
+    uint32_t    transitionMs;
+};
+
+// What the player needs from the outside world. The device wires it to
+// millis(), the SD card and the scanout; the self test to a simulated
+// clock, so timings can be checked to the millisecond.
+struct PlaylistHost
+{
+    std::function<uint32_t()>     now;    // in ms
+    std::function<void(uint32_t)> sleep;  // for that many ms
+    std::function<bool(const char *path, const ImageView &target)> decode;
+
+    // Starts at the next vsync and returns once `to` is the front image;
+    // `from` is null for the first item
+    std::function<void(
+            const Image *from, Image *to, Transition kind, uint32_t ms)>
+            transition;
+
+    // The image being scanned out, which a new run must not decode into
+    // when a run before left one of the buffers on screen
+    std::function<const Image *()> shown;
+};
+
+enum class PlaylistEventKind
+{
+    DecodeStart,
+    DecodeEnd,
+    DecodeFailed,
+    Switch
+};
+
+struct PlaylistEvent
+{
+    PlaylistEventKind kind;
+    int               index;  // of the item
+    uint32_t          atMs;
+};
+
+struct PlaylistStats
+{
+    uint32_t switches;
+    uint32_t late;          // switches held up by a slow decode
+    uint32_t maxLateMs;
+    uint32_t failed;        // items that would not decode, and were skipped
+    uint32_t lastDecodeMs;
+};
+
+// Shows the items one after the other with two frame buffers: while one
+// is on screen, the next item is decoded into the other, so each switch
+// starts on time unless a decode takes longer than the item before it is
+// shown. Switching never waits for the card.
+class PlaylistPlayer
+{
+private:
+    PlaylistHost      host;
+    Image             buffers[2];
+    std::atomic<bool> stopping{};
+    PlaylistStats     stats{};
+
+    void note(PlaylistEventKind kind, int index);
+    bool prefetch(const PlaylistItem &item, int index, Image &target);
+    bool sleepUntil(uint32_t dueMs);
+
+public:
+    // Called for every event, from the task playing
+    std::function<void(const PlaylistEvent &)> onEvent;
+
+    PlaylistPlayer(PlaylistHost host, int width = 640, int height = 480,
+            Allocator &allocator = frameAllocator());
+
+    PlaylistPlayer(const PlaylistPlayer &)            = delete;
+    PlaylistPlayer &operator=(const PlaylistPlayer &) = delete;
+
+    // Returns after the last item has been shown its time, or when
+    // stopped; a looping playlist only ends when stopped
+    bool play(const std::vector<PlaylistItem> &items, bool loop);
+    void stop();
+
+    const PlaylistStats &lastStats() const
+    {
+        return stats;
+    }
+};
+
+// Items are separated by commas or newlines, each written as
+// path[:seconds[:cut|fade|wipe[:seconds]]]
+bool        parsePlaylist(const char *text, std::vector<PlaylistItem> &items);
+const char *transitionName(Transition kind);
+
+// The scanline generator of a transition in progress: `from` blends into
+// `to` over `frames` frames counted from `startFrame`, 8.8 fixed point
+void beginTransition(const Image *from, const Image *to, Transition kind,
+        uint32_t startFrame, uint32_t frames);
+void transitionLine(Color *line, int y, int width, int height, uint32_t frame,
+        int step);
+
+// The device's player, running in a task of its own; starting another
+// playlist or drawing anything else stops the one playing
+bool          startPlaylist(const std::vector<PlaylistItem> &items, bool loop);
+void          stopPlaylist();
+bool          playlistRunning();
+PlaylistStats playlistStats();
+bool          testPlaylist();
@@ -0,0 +1,41 @@
+#pragma once
+
+// ====================================================== //
+// ======== PSRAM line prefetch into internal SRAM ====== //
+// ====================================================== //
+
+#include "vga.h"
+
+#define PREFETCH_LINES 4  // scanlines kept in flight ahead of the beam
+
+// Copies go through GDMA where the async memcpy driver exists, which
+// moves whole lines without the CPU; otherwise the CPU gathers just the
+// pixels scanout samples, every SCAN_STEP-th
+#if defined(CONFIG_IDF_TARGET_ESP32S3) && __has_include(<esp_async_memcpy.h>)
+#define PREFETCH_GDMA 1
+#else
+#define PREFETCH_GDMA 0
+#endif
+
+struct PrefetchStats
+{
+    uint32_t hits;       // line was waiting in the ring
+    uint32_t underruns;  // line had to be read from PSRAM by scanout
+    uint32_t dmaCopies;
+    uint32_t cpuCopies;
+};
+
+extern PrefetchStats prefetchStats;
+
+bool           setupPrefetch();
+void IRAM_ATTR prefetchInvalidate();
+
+// Starts copies of up to `lines` of the PREFETCH_LINES - 1 rows from `y`
+// on that the ring lacks; called while the signal is blanked
+void IRAM_ATTR prefetchIssue(const Image &source, int y, int lines);
+
+// Row `y` for scanout, whose pixel x is at [x / SCAN_STEP * step]
+const Color *IRAM_ATTR prefetchAcquire(
+        const Image &source, int y, int &step);
+
+bool testPrefetch();
@@ -0,0 +1,54 @@
+#pragma once
+
+// ====================================================== //
+// ============ Parallel tile-based renderer ============ //
+// ====================================================== //
+
+#include "image.h"
+
+#define TILE_SIZE 32
+
+struct Tile
+{
+    int x, y;
+    int width, height;
+};
+
+// Renders one tile of `target` with a type-erased kernel
+typedef void (*TileFunction)(
+        const void *kernel, Image &target, const Tile &tile);
+
+// The kernel is called as `Color kernel(int x, int y)` for every pixel; the
+// tile loop is instantiated per kernel type so the call inlines
+template <typename Kernel>
+void renderTile(const void *kernel, Image &target, const Tile &tile)
+{
+    const Kernel &shade = *static_cast<const Kernel *>(kernel);
+    for (int y = tile.y; y < tile.y + tile.height; ++y) {
+        Color *row = target.pixels + y * target.xres;
+        for (int x = tile.x; x < tile.x + tile.width; ++x) {
+            row[x] = shade(x, y);
+        }
+    }
+}
+
+void setupRenderer(int workers);
+int  rendererWorkers();
+int  renderTiles(Image &target, TileFunction render, const void *kernel);
+
+// Renders the whole frame on every worker and returns once all tiles are
+// done, the caller can then flip it to the front. Returns how many tiles
+// the scanout core took in its blanking.
+template <typename Kernel>
+int renderFrame(Image &target, const Kernel &kernel)
+{
+    return renderTiles(target, renderTile<Kernel>, &kernel);
+}
+
+// Renders tiles of the frame in progress for at most `cycles`; the
+// scanout core calls this in vertical blanking, the only time it has
+void lendRenderTime(uint32_t cycles);
+
+bool renderShader(const char *name, Image &target, unsigned time = 0);
+bool testRenderer();
+void benchmarkRenderer(int maxWorkers);
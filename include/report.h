@@ -0,0 +1,26 @@
+#pragma once
+
+// ====================================================== //
+// ======== Console output, clocks and self-tests ======= //
+// ====================================================== //
+
+#include <math.h>
+#include <stdint.h>
+#include <string>
+
+// printf to Serial on the device, to stdout on the host; long lines are
+// cut at 256 bytes
+void report(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// printf appended to `out`
+void appendf(std::string &out, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+// A free-running microsecond clock that wraps like micros()
+uint32_t nowMicros();
+
+void sleepMillis(uint32_t ms);
+
+// Reports a failed self-test check, with where it failed when `at` is
+// given, and hands `condition` back so results can be and-ed up
+bool check(bool condition, const char *what, double at = NAN);
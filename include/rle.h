@@ -0,0 +1,69 @@
+#pragma once
+
+// ====================================================== //
+// ========= Run-length compressed framebuffer ========== //
+// ====================================================== //
+
+#include <vector>
+
+#include "vga.h"
+
+struct RleSpan
+{
+    uint16_t length;
+    Color    color;
+};
+
+// Every line is a list of spans in one fixed pool, found through a line
+// index. Edited lines are rewritten in place when they fit their slot and
+// moved to the end of the pool otherwise, so the image on screen can be
+// drawn on. Compacting the pool and encode() or clear() move or rewrite
+// every line, so they only run while the image is off screen: on screen,
+// an edit that needs compacting fails and a new frame is made in another
+// image that then replaces rleFrame.
+class RleImage
+{
+private:
+    struct LineSlot
+    {
+        uint32_t offset;
+        uint16_t count;
+        uint16_t capacity;
+    };
+
+    std::vector<LineSlot> lines;
+    RleSpan              *spans;
+    size_t                capacity;
+    size_t                used;
+
+    bool storeLine(int y, const RleSpan *runs, size_t count);
+    bool onScreen() const;
+    void compact();
+
+public:
+    int xres;
+    int yres;
+
+    RleImage(int xres = 640, int yres = 480, size_t capacity = 8192);
+    ~RleImage();
+
+    RleImage(const RleImage &)            = delete;
+    RleImage &operator=(const RleImage &) = delete;
+
+    bool   encode(const ImageView &source);
+    bool   clear(Color c);
+    bool   fillRect(int x, int y, int w, int h, Color c);
+    bool   hline(int x, int y, int w, Color c);
+    bool   vline(int x, int y, int h, Color c);
+    bool   set(int x, int y, Color c);
+    void   expandLine(int y, Color *line, int width, int step = 1) const;
+    size_t spanCount(int y) const;
+    size_t bytes() const;
+};
+
+extern RleImage *rleFrame;
+
+void rleLine(Color *line, int y, int width, int height, uint32_t frame,
+        int step);
+bool testRle();
+void benchmarkRle(const Image &source, const VGAMode &mode);
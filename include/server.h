@@ -4,4 +4,13 @@
 // ===================== Web Server ===================== //
 // ====================================================== //
 
-void serverTask(void *args);
\ No newline at end of file
+#include <stdint.h>
+
+#define WIFI_CONNECT_MS 10000  // then the station keeps trying on its own
+
+// Returns false if not connected within `timeoutMs`
+bool connectWifi(uint32_t timeoutMs = WIFI_CONNECT_MS);
+
+// Registers the routes, listens and starts serverTask
+bool startServer();
+void serverTask(void *args);
@@ -0,0 +1,90 @@
+#pragma once
+
+// ====================================================== //
+// ============ Chunked streaming file reads ============ //
+// ====================================================== //
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "allocator.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <SD.h>
+#endif
+
+#define STREAM_CHUNK CHUNK_POOL_BLOCK  // a whole number of SD sectors
+
+// Valid until the reader hands out the next chunk
+struct Chunk
+{
+    const uint8_t *data;
+    size_t         size;
+    size_t         offset;  // of data[0]; chunk aligned unless just seeked
+};
+
+// Reads a file in fixed-size chunks from the chunk pool. With read-ahead,
+// the next chunk is read in the background while the caller processes
+// the current one. One reader is used by one task at a time.
+class FileReader
+{
+private:
+#ifdef ARDUINO
+    File              file;
+    SemaphoreHandle_t done{};
+#else
+    int  fd = -1;
+    bool loaded{};  // the worker finished the read into the other buffer
+#endif
+    uint8_t *buffers[2]{};
+    int      current{};       // buffer holding `chunk`
+    size_t   chunkSize;
+    bool     readAhead;
+    bool     inFlight{};      // a read into the other buffer was started
+    size_t   aheadOffset{};
+    size_t   aheadSize{};
+    size_t   fileSize{};
+    time_t   fileModified{};
+    size_t   filePos{};       // where the next read from the file starts
+    Chunk    chunk{};
+    size_t   cursor{};        // read() position inside `chunk`
+
+    size_t load(uint8_t *buf, size_t size);
+    void   startRead();
+    size_t finishRead();
+    bool   advance();
+
+#ifdef ARDUINO
+    static void readerTask(void *args);
+#else
+    static void readerThread();
+#endif
+
+public:
+    explicit FileReader(size_t chunkSize = STREAM_CHUNK, bool readAhead = true);
+    ~FileReader();
+
+    FileReader(const FileReader &)            = delete;
+    FileReader &operator=(const FileReader &) = delete;
+
+    bool   open(const char *path);
+    void   close();
+    bool   isOpen() const;
+    size_t size() const;
+    time_t lastWrite() const;
+    size_t position() const;
+    bool   next(Chunk &out);
+    size_t read(uint8_t *dst, size_t size);
+    bool   seek(size_t offset);
+};
+
+// Hands every chunk of `path` to `consume` until it returns false
+bool readChunks(const char *path,
+        const std::function<bool(const Chunk &)> &consume,
+        size_t chunkSize = STREAM_CHUNK);
+
+bool testStream(const char *path);
+void benchmarkStream(const char *path, size_t size = 4 << 20);
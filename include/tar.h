@@ -0,0 +1,148 @@
+#pragma once
+
+// ====================================================== //
+// ============ Streaming tar archive transfer ========== //
+// ====================================================== //
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream.h"
+#include "walk.h"
+#include "writer.h"
+
+#define TAR_BLOCK    512
+#define TAR_PATH_MAX 256  // longest path extracted, GNU and pax names included
+
+class ChunkedWriter;
+
+struct TarStats
+{
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t skipped;  // links, devices and unsafe paths
+    size_t   bytes;    // file contents
+    uint32_t micros;
+};
+
+// Extracts a tar stream below a directory as it arrives, in whatever
+// pieces the network hands over: one header block of state, file data
+// written through a WriteBehind. Understands ustar, GNU long names and
+// pax paths; ".." components and absolute paths stay inside `dir`.
+class TarExtractor
+{
+private:
+    enum class State
+    {
+        Header,
+        Body,
+        Padding,
+        End,
+        Error
+    };
+    enum class Body
+    {
+        File,
+        LongName,
+        Pax,
+        Skip
+    };
+
+    uint8_t     header[TAR_BLOCK];
+    size_t      headerUsed{};
+    State       state = State::End;
+    Body        body{};
+    size_t      remaining{};  // payload bytes left in this entry
+    size_t      padding{};    // up to the next block
+    char        root[TAR_PATH_MAX]{};
+    char        path[TAR_PATH_MAX]{};  // of the file being written
+    char        lastDir[TAR_PATH_MAX]{};
+    char        nextName[TAR_PATH_MAX]{};  // from a GNU or pax record
+    size_t      nextNameUsed{};
+    char        pax[TAR_BLOCK];
+    size_t      paxUsed{};
+    bool        badName{};  // the pending long name did not fit
+    WriteBehind file;
+    bool        active{};
+    TarStats    stats{};
+    uint32_t    start{};
+
+    bool parseHeader();
+    bool endBody();
+    bool resolve(const char *name, char *out);
+    bool makeParents(const char *target);
+    bool fail(const char *why);
+
+public:
+    TarExtractor() = default;
+    ~TarExtractor();
+
+    bool begin(const char *dir);
+    bool write(const uint8_t *data, size_t size);
+    bool finish();
+    void abort();
+
+    bool isRunning() const
+    {
+        return active;
+    }
+
+    // Bytes write() takes without waiting on the card
+    size_t room()
+    {
+        return state == State::Body && body == Body::File ? file.room()
+                                                          : SIZE_MAX;
+    }
+
+    const TarStats &lastStats() const
+    {
+        return stats;
+    }
+};
+
+// Produces the archive of `dir` a header or a file chunk per call, for a
+// caller that pulls it only as fast as the network drains it
+class TarWriter
+{
+private:
+    TreeWalker walker;
+    FileReader reader;
+    size_t     skip;        // of the root and its slash, to name entries
+    size_t     sent{};      // of the file being copied
+    bool       copying{};
+    bool       done{};
+    bool       ok = true;
+    TarStats   stats{};
+    uint32_t   start;
+
+public:
+    explicit TarWriter(const char *dir);
+
+    // False once the archive is over, complete or not
+    bool next(ChunkedWriter &out);
+
+    bool isDone() const
+    {
+        return done;
+    }
+
+    // False when an entry was left out or the archive was cut short
+    bool succeeded() const
+    {
+        return ok;
+    }
+
+    const TarStats &lastStats() const
+    {
+        return stats;
+    }
+};
+
+// Streams `dir` and everything below it as a tar archive; stops early
+// when `stop` returns true, e.g. because the client went away
+bool writeTar(const char *dir, ChunkedWriter &out, TarStats &stats,
+        const std::function<bool()> &stop = nullptr);
+
+bool testTar(const char *dir);
+void benchmarkTar(const char *dir, int files, size_t fileSize);
@@ -0,0 +1,174 @@
+#pragma once
+
+// ====================================================== //
+// ============ Event tracer, Chrome trace JSON ========= //
+// ====================================================== //
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+#include "metrics.h"
+
+// Set to 0 to compile every TRACE_ macro out; the tracer itself stays, so
+// /trace answers with an empty trace
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+#define TRACE_EVENTS 1024  // per core, the oldest are overwritten
+#define TRACE_TRACKS 16    // named tasks and threads
+
+// What can be switched on and off at run time; hsync fires 31,000 times a
+// second and fills a ring within a frame, so it is off by default
+enum class TraceCategory : uint32_t
+{
+    Hsync  = 1 << 0,
+    Vsync  = 1 << 1,
+    Render = 1 << 2,
+    Decode = 1 << 3,
+    Http   = 1 << 4,
+    All    = (1 << 5) - 1
+};
+
+#define TRACE_DEFAULT_MASK \
+    ((uint32_t) TraceCategory::All & ~(uint32_t) TraceCategory::Hsync)
+
+enum class TracePhase : uint32_t
+{
+    Begin,
+    End,
+    Instant
+};
+
+// 12 bytes. The phase sits in the low bits of the track, which is the
+// task's handle, or 0 for interrupts, and so always a multiple of four.
+struct TraceEvent
+{
+    uint32_t    cycles;  // the recording core's cycle counter
+    const char *name;    // a string that outlives the trace
+    uint32_t    track;
+};
+
+struct TraceRing
+{
+    TraceEvent            events[TRACE_EVENTS];
+    std::atomic<uint32_t> head{};  // events ever recorded
+};
+
+// Where the calling code runs: its task, or the interrupt track
+METRICS_INLINE uint32_t traceTrack()
+{
+#ifdef ARDUINO
+    return xPortInIsrContext()
+                   ? 0
+                   : (uint32_t) (uintptr_t) xTaskGetCurrentTaskHandle();
+#else
+    static std::atomic<uint32_t> next{};
+    static thread_local uint32_t track = ++next << 2;
+    return track;
+#endif
+}
+
+// Records into a ring per core, so interrupts and tasks on either core
+// never wait on each other: a slot is claimed with one atomic add and the
+// event written into it. A dump copies the rings and lines the two cores'
+// cycle counters up against a common clock.
+class Tracer
+{
+private:
+    TraceRing rings[METRICS_CORES];
+
+    struct Track
+    {
+        uint32_t    track;
+        const char *name;
+    };
+
+    Track                 tracks[TRACE_TRACKS];
+    std::atomic<uint32_t> trackCount{};
+
+public:
+    std::atomic<uint32_t> mask{ TRACE_DEFAULT_MASK };
+
+    METRICS_INLINE void record(
+            TraceCategory category, const char *name, TracePhase phase)
+    {
+        if (mask.load(std::memory_order_relaxed) & (uint32_t) category) {
+            put(metricsCore(), name, phase, traceTrack(), cycleCount());
+        }
+    }
+
+    METRICS_INLINE void put(int core, const char *name, TracePhase phase,
+            uint32_t track, uint32_t cycles)
+    {
+        TraceRing     &ring = rings[core];
+        const uint32_t slot
+                = ring.head.fetch_add(1, std::memory_order_relaxed);
+        TraceEvent &event = ring.events[slot % TRACE_EVENTS];
+        event.cycles      = cycles;
+        event.name        = name;
+        event.track       = track | (uint32_t) phase;
+    }
+
+    // Names the calling task's track in the trace
+    void nameTrack(const char *name);
+    void clear();
+
+    // {"traceEvents":[...]} of what the rings hold, oldest first, with
+    // timestamps in microseconds from the oldest event. `now` is the
+    // common clock in cycles and `coreNow` each core's cycle counter,
+    // read at the same moment.
+    void writeChrome(std::string &out, uint64_t now,
+            const uint32_t coreNow[METRICS_CORES]) const;
+    void writeChrome(std::string &out) const;
+};
+
+extern Tracer tracer;
+
+class TraceScope
+{
+private:
+    TraceCategory category;
+    const char   *name;
+
+public:
+    METRICS_INLINE TraceScope(TraceCategory category, const char *name)
+        : category(category), name(name)
+    {
+        tracer.record(category, name, TracePhase::Begin);
+    }
+
+    METRICS_INLINE ~TraceScope()
+    {
+        tracer.record(category, name, TracePhase::End);
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+
+#if TRACE_ENABLED
+// Begin here, end when the enclosing block is left
+#define TRACE_SCOPE(category, name) \
+    TraceScope TRACE_CONCAT(traceScope, __LINE__)(TraceCategory::category, name)
+#define TRACE_BEGIN(category, name) \
+    tracer.record(TraceCategory::category, name, TracePhase::Begin)
+#define TRACE_END(category, name) \
+    tracer.record(TraceCategory::category, name, TracePhase::End)
+#define TRACE_INSTANT(category, name) \
+    tracer.record(TraceCategory::category, name, TracePhase::Instant)
+#define TRACE_NAME_TRACK(name) tracer.nameTrack(name)
+#else
+#define TRACE_SCOPE(category, name)   ((void) 0)
+#define TRACE_BEGIN(category, name)   ((void) 0)
+#define TRACE_END(category, name)     ((void) 0)
+#define TRACE_INSTANT(category, name) ((void) 0)
+#define TRACE_NAME_TRACK(name)        ((void) 0)
+#endif
+
+// Comma-separated category names, "all" or "none"; false on an unknown one
+bool parseTraceMask(const char *text, uint32_t &mask);
+bool setupTrace();
+bool testTrace();
+void benchmarkTrace();
@@ -4,14 +4,17 @@
 // ================= VGA Utility Library ================ //
 // ====================================================== //
 
+#ifdef ARDUINO
 #include <DDCVCP.h>
 #include <TFT_eSPI.h>
 #include <PNGdec.h>
+#endif
 
-struct Color
-{
-    unsigned char r, g, b;
-};
+#include "hal.h"
+#include "image.h"
+
+#define SCANLINE_MAX 640  // widest line a generator may be asked to fill
+#define SCAN_STEP    4    // every 4th pixel of every 4th line is scanned out
 
 struct VGAMode
 {
@@ -31,43 +34,15 @@ struct VGAMode
     double vBackPorch;
 };
 
-struct Image
-{
-    int    xres{};
-    int    yres{};
-    Color *pixels{};
-
-    Image(int xres = 640, int yres = 480)
-        : xres(xres), yres(yres), pixels(new Color[xres * yres])
-    {}
-
-    ~Image()
-    {
-        delete[] pixels;
-    }
-
-    void loadPixels(int xres, int yres, Color *pixels)
-    {
-        delete[] this->pixels;
-        this->xres   = xres;
-        this->yres   = yres;
-        this->pixels = pixels;
-    }
-
-    Color get(int x, int y) const
-    {
-        return pixels[y * xres + x];
-    }
-
-    void set(int x, int y, Color c)
-    {
-        pixels[y * xres + x] = c;
-    }
-};
-
+// Fills scanline `y` of a `width` x `height` frame into `line`, only
+// every `step`th pixel: line[i] is pixel i * step, up to the width.
+// Scanout asks for SCAN_STEP, the pixels it samples; `frame` counts the
+// frames scanned out so far.
+typedef void (*LineGenerator)(
+        Color *line, int y, int width, int height, uint32_t frame, int step);
 
 extern Image         image;
-extern TFT_eSPI      tft;
+extern Image *volatile frontImage;
 extern const VGAMode VGA480p;
 
 extern const int      hsyncPin;
@@ -84,27 +59,40 @@ extern const int      colorPins[8];
 extern const int      colorPinsMask;
 extern int            xres, xcrt;
 extern int            yres, ycrt;
-extern hw_timer_t    *hPixelTimer;
-extern hw_timer_t    *hSyncTimer;
-extern hw_timer_t    *vSyncTimer;
-extern hw_timer_t    *clkTimer;
+extern HalTimer      *hPixelTimer;
+extern HalTimer      *hSyncTimer;
+extern HalTimer      *vSyncTimer;
 extern const uint64_t pixelTicks;
 extern uint64_t       crtTicks;
 extern uint64_t       ticksElapsed;
-extern int            dacClk;
+extern uint32_t       frameCount;
+extern LineGenerator  scanoutGenerator;
+extern Color          scanLine[SCANLINE_MAX];
+extern int            scanLineY;
 
 void IRAM_ATTR writeByteToRegister(int latch, unsigned char byte);
 void IRAM_ATTR writePixel();
+void IRAM_ATTR scanoutStep();
 void IRAM_ATTR hSyncInt();
 void IRAM_ATTR vSyncInt();
-void           tftInit();
-void           drawPng(PNGDRAW *pDraw);
-bool           decodePng(const char *filepath);
+void IRAM_ATTR prefetchInvalidate();
+void           presentImage(Image *next);
+bool           waitForVsync(uint32_t timeoutMs = 50);
+
+#ifdef ARDUINO
+extern TFT_eSPI tft;
+
+void tftInit();
+void drawPng(PNGDRAW *pDraw);
+bool decodePng(const char *filepath, const ImageView &target = image.view());
+#endif
 
 class VGASignal
 {
 private:
+#ifdef ARDUINO
     DDCVCP ddc;
+#endif
 
 public:
     VGASignal()
@@ -115,70 +103,31 @@ public:
         // }
 
         // Write HIGH to SYNC pin for Generic DAC mode
-        pinMode(syncPin, OUTPUT);
-        digitalWrite(syncPin, HIGH);
+        halPinOutput(syncPin);
+        halPinWrite(syncPin, true);
 
         // Set output pins
-        pinMode(hsyncPin, OUTPUT);
-        pinMode(vsyncPin, OUTPUT);
-        pinMode(blankPin, OUTPUT);
-        pinMode(dacClk, OUTPUT);
-        pinMode(leBPin, OUTPUT);
-        pinMode(leGPin, OUTPUT);
-        pinMode(leRPin, OUTPUT);
+        halPinOutput(hsyncPin);
+        halPinOutput(vsyncPin);
+        halPinOutput(blankPin);
+        halPinOutput(dacClkPin);
+        halPinOutput(leBPin);
+        halPinOutput(leGPin);
+        halPinOutput(leRPin);
         for (int i = 0; i < 8; ++i)
-            pinMode(colorPins[i], OUTPUT);
+            halPinOutput(colorPins[i]);
     }
 
-    void setup()
-    {
-        // Reset signals
-        digitalWrite(hsyncPin, LOW);
-        digitalWrite(vsyncPin, LOW);
-        digitalWrite(blankPin, HIGH);
-        digitalWrite(dacClk, LOW);
-        digitalWrite(leBPin, LOW);
-        digitalWrite(leGPin, LOW);
-        digitalWrite(leRPin, LOW);
-
-        // Pixel clock interrupt
-        if (!hPixelTimer) {
-            hPixelTimer = timerBegin(1, 2, true);
-            Serial.println("Pixel clock timer started");
-        }
-
-        // Horizontal sync interrupt
-        if (!hSyncTimer) {
-            hSyncTimer = timerBegin(3, 2, true);
-            timerAttachInterrupt(hSyncTimer, &hSyncInt, false);
-            timerAlarmWrite(
-                    hSyncTimer, 40.0 * VGA480p.xres * VGA480p.hPixel, true);
-            timerAlarmEnable(hSyncTimer);
-            Serial.println("Horizontal sync timer started");
-        }
-
-        // Vertical sync interrupt
-        if (!vSyncTimer) {
-            vSyncTimer = timerBegin(2, 2, true);
-            timerAttachInterrupt(vSyncTimer, &vSyncInt, false);
-            timerAlarmWrite(
-                    vSyncTimer, 40000.0 * VGA480p.yres * VGA480p.vLine, true);
-            timerAlarmEnable(vSyncTimer);
-            Serial.println("Vertical sync timer started");
-        }
-
-        // Reset timers
-        timerRestart(hSyncTimer);
-        timerRestart(vSyncTimer);
-        timerRestart(hPixelTimer);
-        ticksElapsed = crtTicks = 0;
-    }
+    // Resets the beam and the signals and starts the sync timers
+    void setup();
 
+#ifdef ARDUINO
     void getMonitorResolution(int *width, int *height)
     {
         *width  = ddc.getVCP(0x22);
         *height = ddc.getVCP(0x32);
     }
+#endif
 };
 
 extern VGASignal vga;
\ No newline at end of file
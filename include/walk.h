@@ -0,0 +1,88 @@
+#pragma once
+
+// ====================================================== //
+// ============ Iterative directory tree walk =========== //
+// ====================================================== //
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <SD.h>
+#else
+#include <dirent.h>
+#endif
+
+enum class WalkStep
+{
+    File,
+    EnterDir,
+    LeaveDir  // after everything below the directory
+};
+
+enum class WalkAction
+{
+    Continue,
+    Skip,  // on EnterDir: leave the directory out, LeaveDir included
+    Stop
+};
+
+// `depth` is 0 for the root, 1 for what it holds and so on
+typedef std::function<WalkAction(
+        WalkStep step, const std::string &path, int depth)>
+        WalkVisitor;
+
+// The walk below, one step per call, for callers that cannot hand over
+// control for a whole tree, like a response produced as the network
+// drains it. A directory is opened by the call after its EnterDir, so
+// skip() in between leaves it out.
+class TreeWalker
+{
+private:
+    struct Frame
+    {
+        std::string path;
+        int         depth;
+        bool        expanded;  // its files were visited, its folders above
+    };
+
+#ifdef ARDUINO
+    File dir;
+#else
+    DIR *dir{};
+#endif
+    std::vector<Frame> stack;
+    std::string        parent;      // of the open directory
+    int                childDepth{};
+    bool               dirOpen{};
+    bool               pendingOpen{};  // the last step entered a directory
+    bool               single{};       // the root is reported as a file
+    bool               ok = true;
+
+public:
+    explicit TreeWalker(const char *root);
+    ~TreeWalker();
+
+    TreeWalker(const TreeWalker &)            = delete;
+    TreeWalker &operator=(const TreeWalker &) = delete;
+
+    // False once the walk is over
+    bool next(WalkStep &step, std::string &path, int &depth);
+    void skip();
+
+    // False when a directory could not be read
+    bool succeeded() const
+    {
+        return ok;
+    }
+};
+
+// Visits `root` and everything below it without recursing. Each
+// directory is read once, its files reported while it is open, so they
+// may be removed on the spot; its folders wait on an explicit stack. A
+// root that is not a directory is reported as a single file. Returns
+// false when stopped or when a directory could not be read.
+bool walkTree(const char *root, const WalkVisitor &visit);
+bool isDirectory(const char *path);
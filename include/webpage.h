@@ -1,5 +1,8 @@
 #pragma once
 
+// Source of the web page. scripts/webpage.py minifies and gzips it into
+// webpage_gz.h before every build; the firmware only serves that copy.
+
 const char* webpage = R"V0G0N(<!DOCTYPE html>
 <html>
   <head>
@@ -112,6 +115,10 @@ const char* webpage = R"V0G0N(<!DOCTYPE html>
       <h2>Monitor Details</h2>
       <p><strong>Resolution:</strong> <span id="resolution"></span></p>
 
+      <h2>Generators</h2>
+      <select id="generator"></select>
+      <button class="button button-draw" onclick="selectGenerator()">Show</button>
+
       <h2>Storage Details</h2>
       <p><strong>Total space:</strong> <span id="totalSpace"></span></p>
       <p><strong>Used space:</strong> <span id="usedSpace"></span></p>
@@ -154,7 +161,7 @@ const char* webpage = R"V0G0N(<!DOCTYPE html>
 
         // Fetch the file structure from the server
         let fileStructure = [];
-        fetch("/listDir?dir=" + dirName)
+        fetch("/listDir?sort=type&dir=" + dirName)
           .then((response) => response.json())
           .then((data) => {
             fileStructure = data;
@@ -248,7 +255,11 @@ const char* webpage = R"V0G0N(<!DOCTYPE html>
                 downloadButton.textContent = "Download";
                 downloadButton.className = "button button-secondary";
                 downloadButton.addEventListener("click", function () {
-                  handleDownload(filePath);
+                  if (file.type === "dir") {
+                    window.location = "/archive?dir=" + filePath;
+                  } else {
+                    handleDownload(filePath);
+                  }
                 });
                 actionCell.appendChild(downloadButton);
               });
@@ -280,13 +291,19 @@ const char* webpage = R"V0G0N(<!DOCTYPE html>
           var formData = new FormData();
           formData.append("file", fileInput.files[0]);
 
-          fetch("/update?dir=" + currentDir, {
+          // Archives are unpacked into the current directory
+          var target = fileInput.files[0].name.endsWith(".tar")
+            ? "/archive"
+            : "/update";
+          fetch(target + "?dir=" + currentDir, {
             method: "POST",
             body: formData,
           })
             .then((response) => response.json())
             .then((data) => {
-              console.log("File uploaded successfully");
+              console.log(
+                "File uploaded: " + data.bytes + " bytes at " + data.kbps + " KB/s"
+              );
               updateFileStructure();
             })
             .catch((error) => console.log(error));
@@ -311,15 +328,34 @@ const char* webpage = R"V0G0N(<!DOCTYPE html>
         }
       }
 
+      // Long deletions run as background jobs; poll until one is over
+      function waitForJob(data, done) {
+        if (!data.job) {
+          done();
+          return;
+        }
+        fetch("/jobs/" + data.job)
+          .then((response) => response.json())
+          .then((job) => {
+            if (job.state === "queued" || job.state === "running") {
+              console.log(`Job ${job.id}: ${job.removed} removed`);
+              setTimeout(() => waitForJob(data, done), 500);
+            } else {
+              done();
+            }
+          })
+          .catch((error) => console.log(error));
+      }
+
       // Function to wipe the SD card
       function wipeSDCard() {
         if (confirm("Are you sure you want to wipe the SD card?")) {
           fetch("/wipe")
             .then((response) => response.json())
-            .then((data) => {
+            .then((data) => waitForJob(data, () => {
               console.log("SD card wiped successfully");
               updateFileStructure();
-            })
+            }))
             .catch((error) => console.log(error));
         }
       }
@@ -361,10 +397,10 @@ const char* webpage = R"V0G0N(<!DOCTYPE html>
         console.log(`Deleting file "${filename}"`);
         fetch("/delete?file=" + filename)
           .then((response) => response.json())
-          .then((data) => {
+          .then((data) => waitForJob(data, () => {
             console.log("File deleted successfully");
             updateFileStructure();
-          })
+          }))
           .catch((error) => console.log(error));
       }
 
@@ -393,11 +429,38 @@ const char* webpage = R"V0G0N(<!DOCTYPE html>
           .catch((error) => console.log(error));
       }
 
+      // Function to list the procedural generators
+      function updateGenerators() {
+        fetch("/generator")
+          .then((response) => response.json())
+          .then((data) => {
+            var select = document.getElementById("generator");
+            data.generators.forEach(function (name) {
+              var option = document.createElement("option");
+              option.value = option.textContent = name;
+              option.selected = name === data.active;
+              select.appendChild(option);
+            });
+          })
+          .catch((error) => console.log(error));
+      }
+
+      // Function to switch the VGA output to a generator
+      function selectGenerator() {
+        var name = document.getElementById("generator").value;
+        console.log(`Selecting generator "${name}"`);
+        fetch("/generator?name=" + name)
+          .then((response) => response.json())
+          .then((data) => console.log(data.message))
+          .catch((error) => console.log(error));
+      }
+
       // Update storage details and file structure when the page loads
       window.addEventListener("load", function () {
         updateStorageDetails();
         updateFileStructure("/");
         updateMonitorDetails();
+        updateGenerators();
       });
     </script>
   </body>
@@ -0,0 +1,106 @@
+#pragma once
+
+// ====================================================== //
+// ========== Write-behind buffered file writes ========= //
+// ====================================================== //
+
+#include <atomic>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "allocator.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <SD.h>
+#else
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#endif
+
+#define WRITE_BUFFER  (32 * 1024)  // staged bytes per write, whole sectors
+#define WRITE_BUFFERS 3            // one filling, the others queued
+
+// Where full buffers end up; returns false when the write failed
+typedef std::function<bool(const uint8_t *data, size_t size)> WriteSink;
+
+// Blocking FIFO of buffer indices
+class IndexQueue
+{
+private:
+#ifdef ARDUINO
+    QueueHandle_t queue{};
+#else
+    std::mutex              mutex;
+    std::condition_variable ready;
+    std::deque<int>         items;
+#endif
+
+public:
+    void create(int depth);
+    void destroy();
+    void push(int index);
+    int  pop();
+    bool tryPop(int &index);
+    int  count();
+};
+
+struct WriteStats
+{
+    size_t   bytes;
+    uint32_t micros;  // from begin() until everything reached the sink
+    uint32_t stalls;  // times write() waited for the sink to catch up
+};
+
+// Stages writes into large buffers that a background worker hands to the
+// sink, so receiving the next data overlaps with writing the last. When
+// every buffer is queued, write() blocks until the sink frees one.
+class WriteBehind
+{
+private:
+    uint8_t          *buffers[WRITE_BUFFERS]{};
+    Allocator        *owners[WRITE_BUFFERS]{};
+    size_t            sizes[WRITE_BUFFERS]{};
+    int               filling = -1;  // buffer write() copies into
+    IndexQueue        freeBuffers;
+    IndexQueue        fullBuffers;
+    WriteSink         sink;
+    std::atomic<bool> failed{};
+    bool              running{};
+    WriteStats        stats{};
+    uint32_t          start{};
+#ifdef ARDUINO
+    File file;
+#else
+    std::thread worker;
+    FILE       *file{};
+#endif
+
+    static void workerLoop(void *args);
+
+public:
+    WriteBehind() = default;
+    ~WriteBehind();
+
+    WriteBehind(const WriteBehind &)            = delete;
+    WriteBehind &operator=(const WriteBehind &) = delete;
+
+    bool begin(WriteSink sink);
+    bool open(const char *path);
+    bool write(const uint8_t *data, size_t size);
+    bool finish();
+    bool isRunning() const;
+
+    // Bytes write() takes without waiting for the sink
+    size_t room();
+
+    const WriteStats &lastStats() const
+    {
+        return stats;
+    }
+};
+
+bool testWriteBehind();
@@ -0,0 +1,81 @@
+# ====================================================== #
+# ========== Compressed web page, built per run ======== #
+# ====================================================== #
+#
+# Pre-build step: takes the page from include/webpage.h, minifies it,
+# gzips it and writes include/webpage_gz.h, a PROGMEM byte array with
+# its length and a strong ETag. Runs from platformio.ini as
+# `extra_scripts = pre:scripts/webpage.py`, or by hand with
+# `python scripts/webpage.py` from the project directory.
+
+import gzip
+import hashlib
+import os
+import re
+
+SOURCE = os.path.join("include", "webpage.h")
+TARGET = os.path.join("include", "webpage_gz.h")
+LITERAL = re.compile(r'R"V0G0N\((.*)\)V0G0N"', re.S)
+CSS_COMMENT = re.compile(r"/\*.*?\*/", re.S)
+
+
+def minify(html):
+    # Conservative on purpose: indentation, blank lines, CSS comments and
+    # whole-line script comments go; line breaks stay so the script's
+    # semicolon insertion behaves exactly as before
+    html = CSS_COMMENT.sub("", html)
+    lines = []
+    for line in html.splitlines():
+        line = line.strip()
+        if line and not line.startswith("//"):
+            lines.append(line)
+    return "\n".join(lines) + "\n"
+
+
+def render(data, etag, raw, packed):
+    rows = []
+    for i in range(0, len(data), 12):
+        row = ", ".join("0x%02x" % b for b in data[i:i + 12])
+        rows.append("    " + row + ",")
+    return (
+        "#pragma once\n\n"
+        "// Generated by scripts/webpage.py from webpage.h, do not edit.\n"
+        "// %d bytes of HTML, %d gzipped\n\n"
+        "#include <pgmspace.h>\n"
+        "#include <stddef.h>\n"
+        "#include <stdint.h>\n\n"
+        "#define WEBPAGE_ETAG \"\\\"%s\\\"\"\n\n"
+        "const size_t  webpage_gz_len = %d;\n"
+        "const uint8_t webpage_gz[] PROGMEM = {\n%s\n};\n"
+        % (raw, packed, etag, packed, "\n".join(rows)))
+
+
+def build(project):
+    with open(os.path.join(project, SOURCE), encoding="utf-8") as f:
+        match = LITERAL.search(f.read())
+    if not match:
+        raise SystemExit("webpage.py: no page literal in " + SOURCE)
+
+    html = minify(match.group(1)).encode("utf-8")
+    # A zero timestamp keeps the bytes, and so the ETag, stable per page
+    data = gzip.compress(html, compresslevel=9, mtime=0)
+    etag = hashlib.sha1(data).hexdigest()[:16]
+    text = render(data, etag, len(html), len(data))
+
+    # Rewriting an unchanged header would rebuild everything including it
+    path = os.path.join(project, TARGET)
+    if os.path.exists(path):
+        with open(path, encoding="utf-8") as f:
+            if f.read() == text:
+                return
+    with open(path, "w", encoding="utf-8") as f:
+        f.write(text)
+    print("webpage.py: %d bytes -> %d gzipped, ETag %s"
+          % (len(html), len(data), etag))
+
+
+try:
+    Import("env")  # noqa: F821, provided by PlatformIO
+    build(env.subst("$PROJECT_DIR"))  # noqa: F821
+except NameError:
+    build(os.getcwd())
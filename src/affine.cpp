@@ -0,0 +1,343 @@
+// ====================================================== //
+// ========= Affine background layer ("mode 7") ========= //
+// ====================================================== //
+
+#include "affine.h"
+
+#include <algorithm>
+#include <cstring>
+#include <math.h>
+
+#include "metrics.h"
+#include "report.h"
+
+#ifdef ARDUINO
+static portMUX_TYPE matrixMux = portMUX_INITIALIZER_UNLOCKED;
+#define MATRIX_LOCK()   portENTER_CRITICAL(&matrixMux)
+#define MATRIX_UNLOCK() portEXIT_CRITICAL(&matrixMux)
+#else
+#include <mutex>
+
+static std::mutex matrixMutex;
+#define MATRIX_LOCK()   matrixMutex.lock()
+#define MATRIX_UNLOCK() matrixMutex.unlock()
+#endif
+
+AffineLayer affineLayer = { &image, affineIdentity(), AffineEdge::Wrap,
+    nullptr };
+
+// New matrices from the server are latched at the first line of a frame
+static AffineMatrix  pendingMatrix;
+static volatile bool matrixPending;
+
+AffineMatrix affineIdentity()
+{
+    return AffineMatrix{ 1 << 16, 0, 0, 1 << 16, 0, 0 };
+}
+
+AffineMatrix affineRotateZoom(
+        double angle, double zoom, double u, double v, double x, double y)
+{
+    // Inverse of "rotate by angle and scale by zoom around (u, v)", with
+    // (u, v) of the source landing on (x, y) of the screen
+    const double cosz = cos(angle) / zoom;
+    const double sinz = sin(angle) / zoom;
+
+    AffineMatrix m;
+    m.a  = lround(cosz * 65536.0);
+    m.b  = lround(sinz * 65536.0);
+    m.c  = lround(-sinz * 65536.0);
+    m.d  = lround(cosz * 65536.0);
+    m.tx = llround((u - cosz * x - sinz * y) * 65536.0);
+    m.ty = llround((v + sinz * x - cosz * y) * 65536.0);
+    return m;
+}
+
+bool affinePerspective(AffineMatrix &m, int y, int width, int height)
+{
+    // Floor plane with the horizon a quarter of the way down: the bottom
+    // line is sampled as the flat layer would be, lines above it are
+    // further away and so cover a wider, more distant span of the source
+    const int horizon = height / 4;
+    if (y <= horizon) {
+        return false;
+    }
+
+    const int64_t scale = ((int64_t) (height - horizon) << 16) / (y - horizon);
+    const int64_t ahead = (int64_t) (height - horizon) * (scale - (1 << 16));
+    const int64_t flatY = ((int64_t) height << 16) - ahead;
+    const int64_t edge  = (int64_t) (width / 2) * ((1 << 16) - scale);
+
+    const int64_t a = m.a, b = m.b, c = m.c, d = m.d;
+    m.tx = (a * edge >> 16) + (b * flatY >> 16) + m.tx;
+    m.ty = (c * edge >> 16) + (d * flatY >> 16) + m.ty;
+    m.a  = a * scale >> 16;
+    m.c  = c * scale >> 16;
+    m.b = m.d = 0;
+    return true;
+}
+
+void affineSampleLine(const Image &source, const AffineMatrix &m,
+        AffineEdge edge, Color *line, int y, int width, int step)
+{
+    const int32_t w     = source.xres;
+    const int32_t h     = source.yres;
+    const int     count = (width + step - 1) / step;
+    int64_t       u     = (int64_t) m.b * y + m.tx;
+    int64_t       v     = (int64_t) m.d * y + m.ty;
+    const int64_t stepU = (int64_t) m.a * step;
+    const int64_t stepV = (int64_t) m.c * step;
+
+    if (edge == AffineEdge::Clamp) {
+        const int64_t maxU = (int64_t) (w - 1) << 16;
+        const int64_t maxV = (int64_t) (h - 1) << 16;
+        for (int i = 0; i < count; ++i, u += stepU, v += stepV) {
+            int32_t su = u < 0 ? 0 : u > maxU ? maxU : u;
+            int32_t sv = v < 0 ? 0 : v > maxV ? maxV : v;
+            line[i]    = source.pixels[(sv >> 16) * w + (su >> 16)];
+        }
+        return;
+    }
+
+    // Keep the coordinates and the steps inside one source period, then a
+    // step is two adds with at most one correction each
+    const int32_t spanU = w << 16;
+    const int32_t spanV = h << 16;
+    int32_t       su    = u % spanU;
+    int32_t       sv    = v % spanV;
+    const int32_t du    = stepU % spanU;
+    const int32_t dv    = stepV % spanV;
+    if (su < 0)
+        su += spanU;
+    if (sv < 0)
+        sv += spanV;
+
+    for (int i = 0; i < count; ++i) {
+        line[i] = source.pixels[(sv >> 16) * w + (su >> 16)];
+
+        su += du;
+        if (su >= spanU)
+            su -= spanU;
+        else if (su < 0)
+            su += spanU;
+
+        sv += dv;
+        if (sv >= spanV)
+            sv -= spanV;
+        else if (sv < 0)
+            sv += spanV;
+    }
+}
+
+void affineLine(Color *line, int y, int width, int height, uint32_t frame,
+        int step)
+{
+    static uint32_t latchedFrame = UINT32_MAX;
+    if (frame != latchedFrame) {
+        latchedFrame = frame;
+        if (matrixPending) {
+            MATRIX_LOCK();
+            affineLayer.matrix = pendingMatrix;
+            matrixPending      = false;
+            MATRIX_UNLOCK();
+        }
+    }
+
+    AffineMatrix m = affineLayer.matrix;
+    if (affineLayer.lineHook && !affineLayer.lineHook(m, y, width, height)) {
+        memset(line, 0, (width + step - 1) / step * sizeof(Color));
+        return;
+    }
+
+    affineSampleLine(
+            *affineLayer.source, m, affineLayer.edge, line, y, width, step);
+}
+
+void setAffineMatrix(const AffineMatrix &m)
+{
+    MATRIX_LOCK();
+    pendingMatrix = m;
+    matrixPending = true;
+    MATRIX_UNLOCK();
+}
+
+// ─── Self-test ──────────────────────────────────────────────────────────
+
+// Where the matrix sends screen (x, y), in source pixels
+static void mapPoint(
+        const AffineMatrix &m, double x, double y, double &u, double &v)
+{
+    u = (m.a * x + m.b * y + m.tx) / 65536.0;
+    v = (m.c * x + m.d * y + m.ty) / 65536.0;
+}
+
+// What affineSampleLine() should give, worked out in doubles: the source
+// pixel under each screen pixel, its coordinates wrapped or clamped
+static void referenceLine(const Image &source, const AffineMatrix &m,
+        AffineEdge edge, Color *line, int y, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        double u, v;
+        mapPoint(m, x, y, u, v);
+        double su = floor(u);
+        double sv = floor(v);
+        if (edge == AffineEdge::Clamp) {
+            su = std::min(std::max(su, 0.0), source.xres - 1.0);
+            sv = std::min(std::max(sv, 0.0), source.yres - 1.0);
+        }
+        else {
+            su -= floor(su / source.xres) * source.xres;
+            sv -= floor(sv / source.yres) * source.yres;
+        }
+        line[x] = source.get((int) su, (int) sv);
+    }
+}
+
+bool testAffine()
+{
+    // Every source pixel tells where it came from
+    Image source(37, 23, heapAllocator(MemoryRegion::Internal));
+    for (int y = 0; y < source.yres; ++y) {
+        for (int x = 0; x < source.xres; ++x) {
+            source.set(x, y,
+                    Color{ (uint8_t) x, (uint8_t) y, (uint8_t) (x ^ y) });
+        }
+    }
+
+    static Color line[SCANLINE_MAX], expected[SCANLINE_MAX];
+    const int    width = SCANLINE_MAX;
+    bool         ok    = true;
+
+    // The 16.16 matrix lands the chosen source point on the chosen screen
+    // point, and maps the rest of the screen within rounding of the
+    // rotation and zoom it stands for
+    const double angles[] = { 0, 0.3, -2.1, M_PI / 2, 3 };
+    const double zooms[]  = { 1, 0.37, 2.5 };
+    for (double angle : angles) {
+        for (double zoom : zooms) {
+            const AffineMatrix m
+                    = affineRotateZoom(angle, zoom, 12.5, -7, 320, 240);
+            double worst = 0;
+            for (int y = 0; y < 480; y += 479) {
+                for (int x = 0; x < 640; x += 639) {
+                    const double dx = (x - 320) / zoom;
+                    const double dy = (y - 240) / zoom;
+                    double       u, v;
+                    mapPoint(m, x, y, u, v);
+                    worst = std::max(worst,
+                            fabs(u - (12.5 + cos(angle) * dx
+                                             + sin(angle) * dy)));
+                    worst = std::max(worst,
+                            fabs(v - (-7 - sin(angle) * dx
+                                             + cos(angle) * dy)));
+                }
+            }
+            ok &= check(worst < 1.0 / 64, "rotate and zoom", angle * zoom);
+        }
+    }
+
+    // The fixed-point sampler picks the same pixels as the reference, for
+    // steps that cross the source in either direction, skip whole periods
+    // of it, and start far off it
+    AffineMatrix matrices[] = {
+        affineIdentity(),
+        affineRotateZoom(0.3, 1.7, 3, 5, 320, 240),
+        affineRotateZoom(-2.1, 0.37, 18, 11, 100, 400),
+        affineRotateZoom(M_PI, 0.05, 0, 0, 0, 0),
+        AffineMatrix{ -(41 << 16) - 5, 3 << 14, (23 << 16) + 77, -(1 << 15),
+            -(9000 << 16), 12345 << 16 },
+    };
+    for (const AffineMatrix &m : matrices) {
+        for (AffineEdge edge : { AffineEdge::Wrap, AffineEdge::Clamp }) {
+            for (int y = 0; y < 480; y += 7) {
+                affineSampleLine(source, m, edge, line, y, width);
+                referenceLine(source, m, edge, expected, y, width);
+                ok &= check(!memcmp(line, expected, sizeof(line)),
+                        edge == AffineEdge::Wrap ? "wrap" : "clamp", y);
+
+                // What scanout asks for: every SCAN_STEP-th of those
+                affineSampleLine(source, m, edge, line, y, width, SCAN_STEP);
+                bool same = true;
+                for (int i = 0; i * SCAN_STEP < width; ++i)
+                    same &= !memcmp(&line[i], &expected[i * SCAN_STEP],
+                            sizeof(Color));
+                ok &= check(same, "sampled", y);
+            }
+        }
+    }
+
+    // Perspective blanks the sky, keeps the bottom edge where the flat
+    // layer has it, and spreads the lines above it over a distance that
+    // grows as 1 / (y - horizon)
+    const int          height  = 480;
+    const int          horizon = height / 4;
+    const AffineMatrix flat    = affineRotateZoom(0.7, 1.2, 20, 9, 320, 240);
+    for (int y = 0; y <= height; ++y) {
+        AffineMatrix m = flat;
+        if (!affinePerspective(m, y, width, height)) {
+            ok &= check(y <= horizon, "sky", y);
+            continue;
+        }
+
+        const double scale = (double) (height - horizon) / (y - horizon);
+        const double flatY = height - (height - horizon) * (scale - 1);
+        const double edge  = width / 2 * (1 - scale);
+        double       worst = 0;
+        for (int x = 0; x < width; x += width - 1) {
+            double u, v, fu, fv;
+            mapPoint(m, x, y, u, v);
+            mapPoint(flat, edge + x * scale, flatY, fu, fv);
+            worst = std::max(worst, std::max(fabs(u - fu), fabs(v - fv)));
+        }
+        ok &= check(worst < 1.0 / 16, "perspective", y);
+        if (y == height) {
+            ok &= check(m.a == flat.a && m.c == flat.c
+                                && m.tx == flat.tx + flat.b * height
+                                && m.ty == flat.ty + flat.d * height,
+                    "perspective at the bottom");
+        }
+    }
+
+    // A matrix set mid-frame waits for the next one
+    const AffineLayer saved = affineLayer;
+    affineLayer             = { &source, affineIdentity(), AffineEdge::Wrap,
+        nullptr };
+    affineLine(line, 0, width, height, 1, 1);
+    setAffineMatrix(matrices[1]);
+    affineLine(line, 1, width, height, 1, 1);
+    referenceLine(source, affineIdentity(), AffineEdge::Wrap, expected, 1,
+            width);
+    ok &= check(!memcmp(line, expected, sizeof(line)), "latched mid-frame");
+    affineLine(line, 0, width, height, 2, 1);
+    referenceLine(source, matrices[1], AffineEdge::Wrap, expected, 0, width);
+    ok &= check(!memcmp(line, expected, sizeof(line)), "latched next frame");
+    affineLayer = saved;
+
+    report("Affine tests %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+void benchmarkAffine(const Image &source, const VGAMode &mode)
+{
+    static Color       line[SCANLINE_MAX];
+    const int          width  = std::min(mode.xres, SCANLINE_MAX);
+    const char        *unit   = METRICS_CYCLE_HZ == 1e9 ? "ns" : "cycles";
+    const uint32_t     budget = mode.vLine * (METRICS_CYCLE_HZ / 1e3);
+    const AffineMatrix m      = affineRotateZoom(0.5, 1.3, source.xres / 2.0,
+            source.yres / 2.0, mode.xres / 2.0, mode.yres / 2.0);
+
+    const AffineEdge edges[2] = { AffineEdge::Wrap, AffineEdge::Clamp };
+    for (AffineEdge edge : edges) {
+        uint32_t start = cycleCount();
+        for (int y = 0; y < mode.yres; ++y) {
+            affineSampleLine(source, m, edge, line, y, width);
+        }
+        uint32_t cycles  = cycleCount() - start;
+        uint32_t perLine = cycles / mode.yres;
+
+        report("%s: %u %s/line (%u%% of line period), %.1f Mpixels/s\n",
+                edge == AffineEdge::Wrap ? "wrap" : "clamp", perLine, unit,
+                perLine * 100 / budget,
+                width * mode.yres * METRICS_CYCLE_HZ / 1e6 / cycles);
+    }
+}
@@ -0,0 +1,381 @@
+// ====================================================== //
+// ======= Memory placement aware frame/line buffers ==== //
+// ====================================================== //
+
+#include "allocator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+static portMUX_TYPE allocatorMux = portMUX_INITIALIZER_UNLOCKED;
+#define ALLOCATOR_LOCK()   portENTER_CRITICAL(&allocatorMux)
+#define ALLOCATOR_UNLOCK() portEXIT_CRITICAL(&allocatorMux)
+#define ALLOCATOR_LOG      Serial.printf
+#else
+#include <mutex>
+
+static std::mutex allocatorMutex;
+#define ALLOCATOR_LOCK()   allocatorMutex.lock()
+#define ALLOCATOR_UNLOCK() allocatorMutex.unlock()
+#define ALLOCATOR_LOG      printf
+#endif
+
+static Allocator *allocators;
+
+static size_t alignUp(size_t value, size_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+void *regionAlloc(size_t size, size_t align, MemoryRegion region)
+{
+#ifdef ARDUINO
+    uint32_t caps = MALLOC_CAP_8BIT;
+    switch (region) {
+        case MemoryRegion::Psram:
+            caps |= MALLOC_CAP_SPIRAM;
+            break;
+        case MemoryRegion::Internal:
+            caps |= MALLOC_CAP_INTERNAL;
+            break;
+        case MemoryRegion::InternalDma:
+            caps |= MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA;
+            break;
+    }
+    return heap_caps_aligned_alloc(align, size, caps);
+#else
+    return aligned_alloc(align, alignUp(size, align));
+#endif
+}
+
+void regionFree(void *p)
+{
+#ifdef ARDUINO
+    heap_caps_free(p);
+#else
+    free(p);
+#endif
+}
+
+// ─── Allocator ──────────────────────────────────────────────────────────
+
+Allocator::Allocator(const char *name, MemoryRegion region)
+    : name(name), region(region), next(allocators)
+{
+    allocators = this;
+}
+
+Allocator::~Allocator()
+{
+    for (Allocator **p = &allocators; *p; p = &(*p)->next) {
+        if (*p == this) {
+            *p = next;
+            break;
+        }
+    }
+}
+
+void Allocator::track(ptrdiff_t bytes)
+{
+    inUse += bytes;
+    if (inUse > peak)
+        peak = inUse;
+}
+
+size_t Allocator::capacity() const
+{
+    return 0;
+}
+
+Allocator *firstAllocator()
+{
+    return allocators;
+}
+
+// ─── Heap ───────────────────────────────────────────────────────────────
+
+// Every allocation has a header in front of it as large as its alignment
+// and at least 16 bytes; the last 16 hold its size and the header size
+HeapAllocator::HeapAllocator(const char *name, MemoryRegion region)
+    : Allocator(name, region)
+{}
+
+void *HeapAllocator::allocate(size_t size, size_t align)
+{
+    const size_t header = align > 16 ? align : 16;
+    uint8_t     *p = (uint8_t *) regionAlloc(size + header, header, region);
+    if (!p) {
+        ALLOCATOR_LOG(
+                "%s: out of memory for %u bytes\n", name, (unsigned) size);
+        return nullptr;
+    }
+
+    size_t *info = (size_t *) (p + header - 16);
+    info[0]      = size;
+    info[1]      = header;
+    ALLOCATOR_LOCK();
+    track(size);
+    ALLOCATOR_UNLOCK();
+    return p + header;
+}
+
+void HeapAllocator::deallocate(void *p)
+{
+    if (!p) {
+        return;
+    }
+
+    const size_t *info = (const size_t *) ((uint8_t *) p - 16);
+    ALLOCATOR_LOCK();
+    track(-(ptrdiff_t) info[0]);
+    ALLOCATOR_UNLOCK();
+    regionFree((uint8_t *) p - info[1]);
+}
+
+// ─── Block Pool ─────────────────────────────────────────────────────────
+
+// Blocks are a multiple of 64 bytes from a 64 byte aligned base, so every
+// one serves the 64 byte alignment DMA buffers ask for; the pools' sizes
+// already are, so this costs nothing
+BlockPool::BlockPool(const char *name, size_t blockSize, size_t blocks,
+        MemoryRegion region, Allocator *fallback)
+    : Allocator(name, region),
+      base(nullptr),
+      blockSize(alignUp(blockSize, 64)),
+      blocks(blocks),
+      freeList(nullptr),
+      fallback(fallback)
+{
+    base = (uint8_t *) regionAlloc(this->blockSize * blocks, 64, region);
+    if (!base) {
+        ALLOCATOR_LOG("%s: could not carve %u blocks, using the heap\n", name,
+                (unsigned) blocks);
+        this->blocks = 0;
+        return;
+    }
+
+    // Thread the free list through the blocks themselves
+    for (size_t i = blocks; i-- > 0;) {
+        void **block = (void **) (base + i * this->blockSize);
+        *block       = freeList;
+        freeList     = block;
+    }
+}
+
+void *BlockPool::allocate(size_t size, size_t align)
+{
+    void *block = nullptr;
+    if (size <= blockSize && align <= 64) {
+        ALLOCATOR_LOCK();
+        if (freeList) {
+            block    = freeList;
+            freeList = *(void **) block;
+            track(blockSize);
+        }
+        ALLOCATOR_UNLOCK();
+    }
+
+    if (!block && fallback) {
+        // Either way the pool is sized wrong for its users
+        ALLOCATOR_LOG("%s: %u bytes from %s, %s\n", name, (unsigned) size,
+                fallback->name,
+                size > blockSize ? "oversized"
+                : align > 64     ? "overaligned"
+                                 : "drained");
+        block = fallback->allocate(size, align);
+    }
+    return block;
+}
+
+void BlockPool::deallocate(void *p)
+{
+    if (!p) {
+        return;
+    }
+
+    uint8_t *block = (uint8_t *) p;
+    if (block < base || block >= base + blockSize * blocks) {
+        fallback->deallocate(p);
+        return;
+    }
+
+    ALLOCATOR_LOCK();
+    *(void **) block = freeList;
+    freeList         = block;
+    track(-(ptrdiff_t) blockSize);
+    ALLOCATOR_UNLOCK();
+}
+
+size_t BlockPool::capacity() const
+{
+    return blockSize * blocks;
+}
+
+// ─── Arena ──────────────────────────────────────────────────────────────
+
+Arena::Arena(const char *name, size_t size, MemoryRegion region)
+    : Allocator(name, region),
+      base((uint8_t *) regionAlloc(size, 64, region)),
+      size(base ? size : 0)
+{}
+
+// Locked like the other allocators, so any task may bump it; what it
+// handed out still only lasts until the owner's next reset()
+void *Arena::allocate(size_t bytes, size_t align)
+{
+    ALLOCATOR_LOCK();
+    const uintptr_t start  = (uintptr_t) base;
+    const size_t    used   = inUse;
+    const size_t    offset = alignUp(start + used, align) - start;
+    const bool      fits   = base && offset + bytes <= size;
+    if (fits) {
+        inUse = offset;
+        track(bytes);
+    }
+    ALLOCATOR_UNLOCK();
+
+    if (!fits) {
+        ALLOCATOR_LOG("%s: %u of %u bytes used, %u more do not fit\n", name,
+                (unsigned) used, (unsigned) size, (unsigned) bytes);
+        return nullptr;
+    }
+    return base + offset;
+}
+
+void Arena::deallocate(void *p)
+{
+    // Freed all at once by reset()
+}
+
+size_t Arena::capacity() const
+{
+    return size;
+}
+
+void Arena::reset()
+{
+    ALLOCATOR_LOCK();
+    inUse = 0;
+    ALLOCATOR_UNLOCK();
+}
+
+// ─── Shared Allocators ──────────────────────────────────────────────────
+
+// Built on first use, so images constructed during static initialization
+// in other translation units find them ready
+
+Allocator &heapAllocator(MemoryRegion region)
+{
+    static HeapAllocator psram("psram heap", MemoryRegion::Psram);
+    static HeapAllocator internal("internal heap", MemoryRegion::Internal);
+    static HeapAllocator dma("dma heap", MemoryRegion::InternalDma);
+
+    switch (region) {
+        case MemoryRegion::Psram:
+            return psram;
+        case MemoryRegion::Internal:
+            return internal;
+        default:
+            return dma;
+    }
+}
+
+Allocator &frameAllocator()
+{
+    static BlockPool frames("frames", 640 * 480 * 3, FRAME_POOL_FRAMES,
+            MemoryRegion::Psram, &heapAllocator(MemoryRegion::Psram));
+    return frames;
+}
+
+Allocator &lineAllocator()
+{
+    static BlockPool lines("lines", LINE_POOL_BLOCK, LINE_POOL_BLOCKS,
+            MemoryRegion::InternalDma,
+            &heapAllocator(MemoryRegion::InternalDma));
+    return lines;
+}
+
+Allocator &chunkAllocator(size_t chunkSize)
+{
+    static BlockPool chunks("chunks", CHUNK_POOL_BLOCK, CHUNK_POOL_BLOCKS,
+            MemoryRegion::InternalDma,
+            &heapAllocator(MemoryRegion::InternalDma));
+    static BlockPool sends("sends", SEND_POOL_BLOCK, SEND_POOL_BLOCKS,
+            MemoryRegion::InternalDma,
+            &heapAllocator(MemoryRegion::InternalDma));
+    return chunkSize <= CHUNK_POOL_BLOCK ? (Allocator &) chunks : sends;
+}
+
+Arena &scratchArena()
+{
+    static Arena scratch("scratch", SCRATCH_ARENA, MemoryRegion::Psram);
+    return scratch;
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+bool testAllocator(int cycles)
+{
+    Allocator &lines   = lineAllocator();
+    Allocator &frames  = frameAllocator();
+    Arena     &scratch = scratchArena();
+
+    const size_t linesBefore  = lines.used();
+    const size_t framesBefore = frames.used();
+    size_t       scratchPeak  = 0;
+
+    // Replays what a /draw request allocates: the file in scratch, a line
+    // block for the decoder and a frame for the decoded image
+    for (int i = 0; i < cycles; ++i) {
+        void *file  = scratch.allocate(SCRATCH_ARENA / 2);
+        void *line  = lines.allocate(LINE_POOL_BLOCK);
+        void *frame = frames.allocate(640 * 480 * 3);
+        if (!file || !line || !frame) {
+            ALLOCATOR_LOG("Allocation failed in cycle %d\n", i);
+            return false;
+        }
+
+        lines.deallocate(line);
+        frames.deallocate(frame);
+        scratch.reset();
+
+        if (i == 0) {
+            scratchPeak = scratch.highWater();
+        }
+        if (lines.used() != linesBefore || frames.used() != framesBefore
+                || scratch.used() != 0 || scratch.highWater() != scratchPeak) {
+            ALLOCATOR_LOG("Allocators leaked in cycle %d\n", i);
+            return false;
+        }
+    }
+
+    // Every allocator hands out the alignment it is asked for, the pools
+    // by going to their fallback when their blocks cannot
+    Allocator   &heap      = heapAllocator(MemoryRegion::Internal);
+    Allocator   &chunks    = chunkAllocator();
+    Allocator   *aligned[] = { &heap, &lines, &chunks, &scratch };
+    const size_t heapUsed  = heap.used();
+    for (Allocator *allocator : aligned) {
+        for (size_t align = 16; align <= 256; align *= 2) {
+            void *p = allocator->allocate(100, align);
+            if (!p || (uintptr_t) p % align) {
+                ALLOCATOR_LOG("%s: %u byte alignment not met\n",
+                        allocator->name, (unsigned) align);
+                return false;
+            }
+            allocator->deallocate(p);
+        }
+    }
+    scratch.reset();
+    if (heap.used() != heapUsed || lines.used() != linesBefore) {
+        ALLOCATOR_LOG("Aligned allocations leaked\n");
+        return false;
+    }
+
+    ALLOCATOR_LOG("%d allocation cycles, scratch high-water %u bytes\n",
+            cycles, (unsigned) scratchPeak);
+    return true;
+}
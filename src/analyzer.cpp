@@ -0,0 +1,1047 @@
+// ====================================================== //
+// ======= Logic-analyzer captures of the VGA signal ===== //
+// ====================================================== //
+
+#include "analyzer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <vector>
+
+#include "report.h"
+
+#ifndef ARDUINO
+#include <chrono>
+
+#include "hal.h"
+#endif
+
+static uint64_t signalBit(LogicSignal signal)
+{
+    return 1ull << (int) signal;
+}
+
+// Syncs and blank idle high, so a capture without them shows a picture
+static const uint64_t idleLevels = signalBit(LogicSignal::Hsync)
+                                 | signalBit(LogicSignal::Vsync)
+                                 | signalBit(LogicSignal::Blank);
+
+// ─── Channels ───────────────────────────────────────────────────────────
+
+static const char *const signalNames[LOGIC_SIGNALS] = { "HSYNC", "VSYNC",
+    "BLANK", "DACCLK", "LE_R", "LE_G", "LE_B", "C0", "C1", "C2", "C3", "C4",
+    "C5", "C6", "C7" };
+
+LogicChannels defaultLogicChannels()
+{
+    LogicChannels channels{};
+    for (int i = 0; i < LOGIC_SIGNALS; ++i) {
+        channels.names[i] = signalNames[i];
+    }
+    return channels;
+}
+
+bool parseLogicChannels(const char *text, LogicChannels &channels)
+{
+    while (*text) {
+        const char *end   = text + strcspn(text, ",");
+        const char *equal = std::find(text, end, '=');
+        if (equal == end) {
+            return false;
+        }
+        const std::string key(text, equal);
+        const std::string value(equal + 1, end);
+
+        if (!strcasecmp(key.c_str(), "rate")) {
+            channels.sampleRate = strtod(value.c_str(), nullptr);
+        }
+        else {
+            int signal = 0;
+            while (signal < LOGIC_SIGNALS
+                    && strcasecmp(key.c_str(), signalNames[signal])) {
+                ++signal;
+            }
+            if (signal == LOGIC_SIGNALS) {
+                return false;
+            }
+            channels.names[signal] = value;
+        }
+        text = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+MonitorPins logicMonitorPins()
+{
+    MonitorPins pins{ (int) LogicSignal::Hsync, (int) LogicSignal::Vsync,
+        (int) LogicSignal::Blank, (int) LogicSignal::DacClk,
+        (int) LogicSignal::LatchR, (int) LogicSignal::LatchG,
+        (int) LogicSignal::LatchB, {} };
+    for (int i = 0; i < 8; ++i) {
+        pins.bus[i] = (int) LogicSignal::Bus0 + i;
+    }
+    return pins;
+}
+
+// ─── Reading ────────────────────────────────────────────────────────────
+
+void LogicReader::begin(
+        LogicFormat nextFormat, const LogicChannels &nextChannels,
+        LogicSink nextSink)
+{
+    format     = nextFormat;
+    channels   = nextChannels;
+    sink       = nextSink;
+    state      = State::Header;
+    used       = 0;
+    lineNumber = 0;
+    columns    = 0;
+    levels     = idleLevels;
+    sentAny    = false;
+    at         = 0;
+    matched    = 0;
+    timed      = false;
+    sampleNs   = channels.sampleRate > 0 ? 1e9 / channels.sampleRate : 0;
+    sample     = 0;
+    unitNs     = format == LogicFormat::Csv ? 1e9 : 1;
+    pending[0] = 0;
+    section.clear();
+    words.clear();
+    for (int i = 0; i < 64; ++i) {
+        bits[i] = -1;
+        ids[i].clear();
+    }
+}
+
+bool LogicReader::write(const char *data, size_t size)
+{
+    if (state == State::Error || state == State::End) {
+        return false;
+    }
+    const bool csv = format == LogicFormat::Csv;
+    for (size_t i = 0; i < size; ++i) {
+        const char c = data[i];
+        const bool space = c == ' ' || c == '\n' || c == '\r' || c == '\t';
+        if (csv ? c == '\n' : space) {
+            if (csv || used) {
+                text[used] = 0;
+                used       = 0;
+                if (!(csv ? line() : token())) {
+                    return false;
+                }
+            }
+            lineNumber += c == '\n';
+            continue;
+        }
+        if (used + 1 >= LOGIC_LINE_MAX) {
+            return fail(csv ? "line too long" : "token too long");
+        }
+        text[used++] = c;
+    }
+    return true;
+}
+
+bool LogicReader::finish()
+{
+    if (state == State::Error || state == State::End) {
+        return false;
+    }
+    if (used) {
+        text[used] = 0;
+        used       = 0;
+        if (!(format == LogicFormat::Csv ? line() : token())) {
+            return false;
+        }
+    }
+    if (state != State::Data) {
+        return fail("no samples");
+    }
+    emit();
+    state = State::End;
+    return true;
+}
+
+bool LogicReader::fail(const char *why)
+{
+    report("Capture parse failed: %s on line %u\n", why, lineNumber + 1);
+    state = State::Error;
+    return false;
+}
+
+bool LogicReader::channel(int column, const char *name)
+{
+    if (column >= 64) {
+        return fail("more than 64 channels");
+    }
+    columns = column + 1;
+    for (int signal = 0; signal < LOGIC_SIGNALS; ++signal) {
+        const std::string &wanted = channels.names[signal];
+        if (!wanted.empty() && !strcasecmp(wanted.c_str(), name)) {
+            bits[column] = signal;
+            matched |= 1u << signal;
+        }
+    }
+    return true;
+}
+
+// Hands the levels gathered at `at` over, when they changed
+void LogicReader::emit()
+{
+    if (!sentAny || levels != sent) {
+        sink(at, levels);
+        sent    = levels;
+        sentAny = true;
+    }
+}
+
+// "24 MHz", "1 ns", "10us": a number and an optional unit after it
+static double parseQuantity(const char *text, const char *&unit)
+{
+    char        *end;
+    const double value = strtod(text, &end);
+    while (*end == ' ') {
+        ++end;
+    }
+    unit = end;
+    return end == text ? 1 : value;
+}
+
+// Of a frequency in Hz, or of a time in ns, which happen to agree
+static double unitScale(const char *unit)
+{
+    switch (tolower((unsigned char) *unit)) {
+    case 'g':
+        return 1e9;
+    case 'm':
+        return 1e6;
+    case 'k':
+        return 1e3;
+    case 'u':
+        return 1e3;
+    case 'n':
+        return 1;
+    case 'p':
+        return 1e-3;
+    case 'f':
+        return 1e-6;
+    case 's':
+        return 1e9;
+    default:
+        return 1;
+    }
+}
+
+// ─── CSV ────────────────────────────────────────────────────────────────
+
+bool LogicReader::line()
+{
+    char *row = text;
+    if (const size_t size = strlen(row); size && row[size - 1] == '\r') {
+        row[size - 1] = 0;
+    }
+    if (!*row) {
+        return true;
+    }
+    if (*row == ';') {
+        const char *rate = strstr(row, "Samplerate:");
+        if (rate && !(channels.sampleRate > 0)) {
+            const char  *unit;
+            const double hz = parseQuantity(rate + 11, unit);
+            sampleNs        = 1e9 / (hz * unitScale(unit));
+        }
+        return true;
+    }
+    return state == State::Header ? csvHeader(row) : csvRow(row);
+}
+
+bool LogicReader::csvHeader(char *row)
+{
+    // A capture without a header row has numbers for names
+    const bool named = !isdigit((unsigned char) *row) && *row != '-'
+                    && *row != '.';
+    int column = 0;
+    for (char *field = row;; ++column) {
+        char *end = field + strcspn(field, ",");
+        char  next = *end;
+        *end       = 0;
+        while (*field == ' ') {
+            ++field;
+        }
+        char name[16];
+        snprintf(name, sizeof(name), "D%d", column);
+        if (column == 0 && named && !strncasecmp(field, "time", 4)) {
+            // "Time [s]", "time [us]" and the like
+            timed               = true;
+            const char *bracket = strchr(field, '[');
+            unitNs              = bracket ? unitScale(bracket + 1) : 1e9;
+        }
+        else if (!channel(timed ? column - 1 : column, named ? field : name)) {
+            return false;
+        }
+        if (!next) {
+            break;
+        }
+        *end  = next;
+        field = end + 1;
+    }
+    if (!timed && !(sampleNs > 0)) {
+        return fail("no sample rate or time column");
+    }
+    state = State::Data;
+    return named ? true : csvRow(row);
+}
+
+bool LogicReader::csvRow(char *row)
+{
+    char *field = row;
+    if (timed) {
+        char        *end;
+        const double time = strtod(field, &end);
+        if (end == field) {
+            return fail("bad time");
+        }
+        at    = llround(time * unitNs);
+        field = end + strcspn(end, ",");
+        field += *field == ',';
+    }
+    else {
+        at = llround(sample++ * sampleNs);
+    }
+
+    for (int column = 0; column < columns; ++column) {
+        while (*field == ' ') {
+            ++field;
+        }
+        if (bits[column] >= 0) {
+            const uint64_t bit = 1ull << bits[column];
+            levels = *field == '1' ? levels | bit : levels & ~bit;
+        }
+        field += strcspn(field, ",");
+        if (!*field) {
+            break;
+        }
+        ++field;
+    }
+    emit();
+    return true;
+}
+
+// ─── VCD ────────────────────────────────────────────────────────────────
+
+bool LogicReader::token()
+{
+    const char *word = text;
+
+    // Inside a section every word up to $end is its contents
+    if (!section.empty()) {
+        if (strcmp(word, "$end")) {
+            words += word;
+            words += ' ';
+            return true;
+        }
+        const bool ok = vcdSection();
+        section.clear();
+        words.clear();
+        return ok;
+    }
+
+    // A vector's value waits for its identifier, which may start with $
+    if (pending[0]) {
+        const char value = pending[0] == 'b' || pending[0] == 'B'
+                                 ? pending[strlen(pending) - 1]
+                                 : '0';
+        pending[0] = 0;
+        return state == State::Data ? vcdChange(&value, word)
+                                    : fail("value change before definitions");
+    }
+
+    if (*word == '$') {
+        // Value changes follow these, up to a $end of no meaning
+        static const char *const dumps[] = { "$dumpvars", "$dumpall",
+            "$dumpon", "$dumpoff", "$end" };
+        for (const char *dump : dumps) {
+            if (!strcmp(word, dump)) {
+                return true;
+            }
+        }
+        section = word;
+        return true;
+    }
+    if (state != State::Data) {
+        return fail("value change before $enddefinitions");
+    }
+
+    switch (*word) {
+    case '#': {
+        char          *end;
+        const uint64_t time = llround(strtoull(word + 1, &end, 10) * unitNs);
+        if (end == word + 1 || time < at) {
+            return fail("bad timestamp");
+        }
+        if (time != at) {
+            emit();
+            at = time;
+        }
+        return true;
+    }
+    case '0':
+    case '1':
+    case 'x':
+    case 'X':
+    case 'z':
+    case 'Z':
+        return vcdChange(word, word + 1);
+    case 'b':
+    case 'B':
+    case 'r':
+    case 'R':
+        strcpy(pending, word);
+        return true;
+    default:
+        return fail("unknown value change");
+    }
+}
+
+bool LogicReader::vcdSection()
+{
+    if (section == "$timescale") {
+        const char  *unit;
+        const double count = parseQuantity(words.c_str(), unit);
+        unitNs             = count * unitScale(unit);
+    }
+    else if (section == "$var") {
+        // type, size, identifier, name and an optional range
+        char type[32], id[LOGIC_LINE_MAX], name[LOGIC_LINE_MAX];
+        int  size = 0;
+        if (sscanf(words.c_str(), "%31s %d %1023s %1023s", type, &size, id,
+                    name)
+                != 4) {
+            return fail("bad $var");
+        }
+        if (size == 1) {
+            ids[columns] = id;
+            return channel(columns, name);
+        }
+    }
+    else if (section == "$enddefinitions") {
+        state = State::Data;
+    }
+    return true;
+}
+
+bool LogicReader::vcdChange(const char *value, const char *id)
+{
+    for (int column = 0; column < columns; ++column) {
+        if (ids[column] == id) {
+            if (bits[column] >= 0) {
+                const uint64_t bit = 1ull << bits[column];
+                levels = *value == '1' ? levels | bit : levels & ~bit;
+            }
+            return true;
+        }
+    }
+    return true;  // a wider variable, or one of no interest
+}
+
+// ─── Writing ────────────────────────────────────────────────────────────
+
+LogicWriter::LogicWriter(LogicFormat format, const LogicChannels &channels,
+        ChunkedWriter &out, double sampleRate)
+    : format(format), channels(channels), out(out), sampleNs(1e9 / sampleRate)
+{
+}
+
+void LogicWriter::header()
+{
+    std::string text;
+    if (format == LogicFormat::Vcd) {
+        text = "$version VGA signal analyzer $end\n"
+               "$timescale 1 ns $end\n"
+               "$scope module vga $end\n";
+        for (int i = 0; i < LOGIC_SIGNALS; ++i) {
+            appendf(text, "$var wire 1 %c %s $end\n", '!' + i,
+                    channels.names[i].c_str());
+        }
+        text += "$upscope $end\n$enddefinitions $end\n";
+    }
+    else {
+        appendf(text, "; CSV generated by the VGA signal analyzer\n"
+                      "; Samplerate: %g MHz\n",
+                1e3 / sampleNs);
+        for (int i = 0; i < LOGIC_SIGNALS; ++i) {
+            text += i ? "," : "";
+            text += channels.names[i];
+        }
+        text += '\n';
+    }
+    out.write(text.data(), text.size());
+}
+
+void LogicWriter::writeRows(uint64_t untilNs)
+{
+    for (; sample * sampleNs < untilNs; ++sample) {
+        out.write(row, sizeof(row));
+    }
+}
+
+void LogicWriter::signal(uint64_t atNs, uint64_t next)
+{
+    char text[32];
+    if (!started) {
+        header();
+        if (format == LogicFormat::Vcd) {
+            snprintf(text, sizeof(text), "#%llu\n$dumpvars\n",
+                    (unsigned long long) atNs);
+            out.print(text);
+            for (int i = 0; i < LOGIC_SIGNALS; ++i) {
+                const char change[3] = { char('0' + (next >> i & 1)),
+                    char('!' + i), '\n' };
+                out.write(change, sizeof(change));
+            }
+            out.print("$end\n");
+        }
+        started = true;
+    }
+    else if (format == LogicFormat::Vcd) {
+        snprintf(text, sizeof(text), "#%llu\n", (unsigned long long) atNs);
+        out.print(text);
+        for (int i = 0; i < LOGIC_SIGNALS; ++i) {
+            if ((levels ^ next) >> i & 1) {
+                const char change[3] = { char('0' + (next >> i & 1)),
+                    char('!' + i), '\n' };
+                out.write(change, sizeof(change));
+            }
+        }
+    }
+    else {
+        writeRows(atNs);
+    }
+
+    levels = next;
+    for (int i = 0; i < LOGIC_SIGNALS; ++i) {
+        row[2 * i]     = '0' + (levels >> i & 1);
+        row[2 * i + 1] = i + 1 < LOGIC_SIGNALS ? ',' : '\n';
+    }
+}
+
+void LogicWriter::finish(uint64_t atNs)
+{
+    if (!started) {
+        return;
+    }
+    if (format == LogicFormat::Vcd) {
+        char text[32];
+        snprintf(text, sizeof(text), "#%llu\n", (unsigned long long) atNs);
+        out.print(text);
+    }
+    else {
+        writeRows(atNs);
+    }
+    out.flush();
+}
+
+// ─── Synthetic Signal ───────────────────────────────────────────────────
+
+namespace
+{
+struct Change
+{
+    uint64_t at;
+    uint64_t set;
+    uint64_t clear;
+};
+}  // namespace
+
+uint64_t synthesizeSignal(const VGAMode &mode, const ImageView &image,
+        int frames, int step, const LogicSink &sink)
+{
+    const double pixelNs = mode.hPixel * 1e3;
+    const double slotNs  = pixelNs * step;
+    const double phaseNs = slotNs / 8;  // of latching and clocking a pixel
+
+    std::vector<Change> changes;
+    uint64_t            levels = idleLevels;
+    double              t      = 0;
+
+    auto change = [&](double at, uint64_t set, uint64_t clear) {
+        changes.push_back(Change{ (uint64_t) llround(at), set, clear });
+    };
+    auto raise = [&](double at, LogicSignal s) { change(at, signalBit(s), 0); };
+    auto lower = [&](double at, LogicSignal s) { change(at, 0, signalBit(s)); };
+    auto bus   = [&](double at, uint8_t byte) {
+        change(at, (uint64_t) byte << (int) LogicSignal::Bus0,
+                (uint64_t) (uint8_t) ~byte << (int) LogicSignal::Bus0);
+    };
+
+    // Everything gathered so far, in time order, one sink call per instant
+    auto send = [&]() {
+        std::stable_sort(changes.begin(), changes.end(),
+                [](const Change &a, const Change &b) { return a.at < b.at; });
+        for (size_t i = 0; i < changes.size();) {
+            const uint64_t at = changes[i].at;
+            for (; i < changes.size() && changes[i].at == at; ++i) {
+                levels = (levels | changes[i].set) & ~changes[i].clear;
+            }
+            sink(at, levels);
+        }
+        changes.clear();
+    };
+
+    auto verticalSync = [&]() {
+        lower(t, LogicSignal::Blank);
+        lower(t += mode.vFrontPorch * 1e6, LogicSignal::Vsync);
+        raise(t += mode.vSyncTime * 1e6, LogicSignal::Vsync);
+    };
+
+    for (int frame = 0; frame < frames; ++frame) {
+        // vSyncInt lifts the blank a moment before the first line drops
+        // it again, which is where the back porch shows
+        verticalSync();
+        raise(t += mode.vBackPorch * 1e6, LogicSignal::Blank);
+        t += slotNs;
+        send();
+
+        for (int y = 0; y < mode.yres; ++y) {
+            lower(t, LogicSignal::Blank);
+            lower(t += mode.hFrontPorch * 1e3, LogicSignal::Hsync);
+            raise(t += mode.hSyncTime * 1e3, LogicSignal::Hsync);
+            raise(t += mode.hBackPorch * 1e3, LogicSignal::Blank);
+
+            // Each pixel is latched in the slot before the DAC clock that
+            // puts it out, right as the beam reaches it
+            for (int x = 0; x < mode.xres; x += step) {
+                const double dac   = t + x * pixelNs;
+                const Color  color = image.get(x, y);
+                bus(dac - 7 * phaseNs, color.r);
+                raise(dac - 6 * phaseNs, LogicSignal::LatchR);
+                lower(dac - 5 * phaseNs, LogicSignal::LatchR);
+                bus(dac - 5 * phaseNs, color.g);
+                raise(dac - 4 * phaseNs, LogicSignal::LatchG);
+                lower(dac - 3 * phaseNs, LogicSignal::LatchG);
+                bus(dac - 3 * phaseNs, color.b);
+                raise(dac - 2 * phaseNs, LogicSignal::LatchB);
+                lower(dac - 1 * phaseNs, LogicSignal::LatchB);
+                raise(dac, LogicSignal::DacClk);
+                lower(dac + 2 * phaseNs, LogicSignal::DacClk);
+            }
+            t += mode.xres * pixelNs;
+            send();
+        }
+    }
+    verticalSync();
+    send();
+    return llround(t);
+}
+
+// ─── Analysis ───────────────────────────────────────────────────────────
+
+SignalAnalyzer::SignalAnalyzer(const VGAMode &mode)
+    : mode(mode), monitor(logicMonitorPins(), mode), levels(idleLevels)
+{
+}
+
+// Records how far the period ending at `at` is from the one before it
+void SignalAnalyzer::period(
+        Histogram &jitter, uint64_t at, uint64_t &last, uint64_t &lastPeriod)
+{
+    if (last) {
+        const uint64_t length = at - last;
+        if (lastPeriod) {
+            const uint64_t off = length > lastPeriod ? length - lastPeriod
+                                                     : lastPeriod - length;
+            jitter.record(std::min<uint64_t>(off, UINT32_MAX));
+        }
+        lastPeriod = length;
+    }
+    last = at;
+}
+
+void SignalAnalyzer::signal(uint64_t at, uint64_t next)
+{
+    const uint64_t changed = levels ^ next;
+    auto rose = [&](LogicSignal s) {
+        return (changed & signalBit(s)) && (next & signalBit(s));
+    };
+    auto fell = [&](LogicSignal s) {
+        return (changed & signalBit(s)) && !(next & signalBit(s));
+    };
+    const bool unblanked = next & signalBit(LogicSignal::Blank);
+
+    if (fell(LogicSignal::Hsync)) {
+        period(hsyncJitter, at, hsyncFall, hsyncPeriod);
+    }
+    if (fell(LogicSignal::Vsync)) {
+        period(vsyncJitter, at, vsyncFall, vsyncPeriod);
+        hsyncFall   = 0;
+        hsyncPeriod = 0;
+    }
+    if (rose(LogicSignal::Blank)) {
+        unblankedAt = at;
+        dacRise     = 0;
+        dacPeriod   = 0;
+    }
+    if (fell(LogicSignal::Blank) && unblankedAt) {
+        visibleNs += at - unblankedAt;
+    }
+    if (rose(LogicSignal::DacClk) && unblanked) {
+        ++visibleClocks;
+        period(pixelJitter, at, dacRise, dacPeriod);
+    }
+
+    monitor.signal(at, next);
+    levels = next;
+}
+
+double SignalAnalyzer::pixelClock() const
+{
+    return visibleNs ? visibleClocks * 1e3 / visibleNs : 0;
+}
+
+static void reportJitter(
+        std::string &out, const char *what, const Histogram &histogram)
+{
+    const HistogramSnapshot s = histogram.read();
+    appendf(out, "%s jitter, %llu periods: p50 %u ns, p99 %u ns, max %u ns\n",
+            what, (unsigned long long) s.count, s.quantile(0.5),
+            s.quantile(0.99), s.max);
+
+    uint32_t most = 1;
+    for (uint32_t count : s.buckets) {
+        most = std::max(most, count);
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (!s.buckets[i]) {
+            continue;
+        }
+        const uint32_t low = i ? HistogramSnapshot::upperBound(i - 1) + 1 : 0;
+        const int bars = std::max<uint64_t>(1, 40ull * s.buckets[i] / most);
+        appendf(out, "  %10u .. %-10u ns %9u %.*s\n", low,
+                HistogramSnapshot::upperBound(i), s.buckets[i], bars,
+                "########################################");
+    }
+}
+
+void SignalAnalyzer::writeReport(std::string &out) const
+{
+    writeMonitorReport(out, monitor.report(), mode);
+    appendf(out, "%-16s %10.3f MHz   mode %.3f, every %d: %.3f\n",
+            "pixel clock", pixelClock(), 1 / mode.hPixel, SCAN_STEP,
+            1 / (mode.hPixel * SCAN_STEP));
+    reportJitter(out, "hsync", hsyncJitter);
+    reportJitter(out, "vsync", vsyncJitter);
+    reportJitter(out, "pixel", pixelJitter);
+}
+
+// ─── Files ──────────────────────────────────────────────────────────────
+
+#ifndef ARDUINO
+static LogicFormat formatOf(const char *path)
+{
+    const size_t size = strlen(path);
+    return size > 4 && !strcasecmp(path + size - 4, ".vcd") ? LogicFormat::Vcd
+                                                            : LogicFormat::Csv;
+}
+
+bool analyzeCaptureFile(const char *path, const LogicChannels &channels,
+        const VGAMode &mode, std::string &out, Image *last)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        report("Could not open %s\n", path);
+        return false;
+    }
+
+    SignalAnalyzer analyzer(mode);
+    LogicReader    reader;
+    reader.begin(formatOf(path), channels,
+            [&](uint64_t at, uint64_t levels) { analyzer.signal(at, levels); });
+
+    static char buf[16 * 1024];
+    bool        ok = true;
+    for (size_t n; ok && (n = fread(buf, 1, sizeof(buf), file));) {
+        ok = reader.write(buf, n);
+    }
+    fclose(file);
+    if (!ok || !reader.finish()) {
+        return false;
+    }
+
+    for (int i = 0; i < LOGIC_SIGNALS; ++i) {
+        if (!(reader.found() >> i & 1)) {
+            appendf(out, "no channel %s for %s\n",
+                    channels.names[i].c_str(), signalNames[i]);
+        }
+    }
+    analyzer.writeReport(out);
+    if (last) {
+        blit(last->view(), analyzer.decoder().frame().view());
+    }
+    return true;
+}
+
+bool writeScanoutCapture(const char *path, int frames)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    // The board's pins, in signal order
+    const MonitorPins board = boardMonitorPins();
+    const int         pins[LOGIC_SIGNALS] = { board.hsync, board.vsync,
+        board.blank, board.dacClk, board.latchR, board.latchG, board.latchB,
+        board.bus[0], board.bus[1], board.bus[2], board.bus[3], board.bus[4],
+        board.bus[5], board.bus[6], board.bus[7] };
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            fwrite(data, 1, size, file);
+        });
+        LogicWriter writer(formatOf(path), defaultLogicChannels(), out);
+
+        halSimReset();
+        halSimSink([&](uint64_t at, uint64_t levels) {
+            uint64_t signals = 0;
+            for (int i = 0; i < LOGIC_SIGNALS; ++i) {
+                signals |= (levels >> pins[i] & 1) << i;
+            }
+            writer.signal(at, signals);
+        });
+        vga.setup();
+        const double frameNs = VGA480p.yres * VGA480p.vLine * 1e6;
+        halSimRun(scanoutStep, (uint64_t) ((frames + 1) * frameNs + 1e6));
+        halSimSink(nullptr);
+        writer.finish(halSimNow());
+    }
+    return fclose(file) == 0;
+}
+#endif
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool near(double value, double expected, double tolerance)
+{
+    return std::fabs(value - expected) <= tolerance;
+}
+
+// Both formats by hand: renamed channels, sample rate comments, time
+// columns, and VCD changes sharing a line and a timestamp
+static bool testParsing()
+{
+    bool                  ok       = true;
+    std::vector<uint64_t> got;
+    LogicReader           reader;
+    LogicChannels         channels = defaultLogicChannels();
+    ok &= check(parseLogicChannels("hsync=D2,blank=D0", channels)
+                        && !parseLogicChannels("sync=D1", channels),
+            "channel names", 0);
+    auto sink = [&](uint64_t at, uint64_t levels) {
+        got.push_back(at);
+        got.push_back(levels);
+    };
+    const uint64_t hsync = signalBit(LogicSignal::Hsync);
+    const uint64_t blank = signalBit(LogicSignal::Blank);
+    const uint64_t vsync = signalBit(LogicSignal::Vsync);
+
+    const char csv[] = "; CSV generated by libsigrok\r\n"
+                       "; Samplerate: 25 MHz\r\n"
+                       "D0,D1,D2\r\n1,0,1\r\n1,0,1\r\n0,1,1\r\n0,0,0\r\n";
+    reader.begin(LogicFormat::Csv, channels, sink);
+    for (size_t i = 0; i < strlen(csv); ++i) {
+        ok &= reader.write(csv + i, 1);  // a byte at a time
+    }
+    ok &= check(reader.finish(), "csv", 0);
+    ok &= check(got
+                    == std::vector<uint64_t>{ 0, hsync | vsync | blank, 80,
+                            hsync | vsync, 120, vsync },
+            "csv changes", got.size());
+    ok &= check(reader.found() == (hsync | blank), "csv found",
+            reader.found());
+
+    got.clear();
+    const char timedCsv[] = "Time [us],D2\n0.0,1\n1.5,0\n";
+    reader.begin(LogicFormat::Csv, channels, sink);
+    ok &= check(reader.write(timedCsv, strlen(timedCsv)) && reader.finish(),
+            "timed csv", 0);
+    ok &= check(got.size() == 4 && got[2] == 1500 && got[3] == (vsync | blank),
+            "timed csv changes", got.size());
+
+    reader.begin(LogicFormat::Csv, channels, sink);
+    ok &= check(!reader.write("D0\n1\n", 5), "csv without rate", 0);
+
+    got.clear();
+    const char vcd[] = "$date today $end $version libsigrok $end\n"
+                       "$timescale\n  10 ns\n$end\n"
+                       "$scope module libsigrok $end\n"
+                       "$var wire 1 ! D0 $end\n$var wire 1 \" D1 $end\n"
+                       "$var wire 1 # D2 $end\n"
+                       "$var wire 4 $ bus [3:0] $end\n"
+                       "$upscope $end\n$enddefinitions $end\n"
+                       "#0 1! 1# b1010 $\n#3 0! 1\"\n#4\n#5 0#\n#6 x#\n";
+    reader.begin(LogicFormat::Vcd, channels, sink);
+    ok &= check(reader.write(vcd, strlen(vcd)) && reader.finish(), "vcd", 0);
+    ok &= check(got
+                    == std::vector<uint64_t>{ 0, hsync | vsync | blank, 30,
+                            hsync | vsync, 50, vsync },
+            "vcd changes", got.size());
+
+    reader.begin(LogicFormat::Vcd, channels, sink);
+    ok &= check(!reader.write("#5 1!\n", 6), "vcd before definitions", 0);
+    return ok;
+}
+
+// An image whose every scanned pixel differs from its neighbours
+static void testCard(const ImageView &image)
+{
+    for (int y = 0; y < image.height; ++y) {
+        for (int x = 0; x < image.width; ++x) {
+            image.set(x, y,
+                    Color{ (uint8_t) (x * 255 / (image.width - 1)),
+                            (uint8_t) (y * 255 / (image.height - 1)),
+                            (uint8_t) (x / SCAN_STEP * 7 + y * 13) });
+        }
+    }
+}
+
+// Synthesizes `frames` frames of VGA480p, runs them through a capture of
+// `format` and back, and checks what the analyzer makes of them
+static bool testRoundTrip(
+        LogicFormat format, int frames, double sampleRate, double slack)
+{
+    bool          ok   = true;
+    const VGAMode mode = VGA480p;
+    Image card(mode.xres, mode.yres, heapAllocator(MemoryRegion::Psram));
+    testCard(card.view());
+
+    SignalAnalyzer analyzer(mode);
+    LogicReader    reader;
+    reader.begin(format, defaultLogicChannels(),
+            [&](uint64_t at, uint64_t levels) { analyzer.signal(at, levels); });
+    bool read = true;
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            read = read && reader.write(data, size);
+        });
+        LogicWriter writer(format, defaultLogicChannels(), out, sampleRate);
+        const uint64_t end = synthesizeSignal(mode, card.view(), frames,
+                SCAN_STEP, [&](uint64_t at, uint64_t levels) {
+                    writer.signal(at, levels);
+                });
+        writer.finish(end + 1000);
+    }
+    ok &= check(read && reader.finish(), "capture read", (int) format);
+    ok &= check(reader.found() == (1u << LOGIC_SIGNALS) - 1, "channels",
+            reader.found());
+
+    // Times are in µs and ms; `slack` is in ns
+    const MonitorReport &r             = analyzer.decoder().report();
+    const double         us            = slack / 1e3;
+    const double         ms            = slack / 1e6;
+    const double         pixelsPerLine = mode.xres / SCAN_STEP;
+    ok &= check(r.frames == (uint32_t) frames, "frames", r.frames);
+    ok &= check(near(r.hsyncPeriod.min, modeLineUs(mode), 2 * us),
+            "hsync period", r.hsyncPeriod.min);
+    ok &= check(near(r.hsyncWidth.min, mode.hSyncTime, us)
+                        && near(r.hsyncWidth.max, mode.hSyncTime, us),
+            "hsync width", r.hsyncWidth.max);
+    ok &= check(near(r.hFrontPorch.mean(), mode.hFrontPorch, us)
+                        && near(r.hBackPorch.mean(), mode.hBackPorch, us),
+            "h porches", r.hBackPorch.mean());
+    ok &= check(near(r.vsyncPeriod.mean(), modeFrameMs(mode), 0.001),
+            "vsync period", r.vsyncPeriod.mean());
+    ok &= check(near(r.vsyncWidth.mean(), mode.vSyncTime, ms)
+                        && near(r.vFrontPorch.mean(), mode.vFrontPorch, ms)
+                        && near(r.vBackPorch.mean(), mode.vBackPorch, ms),
+            "v timings", r.vBackPorch.mean());
+    ok &= check(r.linesPerFrame.min == mode.yres
+                        && r.linesPerFrame.max == mode.yres,
+            "lines", r.linesPerFrame.min);
+    ok &= check(r.pixelsPerLine.min == pixelsPerLine
+                        && r.pixelsPerLine.max == pixelsPerLine,
+            "pixels per line", r.pixelsPerLine.min);
+    ok &= check(r.blankedPixels == 0, "blanked pixels", r.blankedPixels);
+    ok &= check(near(analyzer.pixelClock(), 1 / (mode.hPixel * SCAN_STEP),
+                        0.01 / (mode.hPixel * SCAN_STEP)),
+            "pixel clock", analyzer.pixelClock());
+
+    // Rounding to the ns or the sample is all the jitter there is
+    ok &= check(analyzer.hsyncJitter.read().max <= 2 * slack + 1,
+            "hsync jitter", analyzer.hsyncJitter.read().max);
+    ok &= check(analyzer.pixelJitter.read().max <= 2 * slack + 1,
+            "pixel jitter", analyzer.pixelJitter.read().max);
+    ok &= check(analyzer.vsyncJitter.read().count == (uint64_t) frames - 1,
+            "vsync periods", analyzer.vsyncJitter.read().count);
+
+    // The monitor holds each scanned pixel until the next one
+    int wrong = 0;
+    for (int y = 0; y < mode.yres; ++y) {
+        for (int x = 0; x < mode.xres; ++x) {
+            const Color got  = analyzer.decoder().frame().view().get(x, y);
+            const Color want = card.view().get(x / SCAN_STEP * SCAN_STEP, y);
+            wrong += got.r != want.r || got.g != want.g || got.b != want.b;
+        }
+    }
+    ok &= check(!wrong, "picture", wrong);
+
+    std::string text;
+    analyzer.writeReport(text);
+    ok &= check(text.find("pixel jitter") != std::string::npos, "report", 0);
+    return ok;
+}
+
+bool testAnalyzer()
+{
+    bool ok = testParsing();
+    ok &= testRoundTrip(LogicFormat::Vcd, 2, 100e6, 1);
+    ok &= testRoundTrip(LogicFormat::Csv, 1, 100e6, 10);
+    report("Analyzer test %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+#ifndef ARDUINO
+void benchmarkAnalyzer()
+{
+    const VGAMode mode = VGA480p;
+    Image card(mode.xres, mode.yres, heapAllocator(MemoryRegion::Psram));
+    testCard(card.view());
+
+    // The capture first, so only reading and analysis are timed
+    std::string vcd;
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            vcd.append(data, size);
+        });
+        LogicWriter writer(
+                LogicFormat::Vcd, defaultLogicChannels(), out);
+        const uint64_t end = synthesizeSignal(mode, card.view(), 2, SCAN_STEP,
+                [&](uint64_t at, uint64_t levels) {
+                    writer.signal(at, levels);
+                });
+        writer.finish(end);
+    }
+
+    const auto     start = std::chrono::steady_clock::now();
+    SignalAnalyzer analyzer(mode);
+    LogicReader    reader;
+    uint64_t       changes = 0;
+    reader.begin(LogicFormat::Vcd, defaultLogicChannels(),
+            [&](uint64_t at, uint64_t levels) {
+                ++changes;
+                analyzer.signal(at, levels);
+            });
+    reader.write(vcd.data(), vcd.size());
+    reader.finish();
+    const double millis = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start)
+                                  .count();
+
+    report("Analyzed %llu changes (%.1f MB of VCD) in %.0f ms, "
+           "%.0f ns per change\n",
+            (unsigned long long) changes, vcd.size() / 1e6, millis,
+            millis * 1e6 / std::max<uint64_t>(1, changes));
+}
+#endif
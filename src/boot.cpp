@@ -0,0 +1,530 @@
+// ====================================================== //
+// ============ Concurrent boot and snapshots =========== //
+// ====================================================== //
+
+#include "boot.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "report.h"
+#include "stream.h"
+#include "writer.h"
+
+#ifdef ARDUINO
+#include <SD.h>
+
+#include "trace.h"
+#include "vga.h"
+
+#define BOOT_LOCK()   xSemaphoreTake(lock, portMAX_DELAY)
+#define BOOT_UNLOCK() xSemaphoreGive(lock)
+#else
+#include <chrono>
+#include <unistd.h>
+
+#define BOOT_LOCK()   lock.lock()
+#define BOOT_UNLOCK() lock.unlock()
+#endif
+
+// ─── Boot Sequence ──────────────────────────────────────────────────────
+
+BootSequence::BootSequence()
+{
+#ifdef ARDUINO
+    // A mutex rather than a spinlock: phase tasks are created while held
+    lock    = xSemaphoreCreateMutex();
+    allDone = xSemaphoreCreateBinary();
+#endif
+}
+
+BootSequence::~BootSequence()
+{
+#ifdef ARDUINO
+    vSemaphoreDelete(lock);
+    vSemaphoreDelete(allDone);
+#else
+    for (std::thread &worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+#endif
+}
+
+int BootSequence::add(
+        const char *name, BootStep step, std::initializer_list<int> after)
+{
+    if (count == BOOT_MAX_PHASES || start) {
+        return -1;
+    }
+
+    // Only phases added before can be waited for, so there are no cycles
+    uint32_t mask = 0;
+    for (int index : after) {
+        if (index < 0 || index >= count) {
+            return -1;
+        }
+        mask |= 1u << index;
+    }
+
+    BootPhase &phase = phases[count];
+    phase.name       = name;
+    phase.step       = std::move(step);
+    phase.after      = mask;
+    phase.state      = PhaseState::Waiting;
+    return count++;
+}
+
+void BootSequence::run()
+{
+    start = nowMicros() | 1;  // never 0, which means not started
+
+    BOOT_LOCK();
+    launchReady();
+    const bool empty = finished == count;
+    BOOT_UNLOCK();
+
+    if (empty) {
+#ifdef ARDUINO
+        xSemaphoreGive(allDone);
+#else
+        allDone.notify_all();
+#endif
+    }
+}
+
+// Starts every waiting phase whose predecessors are all done and skips
+// those with one that failed; called with the lock held
+void BootSequence::launchReady()
+{
+    bool skipped = true;
+    while (skipped) {
+        skipped = false;
+        for (int i = 0; i < count; ++i) {
+            BootPhase &phase = phases[i];
+            if (phase.state != PhaseState::Waiting) {
+                continue;
+            }
+
+            bool ready  = true;
+            bool doomed = false;
+            for (int j = 0; j < count; ++j) {
+                if (!(phase.after & (1u << j))) {
+                    continue;
+                }
+                const PhaseState state = phases[j].state;
+                doomed |= state == PhaseState::Failed
+                          || state == PhaseState::Skipped;
+                ready &= state == PhaseState::Done;
+            }
+
+            if (doomed) {
+                // Phases after this one may be skipped too, look again
+                phase.state       = PhaseState::Skipped;
+                phase.startMicros = nowMicros() - start;
+                phase.endMicros   = phase.startMicros;
+                ++finished;
+                skipped = true;
+            }
+            else if (ready) {
+                phase.state = PhaseState::Running;
+                launches[i] = Launch{ this, i };
+#ifdef ARDUINO
+                if (xTaskCreatePinnedToCore(phaseTask, phase.name,
+                            BOOT_TASK_STACK, &launches[i], 1, nullptr, 0)
+                        != pdPASS) {
+                    report("Failed to start boot phase %s\n", phase.name);
+                    phase.state = PhaseState::Failed;
+                    ++finished;
+                    skipped = true;
+                }
+#else
+                workers[i] = std::thread(phaseTask, &launches[i]);
+#endif
+            }
+        }
+    }
+}
+
+void BootSequence::runPhase(int index)
+{
+    BootPhase &phase  = phases[index];
+    phase.startMicros = nowMicros() - start;
+    const bool ok     = phase.step();
+    phase.endMicros   = nowMicros() - start;
+
+    BOOT_LOCK();
+    phase.state = ok ? PhaseState::Done : PhaseState::Failed;
+    ++finished;
+    launchReady();
+    const bool last = finished == count;
+    BOOT_UNLOCK();
+
+    if (last) {
+        log();
+#ifdef ARDUINO
+        xSemaphoreGive(allDone);
+#else
+        // Under the lock, so wait() cannot miss it between its checks
+        std::lock_guard<std::mutex> guard(lock);
+        allDone.notify_all();
+#endif
+    }
+}
+
+void BootSequence::phaseTask(void *args)
+{
+    const Launch *launch = (const Launch *) args;
+    launch->sequence->runPhase(launch->index);
+#ifdef ARDUINO
+    vTaskDelete(nullptr);
+#endif
+}
+
+bool BootSequence::wait(uint32_t timeoutMs)
+{
+#ifdef ARDUINO
+    if (xSemaphoreTake(allDone, pdMS_TO_TICKS(timeoutMs)) != pdTRUE) {
+        return false;
+    }
+    xSemaphoreGive(allDone);  // for anyone else waiting
+    return true;
+#else
+    std::unique_lock<std::mutex> guard(lock);
+    if (!allDone.wait_for(guard, std::chrono::milliseconds(timeoutMs),
+                [this] { return start && finished == count; })) {
+        return false;
+    }
+    guard.unlock();
+
+    // Every phase has finished its step, the threads are about to end
+    for (std::thread &worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    return true;
+#endif
+}
+
+void BootSequence::frameShown()
+{
+    if (!firstFrame && start) {
+        firstFrame = (nowMicros() - start) | 1;
+    }
+}
+
+void BootSequence::log() const
+{
+    static const char *const states[] = {
+        "waiting", "running", "done", "failed", "skipped"
+    };
+
+    uint32_t total = 0;
+    for (int i = 0; i < count; ++i) {
+        const BootPhase &phase = phases[i];
+        report("Boot: %-10s %6u ms .. %6u ms  %s\n", phase.name,
+                phase.startMicros / 1000, phase.endMicros / 1000,
+                states[(int) phase.state]);
+        if (phase.endMicros > total) {
+            total = phase.endMicros;
+        }
+    }
+    if (firstFrame) {
+        report("Boot: first frame after %u ms, ", firstFrame / 1000);
+    }
+    report("all done after %u ms\n", total / 1000);
+}
+
+// ─── Snapshots ──────────────────────────────────────────────────────────
+
+struct SnapshotHeader
+{
+    char     magic[4];
+    uint16_t width;
+    uint16_t height;
+    uint32_t bytes;  // of pixels after the header
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeader) == 16, "snapshot header is 16 bytes");
+
+static const char snapshotMagic[4] = { 'V', 'G', 'A', '1' };
+
+static bool removePath(const char *path)
+{
+#ifdef ARDUINO
+    return SD.remove(path);
+#else
+    return unlink(path) == 0;
+#endif
+}
+
+// Replaces `to` with `from`; the SD library will not rename over a file
+static bool replacePath(const char *from, const char *to)
+{
+#ifdef ARDUINO
+    if (SD.exists(to)) {
+        SD.remove(to);
+    }
+    return SD.rename(from, to);
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+bool saveSnapshot(const char *path, const ImageView &frame)
+{
+    if (frame.empty()) {
+        return false;
+    }
+
+    const std::string temp     = std::string(path) + ".tmp";
+    const size_t      rowBytes = (size_t) frame.width * sizeof(Color);
+
+    WriteBehind writer;
+    if (!writer.open(temp.c_str())) {
+        return false;
+    }
+
+    SnapshotHeader header{};
+    memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.width  = frame.width;
+    header.height = frame.height;
+    header.bytes  = rowBytes * frame.height;
+
+    bool ok = writer.write((const uint8_t *) &header, sizeof(header));
+    for (int y = 0; ok && y < frame.height; ++y) {
+        ok = writer.write((const uint8_t *) frame.row(y), rowBytes);
+    }
+    ok = writer.finish() && ok;
+
+    if (!ok) {
+        removePath(temp.c_str());
+        return false;
+    }
+    return replacePath(temp.c_str(), path);
+}
+
+bool loadSnapshot(const char *path, const ImageView &frame)
+{
+    const size_t rowBytes = (size_t) frame.width * sizeof(Color);
+    const size_t bytes    = rowBytes * frame.height;
+
+    FileReader reader;
+    if (frame.empty() || !reader.open(path)
+            || reader.size() != sizeof(SnapshotHeader) + bytes) {
+        return false;
+    }
+
+    SnapshotHeader header;
+    if (reader.read((uint8_t *) &header, sizeof(header)) != sizeof(header)
+            || memcmp(header.magic, snapshotMagic, sizeof(header.magic))
+            || header.width != frame.width || header.height != frame.height
+            || header.bytes != bytes) {
+        return false;
+    }
+
+    for (int y = 0; y < frame.height; ++y) {
+        if (reader.read((uint8_t *) frame.row(y), rowBytes) != rowBytes) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef ARDUINO
+
+// millis() of the last request, 0 when none is pending
+static std::atomic<uint32_t> snapshotRequested{ 0 };
+
+static void snapshotTask(void *args)
+{
+    TRACE_NAME_TRACK("snapshots");
+    for (;;) {
+        sleepMillis(250);
+
+        uint32_t requested = snapshotRequested;
+        if (!requested || millis() - requested < SNAPSHOT_SETTLE_MS) {
+            continue;
+        }
+        // A request arriving while saving makes for another save later
+        if (!snapshotRequested.compare_exchange_strong(requested, 0)) {
+            continue;
+        }
+
+        const Image *front = frontImage;
+        uint32_t     begin = millis();
+        if (saveSnapshot(SNAPSHOT_PATH, front->view())) {
+            Serial.printf("Snapshot saved in %u ms\n", millis() - begin);
+        }
+        else {
+            Serial.println("Failed to save the snapshot");
+        }
+    }
+}
+
+bool setupSnapshots()
+{
+    return xTaskCreatePinnedToCore(
+                   snapshotTask, "Snapshot Task", 4096, nullptr, 0, nullptr, 0)
+           == pdPASS;
+}
+
+void requestSnapshot()
+{
+    snapshotRequested = millis() | 1;
+}
+
+#endif
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool fileExists(const char *path)
+{
+#ifdef ARDUINO
+    return SD.exists(path);
+#else
+    return access(path, F_OK) == 0;
+#endif
+}
+
+static bool testSnapshots(const char *dir)
+{
+    const std::string path = std::string(dir) + "/snapshot.raw";
+    const std::string cut  = std::string(dir) + "/snapshot.cut";
+    const std::string none = std::string(dir) + "/snapshot.none";
+    Allocator        &heap = heapAllocator(MemoryRegion::Psram);
+    bool              ok   = true;
+
+    Image frame(64, 48, heap);
+    Image copy(64, 48, heap);
+    Image other(48, 64, heap);
+    for (int y = 0; y < frame.yres; ++y) {
+        for (int x = 0; x < frame.xres; ++x) {
+            frame.set(x, y,
+                    Color{ (uint8_t) (x * 4), (uint8_t) (y * 5),
+                        (uint8_t) (x ^ y) });
+        }
+    }
+    fill(copy.view(), Color{ 0, 0, 0 });
+
+    ok &= check(saveSnapshot(path.c_str(), frame.view()), "save", 0);
+    ok &= check(!fileExists((path + ".tmp").c_str()), "temporary left", 0);
+    ok &= check(loadSnapshot(path.c_str(), copy.view()), "load", 0);
+    for (int y = 0; ok && y < frame.yres; ++y) {
+        ok &= check(!memcmp(frame.view().row(y), copy.view().row(y),
+                            frame.xres * sizeof(Color)),
+                "round trip", y);
+    }
+    ok &= check(!loadSnapshot(path.c_str(), other.view()), "other size", 0);
+    ok &= check(!loadSnapshot(none.c_str(), copy.view()), "missing", 0);
+
+    // The start of a snapshot alone, as left by a save cut short
+    uint8_t     start[256];
+    FileReader  reader;
+    WriteBehind writer;
+    ok &= check(reader.open(path.c_str())
+                        && reader.read(start, sizeof(start)) == sizeof(start),
+            "read back", 0);
+    reader.close();
+    ok &= check(writer.open(cut.c_str()) && writer.write(start, sizeof(start))
+                        && writer.finish(),
+            "write truncated", 0);
+    ok &= check(!loadSnapshot(cut.c_str(), copy.view()), "truncated", 0);
+
+    removePath(path.c_str());
+    removePath(cut.c_str());
+    return ok;
+}
+
+// Sleeps stand in for the card, the network and the display; what is
+// checked is the order and overlap of the phases, not their durations
+static bool testSequence()
+{
+    bool         ok = true;
+    BootSequence boot;
+
+    int sd      = boot.add("sd", [] {
+        sleepMillis(30);
+        return true;
+    });
+    int frame   = boot.add("frame", [&boot] {
+        sleepMillis(10);
+        boot.frameShown();
+        return true;
+    }, { sd });
+    int wifi    = boot.add("wifi", [] {
+        sleepMillis(120);
+        return true;
+    });
+    int server  = boot.add("server", [] {
+        sleepMillis(10);
+        return true;
+    }, { wifi, sd });
+    int display = boot.add("display", [] {
+        sleepMillis(20);
+        return true;
+    }, { sd });
+    int broken  = boot.add("broken", [] { return false; });
+    int after   = boot.add("after", [] { return true; }, { broken });
+    int later   = boot.add("later", [] { return true; }, { after, sd });
+
+    ok &= check(later == 7, "phases added", later);
+    ok &= check(boot.add("extra", [] { return true; }) == -1, "too many", 0);
+    if (!ok) {
+        return false;
+    }
+
+    boot.run();
+    ok &= check(boot.wait(5000), "finished", 0);
+    if (!ok) {
+        return false;
+    }
+
+    const BootPhase &p = boot.phase(sd);
+    ok &= check(p.state == PhaseState::Done, "sd done", 0);
+    ok &= check(boot.phase(frame).startMicros >= p.endMicros, "frame order",
+            boot.phase(frame).startMicros);
+    ok &= check(boot.phase(display).startMicros >= p.endMicros,
+            "display order", boot.phase(display).startMicros);
+    ok &= check(boot.phase(server).startMicros >= boot.phase(wifi).endMicros
+                        && boot.phase(server).startMicros >= p.endMicros,
+            "server order", boot.phase(server).startMicros);
+
+    // Independent phases overlap
+    ok &= check(boot.phase(wifi).startMicros < p.endMicros, "wifi overlap",
+            boot.phase(wifi).startMicros);
+
+    // The first frame is up long before the network
+    const uint32_t shown = boot.firstFrameMicros();
+    ok &= check(shown >= 40000, "first frame too soon", shown);
+    ok &= check(shown < boot.phase(wifi).endMicros, "first frame late", shown);
+
+    // Failures skip whatever comes after, directly or not
+    ok &= check(boot.phase(broken).state == PhaseState::Failed, "failed", 0);
+    ok &= check(boot.phase(after).state == PhaseState::Skipped, "skipped", 0);
+    ok &= check(boot.phase(later).state == PhaseState::Skipped,
+            "skipped transitively", 0);
+
+    // All of it takes about as long as the slowest chain, not the sum
+    const uint32_t total = boot.phase(server).endMicros;
+    ok &= check(total >= 130000, "total too short", total);
+    ok &= check(total < 190000, "phases ran one by one", total);
+
+    // With nothing to run, a sequence finishes at once
+    BootSequence empty;
+    empty.run();
+    ok &= check(empty.wait(100), "empty sequence", 0);
+    return ok;
+}
+
+bool testBoot(const char *dir)
+{
+    bool ok = testSnapshots(dir) && testSequence();
+    report("Boot test %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
@@ -0,0 +1,940 @@
+// ====================================================== //
+// ============ Framebuffer capture encoders ============ //
+// ====================================================== //
+
+#include "capture.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "report.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+// ─── Tables ─────────────────────────────────────────────────────────────
+
+#define STORED_BLOCK 65535  // most bytes a stored deflate block holds
+#define MAX_RUN      258    // longest deflate match
+
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13,
+    15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195,
+    227, 258 };
+
+static int lengthExtra(int index)
+{
+    return index < 8 || index == 28 ? 0 : (index - 4) / 4;
+}
+
+// Built on first use: CRC-32 for PNG chunks, the fixed Huffman codes of
+// deflate already bit-reversed, as the stream is written LSB first, and
+// the length code of every run length
+struct CaptureTables
+{
+    uint32_t crc[256];
+    uint16_t code[288];
+    uint8_t  codeLength[288];
+    uint8_t  lengthCode[MAX_RUN + 1];
+
+    CaptureTables()
+    {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crc[n] = c;
+        }
+
+        for (int symbol = 0; symbol < 288; ++symbol) {
+            uint32_t value;
+            int      length;
+            if (symbol < 144) {
+                value  = 0x30 + symbol;
+                length = 8;
+            }
+            else if (symbol < 256) {
+                value  = 0x190 + symbol - 144;
+                length = 9;
+            }
+            else if (symbol < 280) {
+                value  = symbol - 256;
+                length = 7;
+            }
+            else {
+                value  = 0xc0 + symbol - 280;
+                length = 8;
+            }
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; ++i)
+                reversed |= ((value >> i) & 1) << (length - 1 - i);
+            code[symbol]       = reversed;
+            codeLength[symbol] = length;
+        }
+
+        int index = 0;
+        for (int length = 3; length <= MAX_RUN; ++length) {
+            while (index < 28 && length >= lengthBase[index + 1])
+                ++index;
+            lengthCode[length] = index;
+        }
+    }
+};
+
+static const CaptureTables &tables()
+{
+    static const CaptureTables instance;
+    return instance;
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    const uint32_t *table = tables().crc;
+    crc                   = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size)
+{
+    // 5552 bytes is the most that can be summed before a modulo is due
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size) {
+        size_t n = size < 5552 ? size : 5552;
+        size -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+static void putBigEndian(uint8_t *at, uint32_t value)
+{
+    at[0] = value >> 24;
+    at[1] = value >> 16;
+    at[2] = value >> 8;
+    at[3] = value;
+}
+
+static void appendBigEndian(std::vector<uint8_t> &out, uint32_t value)
+{
+    uint8_t bytes[4];
+    putBigEndian(bytes, value);
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+// ─── Encoder ────────────────────────────────────────────────────────────
+
+FrameEncoder::FrameEncoder(const ImageView &source, CaptureFormat format,
+        int scale, PngDeflate deflate)
+    : source(source),
+      format(format),
+      deflate(deflate),
+      factor(scale < 1 ? 1 : scale > CAPTURE_MAX_SCALE ? CAPTURE_MAX_SCALE
+                                                       : scale),
+      outWidth(source.empty() ? 0 : source.width / factor),
+      outHeight(outWidth ? source.height / factor : 0)
+{
+    if (!outHeight) {
+        outWidth = 0;
+    }
+    if (factor > 1) {
+        line.resize(outWidth);
+    }
+
+    // A compressed PNG row can grow to 9 bits per byte
+    const size_t rowBytes = 1 + 3 * (size_t) outWidth;
+    if (format == CaptureFormat::Png) {
+        filtered.resize(rowBytes);
+        packed.reserve(rowBytes + rowBytes / 8 + 5 * (rowBytes / STORED_BLOCK)
+                       + 16);
+    }
+    else if (format == CaptureFormat::Qoi) {
+        packed.reserve(4 * (size_t) outWidth + 16);
+    }
+}
+
+size_t FrameEncoder::length() const
+{
+    const size_t w = outWidth, h = outHeight;
+    if (format == CaptureFormat::Raw) {
+        return 3 * w * h;
+    }
+    if (format != CaptureFormat::Png || deflate != PngDeflate::Store
+            || !h) {
+        return 0;
+    }
+    // Signature, IHDR, one IDAT per row with its stored blocks, the zlib
+    // header and checksum and IEND
+    const size_t rowBytes = 1 + 3 * w;
+    const size_t blocks   = (rowBytes + STORED_BLOCK - 1) / STORED_BLOCK;
+    return 8 + 25 + h * (12 + 5 * blocks + rowBytes) + 2 + 4 + 12;
+}
+
+const Color *FrameEncoder::nextLine()
+{
+    if (factor == 1) {
+        return source.row(y);
+    }
+
+    downscaleRow(source, factor, y, line.data());
+    return line.data();
+}
+
+bool FrameEncoder::next(ChunkedWriter &out)
+{
+    if (!started) {
+        started = true;
+        if (format == CaptureFormat::Png) {
+            pngHeader(out);
+        }
+        else if (format == CaptureFormat::Qoi) {
+            uint8_t header[14] = { 'q', 'o', 'i', 'f' };
+            putBigEndian(header + 4, outWidth);
+            putBigEndian(header + 8, outHeight);
+            header[12] = 3;  // RGB
+            header[13] = 0;  // sRGB
+            out.write((const char *) header, sizeof(header));
+        }
+    }
+    if (y >= outHeight) {
+        return false;
+    }
+
+    const Color *pixels  = nextLine();
+    const bool   lastRow = ++y == outHeight;
+    switch (format) {
+        case CaptureFormat::Png:
+            filtered[0] = deflate == PngDeflate::Store ? 0 : 1;
+            memcpy(filtered.data() + 1, pixels, 3 * (size_t) outWidth);
+            if (deflate == PngDeflate::Store) {
+                pngStoredRow(out, lastRow);
+            }
+            else {
+                pngFastRow(out, lastRow);
+            }
+            break;
+        case CaptureFormat::Qoi:
+            qoiRow(out, pixels, lastRow);
+            break;
+        case CaptureFormat::Raw:
+            out.write((const char *) pixels, 3 * (size_t) outWidth);
+            break;
+    }
+    return !lastRow;
+}
+
+// ─── PNG ────────────────────────────────────────────────────────────────
+
+void FrameEncoder::writeChunk(ChunkedWriter &out, const char *type,
+        const uint8_t *data, size_t size)
+{
+    uint8_t head[8];
+    putBigEndian(head, size);
+    memcpy(head + 4, type, 4);
+    uint8_t tail[4];
+    putBigEndian(tail, crc32(crc32(0, head + 4, 4), data, size));
+
+    out.write((const char *) head, sizeof(head));
+    if (size) {
+        out.write((const char *) data, size);
+    }
+    out.write((const char *) tail, sizeof(tail));
+}
+
+void FrameEncoder::pngHeader(ChunkedWriter &out)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n',
+        0x1a, '\n' };
+    out.write((const char *) signature, sizeof(signature));
+
+    uint8_t ihdr[13];
+    putBigEndian(ihdr, outWidth);
+    putBigEndian(ihdr + 4, outHeight);
+    ihdr[8]  = 8;  // bits per channel
+    ihdr[9]  = 2;  // RGB
+    ihdr[10] = 0;  // deflate
+    ihdr[11] = 0;  // adaptive filtering
+    ihdr[12] = 0;  // not interlaced
+    writeChunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+    // zlib header for a 32 KB window and the fastest level
+    packed.clear();
+    packed.push_back(0x78);
+    packed.push_back(0x01);
+    if (!outHeight) {
+        writeChunk(out, "IEND", nullptr, 0);
+    }
+}
+
+// Each row is one IDAT of stored blocks, whose size is known in advance
+void FrameEncoder::pngStoredRow(ChunkedWriter &out, bool lastRow)
+{
+    const uint8_t *data = filtered.data();
+    size_t         left = filtered.size();
+    adler               = adler32(adler, data, left);
+
+    while (left) {
+        const size_t n = left < STORED_BLOCK ? left : STORED_BLOCK;
+        left -= n;
+        packed.push_back(lastRow && !left);  // BFINAL, BTYPE 00
+        packed.push_back(n);
+        packed.push_back(n >> 8);
+        packed.push_back(~n);
+        packed.push_back(~n >> 8);
+        packed.insert(packed.end(), data, data + n);
+        data += n;
+    }
+    if (lastRow) {
+        appendBigEndian(packed, adler);
+    }
+    writeChunk(out, "IDAT", packed.data(), packed.size());
+    packed.clear();
+    if (lastRow) {
+        writeChunk(out, "IEND", nullptr, 0);
+    }
+}
+
+void FrameEncoder::putBits(uint32_t value, int count)
+{
+    bits |= value << bitCount;
+    bitCount += count;
+    while (bitCount >= 8) {
+        packed.push_back(bits);
+        bits >>= 8;
+        bitCount -= 8;
+    }
+}
+
+void FrameEncoder::putLiteral(int symbol)
+{
+    const CaptureTables &t = tables();
+    putBits(t.code[symbol], t.codeLength[symbol]);
+}
+
+// A match one byte back, which repeats the previous byte `length` times
+void FrameEncoder::putRun(int length)
+{
+    const int index = tables().lengthCode[length];
+    putLiteral(257 + index);
+    putBits(length - lengthBase[index], lengthExtra(index));
+    putBits(0, 5);  // distance code 0, distance 1
+}
+
+void FrameEncoder::alignBits()
+{
+    if (bitCount) {
+        putBits(0, 8 - bitCount);
+    }
+}
+
+// Sub-filtered rows turn flat areas and smooth gradients into runs, which
+// a single fixed Huffman block codes as distance-1 matches. Rows carry
+// the bits that do not fill a byte over to the next IDAT.
+void FrameEncoder::pngFastRow(ChunkedWriter &out, bool lastRow)
+{
+    uint8_t     *data = filtered.data();
+    const size_t size = filtered.size();
+    for (size_t i = size - 1; i > 3; --i)
+        data[i] -= data[i - 3];
+    adler = adler32(adler, data, size);
+
+    if (y == 1) {
+        putBits(1, 1);  // BFINAL
+        putBits(1, 2);  // BTYPE 01, fixed codes
+    }
+
+    size_t i = 0;
+    while (i < size) {
+        if (havePrevious && data[i] == previous) {
+            size_t run = 1;
+            while (i + run < size && run < MAX_RUN && data[i + run] == previous)
+                ++run;
+            if (run >= 3) {
+                putRun(run);
+                i += run;
+                continue;
+            }
+        }
+        putLiteral(data[i]);
+        previous     = data[i];
+        havePrevious = true;
+        ++i;
+    }
+
+    if (lastRow) {
+        putLiteral(256);  // end of block
+        alignBits();
+        appendBigEndian(packed, adler);
+    }
+    if (!packed.empty()) {
+        writeChunk(out, "IDAT", packed.data(), packed.size());
+        packed.clear();
+    }
+    if (lastRow) {
+        writeChunk(out, "IEND", nullptr, 0);
+    }
+}
+
+// ─── QOI ────────────────────────────────────────────────────────────────
+
+static inline int qoiHash(Color c)
+{
+    return (c.r * 3 + c.g * 5 + c.b * 7 + 255 * 11) % 64;
+}
+
+static inline bool sameColor(Color a, Color b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+// The stream runs on across rows, so runs and the colour index do too
+void FrameEncoder::qoiRow(
+        ChunkedWriter &out, const Color *pixels, bool lastRow)
+{
+    for (int x = 0; x < outWidth; ++x) {
+        const Color c = pixels[x];
+        if (sameColor(c, last)) {
+            if (++run == 62) {
+                packed.push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            packed.push_back(0xc0 | (run - 1));
+            run = 0;
+        }
+
+        const int hash = qoiHash(c);
+        if (indexUsed[hash] && sameColor(index[hash], c)) {
+            packed.push_back(hash);
+        }
+        else {
+            index[hash]     = c;
+            indexUsed[hash] = true;
+
+            const int8_t dr = c.r - last.r;
+            const int8_t dg = c.g - last.g;
+            const int8_t db = c.b - last.b;
+            const int    rg = dr - dg, bg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2
+                    && db <= 1) {
+                packed.push_back(
+                        0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            }
+            else if (dg >= -32 && dg <= 31 && rg >= -8 && rg <= 7 && bg >= -8
+                     && bg <= 7) {
+                packed.push_back(0x80 | (dg + 32));
+                packed.push_back((rg + 8) << 4 | (bg + 8));
+            }
+            else {
+                const uint8_t rgb[4] = { 0xfe, c.r, c.g, c.b };
+                packed.insert(packed.end(), rgb, rgb + 4);
+            }
+        }
+        last = c;
+    }
+
+    if (lastRow) {
+        if (run) {
+            packed.push_back(0xc0 | (run - 1));
+            run = 0;
+        }
+        static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+        packed.insert(packed.end(), end, end + 8);
+    }
+    out.write((const char *) packed.data(), packed.size());
+    packed.clear();
+}
+
+// ─── Formats ────────────────────────────────────────────────────────────
+
+bool parseCaptureFormat(const char *name, CaptureFormat &format)
+{
+    if (!name || !*name || !strcmp(name, "png")) {
+        format = CaptureFormat::Png;
+    }
+    else if (!strcmp(name, "qoi")) {
+        format = CaptureFormat::Qoi;
+    }
+    else if (!strcmp(name, "raw")) {
+        format = CaptureFormat::Raw;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+const char *captureMimeType(CaptureFormat format)
+{
+    switch (format) {
+        case CaptureFormat::Png:
+            return "image/png";
+        case CaptureFormat::Qoi:
+            return "image/qoi";
+        default:
+            return "application/octet-stream";
+    }
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static uint32_t readBigEndian(const uint8_t *at)
+{
+    return (uint32_t) at[0] << 24 | at[1] << 16 | at[2] << 8 | at[3];
+}
+
+struct BitReader
+{
+    const uint8_t *data;
+    size_t         size;
+    size_t         pos{};
+    int            bit{};
+    bool           overrun{};
+
+    uint32_t get(int count)
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < count; ++i) {
+            if (pos >= size) {
+                overrun = true;
+                return 0;
+            }
+            value |= ((data[pos] >> bit) & 1) << i;
+            if (++bit == 8) {
+                bit = 0;
+                ++pos;
+            }
+        }
+        return value;
+    }
+
+    // Huffman codes are stored most significant bit first
+    uint32_t getReversed(int count)
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < count; ++i)
+            value = value << 1 | get(1);
+        return value;
+    }
+};
+
+// Enough of inflate for what the encoder writes: stored and fixed
+// Huffman blocks, in a zlib wrapper
+static bool inflateZlib(
+        const uint8_t *data, size_t size, std::vector<uint8_t> &out)
+{
+    static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17,
+        25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049,
+        3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+
+    if (size < 6 || (data[0] & 0x0f) != 8 || (data[0] << 8 | data[1]) % 31) {
+        return false;
+    }
+    BitReader in{ data + 2, size - 6 };
+    bool      final = false;
+    while (!final && !in.overrun) {
+        final          = in.get(1);
+        const int type = in.get(2);
+        if (type == 0) {
+            if (in.bit) {
+                in.bit = 0;
+                ++in.pos;
+            }
+            if (in.pos + 4 > in.size) {
+                return false;
+            }
+            const uint8_t *p   = in.data + in.pos;
+            const size_t   len = p[0] | p[1] << 8;
+            if ((len ^ (p[2] | p[3] << 8)) != 0xffff
+                    || in.pos + 4 + len > in.size) {
+                return false;
+            }
+            out.insert(out.end(), p + 4, p + 4 + len);
+            in.pos += 4 + len;
+            continue;
+        }
+        if (type != 1) {
+            return false;
+        }
+        for (;;) {
+            int symbol;
+            int code = in.getReversed(7);
+            if (code < 24) {
+                symbol = 256 + code;
+            }
+            else {
+                code = code << 1 | in.get(1);
+                if (code >= 0x30 && code < 0xc0) {
+                    symbol = code - 0x30;
+                }
+                else if (code >= 0xc0 && code < 0xc8) {
+                    symbol = 280 + code - 0xc0;
+                }
+                else {
+                    symbol = 144 + (code << 1 | in.get(1)) - 0x190;
+                }
+            }
+            if (in.overrun || symbol > 285) {
+                return false;
+            }
+            if (symbol < 256) {
+                out.push_back(symbol);
+                continue;
+            }
+            if (symbol == 256) {
+                break;
+            }
+            const int    index = symbol - 257;
+            const size_t length
+                    = lengthBase[index] + in.get(lengthExtra(index));
+            const int d = in.getReversed(5);
+            if (d >= 30) {
+                return false;
+            }
+            const size_t distance
+                    = distanceBase[d] + in.get(d < 4 ? 0 : (d - 2) / 2);
+            if (distance > out.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < length; ++i)
+                out.push_back(out[out.size() - distance]);
+        }
+    }
+    if (in.overrun) {
+        return false;
+    }
+    if (in.bit) {
+        ++in.pos;
+    }
+    return in.pos + 4 == size - 2
+           && readBigEndian(data + size - 4)
+                      == adler32(1, out.data(), out.size());
+}
+
+static bool decodePngFile(const std::string &file, int &width, int &height,
+        std::vector<Color> &pixels)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n',
+        0x1a, '\n' };
+    const uint8_t *p = (const uint8_t *) file.data();
+    if (file.size() < 8 || memcmp(p, signature, 8)) {
+        return false;
+    }
+
+    std::vector<uint8_t> idat;
+    bool                 ended = false;
+    width = height = 0;
+    for (size_t pos = 8; pos + 12 <= file.size() && !ended;) {
+        const size_t length = readBigEndian(p + pos);
+        if (pos + 12 + length > file.size()) {
+            return false;
+        }
+        const uint8_t *type = p + pos + 4;
+        const uint8_t *body = type + 4;
+        if (readBigEndian(body + length) != crc32(0, type, 4 + length)) {
+            return false;
+        }
+        if (!memcmp(type, "IHDR", 4)) {
+            width  = readBigEndian(body);
+            height = readBigEndian(body + 4);
+            if (body[8] != 8 || body[9] != 2 || body[12]) {
+                return false;
+            }
+        }
+        else if (!memcmp(type, "IDAT", 4)) {
+            idat.insert(idat.end(), body, body + length);
+        }
+        else if (!memcmp(type, "IEND", 4)) {
+            ended = pos + 12 == file.size();
+        }
+        pos += 12 + length;
+    }
+
+    std::vector<uint8_t> raw;
+    const size_t         rowBytes = 1 + 3 * (size_t) width;
+    if (!ended || !inflateZlib(idat.data(), idat.size(), raw)
+            || raw.size() != rowBytes * height) {
+        return false;
+    }
+    pixels.resize((size_t) width * height);
+    for (int y = 0; y < height; ++y) {
+        uint8_t *row = raw.data() + y * rowBytes;
+        if (row[0] == 1) {
+            for (size_t i = 4; i < rowBytes; ++i)
+                row[i] += row[i - 3];
+        }
+        else if (row[0]) {
+            return false;
+        }
+        memcpy(pixels.data() + (size_t) y * width, row + 1, rowBytes - 1);
+    }
+    return true;
+}
+
+static bool decodeQoiFile(const std::string &file, int &width, int &height,
+        std::vector<Color> &pixels)
+{
+    const uint8_t *p    = (const uint8_t *) file.data();
+    const size_t   size = file.size();
+    if (size < 22 || memcmp(p, "qoif", 4) || p[12] != 3) {
+        return false;
+    }
+    width  = readBigEndian(p + 4);
+    height = readBigEndian(p + 8);
+    pixels.resize((size_t) width * height);
+
+    Color  index[64] = {};
+    bool   used[64]  = {};
+    Color  c{ 0, 0, 0 };
+    size_t pos = 14;
+    for (size_t i = 0; i < pixels.size();) {
+        if (pos >= size - 8) {
+            return false;
+        }
+        const uint8_t op = p[pos++];
+        if (op == 0xfe) {
+            c = Color{ p[pos], p[pos + 1], p[pos + 2] };
+            pos += 3;
+        }
+        else if ((op & 0xc0) == 0x00) {
+            if (!used[op]) {
+                return false;
+            }
+            c = index[op];
+        }
+        else if ((op & 0xc0) == 0x40) {
+            c.r += ((op >> 4) & 3) - 2;
+            c.g += ((op >> 2) & 3) - 2;
+            c.b += (op & 3) - 2;
+        }
+        else if ((op & 0xc0) == 0x80) {
+            const int dg = (op & 0x3f) - 32;
+            const int rg = (p[pos] >> 4) - 8, bg = (p[pos] & 0x0f) - 8;
+            ++pos;
+            c.r += dg + rg;
+            c.g += dg;
+            c.b += dg + bg;
+        }
+        else if (op != 0xff) {
+            for (int n = (op & 0x3f) + 1; n > 0 && i < pixels.size(); --n)
+                pixels[i++] = c;
+            continue;
+        }
+        else {
+            return false;  // RGBA never appears in an RGB stream
+        }
+        index[qoiHash(c)] = c;
+        used[qoiHash(c)]  = true;
+        pixels[i++]       = c;
+    }
+    static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    return pos + 8 == size && !memcmp(p + pos, end, 8);
+}
+
+// Flat areas, gradients and noise, so every encoder path gets a turn
+static void drawTestPattern(const ImageView &view)
+{
+    uint32_t seed = 12345;
+    for (int y = 0; y < view.height; ++y) {
+        for (int x = 0; x < view.width; ++x) {
+            seed = seed * 1103515245 + 12345;
+            Color c;
+            if (y < view.height / 3) {
+                c = x < view.width / 2 ? Color{ 40, 80, 120 }
+                                       : Color{ 200, 10, 10 };
+            }
+            else if (y < 2 * view.height / 3) {
+                c = Color{ (unsigned char) (x * 3), (unsigned char) (y * 2),
+                    (unsigned char) (x + y) };
+            }
+            else {
+                c = Color{ (unsigned char) (seed >> 24),
+                    (unsigned char) (seed >> 16), (unsigned char) (seed >> 8) };
+            }
+            view.set(x, y, c);
+        }
+    }
+}
+
+// Straightforward box average to hold the encoders' downscale against
+static std::vector<Color> reference(const ImageView &view, int scale)
+{
+    const int          w = view.width / scale, h = view.height / scale;
+    std::vector<Color> out;
+    if (!w || !h) {
+        return out;
+    }
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            int sum[3] = {};
+            for (int v = y * scale; v < (y + 1) * scale; ++v) {
+                for (int u = x * scale; u < (x + 1) * scale; ++u) {
+                    const Color c = view.get(u, v);
+                    sum[0] += c.r;
+                    sum[1] += c.g;
+                    sum[2] += c.b;
+                }
+            }
+            const int n = scale * scale;
+            out.push_back(Color{ (unsigned char) ((sum[0] + n / 2) / n),
+                (unsigned char) ((sum[1] + n / 2) / n),
+                (unsigned char) ((sum[2] + n / 2) / n) });
+        }
+    }
+    return out;
+}
+
+static std::string encode(FrameEncoder &encoder)
+{
+    std::string file;
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            file.append(data, size);
+        });
+        while (encoder.next(out)) {}
+    }
+    return file;
+}
+
+static bool checkRoundTrip(const ImageView &view, int scale, int at)
+{
+    const std::vector<Color> expected = reference(view, scale);
+    const int                w = view.width / scale, h = view.height / scale;
+    bool                     ok = true;
+
+    for (int kind = 0; kind < 4; ++kind) {
+        const CaptureFormat format = kind < 2 ? CaptureFormat::Png
+                                     : kind == 2 ? CaptureFormat::Qoi
+                                                 : CaptureFormat::Raw;
+        const PngDeflate deflate = kind ? PngDeflate::Fast : PngDeflate::Store;
+        FrameEncoder       encoder(view, format, scale, deflate);
+        const std::string  file = encode(encoder);
+        std::vector<Color> pixels;
+        int                width = 0, height = 0;
+
+        if (!w || !h) {
+            ok &= check(encoder.width() == 0 && encoder.height() == 0,
+                    "empty image size", at);
+            continue;
+        }
+        bool decoded;
+        if (format == CaptureFormat::Png) {
+            decoded = decodePngFile(file, width, height, pixels);
+        }
+        else if (format == CaptureFormat::Qoi) {
+            decoded = decodeQoiFile(file, width, height, pixels);
+        }
+        else {
+            width   = encoder.width();
+            height  = encoder.height();
+            decoded = file.size() == 3 * (size_t) width * height;
+            pixels.resize(file.size() / 3);
+            memcpy(pixels.data(), file.data(), file.size());
+        }
+        if (!check(decoded, "decode", at * 4 + kind)) {
+            ok = false;
+            continue;
+        }
+        ok &= check(width == w && height == h, "size", at * 4 + kind);
+        ok &= check(pixels.size() == expected.size()
+                            && !memcmp(pixels.data(), expected.data(),
+                                    expected.size() * sizeof(Color)),
+                "pixels", at * 4 + kind);
+        if (encoder.length()) {
+            ok &= check(encoder.length() == file.size(), "length",
+                    at * 4 + kind);
+        }
+    }
+    return ok;
+}
+
+bool testCapture()
+{
+    Allocator &heap = heapAllocator(MemoryRegion::Psram);
+    bool       ok   = true;
+
+    // Odd sizes, every scale up to a few, and a view into a larger image
+    // so rows are read with a stride
+    static const int sizes[][2] = { { 1, 1 }, { 2, 3 }, { 37, 23 },
+        { 64, 48 }, { 161, 7 } };
+    int at = 0;
+    for (const auto &size : sizes) {
+        Image image(size[0] + 5, size[1] + 2, heap);
+        drawTestPattern(image.view());
+        const ImageView view = image.view().sub(3, 1, size[0], size[1]);
+        for (int scale = 1; scale <= 4; ++scale)
+            ok &= checkRoundTrip(view, scale, at++);
+    }
+
+    // Rows longer than a stored block are split over several
+    {
+        Image wide(22000, 2, heap);
+        drawTestPattern(wide.view());
+        ok &= checkRoundTrip(wide.view(), 1, at++);
+    }
+
+    // Long runs cross rows and split at QOI's 62 and deflate's 258
+    {
+        Image flat(300, 4, heap);
+        fill(flat.view(), Color{ 7, 7, 7 });
+        ok &= checkRoundTrip(flat.view(), 1, at++);
+        FrameEncoder encoder(flat.view(), CaptureFormat::Png, 1);
+        const size_t size = encode(encoder).size();
+        ok &= check(size < 3 * 300 * 4 / 16, "runs compress", (int) size);
+    }
+
+    CaptureFormat format;
+    ok &= check(parseCaptureFormat("qoi", format)
+                        && format == CaptureFormat::Qoi,
+            "parse qoi", 0);
+    ok &= check(parseCaptureFormat("", format) && format == CaptureFormat::Png,
+            "parse default", 0);
+    ok &= check(!parseCaptureFormat("gif", format), "parse unknown", 0);
+
+    report("Capture tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+// ─── Benchmark ──────────────────────────────────────────────────────────
+
+void benchmarkCapture(const ImageView &source)
+{
+    static const struct
+    {
+        const char   *name;
+        CaptureFormat format;
+        PngDeflate    deflate;
+        int           scale;
+    } cases[] = {
+        { "raw", CaptureFormat::Raw, PngDeflate::Store, 1 },
+        { "png stored", CaptureFormat::Png, PngDeflate::Store, 1 },
+        { "png fast", CaptureFormat::Png, PngDeflate::Fast, 1 },
+        { "qoi", CaptureFormat::Qoi, PngDeflate::Store, 1 },
+        { "png fast 1/4", CaptureFormat::Png, PngDeflate::Fast, 4 },
+        { "qoi 1/4", CaptureFormat::Qoi, PngDeflate::Store, 4 },
+    };
+
+    report("Capturing %dx%d\n", source.width, source.height);
+    for (const auto &c : cases) {
+        size_t        bytes = 0;
+        ChunkedWriter out([&](const char *, size_t size) { bytes += size; });
+        FrameEncoder  encoder(source, c.format, c.scale, c.deflate);
+
+        const uint32_t start = nowMicros();
+        while (encoder.next(out)) {}
+        out.flush();
+        const uint32_t elapsed = nowMicros() - start;
+
+        report("%-14s %7u us per frame, %8u bytes\n", c.name,
+                (unsigned) elapsed, (unsigned) bytes);
+    }
+}
@@ -0,0 +1,436 @@
+// ====================================================== //
+// ========== Multi-layer compositing at scanout ======== //
+// ====================================================== //
+
+#include "compositor.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "metrics.h"
+#include "report.h"
+#include "stream.h"
+
+#ifdef ARDUINO
+static portMUX_TYPE maskMux = portMUX_INITIALIZER_UNLOCKED;
+#define MASK_LOCK()   portENTER_CRITICAL(&maskMux)
+#define MASK_UNLOCK() portEXIT_CRITICAL(&maskMux)
+#else
+#include <mutex>
+
+static std::mutex maskMutex;
+#define MASK_LOCK()   maskMutex.lock()
+#define MASK_UNLOCK() maskMutex.unlock()
+#endif
+
+Layer layers[MAX_LAYERS] = { { &image, 255, nullptr, MaskFormat::None,
+        true } };
+
+// New masks are latched together with their format at the first line of
+// a frame, so scanout never pairs a mask with the wrong format
+struct PendingMask
+{
+    const uint8_t *mask;
+    MaskFormat     format;
+    bool           pending;
+};
+static PendingMask   pendingMasks[MAX_LAYERS];
+static volatile bool masksPending;
+
+// Masks loaded from SD belong to the compositor; a whole-frame mask is
+// too large for internal memory
+static uint8_t *loadedMasks[MAX_LAYERS];
+
+static Allocator &maskAllocator()
+{
+    return heapAllocator(MemoryRegion::Psram);
+}
+
+size_t maskRowBytes(int width, MaskFormat format)
+{
+    switch (format) {
+        case MaskFormat::Bits1:
+            return (width + 7) / 8;
+        case MaskFormat::Bits4:
+            return (width + 1) / 2;
+        default:
+            return 0;
+    }
+}
+
+bool setLayer(int index, const Image *image, uint8_t alpha)
+{
+    if (index < 0 || index >= MAX_LAYERS) {
+        return false;
+    }
+
+    layers[index].image   = image;
+    layers[index].alpha   = alpha;
+    layers[index].enabled = image != nullptr;
+    return true;
+}
+
+bool setLayerMask(int index, const uint8_t *mask, MaskFormat format)
+{
+    if (index < 0 || index >= MAX_LAYERS) {
+        return false;
+    }
+
+    MASK_LOCK();
+    pendingMasks[index] = { mask, mask ? format : MaskFormat::None, true };
+    masksPending        = true;
+    MASK_UNLOCK();
+    return true;
+}
+
+bool loadLayerMask(int index, const char *path, MaskFormat format)
+{
+    if (index < 0 || index >= MAX_LAYERS || !layers[index].image) {
+        return false;
+    }
+
+    const Image *image = layers[index].image;
+    const size_t size  = maskRowBytes(image->xres, format) * image->yres;
+
+    FileReader reader;
+    if (!reader.open(path) || reader.size() != size) {
+        report("Mask %s is not a %u byte mask\n", path, (unsigned) size);
+        return false;
+    }
+
+    uint8_t *mask = (uint8_t *) maskAllocator().allocate(size);
+    if (!mask) {
+        return false;
+    }
+    size_t len = reader.read(mask, size);
+    if (len != size) {
+        report("Failed to read mask %s\n", path);
+        maskAllocator().deallocate(mask);
+        return false;
+    }
+
+    // The old mask is used until the next frame latches the new one, free
+    // it once that frame started
+    uint8_t *old = loadedMasks[index];
+    setLayerMask(index, mask, format);
+    loadedMasks[index] = mask;
+    waitForVsync();
+    maskAllocator().deallocate(old);
+
+    report("Loaded mask %s for layer %d\n", path, index);
+    return true;
+}
+
+static inline void blendMasked(Color &dst, Color src, uint32_t a)
+{
+    if (a == 256)
+        dst = src;
+    else if (a)
+        blendPixel(dst, src, a);
+}
+
+// Mask level of pixel x: 0..1 for Bits1, 0..15 for Bits4
+static inline int maskLevel(const uint8_t *mask, MaskFormat format, int x)
+{
+    if (format == MaskFormat::Bits1)
+        return (mask[x >> 3] >> (7 - (x & 7))) & 1;
+    return (mask[x >> 1] >> ((~x & 1) << 2)) & 0xf;
+}
+
+void compositeLine(Color *line, int y, int width, int height, uint32_t frame,
+        int step)
+{
+    static uint32_t latchedFrame = UINT32_MAX;
+    if (frame != latchedFrame) {
+        latchedFrame = frame;
+        if (masksPending) {
+            MASK_LOCK();
+            for (int i = 0; i < MAX_LAYERS; ++i) {
+                if (pendingMasks[i].pending) {
+                    layers[i].mask          = pendingMasks[i].mask;
+                    layers[i].maskFormat    = pendingMasks[i].format;
+                    pendingMasks[i].pending = false;
+                }
+            }
+            masksPending = false;
+            MASK_UNLOCK();
+        }
+    }
+
+    memset(line, 0, (width + step - 1) / step * sizeof(Color));
+
+    for (int i = 0; i < MAX_LAYERS; ++i) {
+        const Layer layer = layers[i];
+        if (!layer.enabled || !layer.image || y >= layer.image->yres) {
+            continue;
+        }
+        const Image &source = *layer.image;
+
+        const uint32_t global = layer.alpha + (layer.alpha >> 7);
+        const int      w      = std::min(width, source.xres);
+        const Color   *src    = source.pixels + y * source.xres;
+        const bool     masked
+                = layer.mask && layer.maskFormat != MaskFormat::None;
+        const size_t   stride = maskRowBytes(source.xres, layer.maskFormat);
+        const uint8_t *mask   = masked ? layer.mask + y * stride : nullptr;
+
+        // Effective alpha of every mask level, 0..256, for masked layers
+        uint16_t alpha[16];
+        if (masked) {
+            const bool bits1  = layer.maskFormat == MaskFormat::Bits1;
+            const int  levels = bits1 ? 2 : 16;
+            for (int level = 0; level < levels; ++level) {
+                alpha[level] = bits1 ? (level ? global : 0)
+                                     : (global * level + 7) / 15;
+            }
+        }
+
+        // Sampled lines touch one pixel in `step`, too few for the runs
+        // below to pay off
+        if (step > 1) {
+            for (int j = 0, x = 0; x < w; ++j, x += step) {
+                blendMasked(line[j], src[x],
+                        masked ? alpha[maskLevel(mask, layer.maskFormat, x)]
+                               : global);
+            }
+            continue;
+        }
+
+        if (!masked) {
+            if (global == 256) {
+                memcpy(line, src, w * sizeof(Color));
+            }
+            else if (global) {
+                for (int x = 0; x < w; ++x)
+                    blendPixel(line[x], src[x], global);
+            }
+            continue;
+        }
+
+        if (layer.maskFormat == MaskFormat::Bits1) {
+            for (int x = 0; x < w; x += 8) {
+                const uint8_t bits = mask[x >> 3];
+                const int     end  = std::min(x + 8, w);
+                if (!bits)
+                    continue;
+                if (bits == 0xff && global == 256) {
+                    memcpy(line + x, src + x, (end - x) * sizeof(Color));
+                    continue;
+                }
+                for (int j = x; j < end; ++j) {
+                    const int bit = (bits >> (7 - (j & 7))) & 1;
+                    blendMasked(line[j], src[j], alpha[bit]);
+                }
+            }
+        }
+        else {
+            for (int x = 0; x < w; ++x) {
+                const int level = maskLevel(mask, MaskFormat::Bits4, x);
+                blendMasked(line[x], src[x], alpha[level]);
+            }
+        }
+    }
+}
+
+// ─── Self-test ──────────────────────────────────────────────────────────
+
+static uint32_t randomState = 0x2545f491;
+
+static uint32_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// One channel of blendPixel(), with nothing shared between channels
+static uint8_t blendChannel(uint8_t dst, uint8_t src, uint32_t a)
+{
+    return (dst * (256 - a) + src * a) >> 8;
+}
+
+// compositeLine() one pixel at a time, straight from the layer rules
+static void referenceLine(Color *line, int y, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        Color c = { 0, 0, 0 };
+        for (const Layer &layer : layers) {
+            if (!layer.enabled || !layer.image || y >= layer.image->yres
+                    || x >= layer.image->xres) {
+                continue;
+            }
+
+            uint32_t a = layer.alpha + (layer.alpha >> 7);
+            if (layer.mask && layer.maskFormat != MaskFormat::None) {
+                const size_t row = maskRowBytes(
+                        layer.image->xres, layer.maskFormat);
+                const uint8_t byte = layer.mask[y * row
+                        + (layer.maskFormat == MaskFormat::Bits1 ? x / 8
+                                                                 : x / 2)];
+                if (layer.maskFormat == MaskFormat::Bits1) {
+                    a = byte >> (7 - x % 8) & 1 ? a : 0;
+                }
+                else {
+                    a = (a * (x % 2 ? byte & 0xf : byte >> 4) + 7) / 15;
+                }
+            }
+
+            const Color src = layer.image->get(x, y);
+            if (a == 256) {
+                c = src;
+            }
+            else if (a) {
+                c = { blendChannel(c.r, src.r, a), blendChannel(c.g, src.g, a),
+                    blendChannel(c.b, src.b, a) };
+            }
+        }
+        line[x] = c;
+    }
+}
+
+bool testCompositor()
+{
+    bool ok = true;
+
+    // The shared multiply for red and blue never lets one carry into the
+    // other, for every pair of values at every alpha
+    for (uint32_t a = 0; a <= 256 && ok; ++a) {
+        for (int d = 0; d < 256; ++d) {
+            for (int s = 0; s < 256; ++s) {
+                Color       dst = { (uint8_t) d, (uint8_t) (255 - d),
+                    (uint8_t) s };
+                const Color src = { (uint8_t) s, (uint8_t) (d ^ 0x5a),
+                    (uint8_t) (255 - d) };
+                const Color want = { blendChannel(d, s, a),
+                    blendChannel(255 - d, d ^ 0x5a, a),
+                    blendChannel(s, 255 - d, a) };
+                blendPixel(dst, src, a);
+                ok &= check(!memcmp(&dst, &want, sizeof(dst)), "blend",
+                        a * 65536 + d * 256 + s);
+            }
+        }
+    }
+
+    // Widths that end mid mask byte, one narrower than the line and one
+    // wider, so a layer may stop short of the line
+    Image      bottom(45, 6, heapAllocator(MemoryRegion::Internal));
+    Image      top(37, 4, heapAllocator(MemoryRegion::Internal));
+    Image     *images[2] = { &bottom, &top };
+    static uint8_t masks[2][(45 + 1) / 2 * 6];
+    static Color   line[SCANLINE_MAX], expected[SCANLINE_MAX];
+    const int      width = 41;
+
+    Layer saved[MAX_LAYERS];
+    memcpy(saved, layers, sizeof(layers));
+
+    const uint8_t    alphas[]  = { 255, 0, 128, 1, 254, 77 };
+    const MaskFormat formats[] = { MaskFormat::None, MaskFormat::Bits1,
+        MaskFormat::Bits4 };
+    for (int round = 0; round < 200 && ok; ++round) {
+        for (Image *image : images) {
+            for (int i = 0; i < image->xres * image->yres; ++i) {
+                const uint32_t r = nextRandom();
+                image->pixels[i] = { (uint8_t) r, (uint8_t) (r >> 8),
+                    (uint8_t) (r >> 16) };
+            }
+        }
+
+        memset(layers, 0, sizeof(layers));
+        for (int i = 0; i < 2; ++i) {
+            // Masks that are all set or all clear take the fast paths
+            const uint32_t kind = nextRandom() % 4;
+            for (uint8_t &byte : masks[i]) {
+                byte = kind == 0 ? 0 : kind == 1 ? 0xff : nextRandom();
+            }
+            layers[i * 2] = { images[i], alphas[nextRandom() % 6], masks[i],
+                formats[nextRandom() % 3], nextRandom() % 8 != 0 };
+        }
+
+        for (int y = 0; y < bottom.yres; ++y) {
+            compositeLine(line, y, width, bottom.yres, 0, 1);
+            referenceLine(expected, y, width);
+            ok &= check(!memcmp(line, expected, width * sizeof(Color)),
+                    "composite", round * 100 + y);
+
+            // Sampled as scanout asks for it
+            compositeLine(line, y, width, bottom.yres, 0, SCAN_STEP);
+            bool same = true;
+            for (int i = 0; i * SCAN_STEP < width; ++i)
+                same &= !memcmp(&line[i], &expected[i * SCAN_STEP],
+                        sizeof(Color));
+            ok &= check(same, "sampled", round * 100 + y);
+        }
+    }
+
+    // A mask set mid-frame waits for the next one, format and all
+    memset(layers, 0, sizeof(layers));
+    memset(masks[0], 0, sizeof(masks[0]));
+    layers[0] = { &bottom, 255, nullptr, MaskFormat::None, true };
+    compositeLine(line, 0, width, bottom.yres, 1, 1);
+    ok &= check(setLayerMask(0, masks[0], MaskFormat::Bits1), "set mask");
+    compositeLine(line, 1, width, bottom.yres, 1, 1);
+    referenceLine(expected, 1, width);
+    ok &= check(!memcmp(line, expected, width * sizeof(Color))
+                        && !layers[0].mask,
+            "mask latched mid-frame");
+    compositeLine(line, 0, width, bottom.yres, 2, 1);
+    ok &= check(layers[0].mask == masks[0]
+                        && layers[0].maskFormat == MaskFormat::Bits1
+                        && line[0].r == 0 && line[width - 1].g == 0,
+            "mask latched next frame");
+
+    ok &= check(!setLayer(MAX_LAYERS, &top, 255), "layer out of range");
+    ok &= check(!setLayerMask(-1, masks[0], MaskFormat::Bits1),
+            "mask out of range");
+    memcpy(layers, saved, sizeof(layers));
+
+    report("Compositor tests %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+void benchmarkCompositor(const VGAMode &mode)
+{
+    static Color   line[SCANLINE_MAX];
+    const int      width  = std::min(mode.xres, SCANLINE_MAX);
+    const char    *unit   = METRICS_CYCLE_HZ == 1e9 ? "ns" : "cycles";
+    const uint32_t budget = mode.xres * mode.hPixel * (METRICS_CYCLE_HZ / 1e6);
+
+    // Background plus a half transparent overlay with a 4-bit ramp mask
+    const size_t rowBytes = maskRowBytes(image.xres, MaskFormat::Bits4);
+    uint8_t     *mask
+            = (uint8_t *) maskAllocator().allocate(rowBytes * image.yres);
+    if (!mask) {
+        return;
+    }
+    for (size_t i = 0; i < rowBytes * image.yres; ++i)
+        mask[i] = i % rowBytes * 16 / rowBytes * 0x11;
+
+    Layer saved[MAX_LAYERS];
+    memcpy(saved, layers, sizeof(layers));
+    memset(layers, 0, sizeof(layers));
+
+    const MaskFormat formats[3] = { MaskFormat::None, MaskFormat::Bits1,
+        MaskFormat::Bits4 };
+    for (MaskFormat format : formats) {
+        layers[0] = { &image, 255, nullptr, MaskFormat::None, true };
+        layers[1] = { &image, 128, format == MaskFormat::None ? nullptr : mask,
+            format, true };
+
+        uint32_t start = cycleCount();
+        for (int y = 0; y < mode.yres; ++y) {
+            compositeLine(line, y, width, mode.yres, 0, SCAN_STEP);
+        }
+        uint32_t perLine = (cycleCount() - start) / mode.yres;
+
+        report("2 layers, %d-bit mask: %u %s/line (%u%% of the active "
+               "line)\n",
+                format == MaskFormat::None    ? 0
+                : format == MaskFormat::Bits1 ? 1
+                                              : 4,
+                perLine, unit, perLine * 100 / budget);
+    }
+
+    memcpy(layers, saved, sizeof(layers));
+    maskAllocator().deallocate(mask);
+}
@@ -0,0 +1,463 @@
+// ====================================================== //
+// ============== Pixel format conversion =============== //
+// ====================================================== //
+
+#include "convert.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "report.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+static inline uint16_t pack565(Color c)
+{
+    return ((c.r & 0xf8) << 8) | ((c.g & 0xfc) << 3) | (c.b >> 3);
+}
+
+static inline Color unpack565(uint16_t p)
+{
+    unsigned r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+    return Color{ (unsigned char) ((r << 3) | (r >> 2)),
+        (unsigned char) ((g << 2) | (g >> 4)),
+        (unsigned char) ((b << 3) | (b >> 2)) };
+}
+
+static inline uint8_t pack332(Color c)
+{
+    return (c.r & 0xe0) | ((c.g & 0xe0) >> 3) | (c.b >> 6);
+}
+
+// round(c * a / 255) without a divide
+static inline uint8_t scale255(unsigned c, unsigned a)
+{
+    unsigned t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t load32(const void *p)
+{
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline void store32(void *p, uint32_t word)
+{
+    memcpy(p, &word, sizeof(word));
+}
+
+static inline bool aligned4(const void *p)
+{
+    return ((uintptr_t) p & 3) == 0;
+}
+
+// ─── Scalar ─────────────────────────────────────────────────────────────
+
+namespace scalar
+{
+void rgb888ToRgb565(const Color *src, uint16_t *dst, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = pack565(src[i]);
+}
+
+void rgb565ToRgb888(const uint16_t *src, Color *dst, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = unpack565(src[i]);
+}
+
+void rgb888ToRgb332(const Color *src, uint8_t *dst, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = pack332(src[i]);
+}
+
+void premultiplyRgba(const uint8_t *src, Color *dst, int n)
+{
+    for (int i = 0; i < n; ++i, src += 4) {
+        const unsigned a = src[3];
+        dst[i] = Color{ scale255(src[0], a), scale255(src[1], a),
+            scale255(src[2], a) };
+    }
+}
+
+void byteSwap16(uint16_t *pixels, int n)
+{
+    for (int i = 0; i < n; ++i)
+        pixels[i] = (pixels[i] << 8) | (pixels[i] >> 8);
+}
+}  // namespace scalar
+
+// ─── SWAR ───────────────────────────────────────────────────────────────
+
+// Four RGB888 pixels are exactly three words. The scalar kernels handle
+// the pixels before the source is word aligned and the tail.
+namespace swar
+{
+void rgb888ToRgb565(const Color *src, uint16_t *dst, int n)
+{
+    int i = 0;
+    for (; i < n && !aligned4(src + i); ++i)
+        dst[i] = pack565(src[i]);
+
+    for (; i + 4 <= n; i += 4) {
+        const uint32_t w0 = load32(src + i);
+        const uint32_t w1 = load32((const uint8_t *) (src + i) + 4);
+        const uint32_t w2 = load32((const uint8_t *) (src + i) + 8);
+
+        dst[i]     = ((w0 & 0xf8) << 8) | ((w0 & 0xfc00) >> 5)
+                     | ((w0 & 0xf80000) >> 19);
+        dst[i + 1] = ((w0 >> 16) & 0xf800) | ((w1 & 0xfc) << 3)
+                     | ((w1 & 0xf800) >> 11);
+        dst[i + 2] = ((w1 & 0xf80000) >> 8) | ((w1 >> 21) & 0x7e0)
+                     | ((w2 & 0xf8) >> 3);
+        dst[i + 3] = (w2 & 0xf800) | ((w2 & 0xfc0000) >> 13) | (w2 >> 27);
+    }
+
+    scalar::rgb888ToRgb565(src + i, dst + i, n - i);
+}
+
+void rgb565ToRgb888(const uint16_t *src, Color *dst, int n)
+{
+    int i = 0;
+    for (; i < n && !aligned4(dst + i); ++i)
+        dst[i] = unpack565(src[i]);
+
+    for (; i + 4 <= n; i += 4) {
+        const Color c0 = unpack565(src[i]);
+        const Color c1 = unpack565(src[i + 1]);
+        const Color c2 = unpack565(src[i + 2]);
+        const Color c3 = unpack565(src[i + 3]);
+
+        uint8_t *out = (uint8_t *) (dst + i);
+        store32(out, c0.r | (c0.g << 8) | (c0.b << 16) | (c1.r << 24));
+        store32(out + 4, c1.g | (c1.b << 8) | (c2.r << 16) | (c2.g << 24));
+        store32(out + 8, c2.b | (c3.r << 8) | (c3.g << 16) | (c3.b << 24));
+    }
+
+    scalar::rgb565ToRgb888(src + i, dst + i, n - i);
+}
+
+void rgb888ToRgb332(const Color *src, uint8_t *dst, int n)
+{
+    int i = 0;
+    for (; i < n && !aligned4(src + i); ++i)
+        dst[i] = pack332(src[i]);
+
+    for (; i + 4 <= n; i += 4) {
+        const uint32_t w0 = load32(src + i);
+        const uint32_t w1 = load32((const uint8_t *) (src + i) + 4);
+        const uint32_t w2 = load32((const uint8_t *) (src + i) + 8);
+
+        const uint32_t p0 = (w0 & 0xe0) | ((w0 >> 11) & 0x1c)
+                            | ((w0 >> 22) & 3);
+        const uint32_t p1 = ((w0 >> 24) & 0xe0) | ((w1 & 0xe0) >> 3)
+                            | ((w1 >> 14) & 3);
+        const uint32_t p2 = ((w1 >> 16) & 0xe0) | ((w1 >> 27) & 0x1c)
+                            | ((w2 >> 6) & 3);
+        const uint32_t p3 = ((w2 >> 8) & 0xe0) | ((w2 >> 19) & 0x1c)
+                            | (w2 >> 30);
+        store32(dst + i, p0 | (p1 << 8) | (p2 << 16) | (p3 << 24));
+    }
+
+    scalar::rgb888ToRgb332(src + i, dst + i, n - i);
+}
+
+void premultiplyRgba(const uint8_t *src, Color *dst, int n)
+{
+    // Red and blue ride in the two 16-bit lanes of one multiply
+    for (int i = 0; i < n; ++i, src += 4) {
+        const uint32_t w = load32(src);
+        const uint32_t a = w >> 24;
+
+        uint32_t rb = (w & 0x00ff00ff) * a + 0x00800080;
+        rb          = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+        dst[i] = Color{ (unsigned char) rb, scale255((w >> 8) & 0xff, a),
+            (unsigned char) (rb >> 16) };
+    }
+}
+
+void byteSwap16(uint16_t *pixels, int n)
+{
+    int i = 0;
+    for (; i < n && !aligned4(pixels + i); ++i)
+        pixels[i] = (pixels[i] << 8) | (pixels[i] >> 8);
+
+    for (; i + 2 <= n; i += 2) {
+        const uint32_t w = load32(pixels + i);
+        store32(pixels + i,
+                ((w & 0x00ff00ff) << 8) | ((w >> 8) & 0x00ff00ff));
+    }
+
+    scalar::byteSwap16(pixels + i, n - i);
+}
+}  // namespace swar
+
+// ─── Dispatch ───────────────────────────────────────────────────────────
+
+#if CONVERT_SWAR
+namespace kernels = swar;
+#else
+namespace kernels = scalar;
+#endif
+
+void rgb888ToRgb565(const Color *src, uint16_t *dst, int n)
+{
+    kernels::rgb888ToRgb565(src, dst, n);
+}
+
+void rgb565ToRgb888(const uint16_t *src, Color *dst, int n)
+{
+    kernels::rgb565ToRgb888(src, dst, n);
+}
+
+void rgb888ToRgb332(const Color *src, uint8_t *dst, int n)
+{
+    kernels::rgb888ToRgb332(src, dst, n);
+}
+
+void premultiplyRgba(const uint8_t *src, Color *dst, int n)
+{
+    kernels::premultiplyRgba(src, dst, n);
+}
+
+void byteSwap16(uint16_t *pixels, int n)
+{
+    kernels::byteSwap16(pixels, n);
+}
+
+// Table lookups gain nothing from wider loads, these stay scalar
+
+void rgb332ToRgb888(const uint8_t *src, Color *dst, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        const unsigned r = src[i] >> 5, g = (src[i] >> 2) & 7, b = src[i] & 3;
+        dst[i] = Color{ (unsigned char) ((r << 5) | (r << 2) | (r >> 1)),
+            (unsigned char) ((g << 5) | (g << 2) | (g >> 1)),
+            (unsigned char) (b * 0x55) };
+    }
+}
+
+void indexedToRgb888(
+        const uint8_t *src, const Color *palette, Color *dst, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = palette[src[i]];
+}
+
+void rgb888ToIndexed(const Color *src, const Color *palette, int colors,
+        uint8_t *dst, int n)
+{
+    // Nearest palette entry; runs of one colour only search once
+    Color   last{};
+    uint8_t lastIndex = 0;
+    bool    cached    = false;
+    for (int i = 0; i < n; ++i) {
+        const Color c = src[i];
+        if (!cached || c.r != last.r || c.g != last.g || c.b != last.b) {
+            int best = 0x7fffffff;
+            for (int k = 0; k < colors; ++k) {
+                const int dr = c.r - palette[k].r, dg = c.g - palette[k].g,
+                          db = c.b - palette[k].b;
+                const int d = dr * dr + dg * dg + db * db;
+                if (d < best) {
+                    best      = d;
+                    lastIndex = k;
+                }
+            }
+            last   = c;
+            cached = true;
+        }
+        dst[i] = lastIndex;
+    }
+}
+
+void grayToRgb888(const uint8_t *src, Color *dst, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = Color{ src[i], src[i], src[i] };
+}
+
+void rgbaToRgb888(const uint8_t *src, Color *dst, int n)
+{
+    for (int i = 0; i < n; ++i, src += 4)
+        dst[i] = Color{ src[0], src[1], src[2] };
+}
+
+void argbToRgb888(const uint32_t *src, Color *dst, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = Color{ (unsigned char) (src[i] >> 16),
+            (unsigned char) (src[i] >> 8), (unsigned char) src[i] };
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+#define TEST_ROW  256
+#define BENCH_ROW 640
+
+static uint32_t randomState = 0x12345678;
+
+static uint32_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+bool testConvert()
+{
+    static uint8_t  bytes[TEST_ROW * 4 + 4];
+    static Color    colors[TEST_ROW + 4], expected[TEST_ROW + 4];
+    static uint16_t words[TEST_ROW + 4], expectedWords[TEST_ROW + 4];
+    static uint8_t  small[TEST_ROW + 4], expectedSmall[TEST_ROW + 4];
+    bool            ok = true;
+
+    // Every RGB565 value survives the round trip through RGB888
+    for (int v = 0; v < 65536 && ok; v += TEST_ROW) {
+        for (int i = 0; i < TEST_ROW; ++i)
+            words[i] = v + i;
+        rgb565ToRgb888(words, colors, TEST_ROW);
+        scalar::rgb565ToRgb888(words, expected, TEST_ROW);
+        ok &= check(!memcmp(colors, expected, sizeof(Color) * TEST_ROW),
+                "565 to 888", v);
+        rgb888ToRgb565(colors, expectedWords, TEST_ROW);
+        ok &= check(!memcmp(words, expectedWords, 2 * TEST_ROW),
+                "565 round trip", v);
+    }
+
+    // So does every RGB332 value
+    for (int i = 0; i < 256; ++i)
+        small[i] = i;
+    rgb332ToRgb888(small, colors, 256);
+    rgb888ToRgb332(colors, expectedSmall, 256);
+    ok &= check(!memcmp(small, expectedSmall, 256), "332 round trip", 0);
+
+    // Premultiplication matches round(c * a / 255) for every pair
+    for (int a = 0; a < 256 && ok; ++a) {
+        for (int c = 0; c < 256; ++c) {
+            bytes[c * 4]     = c;
+            bytes[c * 4 + 1] = 255 - c;
+            bytes[c * 4 + 2] = c ^ 0x5a;
+            bytes[c * 4 + 3] = a;
+        }
+        premultiplyRgba(bytes, colors, 256);
+        for (int c = 0; c < 256; ++c) {
+            ok &= check(colors[c].r == (c * a * 2 + 255) / 510
+                                && colors[c].g
+                                           == ((255 - c) * a * 2 + 255) / 510
+                                && colors[c].b
+                                           == ((c ^ 0x5a) * a * 2 + 255) / 510,
+                    "premultiply", a * 256 + c);
+        }
+    }
+
+    // SWAR kernels against scalar ones, at every length and alignment
+    for (int round = 0; round < 64 && ok; ++round) {
+        for (size_t i = 0; i < sizeof(bytes); ++i)
+            bytes[i] = nextRandom();
+        const int offset = round & 3;
+        const int n      = nextRandom() % (TEST_ROW - 4);
+
+        const Color *src = (const Color *) (bytes + offset);
+        swar::rgb888ToRgb565(src, words, n);
+        scalar::rgb888ToRgb565(src, expectedWords, n);
+        ok &= check(!memcmp(words, expectedWords, 2 * n), "888 to 565", n);
+
+        swar::rgb888ToRgb332(src, small, n);
+        scalar::rgb888ToRgb332(src, expectedSmall, n);
+        ok &= check(!memcmp(small, expectedSmall, n), "888 to 332", n);
+
+        const uint16_t *src16 = (const uint16_t *) (bytes + 2 * (round & 1));
+        swar::rgb565ToRgb888(src16, colors + offset, n);
+        scalar::rgb565ToRgb888(src16, expected + offset, n);
+        ok &= check(!memcmp(colors + offset, expected + offset,
+                            sizeof(Color) * n),
+                "565 to 888 unaligned", n);
+
+        memcpy(words, src16, 2 * n);
+        memcpy(expectedWords, src16, 2 * n);
+        swar::byteSwap16(words + (round & 1), n - (round & 1));
+        scalar::byteSwap16(expectedWords + (round & 1), n - (round & 1));
+        ok &= check(!memcmp(words, expectedWords, 2 * n), "byte swap", n);
+
+        swar::premultiplyRgba(bytes + offset, colors, n);
+        scalar::premultiplyRgba(bytes + offset, expected, n);
+        ok &= check(!memcmp(colors, expected, sizeof(Color) * n),
+                "premultiply SWAR", n);
+    }
+
+    // Palette colours map back to themselves
+    Color palette[16];
+    for (int i = 0; i < 16; ++i)
+        palette[i] = Color{ (unsigned char) (i * 17), (unsigned char) (i * 5),
+            (unsigned char) (255 - i * 13) };
+    rgb888ToIndexed(palette, palette, 16, small, 16);
+    indexedToRgb888(small, palette, colors, 16);
+    ok &= check(!memcmp(colors, palette, sizeof(palette)), "indexed", 0);
+
+    report("Conversion tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+// ─── Benchmark ──────────────────────────────────────────────────────────
+
+template <typename Kernel>
+static void timeKernel(const char *name, Kernel kernel)
+{
+    const int iterations = 200;
+    uint32_t  start      = nowMicros();
+    for (int i = 0; i < iterations; ++i)
+        kernel();
+    uint32_t elapsed = nowMicros() - start;
+    if (!elapsed) {
+        elapsed = 1;
+    }
+    report("%-24s %6u kpx/s\n", name,
+            (unsigned) ((uint64_t) iterations * BENCH_ROW * 1000
+                        / elapsed));
+}
+
+void benchmarkConvert()
+{
+    static uint8_t  rgba[BENCH_ROW * 4];
+    static Color    colors[BENCH_ROW];
+    static uint16_t words[BENCH_ROW];
+    static uint8_t  small[BENCH_ROW];
+    static Color    palette[256];
+    const int       n = BENCH_ROW;
+
+    for (size_t i = 0; i < sizeof(rgba); ++i)
+        rgba[i] = nextRandom();
+    memcpy(colors, rgba, sizeof(colors));
+    memcpy(palette, rgba, sizeof(palette));
+
+    timeKernel("scalar 888 to 565",
+            [&] { scalar::rgb888ToRgb565(colors, words, n); });
+    timeKernel("swar 888 to 565",
+            [&] { swar::rgb888ToRgb565(colors, words, n); });
+    timeKernel("scalar 565 to 888",
+            [&] { scalar::rgb565ToRgb888(words, colors, n); });
+    timeKernel("swar 565 to 888",
+            [&] { swar::rgb565ToRgb888(words, colors, n); });
+    timeKernel("scalar 888 to 332",
+            [&] { scalar::rgb888ToRgb332(colors, small, n); });
+    timeKernel("swar 888 to 332",
+            [&] { swar::rgb888ToRgb332(colors, small, n); });
+    timeKernel("332 to 888", [&] { rgb332ToRgb888(small, colors, n); });
+    timeKernel("indexed to 888",
+            [&] { indexedToRgb888(small, palette, colors, n); });
+    timeKernel("rgba to 888", [&] { rgbaToRgb888(rgba, colors, n); });
+    timeKernel("scalar premultiply",
+            [&] { scalar::premultiplyRgba(rgba, colors, n); });
+    timeKernel("swar premultiply",
+            [&] { swar::premultiplyRgba(rgba, colors, n); });
+    timeKernel("scalar byte swap", [&] { scalar::byteSwap16(words, n); });
+    timeKernel("swar byte swap", [&] { swar::byteSwap16(words, n); });
+}
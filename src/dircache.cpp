@@ -0,0 +1,611 @@
+// ====================================================== //
+// ============== Cached directory listings ============= //
+// ====================================================== //
+
+#include "dircache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <strings.h>
+
+#include "allocator.h"
+#include "http.h"
+#include "report.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <SD.h>
+#include <ff.h>
+
+static SemaphoreHandle_t cacheMutex = xSemaphoreCreateMutex();
+#define CACHE_LOCK()   xSemaphoreTake(cacheMutex, portMAX_DELAY)
+#define CACHE_UNLOCK() xSemaphoreGive(cacheMutex)
+#else
+#include <dirent.h>
+#include <mutex>
+#include <sys/stat.h>
+
+static std::mutex cacheMutex;
+#define CACHE_LOCK()   cacheMutex.lock()
+#define CACHE_UNLOCK() cacheMutex.unlock()
+#endif
+
+// ─── Directory Index ────────────────────────────────────────────────────
+
+// 8 bytes an entry plus its name, so a folder of 10k frames needs about
+// 200KB; the tables grow by doubling in PSRAM
+struct Record
+{
+    uint32_t name : 31;  // offset into the name pool
+    uint32_t isDir : 1;
+    uint32_t size;
+};
+
+struct DirIndex
+{
+    char      path[DIR_PATH_MAX];
+    Record   *records;
+    size_t    recordBytes;
+    size_t    count;
+    char     *names;
+    size_t    nameBytes;
+    size_t    namesUsed;
+    uint32_t *order;  // entry indices in `sortedBy` order
+    size_t    orderBytes;
+    DirSort   sortedBy;
+    bool      descending;
+    uint32_t  lastUsed;  // 0 while the slot is free
+};
+
+static DirIndex cache[DIR_CACHE_DIRS];
+static uint32_t useClock;
+
+static Allocator &indexAllocator()
+{
+    return heapAllocator(MemoryRegion::Psram);
+}
+
+// Doubles `data` until it holds `need` bytes
+static bool grow(void *&data, size_t &capacity, size_t need)
+{
+    if (need <= capacity) {
+        return true;
+    }
+    size_t size = capacity ? capacity : 1024;
+    while (size < need)
+        size *= 2;
+
+    void *p = indexAllocator().allocate(size);
+    if (!p) {
+        return false;
+    }
+    if (data) {
+        memcpy(p, data, capacity);
+        indexAllocator().deallocate(data);
+    }
+    data     = p;
+    capacity = size;
+    return true;
+}
+
+static void release(void *&data, size_t &capacity)
+{
+    if (data) {
+        indexAllocator().deallocate(data);
+    }
+    data     = nullptr;
+    capacity = 0;
+}
+
+static void drop(DirIndex &index)
+{
+    release((void *&) index.records, index.recordBytes);
+    release((void *&) index.names, index.nameBytes);
+    release((void *&) index.order, index.orderBytes);
+    index.path[0]   = 0;
+    index.count     = 0;
+    index.namesUsed = 0;
+    index.sortedBy  = DirSort::None;
+    index.lastUsed  = 0;
+}
+
+static bool append(DirIndex &index, const char *name, size_t size, bool isDir)
+{
+    const size_t length = strlen(name) + 1;
+    if (!grow((void *&) index.records, index.recordBytes,
+                (index.count + 1) * sizeof(Record))
+            || !grow((void *&) index.names, index.nameBytes,
+                    index.namesUsed + length)) {
+        report("No memory to index entry %u\n", (unsigned) index.count);
+        return false;
+    }
+
+    Record &record = index.records[index.count++];
+    record.name    = index.namesUsed;
+    record.isDir   = isDir;
+    record.size    = size;
+    memcpy(index.names + index.namesUsed, name, length);
+    index.namesUsed += length;
+    return true;
+}
+
+// ─── Scanning ───────────────────────────────────────────────────────────
+
+#ifdef ARDUINO
+// SD.begin() mounts the card as the first FatFs drive. Reading the
+// directory through FatFs yields every entry's size and attributes in
+// one pass, where File::openNextFile() opens and stats each entry.
+static bool scanFatFs(DirIndex &index, const char *path)
+{
+    char drivePath[DIR_PATH_MAX + 8];
+    snprintf(drivePath, sizeof(drivePath), "0:%s", path);
+
+    FF_DIR  dir;
+    FILINFO info;
+    if (f_opendir(&dir, drivePath) != FR_OK) {
+        return false;
+    }
+    bool ok = true;
+    while (ok && f_readdir(&dir, &info) == FR_OK && info.fname[0])
+        ok = append(index, info.fname, info.fsize, info.fattrib & AM_DIR);
+    f_closedir(&dir);
+    return ok;
+}
+
+static bool scanFiles(DirIndex &index, const char *path)
+{
+    File root = SD.open(path);
+    if (!root || !root.isDirectory()) {
+        return false;
+    }
+    for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+        const bool isDir = file.isDirectory();
+        if (!append(index, file.name(), isDir ? 0 : file.size(), isDir)) {
+            return false;
+        }
+    }
+    return true;
+}
+#else
+static bool scanPosix(DirIndex &index, const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+    bool    ok = true;
+    dirent *entry;
+    while (ok && (entry = readdir(dir))) {
+        struct stat info;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")
+                || fstatat(dirfd(dir), entry->d_name, &info, 0) != 0) {
+            continue;
+        }
+        const bool isDir = S_ISDIR(info.st_mode);
+        ok = append(index, entry->d_name, isDir ? 0 : info.st_size, isDir);
+    }
+    closedir(dir);
+    return ok;
+}
+#endif
+
+static bool scan(DirIndex &index, const char *path)
+{
+    const uint32_t start = nowMicros();
+#ifdef ARDUINO
+    // Fall back to the File API should the card sit on another drive
+    bool ok = scanFatFs(index, path);
+    if (!ok) {
+        drop(index);
+        ok = scanFiles(index, path);
+    }
+#else
+    bool ok = scanPosix(index, path);
+#endif
+    if (ok) {
+        report("Indexed %u entries of %s in %u ms\n", (unsigned) index.count,
+                path, (unsigned) ((nowMicros() - start) / 1000));
+    }
+    return ok;
+}
+
+// ─── Sorting ────────────────────────────────────────────────────────────
+
+static int compareNames(const DirIndex &index, uint32_t a, uint32_t b)
+{
+    const char *nameA = index.names + index.records[a].name;
+    const char *nameB = index.names + index.records[b].name;
+    int         order = strcasecmp(nameA, nameB);
+    return order ? order : strcmp(nameA, nameB);
+}
+
+static void sortIndex(DirIndex &index, DirSort sort, bool descending)
+{
+    if (index.order && index.sortedBy == sort
+            && index.descending == descending) {
+        return;
+    }
+    if (!grow((void *&) index.order, index.orderBytes,
+                index.count * sizeof(uint32_t))) {
+        report("No memory to sort %s\n", index.path);
+        release((void *&) index.order, index.orderBytes);
+        return;
+    }
+
+    uint32_t *first = index.order;
+    uint32_t *last  = index.order + index.count;
+    for (size_t i = 0; i < index.count; ++i)
+        first[i] = i;
+
+    const Record *records = index.records;
+    switch (sort) {
+        case DirSort::None:
+            break;
+        case DirSort::Name:
+            std::sort(first, last, [&](uint32_t a, uint32_t b) {
+                return compareNames(index, a, b) < 0;
+            });
+            break;
+        case DirSort::Size:
+            std::sort(first, last, [&](uint32_t a, uint32_t b) {
+                if (records[a].size != records[b].size) {
+                    return records[a].size < records[b].size;
+                }
+                return compareNames(index, a, b) < 0;
+            });
+            break;
+        case DirSort::Type:
+            std::sort(first, last, [&](uint32_t a, uint32_t b) {
+                if (records[a].isDir != records[b].isDir) {
+                    return records[a].isDir > records[b].isDir;
+                }
+                return compareNames(index, a, b) < 0;
+            });
+            break;
+    }
+    if (descending) {
+        std::reverse(first, last);
+    }
+    index.sortedBy   = sort;
+    index.descending = descending;
+}
+
+// ─── Cache ──────────────────────────────────────────────────────────────
+
+// Copies `path` without a trailing slash; false when it is too long
+static bool normalize(const char *path, char *key)
+{
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/')
+        --length;
+    if (length >= DIR_PATH_MAX) {
+        return false;
+    }
+    memcpy(key, path, length);
+    key[length] = 0;
+    return true;
+}
+
+// Finds or loads the index of `key`; the caller holds the lock
+static DirIndex *lookup(const char *key)
+{
+    DirIndex *victim = &cache[0];
+    for (DirIndex &index : cache) {
+        if (index.lastUsed && !strcmp(index.path, key)) {
+            index.lastUsed = ++useClock;
+            return &index;
+        }
+        if (index.lastUsed < victim->lastUsed) {
+            victim = &index;
+        }
+    }
+
+    drop(*victim);
+    if (!scan(*victim, key)) {
+        drop(*victim);
+        return nullptr;
+    }
+    strcpy(victim->path, key);
+    victim->lastUsed = ++useClock;
+    return victim;
+}
+
+long forEachEntry(const char *path, DirSort sort, bool descending,
+        size_t offset, size_t limit, const DirVisitor &visit)
+{
+    char key[DIR_PATH_MAX];
+    if (!normalize(path, key)) {
+        report("Path too long to list: %s\n", path);
+        return -1;
+    }
+
+    CACHE_LOCK();
+    DirIndex *index = lookup(key);
+    if (!index) {
+        CACHE_UNLOCK();
+        return -1;
+    }
+
+    // Entries stay in card order unless asked otherwise, which needs no
+    // order table at all
+    const bool sorted = sort != DirSort::None || descending;
+    if (sorted) {
+        sortIndex(*index, sort, descending);
+    }
+    const uint32_t *order = sorted ? index->order : nullptr;
+
+    size_t end = index->count;
+    if (limit && offset < end && limit < end - offset) {
+        end = offset + limit;
+    }
+    for (size_t i = offset; i < end; ++i) {
+        const Record &record = index->records[order ? order[i] : i];
+        visit(DirEntry{ index->names + record.name, record.size,
+                (bool) record.isDir });
+    }
+
+    const long total = index->count;
+    CACHE_UNLOCK();
+    return total;
+}
+
+long dirEntryCount(const char *path)
+{
+    char key[DIR_PATH_MAX];
+    if (!normalize(path, key)) {
+        return -1;
+    }
+
+    CACHE_LOCK();
+    DirIndex  *index = lookup(key);
+    const long total = index ? (long) index->count : -1;
+    CACHE_UNLOCK();
+    return total;
+}
+
+long writeDirEntries(ChunkedWriter &out, const char *path, DirSort sort,
+        bool descending, size_t offset, size_t limit, bool first)
+{
+    return forEachEntry(
+            path, sort, descending, offset, limit, [&](const DirEntry &entry) {
+                out.print(first ? "{\"type\":\"" : ",{\"type\":\"");
+                out.print(entry.isDir ? "dir" : "file");
+                out.print("\",\"name\":");
+                out.printJsonString(entry.name);
+                out.print(",\"size\":");
+                out.print((unsigned long) (entry.size + 1023) / 1024);
+                out.print("}");
+                first = false;
+            });
+}
+
+long writeDirJson(ChunkedWriter &out, const char *path, DirSort sort,
+        bool descending, size_t offset, size_t limit)
+{
+    out.print("[");
+    long total
+            = writeDirEntries(out, path, sort, descending, offset, limit, true);
+    out.print("]");
+    return total;
+}
+
+void invalidateDir(const char *path)
+{
+    char key[DIR_PATH_MAX];
+    if (!normalize(path, key)) {
+        return;
+    }
+
+    // The directory holding `path` lists it, so it goes too
+    char        parent[DIR_PATH_MAX];
+    const char *slash = strrchr(key, '/');
+    size_t      split = slash ? (slash == key ? 1 : slash - key) : 0;
+    memcpy(parent, key, split);
+    parent[split] = 0;
+
+    const size_t length = strlen(key);
+    CACHE_LOCK();
+    for (DirIndex &index : cache) {
+        if (!index.lastUsed) {
+            continue;
+        }
+        const bool below = !strncmp(index.path, key, length)
+                           && (index.path[length] == '/' || length == 1);
+        if (below || !strcmp(index.path, key)
+                || !strcmp(index.path, parent)) {
+            drop(index);
+        }
+    }
+    CACHE_UNLOCK();
+}
+
+DirSort parseDirSort(const char *name)
+{
+    if (!strcmp(name, "name")) {
+        return DirSort::Name;
+    }
+    if (!strcmp(name, "size")) {
+        return DirSort::Size;
+    }
+    if (!strcmp(name, "type")) {
+        return DirSort::Type;
+    }
+    return DirSort::None;
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool createFile(const char *path, size_t size)
+{
+    static const char fill[64] = {};
+#ifdef ARDUINO
+    File file = SD.open(path, FILE_WRITE);
+    if (!file) {
+        return false;
+    }
+    for (size_t n = 0; n < size; n += sizeof(fill))
+        file.write((const uint8_t *) fill, std::min(size - n, sizeof(fill)));
+    file.close();
+#else
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    for (size_t n = 0; n < size; n += sizeof(fill))
+        fwrite(fill, 1, std::min(size - n, sizeof(fill)), file);
+    fclose(file);
+#endif
+    return true;
+}
+
+static bool createFolder(const char *path)
+{
+#ifdef ARDUINO
+    return SD.exists(path) || SD.mkdir(path);
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Names of one page, joined by spaces
+static bool pageIs(const char *path, DirSort sort, bool descending,
+        size_t offset, size_t limit, const char *expected)
+{
+    char listing[128] = "";
+    forEachEntry(path, sort, descending, offset, limit,
+            [&](const DirEntry &entry) {
+                if (listing[0]) {
+                    strcat(listing, " ");
+                }
+                strcat(listing, entry.name);
+            });
+    if (strcmp(listing, expected)) {
+        report("Listing test failed: got \"%s\", expected \"%s\"\n", listing,
+                expected);
+        return false;
+    }
+    return true;
+}
+
+bool testDirCache(const char *dir)
+{
+    char path[DIR_PATH_MAX];
+    char file[DIR_PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/listing", dir);
+
+    bool ok = createFolder(path);
+    snprintf(file, sizeof(file), "%s/z", path);
+    ok &= createFolder(file);
+    const char  *names[] = { "b", "a", "C" };
+    const size_t sizes[] = { 3000, 10000, 1 };
+    for (int i = 0; i < 3; ++i) {
+        snprintf(file, sizeof(file), "%s/%s", path, names[i]);
+        ok &= createFile(file, sizes[i]);
+    }
+    if (!ok) {
+        report("Could not create %s\n", path);
+        return false;
+    }
+    invalidateDir(path);
+
+    ok &= dirEntryCount(path) == 4;
+    ok &= pageIs(path, DirSort::Name, false, 0, 0, "a b C z");
+    ok &= pageIs(path, DirSort::Name, true, 0, 0, "z C b a");
+    ok &= pageIs(path, DirSort::Type, false, 0, 0, "z a b C");
+    ok &= pageIs(path, DirSort::Size, true, 0, 0, "a b C z");
+    ok &= pageIs(path, DirSort::Name, false, 1, 2, "b C");
+    ok &= pageIs(path, DirSort::Name, false, 3, 10, "z");
+    ok &= pageIs(path, DirSort::Name, false, 4, 10, "");
+
+    // A new file shows up once its directory has been invalidated
+    snprintf(file, sizeof(file), "%s/d", path);
+    ok &= createFile(file, 0);
+    ok &= dirEntryCount(path) == 4;
+    invalidateDir(file);
+    ok &= pageIs(path, DirSort::Name, false, 0, 0, "a b C d z");
+
+    // So does the parent of a directory that was changed
+    const long inDir = dirEntryCount(dir);
+    invalidateDir(path);
+    ok &= dirEntryCount(dir) == inDir && dirEntryCount("/no/such/dir") == -1;
+
+    std::string json;
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            json.append(data, size);
+        });
+        ok &= writeDirJson(out, path, DirSort::Type, false, 0, 3) == 5;
+    }
+    ok &= json
+          == "[{\"type\":\"dir\",\"name\":\"z\",\"size\":0},"
+             "{\"type\":\"file\",\"name\":\"a\",\"size\":10},"
+             "{\"type\":\"file\",\"name\":\"b\",\"size\":3}]";
+
+    report("Directory cache tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+// Lists a folder of `files` frames the ways the web page does
+void benchmarkDirCache(const char *dir, int files)
+{
+    char path[DIR_PATH_MAX + 16];
+    if (dirEntryCount(dir) < files) {
+        report("Creating %d files in %s\n", files, dir);
+        for (int i = 0; i < files; ++i) {
+            snprintf(path, sizeof(path), "%s/frame%05d.png", dir, i);
+            createFile(path, i % 7 * 100);
+        }
+    }
+
+    uint32_t start = nowMicros();
+    invalidateDir(dir);
+    const long     total = dirEntryCount(dir);
+    const uint32_t cold  = nowMicros() - start;
+
+    size_t bytes = 0;
+    auto   count = [&](const char *data, size_t size) { bytes += size; };
+
+    uint32_t times[4];
+    size_t   sent[4];
+    for (int i = 0; i < 4; ++i) {
+        bytes = 0;
+        start = nowMicros();
+        {
+            ChunkedWriter out(count);
+            if (i == 0) {
+                writeDirJson(out, dir, DirSort::None, false, 0, 0);
+            }
+            else if (i == 1) {
+                writeDirJson(out, dir, DirSort::Name, true, 0, 100);
+            }
+            else if (i == 2) {
+                writeDirJson(out, dir, DirSort::Name, true, total / 2, 100);
+            }
+            else {
+                writeDirJson(out, dir, DirSort::Size, false, 0, 0);
+            }
+        }
+        times[i] = nowMicros() - start;
+        sent[i]  = bytes;
+    }
+
+    report("Listing %ld entries: scan %u us\n", total, (unsigned) cold);
+    report("  whole listing     %6u us, %u bytes\n", (unsigned) times[0],
+            (unsigned) sent[0]);
+    report("  sorted first page %6u us, %u bytes\n", (unsigned) times[1],
+            (unsigned) sent[1]);
+    report("  middle page       %6u us, %u bytes\n", (unsigned) times[2],
+            (unsigned) sent[2]);
+    report("  resorted listing  %6u us, %u bytes\n", (unsigned) times[3],
+            (unsigned) sent[3]);
+    size_t indexBytes = 0;
+    CACHE_LOCK();
+    for (const DirIndex &index : cache)
+        indexBytes += index.recordBytes + index.nameBytes + index.orderBytes;
+    CACHE_UNLOCK();
+    report("  index memory %u bytes, stream buffer %u bytes\n",
+            (unsigned) indexBytes, (unsigned) CHUNK_BUFFER);
+}
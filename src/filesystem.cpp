@@ -18,28 +18,14 @@ size_t sizeInMbytes(size_t bytes)
 
 std::vector<DirListingItem> listDir(const char *dirname)
 {
-    File root = SD.open(dirname);
-    if (!root) {
-        Serial.printf("Failed to open directory %s\n", dirname);
-        return std::vector<DirListingItem>();
-    }
-    if (!root.isDirectory()) {
-        Serial.printf("%s is not a directory\n", dirname);
-        return std::vector<DirListingItem>();
-    }
-
     std::vector<DirListingItem> listing;
-
-    File file = root.openNextFile();
-    while (file) {
-        if (file.isDirectory()) {
-            listing.push_back({ file.name(), true, 0 });
-        }
-        else {
-            listing.push_back({ file.name(), false, file.size() });
-        }
-
-        file = root.openNextFile();
+    long total = forEachEntry(dirname, DirSort::None, false, 0, 0,
+            [&](const DirEntry &entry) {
+                listing.push_back({ entry.name, entry.isDir, entry.size });
+            });
+    if (total < 0) {
+        Serial.printf("Failed to open directory %s\n", dirname);
+        return listing;
     }
 
     Serial.printf("Found %u items in directory %s\n", listing.size(), dirname);
@@ -49,6 +35,7 @@ std::vector<DirListingItem> listDir(const char *dirname)
 bool createDir(const char *path)
 {
     if (SD.mkdir(path)) {
+        invalidateDir(path);
         Serial.printf("Dir %s created\n", path);
         return true;
     }
@@ -59,6 +46,7 @@ bool createDir(const char *path)
 bool removeDir(const char *path)
 {
     if (SD.rmdir(path)) {
+        invalidateDir(path);
         Serial.printf("Dir %s removed\n", path);
         return true;
     }
@@ -66,25 +54,22 @@ bool removeDir(const char *path)
     return false;
 }
 
-uint8_t *readFile(const char *path)
+uint8_t *readFile(const char *path, Allocator &allocator, size_t *size)
 {
-    File file = SD.open(path);
-    if (!file) {
-        Serial.printf("Failed to open file %s for reading\n", path);
+    FileReader reader(STREAM_CHUNK, false);
+    if (!reader.open(path)) {
         return nullptr;
     }
 
-    if (file.isDirectory()) {
-        Serial.printf("File %s is a directory\n", path);
+    uint8_t *buf = (uint8_t *) allocator.allocate(reader.size());
+    if (!buf) {
         return nullptr;
     }
 
-    uint8_t *buf = new uint8_t[file.size()];
-    size_t   len = 0;
-    while (file.available()) {
-        len += file.read(buf + len, file.size());
+    size_t len = reader.read(buf, reader.size());
+    if (size) {
+        *size = len;
     }
-    file.close();
 
     Serial.printf("Read %u bytes from file %s\n", sizeInKbytes(len), path);
     return buf;
@@ -100,6 +85,7 @@ bool writeFile(const char *path, const uint8_t *bytes, size_t size, bool append)
 
     bool success = file.write(bytes, size) == size;
     file.close();
+    invalidateDir(path);
     if (success) {
         Serial.printf("Wrote %u bytes to file %s\n", sizeInKbytes(size), path);
         return true;
@@ -111,6 +97,8 @@ bool writeFile(const char *path, const uint8_t *bytes, size_t size, bool append)
 bool renameFile(const char *path1, const char *path2)
 {
     if (SD.rename(path1, path2)) {
+        invalidateDir(path1);
+        invalidateDir(path2);
         Serial.printf("File renamed to %s\n", path2);
         return true;
     }
@@ -121,6 +109,7 @@ bool renameFile(const char *path1, const char *path2)
 bool deleteFile(const char *path)
 {
     if (SD.remove(path)) {
+        invalidateDir(path);
         Serial.printf("File %s deleted\n", path);
         return true;
     }
@@ -128,33 +117,18 @@ bool deleteFile(const char *path)
     return false;
 }
 
+// Iterative, so deep trees cannot overflow the stack; long deletions
+// belong in a background job, see submitDelete()
 bool deleteItem(String path)
 {
-    File file = SD.open(path);
-    if (!file) {
-        Serial.printf("Failed to open %s\n", path.c_str());
-        return false;
-    }
-
-    if (!file.isDirectory()) {
-        if (SD.remove(path)) {
-            Serial.printf("File %s deleted\n", path.c_str());
-            return true;
-        }
-
-        Serial.printf("Delete failed for %s\n", path.c_str());
-        return true;
-    }
-
-    // Recursively delete all files in the directory
-    auto listing = listDir(path.c_str());
-    bool success = true;
-    for (auto &item : listing) {
-        if (!deleteItem(path + "/" + item.name))
-            success = false;
-    }
-
-    return success && removeDir(path.c_str());
+    TreeProgress progress;
+    bool         success = removeTree(path.c_str(), false, nullptr, progress);
+    invalidateDir(path.c_str());
+
+    Serial.printf("Deleted %u entries of %s, %u failed\n",
+            (unsigned) progress.removed, path.c_str(),
+            (unsigned) progress.errors);
+    return success;
 }
 
 void testFileIO(const char *path)
@@ -219,21 +193,29 @@ void testSD()
     Serial.printf("Used space: %uMB\n", sizeInMbytes(SD.usedBytes()));
 }
 
-void setupSD()
+bool setupSD()
 {
     Serial.println("Initializing SD card...");
 
+    // A card that is still powering up fails the first try, retry briefly
+    // instead of waiting a fixed second every boot
     sdSPI.begin(SD_SCK, SD_MISO, SD_MOSI, SD_CS);
-    delay(1000);
-    if (!SD.begin(SD_CS, sdSPI)) {
+    bool mounted = false;
+    for (int attempt = 0; !mounted && attempt < SD_MOUNT_TRIES; ++attempt) {
+        if (attempt) {
+            delay(100);
+        }
+        mounted = SD.begin(SD_CS, sdSPI);
+    }
+    if (!mounted) {
         Serial.println("Card Mount Failed");
-        return;
+        return false;
     }
 
     uint8_t cardType = SD.cardType();
     if (cardType == CARD_NONE) {
         Serial.println("No SD card attached");
-        return;
+        return false;
     }
 
     Serial.print("SD Card Type: ");
@@ -254,4 +236,5 @@ void setupSD()
     Serial.printf(
             "SD Card Total Space: %u KB\n", sizeInKbytes(SD.totalBytes()));
     Serial.printf("SD Card Used Space: %u KB\n", sizeInKbytes(SD.usedBytes()));
+    return true;
 }
\ No newline at end of file
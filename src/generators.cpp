@@ -0,0 +1,406 @@
+// ====================================================== //
+// ========= Procedural scanline generators ============= //
+// ====================================================== //
+
+#include "generators.h"
+#include "affine.h"
+#include "compositor.h"
+#include "rle.h"
+#include "playlist.h"
+#include "metrics.h"
+#include "report.h"
+
+#include <cstring>
+
+// ─── Fixed Point Trigonometry ───────────────────────────────────────────
+
+constexpr double pi = 3.14159265358979323846;
+
+// Taylor series, good to well below 8-bit precision on [-pi, pi]
+constexpr double taylorSin(double x)
+{
+    double term = x, sum = x;
+    for (int n = 1; n < 12; ++n) {
+        term *= -x * x / ((2 * n) * (2 * n + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+// One full period in 256 steps, amplitude 127
+struct SineTable
+{
+    int8_t values[256]{};
+
+    constexpr SineTable()
+    {
+        for (int i = 0; i < 256; ++i) {
+            double s  = taylorSin((i < 128 ? i : i - 256) * pi / 128.0);
+            values[i] = (int8_t) (s * 127.0 + (s < 0 ? -0.5 : 0.5));
+        }
+    }
+};
+
+// Smooth cyclic palette used by the plasma
+struct PlasmaPalette
+{
+    Color colors[256]{};
+
+    constexpr PlasmaPalette()
+    {
+        SineTable sine;
+        for (int i = 0; i < 256; ++i) {
+            colors[i].r = 128 + sine.values[i & 0xff];
+            colors[i].g = 128 + sine.values[(i + 85) & 0xff];
+            colors[i].b = 128 + sine.values[(i + 170) & 0xff];
+        }
+    }
+};
+
+constexpr SineTable     sineTable;
+constexpr PlasmaPalette plasmaPalette;
+
+static inline int sin8(unsigned phase)
+{
+    return sineTable.values[phase & 0xff];
+}
+
+// Fills columns [from, to) of a line that holds every step-th column
+static inline void fillRun(Color *line, int from, int to, Color c, int step)
+{
+    for (int i = (from + step - 1) / step; i * step < to; ++i)
+        line[i] = c;
+}
+
+// ─── Generators ─────────────────────────────────────────────────────────
+
+static void gradient(Color *line, int y, int width, int height,
+        uint32_t frame, int step)
+{
+    // 16.16 fixed point slope, rounded up so that the last column maps to
+    // 255 rather than falling just short of it
+    const uint32_t span  = width > 1 ? width - 1 : 1;
+    const uint32_t slope = ((255u << 16) + span - 1) / span;
+    const uint8_t  g     = y * 255 / (height > 1 ? height - 1 : 1);
+    uint32_t       acc   = 0;
+    for (int i = 0; i * step < width; ++i, acc += slope * step) {
+        uint8_t r = acc >> 16;
+        line[i]   = Color{ r, g, (unsigned char) (255 - r) };
+    }
+}
+
+static void checkerboard(Color *line, int y, int width, int height,
+        uint32_t frame, int step)
+{
+    // 32 pixel squares scrolling diagonally, one pixel per frame
+    const Color    colors[2] = { { 0, 0, 0 }, { 255, 255, 255 } };
+    const uint32_t row       = (y + frame) >> 5;
+    for (int i = 0, x = 0; x < width; ++i, x += step)
+        line[i] = colors[(((x + frame) >> 5) ^ row) & 1];
+}
+
+static void plasma(Color *line, int y, int width, int height, uint32_t frame,
+        int step)
+{
+    const unsigned t     = frame * 2;
+    const int      lineV = sin8(y + t) + sin8((y >> 1) - t);
+    for (int i = 0, x = 0; x < width; ++i, x += step) {
+        int v   = lineV + sin8(x + t) + sin8((x + y + t) >> 1);
+        line[i] = plasmaPalette.colors[(v >> 2) & 0xff];
+    }
+}
+
+static void noise(Color *line, int y, int width, int height, uint32_t frame,
+        int step)
+{
+    // Hashed per pixel rather than a running xorshift, so that skipped
+    // columns cost nothing
+    const uint32_t seed = (y + 1) * 0x9e3779b9u ^ (frame + 1) * 0x85ebca6bu;
+    for (int i = 0, x = 0; x < width; ++i, x += step) {
+        uint32_t h = seed ^ (x + 1) * 0xc2b2ae35u;
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        unsigned char v = h >> 24;
+        line[i]         = Color{ v, v, v };
+    }
+}
+
+static void smpteBars(Color *line, int y, int width, int height,
+        uint32_t frame, int step)
+{
+    // SMPTE ECR 1-1978 layout with 75% bars
+    static const Color bars[7]    = { { 191, 191, 191 }, { 191, 191, 0 },
+           { 0, 191, 191 }, { 0, 191, 0 }, { 191, 0, 191 }, { 191, 0, 0 },
+           { 0, 0, 191 } };
+    static const Color castles[7] = { { 0, 0, 191 }, { 19, 19, 19 },
+           { 191, 0, 191 }, { 19, 19, 19 }, { 0, 191, 191 }, { 19, 19, 19 },
+           { 191, 191, 191 } };
+
+    if (y < height * 2 / 3) {
+        for (int i = 0; i < 7; ++i)
+            fillRun(line, i * width / 7, (i + 1) * width / 7, bars[i], step);
+        return;
+    }
+
+    if (y < height * 3 / 4) {
+        for (int i = 0; i < 7; ++i) {
+            fillRun(line, i * width / 7, (i + 1) * width / 7, castles[i],
+                    step);
+        }
+        return;
+    }
+
+    // -I, white, +Q, black, then the PLUGE steps and black
+    const int bar = width / 7;
+    fillRun(line, 0, bar * 5 / 4, Color{ 0, 33, 76 }, step);
+    fillRun(line, bar * 5 / 4, bar * 5 / 2, Color{ 255, 255, 255 }, step);
+    fillRun(line, bar * 5 / 2, bar * 15 / 4, Color{ 50, 0, 106 }, step);
+    fillRun(line, bar * 15 / 4, bar * 5, Color{ 19, 19, 19 }, step);
+    fillRun(line, bar * 5, bar * 16 / 3, Color{ 9, 9, 9 }, step);
+    fillRun(line, bar * 16 / 3, bar * 17 / 3, Color{ 19, 19, 19 }, step);
+    fillRun(line, bar * 17 / 3, bar * 6, Color{ 29, 29, 29 }, step);
+    fillRun(line, bar * 6, width, Color{ 19, 19, 19 }, step);
+}
+
+static void crosshatch(Color *line, int y, int width, int height,
+        uint32_t frame, int step)
+{
+    // 16 cells across with square cells and a closed border
+    const Color black = { 0, 0, 0 };
+    const Color white = { 255, 255, 255 };
+    const int   cell  = width / 16 > 0 ? width / 16 : 1;
+
+    if (y % cell == 0 || y == height - 1) {
+        fillRun(line, 0, width, white, step);
+        return;
+    }
+
+    // A sample lands on a vertical only where the step hits it exactly
+    fillRun(line, 0, width, black, step);
+    for (int x = 0; x < width; x += cell) {
+        if (x % step == 0)
+            line[x / step] = white;
+    }
+    if ((width - 1) % step == 0)
+        line[(width - 1) / step] = white;
+}
+
+// ─── Registry ───────────────────────────────────────────────────────────
+
+const Generator generators[] = {
+    { "gradient", gradient },
+    { "checkerboard", checkerboard },
+    { "plasma", plasma },
+    { "noise", noise },
+    { "smpte", smpteBars },
+    { "crosshatch", crosshatch },
+    { "affine", affineLine },
+    { "layers", compositeLine },
+    { "rle", rleLine },
+    { "transition", transitionLine },
+};
+const size_t generatorCount = sizeof(generators) / sizeof(generators[0]);
+
+const Generator *findGenerator(const char *name)
+{
+    for (size_t i = 0; i < generatorCount; ++i) {
+        if (!strcmp(generators[i].name, name)) {
+            return &generators[i];
+        }
+    }
+    return nullptr;
+}
+
+bool selectGenerator(const char *name)
+{
+    // "none" goes back to scanning out the image
+    if (!strcmp(name, "none")) {
+        scanoutGenerator = nullptr;
+        return true;
+    }
+
+    const Generator *generator = findGenerator(name);
+    if (!generator) {
+        report("Unknown generator %s\n", name);
+        return false;
+    }
+
+    scanLineY        = -1;
+    scanoutGenerator = generator->fill;
+    report("Generator %s selected\n", name);
+    return true;
+}
+
+const char *activeGeneratorName()
+{
+    for (size_t i = 0; i < generatorCount; ++i) {
+        if (generators[i].fill == scanoutGenerator) {
+            return generators[i].name;
+        }
+    }
+    return "none";
+}
+
+static bool isColor(Color c, unsigned char r, unsigned char g, unsigned char b)
+{
+    return c.r == r && c.g == g && c.b == b;
+}
+
+// What each generator draws at full resolution
+static bool testPatterns()
+{
+    static Color line[SCANLINE_MAX], other[SCANLINE_MAX];
+    const int    width  = SCANLINE_MAX;
+    const int    height = 480;
+    bool         ok     = true;
+
+    // The gradient runs from blue to red across every line and from no
+    // green at the top to full green at the bottom
+    const int rows[] = { 0, height / 3, height - 1 };
+    for (int y : rows) {
+        gradient(line, y, width, height, 0, 1);
+        const unsigned char g = y * 255 / (height - 1);
+        bool                same = true;
+        for (int x = 0; x < width; ++x)
+            same &= line[x].r + line[x].b == 255 && line[x].g == g;
+        ok &= check(same, "gradient channels", y);
+        ok &= check(isColor(line[0], 0, g, 255), "gradient left", y);
+        ok &= check(isColor(line[width - 1], 255, g, 0), "gradient right", y);
+    }
+
+    // The checkerboard moves one pixel down and right each frame
+    const uint32_t frames[] = { 0, 7, 31, 32, 1000 };
+    for (uint32_t frame : frames) {
+        for (int y = 0; y < height - 1; y += 13) {
+            checkerboard(line, y, width, height, frame + 1, 1);
+            checkerboard(other, y + 1, width, height, frame, 1);
+            ok &= check(!memcmp(line, other + 1, (width - 1) * sizeof(Color)),
+                    "checkerboard scroll", y);
+        }
+    }
+
+    // Noise is grey, the same for the same line and frame, and new in the
+    // next frame
+    noise(line, 5, width, height, 9, 1);
+    noise(other, 5, width, height, 9, 1);
+    ok &= check(!memcmp(line, other, sizeof(line)), "noise repeats", 5);
+    bool grey = true;
+    for (int x = 0; x < width; ++x)
+        grey &= line[x].r == line[x].g && line[x].g == line[x].b;
+    ok &= check(grey, "noise grey", 5);
+    noise(other, 5, width, height, 10, 1);
+    ok &= check(memcmp(line, other, sizeof(line)), "noise changes", 5);
+
+    // The bars start at 75% grey and end at 75% blue
+    smpteBars(line, 0, width, height, 0, 1);
+    ok &= check(isColor(line[0], 191, 191, 191), "smpte first bar", 0);
+    ok &= check(isColor(line[width - 1], 0, 0, 191), "smpte last bar", 0);
+
+    // The crosshatch has a white top row, and white columns at the left
+    // edge, every cell and the right edge
+    const int cell = width / 16;
+    crosshatch(line, 0, width, height, 0, 1);
+    bool white = true;
+    for (int x = 0; x < width; ++x)
+        white &= isColor(line[x], 255, 255, 255);
+    ok &= check(white, "crosshatch top row", 0);
+    crosshatch(line, 1, width, height, 0, 1);
+    ok &= check(isColor(line[0], 255, 255, 255)
+                        && isColor(line[cell], 255, 255, 255)
+                        && isColor(line[width - 1], 255, 255, 255),
+            "crosshatch columns", 1);
+    ok &= check(isColor(line[1], 0, 0, 0), "crosshatch cell", 1);
+    return ok;
+}
+
+bool testGenerators()
+{
+    bool ok = testPatterns();
+
+    // Every generator, sampled as scanout asks, gives the pixels a full
+    // line has at multiples of SCAN_STEP; the ones that scan out state
+    // get a blocky card, a second card to cross to and its run-length
+    // encoding, and a width that is no multiple of the step
+    Allocator &heap = heapAllocator(MemoryRegion::Internal);
+    Image      card(97, 61, heap);
+    Image      other(97, 61, heap);
+    for (int y = 0; y < card.yres; ++y) {
+        for (int x = 0; x < card.xres; ++x) {
+            card.set(x, y,
+                    Color{ (uint8_t) (x / 5 * 13), (uint8_t) (y / 3 * 11),
+                        (uint8_t) ((x ^ y) & 0xe0) });
+            other.set(x, y, Color{ (uint8_t) (y * 4), 0, (uint8_t) x });
+        }
+    }
+    RleImage rle(card.xres, card.yres, 8192);
+    ok &= check(rle.encode(card.view()), "encode");
+
+    const AffineLayer savedAffine = affineLayer;
+    Layer             savedLayers[MAX_LAYERS];
+    memcpy(savedLayers, layers, sizeof(layers));
+    RleImage *const savedRle = rleFrame;
+
+    affineLayer = { &card, affineRotateZoom(0.4, 0.8, 20, 10, 50, 30),
+        AffineEdge::Wrap, affinePerspective };
+    memset(layers, 0, sizeof(layers));
+    layers[0] = { &card, 255, nullptr, MaskFormat::None, true };
+    layers[1] = { &other, 100, nullptr, MaskFormat::None, true };
+    rleFrame  = &rle;
+
+    static Color     full[SCANLINE_MAX], sampled[SCANLINE_MAX / SCAN_STEP];
+    const int        widths[] = { SCANLINE_MAX, card.xres + 4 };
+    const int        height   = 480;
+    const uint32_t   frame    = 3;
+    const Transition kinds[]  = { Transition::Crossfade, Transition::Wipe };
+    for (Transition kind : kinds) {
+        beginTransition(&card, &other, kind, 0, 8);
+        for (size_t g = 0; g < generatorCount; ++g) {
+            for (int width : widths) {
+                for (int y = 0; y < height; y += 3) {
+                    generators[g].fill(full, y, width, height, frame, 1);
+                    generators[g].fill(
+                            sampled, y, width, height, frame, SCAN_STEP);
+                    bool same = true;
+                    for (int i = 0; i * SCAN_STEP < width; ++i) {
+                        same &= !memcmp(&sampled[i], &full[i * SCAN_STEP],
+                                sizeof(Color));
+                    }
+                    ok &= check(same, generators[g].name, y);
+                }
+            }
+        }
+    }
+
+    // The images go with this test, so nothing may keep them
+    beginTransition(nullptr, nullptr, Transition::Crossfade, 0, 0);
+    rleFrame    = savedRle;
+    affineLayer = savedAffine;
+    memcpy(layers, savedLayers, sizeof(layers));
+
+    report("Generator tests %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+void benchmarkGenerators(const VGAMode &mode)
+{
+    // Cycles on the device; on the host, nanoseconds of a faster CPU, so
+    // only the ratios between generators carry over. Lines are sampled as
+    // scanout asks for them, every SCAN_STEP-th pixel
+    static Color   line[SCANLINE_MAX / SCAN_STEP];
+    const int      width  = mode.xres < SCANLINE_MAX ? mode.xres : SCANLINE_MAX;
+    const char    *unit   = METRICS_CYCLE_HZ == 1e9 ? "ns" : "cycles";
+    const uint32_t budget = mode.vLine * (METRICS_CYCLE_HZ / 1e3);
+
+    report("Line period: %u %s\n", budget, unit);
+    for (size_t i = 0; i < generatorCount; ++i) {
+        uint32_t start = cycleCount();
+        for (int y = 0; y < mode.yres; ++y) {
+            generators[i].fill(line, y, width, mode.yres, 0, SCAN_STEP);
+        }
+        uint32_t perLine = (cycleCount() - start) / mode.yres;
+
+        report("%-12s %7u %s/line (%3u%% of line period)\n",
+                generators[i].name, perLine, unit, perLine * 100 / budget);
+    }
+}
@@ -0,0 +1,182 @@
+// ====================================================== //
+// =========== Hardware access of the scanout =========== //
+// ====================================================== //
+
+#include "hal.h"
+
+// The board's accesses are inline in hal.h; this is the simulated machine
+// of the native build
+#ifndef ARDUINO
+
+#define HAL_TIMERS 4
+
+struct HalTimer
+{
+    bool     running;
+    uint64_t zeroAt;  // ns when the count was 0
+    uint64_t alarm;   // in ticks, 0 for none
+    void (*isr)();
+    bool     pending;    // alarm reached, handler not run yet
+    uint64_t pendingAt;  // ns of that alarm
+};
+
+static const uint64_t tickNs = 1000000000 / HAL_TIMER_HZ;
+
+static HalTimer   timers[HAL_TIMERS];
+static HalCosts   costs;
+static HalPinSink sink;
+static uint64_t   now;
+static uint64_t   levels;
+static bool       inIsr;
+
+// Raises the alarms that are due. The count starts over at the alarm, and
+// periods that passed whole while one was pending raise nothing more, as
+// the interrupt status bit on the board stays set until it is handled.
+static void raise()
+{
+    for (HalTimer &timer : timers) {
+        if (!timer.running || !timer.isr || !timer.alarm) {
+            continue;
+        }
+        const uint64_t period = timer.alarm * tickNs;
+        if (timer.zeroAt + period > now) {
+            continue;
+        }
+        const uint64_t passed = (now - timer.zeroAt) / period * period;
+        if (!timer.pending) {
+            timer.pending   = true;
+            timer.pendingAt = timer.zeroAt + period;
+        }
+        timer.zeroAt += passed;
+    }
+}
+
+// Runs the handlers of the raised alarms, earliest first
+static void interrupts()
+{
+    raise();
+    if (inIsr) {
+        return;
+    }
+    for (;;) {
+        HalTimer *due = nullptr;
+        for (HalTimer &timer : timers) {
+            if (timer.pending && (!due || timer.pendingAt < due->pendingAt)) {
+                due = &timer;
+            }
+        }
+        if (!due) {
+            return;
+        }
+        due->pending = false;
+        inIsr        = true;
+        due->isr();
+        inIsr = false;
+        raise();
+    }
+}
+
+static void spend(uint32_t ns)
+{
+    now += ns;
+    interrupts();
+}
+
+static void output(uint64_t next, uint32_t cost)
+{
+    if (next != levels) {
+        levels = next;
+        if (sink) {
+            sink(now, levels);
+        }
+    }
+    spend(cost);
+}
+
+void halGpioSet(uint64_t mask)
+{
+    output(levels | mask, costs.gpioWrite);
+}
+
+void halGpioClear(uint64_t mask)
+{
+    output(levels & ~mask, costs.gpioWrite);
+}
+
+void halPinOutput(int pin)
+{
+}
+
+void halPinWrite(int pin, bool high)
+{
+    const uint64_t bit = 1ull << pin;
+    output(high ? levels | bit : levels & ~bit, costs.pinWrite);
+}
+
+HalTimer *halTimerBegin(int number)
+{
+    HalTimer &timer = timers[number % HAL_TIMERS];
+    timer           = HalTimer{ true, now, 0, nullptr, false, 0 };
+    return &timer;
+}
+
+void halTimerAlarm(HalTimer *timer, void (*isr)(), uint64_t ticks)
+{
+    timer->isr   = isr;
+    timer->alarm = ticks;
+}
+
+uint64_t halTimerRead(HalTimer *timer)
+{
+    // Read first: an interrupt can come between the read and its use
+    const uint64_t ticks = (now - timer->zeroAt) / tickNs;
+    spend(costs.timerRead);
+    return ticks;
+}
+
+void halTimerWrite(HalTimer *timer, uint64_t ticks)
+{
+    timer->zeroAt = now - ticks * tickNs;
+}
+
+void halTimerRestart(HalTimer *timer)
+{
+    timer->zeroAt = now;
+}
+
+void halSimReset(const HalCosts &next)
+{
+    costs  = next;
+    now    = 0;
+    levels = 0;
+    inIsr  = false;
+    for (HalTimer &timer : timers) {
+        timer.zeroAt  = 0;
+        timer.pending = false;
+    }
+}
+
+void halSimSink(HalPinSink next)
+{
+    sink = next;
+}
+
+uint64_t halSimNow()
+{
+    return now;
+}
+
+void halSimRun(void (*loop)(), uint64_t ns)
+{
+    const uint64_t end = now + ns;
+    interrupts();
+    while (now < end) {
+        const uint64_t before = now;
+        loop();
+        if (now == before) {
+            spend(1);  // a loop that touches no hardware still takes time
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,454 @@
+// ====================================================== //
+// ========== HTTP ranges and cache validators ========== //
+// ====================================================== //
+
+#include "http.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctype.h>
+#include <string>
+#include <vector>
+
+#include "report.h"
+#include "stream.h"
+
+void makeValidators(Validators &out, size_t size, time_t modified)
+{
+    snprintf(out.etag, sizeof(out.etag), "\"%lx-%lx\"",
+            (unsigned long) modified, (unsigned long) size);
+
+    struct tm utc;
+    gmtime_r(&modified, &utc);
+    strftime(out.lastModified, sizeof(out.lastModified),
+            "%a, %d %b %Y %H:%M:%S GMT", &utc);
+}
+
+// Reads a decimal number, returning false on anything else
+static bool parseNumber(const char *&p, size_t &value)
+{
+    if (!isdigit((unsigned char) *p)) {
+        return false;
+    }
+    char *end;
+    value = strtoul(p, &end, 10);
+    p     = end;
+    return true;
+}
+
+// Only single ranges are served; a header this cannot parse, or one
+// asking for several ranges, is ignored and the whole file is sent
+int parseRange(const char *header, size_t size, ByteRange &range)
+{
+    if (!header || strncmp(header, "bytes=", 6) != 0) {
+        return 200;
+    }
+    const char *p = header + 6;
+    while (*p == ' ')
+        ++p;
+
+    size_t first, last;
+    if (*p == '-') {
+        // Suffix: the last N bytes
+        ++p;
+        size_t suffix;
+        if (!parseNumber(p, suffix) || *p) {
+            return 200;
+        }
+        if (!suffix || !size) {
+            return 416;
+        }
+        first = suffix < size ? size - suffix : 0;
+        last  = size - 1;
+    }
+    else {
+        if (!parseNumber(p, first) || *p++ != '-') {
+            return 200;
+        }
+        const bool open = !*p;
+        if (!open && (!parseNumber(p, last) || *p || last < first)) {
+            return 200;
+        }
+        if (first >= size) {
+            return 416;
+        }
+        if (open || last >= size) {
+            last = size - 1;
+        }
+    }
+
+    range = ByteRange{ first, last };
+    return 206;
+}
+
+bool ifRangeMatches(const char *ifRange, const Validators &validators)
+{
+    // An ETag must match strongly, a date exactly
+    if (!ifRange || !*ifRange) {
+        return true;
+    }
+    if (ifRange[0] == '"') {
+        return strcmp(ifRange, validators.etag) == 0;
+    }
+    return strcmp(ifRange, validators.lastModified) == 0;
+}
+
+// Weak comparison over a comma separated list, as If-None-Match asks
+bool etagListMatches(const char *list, const char *etag)
+{
+    const size_t length = strlen(etag);
+    for (const char *p = list; *p;) {
+        while (*p == ' ' || *p == ',')
+            ++p;
+        if (*p == '*') {
+            return true;
+        }
+        if (p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        if (strncmp(p, etag, length) == 0
+                && (p[length] == ',' || p[length] == ' ' || !p[length])) {
+            return true;
+        }
+        while (*p && *p != ',')
+            ++p;
+    }
+    return false;
+}
+
+int revalidate(const char *etag, const char *ifNoneMatch)
+{
+    if (ifNoneMatch && *ifNoneMatch && etagListMatches(ifNoneMatch, etag)) {
+        return 304;
+    }
+    return 200;
+}
+
+DownloadPlan planDownload(size_t size, const Validators &validators,
+        const char *range, const char *ifRange, const char *ifNoneMatch)
+{
+    DownloadPlan plan{ 200, ByteRange{ 0, size ? size - 1 : 0 }, size };
+
+    if (revalidate(validators.etag, ifNoneMatch) == 304) {
+        plan.status = 304;
+        plan.length = 0;
+        return plan;
+    }
+
+    // A stale If-Range means the client's part belongs to another
+    // version, so it gets the whole new file instead
+    if (!range || !*range || !ifRangeMatches(ifRange, validators)) {
+        return plan;
+    }
+
+    ByteRange requested;
+    switch (parseRange(range, size, requested)) {
+        case 206:
+            plan.status = 206;
+            plan.range  = requested;
+            plan.length = requested.last - requested.first + 1;
+            break;
+        case 416:
+            plan.status = 416;
+            plan.length = 0;
+            break;
+    }
+    return plan;
+}
+
+// ─── Chunked Writer ─────────────────────────────────────────────────────
+
+ChunkedWriter::ChunkedWriter(ChunkSink sink) : sink(sink)
+{
+}
+
+ChunkedWriter::~ChunkedWriter()
+{
+    flush();
+}
+
+void ChunkedWriter::write(const char *data, size_t size)
+{
+    total += size;
+
+    // Whole chunks' worth go straight through instead of being copied
+    if (size >= CHUNK_BUFFER) {
+        flush();
+        sink(data, size);
+        return;
+    }
+    while (size) {
+        size_t n = CHUNK_BUFFER - used;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(buf + used, data, n);
+        used += n;
+        data += n;
+        size -= n;
+        if (used == CHUNK_BUFFER) {
+            flush();
+        }
+    }
+}
+
+void ChunkedWriter::print(const char *text)
+{
+    write(text, strlen(text));
+}
+
+void ChunkedWriter::print(unsigned long value)
+{
+    char digits[24];
+    write(digits, snprintf(digits, sizeof(digits), "%lu", value));
+}
+
+// Quotes `text`, escaping what JSON does not allow in a string
+void ChunkedWriter::printJsonString(const char *text)
+{
+    write("\"", 1);
+    for (const char *p = text; *p; ++p) {
+        const unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            const char escaped[2] = { '\\', (char) c };
+            write(escaped, 2);
+        }
+        else if (c < 0x20) {
+            char escaped[8];
+            write(escaped, snprintf(escaped, sizeof(escaped), "\\u%04x", c));
+        }
+        else {
+            write(p, 1);
+        }
+    }
+    write("\"", 1);
+}
+
+// Empty chunks are never passed on, as they end a chunked response
+void ChunkedWriter::flush()
+{
+    if (used) {
+        sink(buf, used);
+        used = 0;
+    }
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static uint8_t patternByte(size_t offset)
+{
+    return (offset * 29 + (offset >> 9)) & 0xff;
+}
+
+static bool writePattern(const char *path, size_t size)
+{
+    uint8_t buf[256];
+#ifdef ARDUINO
+    File file = SD.open(path, FILE_WRITE);
+#else
+    FILE *file = fopen(path, "wb");
+#endif
+    if (!file) {
+        return false;
+    }
+
+    for (size_t offset = 0; offset < size; offset += sizeof(buf)) {
+        size_t n = size - offset < sizeof(buf) ? size - offset : sizeof(buf);
+        for (size_t i = 0; i < n; ++i)
+            buf[i] = patternByte(offset + i);
+#ifdef ARDUINO
+        file.write(buf, n);
+#else
+        fwrite(buf, 1, n, file);
+#endif
+    }
+
+#ifdef ARDUINO
+    file.close();
+#else
+    fclose(file);
+#endif
+    return true;
+}
+
+// Streams the planned bytes the way /download does and checks them
+static bool bodyMatches(const char *path, const DownloadPlan &plan)
+{
+    FileReader reader(DOWNLOAD_CHUNK);
+    if (!reader.open(path) || !reader.seek(plan.range.first)) {
+        return false;
+    }
+
+    size_t remaining = plan.length;
+    size_t offset    = plan.range.first;
+    Chunk  chunk;
+    while (remaining && reader.next(chunk)) {
+        size_t n = chunk.size < remaining ? chunk.size : remaining;
+        if (chunk.offset != offset) {
+            return false;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (chunk.data[i] != patternByte(offset + i)) {
+                return false;
+            }
+        }
+        offset += n;
+        remaining -= n;
+    }
+    return remaining == 0;
+}
+
+struct RangeCase
+{
+    const char *range;
+    const char *ifRange;  // "etag" and "date" stand for the current ones
+    int         status;
+    size_t      first;
+    size_t      last;
+};
+
+bool testHttpRanges(const char *dir)
+{
+    const size_t    size    = 3 * DOWNLOAD_CHUNK + 77;
+    const RangeCase cases[] = {
+        { nullptr, nullptr, 200, 0, size - 1 },
+        { "bytes=0-0", nullptr, 206, 0, 0 },
+        { "bytes=100-199", nullptr, 206, 100, 199 },
+        { "bytes=16380-", nullptr, 206, 16380, size - 1 },
+        { "bytes=-500", nullptr, 206, size - 500, size - 1 },
+        { "bytes=-999999", nullptr, 206, 0, size - 1 },
+        { "bytes=40000-999999", nullptr, 206, 40000, size - 1 },
+        { "bytes=0-", nullptr, 206, 0, size - 1 },
+        { "bytes=999999-", nullptr, 416, 0, 0 },
+        { "bytes=-0", nullptr, 416, 0, 0 },
+        { "bytes=5-2", nullptr, 200, 0, size - 1 },
+        { "bytes=0-1,5-6", nullptr, 200, 0, size - 1 },
+        { "items=0-1", nullptr, 200, 0, size - 1 },
+        { "bytes=abc", nullptr, 200, 0, size - 1 },
+        { "bytes=100-199", "etag", 206, 100, 199 },
+        { "bytes=100-199", "date", 206, 100, 199 },
+        { "bytes=100-199", "\"0-0\"", 200, 0, size - 1 },
+        { "bytes=100-199", "Thu, 01 Jan 1970 00:00:00 GMT", 200, 0,
+                size - 1 },
+    };
+
+    char path[96];
+    snprintf(path, sizeof(path), "%s/range.bin", dir);
+    if (!writePattern(path, size)) {
+        report("Could not write %s\n", path);
+        return false;
+    }
+
+    Validators validators;
+    makeValidators(validators, size, 1700000000);
+
+    bool ok = true;
+    for (const RangeCase &c : cases) {
+        const char *ifRange = c.ifRange;
+        if (ifRange && !strcmp(ifRange, "etag")) {
+            ifRange = validators.etag;
+        }
+        else if (ifRange && !strcmp(ifRange, "date")) {
+            ifRange = validators.lastModified;
+        }
+
+        DownloadPlan plan
+                = planDownload(size, validators, c.range, ifRange, nullptr);
+        bool pass = plan.status == c.status;
+        if (pass && plan.status != 416) {
+            pass = plan.range.first == c.first && plan.range.last == c.last
+                   && plan.length == c.last - c.first + 1
+                   && bodyMatches(path, plan);
+        }
+        if (!pass) {
+            report("Range test failed: %s (If-Range %s) gave %d\n",
+                    c.range ? c.range : "none", c.ifRange ? c.ifRange : "none",
+                    plan.status);
+            ok = false;
+        }
+    }
+
+    // Conditional requests against the current validators
+    char list[64];
+    snprintf(list, sizeof(list), "\"x\", W/%s", validators.etag);
+    ok &= planDownload(size, validators, nullptr, nullptr, list).status
+          == 304;
+    ok &= planDownload(size, validators, nullptr, nullptr, "*").status == 304;
+    ok &= planDownload(size, validators, "bytes=0-9", nullptr, "\"stale\"")
+                  .status
+          == 206;
+    ok &= !strcmp(validators.lastModified, "Tue, 14 Nov 2023 22:13:20 GMT");
+
+    // Nothing in an empty file can be asked for
+    ByteRange range;
+    ok &= parseRange("bytes=0-", 0, range) == 416;
+
+    report("HTTP range tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+bool testChunkedWriter()
+{
+    const char         *head = "\"a\\\"b\\\\c\\u000a\",4294967295";
+    const size_t        size = strlen(head) + 2000;
+    std::string         body;
+    std::vector<size_t> chunks;
+    bool                ok = true;
+    {
+        ChunkedWriter out([&](const char *data, size_t n) {
+            body.append(data, n);
+            chunks.push_back(n);
+        });
+        out.printJsonString("a\"b\\c\n");
+        out.write(",", 1);
+        out.print(4294967295ul);
+        for (int i = 0; i < 1000; ++i)
+            out.print("[]");
+        ok &= out.bytes() == size;
+    }
+
+    // Everything arrived once the writer went out of scope
+    ok &= body.size() == size && body.compare(0, strlen(head), head) == 0;
+    ok &= chunks.size() == 2 && chunks[0] == CHUNK_BUFFER;
+
+    report("Chunked writer tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+bool testRevalidate()
+{
+    struct Case
+    {
+        const char *ifNoneMatch;
+        int         status;
+    };
+
+    const char *etag    = "\"3b99a22102fe92de\"";
+    const Case  cases[] = {
+        { nullptr, 200 },
+        { "", 200 },
+        { "\"3b99a22102fe92de\"", 304 },
+        { "W/\"3b99a22102fe92de\"", 304 },
+        { "\"0\", \"3b99a22102fe92de\"", 304 },
+        { "\"0\",\"3b99a22102fe92de\" ", 304 },
+        { "*", 304 },
+        { "\"3b99a22102fe92d\"", 200 },
+        { "\"3b99a22102fe92de0\"", 200 },
+        { "3b99a22102fe92de", 200 },
+        { "\"0\", \"1\"", 200 },
+    };
+
+    bool ok = true;
+    for (const Case &c : cases) {
+        const int status = revalidate(etag, c.ifNoneMatch);
+        if (status != c.status) {
+            report("Revalidate test failed: If-None-Match %s gave %d\n",
+                    c.ifNoneMatch ? c.ifNoneMatch : "none", status);
+            ok = false;
+        }
+    }
+
+    report("Revalidate tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
@@ -0,0 +1,1448 @@
+// ====================================================== //
+// ============ Event-driven HTTP/1.1 server ============ //
+// ====================================================== //
+
+#include "httpd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <thread>
+
+#include "report.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static uint32_t nowMillis()
+{
+#ifdef ARDUINO
+    return millis();
+#else
+    return nowMicros() / 1000;
+#endif
+}
+
+// ─── Connections ────────────────────────────────────────────────────────
+
+enum class Phase
+{
+    Head,   // reading the request line and headers
+    Body,   // reading, or skipping, the request body
+    Reply   // sending the answer; further requests wait in the socket
+};
+
+enum class Part
+{
+    Data,      // a part's contents, or the preamble, up to a delimiter
+    Boundary,  // after a delimiter: "--" ends the body, CRLF a part
+    Headers,
+    Done
+};
+
+typedef std::vector<std::pair<std::string, std::string>> Fields;
+
+struct HttpServer::Connection
+{
+    int         fd;
+    Phase       phase = Phase::Head;
+    std::string in;  // received but not consumed
+    std::string out;
+    size_t      outSent{};
+    uint32_t    lastActive;
+    bool        keepAlive{};
+    bool        closeAfter{};
+
+    // The request
+    HttpMethod               method{};
+    std::string              path;
+    Fields                   args;
+    Fields                   headers;
+    std::vector<std::string> pathArgs;
+    const Route             *route{};
+    size_t                   bodyLeft{};
+
+    // Its multipart body
+    bool        multipart{};
+    Part        part{};
+    std::string delimiter;  // CRLF, "--" and the boundary
+    std::string pending;    // what might still be the start of one
+    bool        inFile{};
+    HttpUpload  upload{};
+
+    // The answer
+    Fields     replyHeaders;
+    bool       replied{};
+    BodyWriter writer;
+    bool       chunked{};
+    size_t     streamLeft{};  // of a body with a known length
+};
+
+static const std::string none;
+
+static bool setNonBlocking(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static bool wouldBlock()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static const char *reasonPhrase(int status)
+{
+    switch (status) {
+        case 100:
+            return "Continue";
+        case 200:
+            return "OK";
+        case 202:
+            return "Accepted";
+        case 204:
+            return "No Content";
+        case 206:
+            return "Partial Content";
+        case 304:
+            return "Not Modified";
+        case 400:
+            return "Bad Request";
+        case 403:
+            return "Forbidden";
+        case 404:
+            return "Not Found";
+        case 409:
+            return "Conflict";
+        case 416:
+            return "Range Not Satisfiable";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 500:
+            return "Internal Server Error";
+        case 501:
+            return "Not Implemented";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "";
+    }
+}
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Percent escapes, and in a query "+" for a space
+static std::string urlDecode(const char *text, size_t size, bool query)
+{
+    std::string out;
+    out.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        int high, low;
+        if (text[i] == '%' && i + 2 < size
+                && (high = hexValue(text[i + 1])) >= 0
+                && (low = hexValue(text[i + 2])) >= 0) {
+            out += (char) (high << 4 | low);
+            i += 2;
+        }
+        else {
+            out += query && text[i] == '+' ? ' ' : text[i];
+        }
+    }
+    return out;
+}
+
+static void parseQuery(const char *query, size_t size, Fields &args)
+{
+    const char *end = query + size;
+    for (const char *p = query; p < end;) {
+        const char *amp = std::find(p, end, '&');
+        const char *eq  = std::find(p, amp, '=');
+        if (eq != p) {
+            args.emplace_back(urlDecode(p, eq - p, true),
+                    eq < amp ? urlDecode(eq + 1, amp - eq - 1, true) : "");
+        }
+        p = amp + 1;
+    }
+}
+
+static const std::string *findField(const Fields &fields, const char *name)
+{
+    for (const auto &field : fields) {
+        if (!strcasecmp(field.first.c_str(), name)) {
+            return &field.second;
+        }
+    }
+    return nullptr;
+}
+
+// Value of `name="..."` in a Content-Disposition, not of `filename="..."`
+// when asked for `name`
+static std::string quotedParam(const std::string &block, const char *name)
+{
+    const std::string key = std::string(name) + "=\"";
+    for (size_t at = block.find(key); at != std::string::npos;
+            at = block.find(key, at + 1)) {
+        if (at && isalnum((unsigned char) block[at - 1])) {
+            continue;
+        }
+        const size_t start = at + key.size();
+        const size_t end   = block.find('"', start);
+        return block.substr(start, end == std::string::npos ? 0 : end - start);
+    }
+    return "";
+}
+
+// ─── Server ─────────────────────────────────────────────────────────────
+
+HttpServer::HttpServer(uint16_t port) : listenPort(port) {}
+
+HttpServer::~HttpServer()
+{
+    end();
+}
+
+void HttpServer::on(const char *pattern, HttpMethod method,
+        HttpHandler handler, HttpHandler upload)
+{
+    routes.push_back({ pattern, method, handler, upload });
+}
+
+void HttpServer::onNotFound(HttpHandler handler)
+{
+    notFound = handler;
+}
+
+bool HttpServer::begin()
+{
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        report("HTTP server: no socket (%d)\n", errno);
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(listenPort);
+    socklen_t length     = sizeof(addr);
+    if (bind(listener, (sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(listener, HTTPD_MAX_CLIENTS) < 0
+            || !setNonBlocking(listener)
+            || getsockname(listener, (sockaddr *) &addr, &length) < 0) {
+        report("HTTP server: cannot listen on port %u (%d)\n",
+                (unsigned) listenPort, errno);
+        ::close(listener);
+        listener = -1;
+        return false;
+    }
+    listenPort = ntohs(addr.sin_port);
+    return true;
+}
+
+void HttpServer::end()
+{
+    for (auto &client : clients) {
+        if (client) {
+            close(client);
+        }
+    }
+    if (listener >= 0) {
+        ::close(listener);
+        listener = -1;
+    }
+}
+
+uint16_t HttpServer::port() const
+{
+    return listenPort;
+}
+
+void HttpServer::acceptClients()
+{
+    for (auto &client : clients) {
+        if (client) {
+            continue;
+        }
+        const int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            return;
+        }
+
+        // Answers are small and go out whole, so Nagle would only delay
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (!setNonBlocking(fd)) {
+            ::close(fd);
+            continue;
+        }
+
+        client.reset(new Connection);
+        client->fd         = fd;
+        client->lastActive = nowMillis();
+        ++stats.accepted;
+        ++stats.active;
+    }
+}
+
+void HttpServer::close(std::unique_ptr<Connection> &client)
+{
+    if (client->inFile) {
+        emitUpload(*client, UploadStatus::Aborted, nullptr, 0);
+    }
+    ::close(client->fd);
+    client.reset();
+    --stats.active;
+}
+
+void HttpServer::poll(uint32_t timeoutMs)
+{
+    if (listener < 0) {
+        return;
+    }
+
+    fd_set readable, writable;
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+    int  maxFd = -1;
+    bool room  = false;
+    for (auto &client : clients) {
+        if (!client) {
+            room = true;
+            continue;
+        }
+        if (client->phase != Phase::Reply && !held(*client)) {
+            FD_SET(client->fd, &readable);
+        }
+        if (client->outSent < client->out.size() || client->writer) {
+            FD_SET(client->fd, &writable);
+        }
+        maxFd = std::max(maxFd, client->fd);
+    }
+
+    // With every slot busy, new clients wait in the listen backlog
+    if (room) {
+        FD_SET(listener, &readable);
+        maxFd = std::max(maxFd, listener);
+    }
+
+    timeval timeout;
+    timeout.tv_sec  = timeoutMs / 1000;
+    timeout.tv_usec = timeoutMs % 1000 * 1000;
+    if (select(maxFd + 1, &readable, &writable, nullptr, &timeout) < 0) {
+        return;
+    }
+    if (room && FD_ISSET(listener, &readable)) {
+        acceptClients();
+    }
+
+    for (auto &client : clients) {
+        if (!client) {
+            continue;
+        }
+        const int fd = client->fd;
+        if (FD_ISSET(fd, &readable) && !receive(*client)) {
+            close(client);
+            continue;
+        }
+
+        // Whatever the handlers queued goes out right away
+        if ((FD_ISSET(fd, &writable) || client->outSent < client->out.size()
+                    || client->phase == Phase::Reply)
+                && !transmit(*client)) {
+            close(client);
+            continue;
+        }
+
+        if (nowMillis() - client->lastActive > HTTPD_IDLE_MS) {
+            ++stats.timeouts;
+            close(client);
+        }
+    }
+}
+
+// An upload whose handler could not take another read waits, without
+// counting as idle, until its consumer catches up
+bool HttpServer::held(Connection &c)
+{
+    const size_t next = HTTPD_READ_CHUNK + c.pending.size();
+    if (!c.inFile || !c.upload.room || c.upload.room() >= next) {
+        return false;
+    }
+    c.lastActive = nowMillis();
+    return true;
+}
+
+// One read per connection and round, so a fast sender cannot crowd out
+// the others; returns false when the connection is over
+bool HttpServer::receive(Connection &c)
+{
+    char          buf[HTTPD_READ_CHUNK];
+    const ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+    if (n == 0) {
+        return false;
+    }
+    if (n < 0) {
+        return wouldBlock();
+    }
+    c.lastActive = nowMillis();
+    stats.bytesIn += n;
+
+    // Bodies go straight to their consumer, heads are gathered first
+    size_t used = 0;
+    if (c.phase == Phase::Body && c.in.empty()) {
+        used = feedBody(c, buf, n);
+    }
+    c.in.append(buf + used, n - used);
+    return process(c);
+}
+
+bool HttpServer::process(Connection &c)
+{
+    for (;;) {
+        if (c.phase == Phase::Head) {
+            const size_t end = c.in.find("\r\n\r\n");
+            if (end == std::string::npos || end + 4 > HTTPD_HEAD_MAX) {
+                if (c.in.size() > HTTPD_HEAD_MAX) {
+                    reject(c, 431, "Request head too large");
+                }
+                return true;
+            }
+            if (!parseHead(c, end)) {
+                return true;
+            }
+            c.in.erase(0, end + 4);
+            c.phase = Phase::Body;
+        }
+
+        if (c.phase == Phase::Body) {
+            c.in.erase(0, feedBody(c, c.in.data(), c.in.size()));
+            if (c.bodyLeft) {
+                return true;
+            }
+            if (c.inFile) {
+                emitUpload(c, UploadStatus::Aborted, nullptr, 0);
+            }
+            dispatch(c);
+        }
+
+        if (c.phase == Phase::Reply) {
+            return true;
+        }
+    }
+}
+
+bool HttpServer::parseHead(Connection &c, size_t end)
+{
+    static const struct
+    {
+        const char *name;
+        HttpMethod  method;
+    } methods[] = {
+        { "GET", HttpMethod::Get },       { "HEAD", HttpMethod::Head },
+        { "POST", HttpMethod::Post },     { "PUT", HttpMethod::Put },
+        { "DELETE", HttpMethod::Delete },
+    };
+
+    const char *head = c.in.c_str();
+    const char *line = strstr(head, "\r\n");
+    const char *sp1  = (const char *) memchr(head, ' ', line - head);
+    const char *sp2  = sp1 ? (const char *) memchr(sp1 + 1, ' ', line - sp1 - 1)
+                           : nullptr;
+    if (!sp2 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0) {
+        reject(c, 400, "Malformed request line");
+        return false;
+    }
+
+    c.method = HttpMethod::Other;
+    for (const auto &m : methods) {
+        if (strlen(m.name) == (size_t) (sp1 - head)
+                && !strncmp(head, m.name, sp1 - head)) {
+            c.method = m.method;
+        }
+    }
+
+    const char *target = sp1 + 1;
+    const char *query  = (const char *) memchr(target, '?', sp2 - target);
+    c.path = urlDecode(target, (query ? query : sp2) - target, false);
+    c.args.clear();
+    if (query) {
+        parseQuery(query + 1, sp2 - query - 1, c.args);
+    }
+
+    c.headers.clear();
+    for (const char *p = line + 2; p < head + end;) {
+        const char *eol   = strstr(p, "\r\n");
+        const char *colon = (const char *) memchr(p, ':', eol - p);
+        if (colon) {
+            const char *value = colon + 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+                ++value;
+            c.headers.emplace_back(
+                    std::string(p, colon - p), std::string(value, eol - value));
+        }
+        p = eol + 2;
+    }
+
+    // HTTP/1.1 keeps the connection unless told otherwise, 1.0 the reverse
+    const std::string *connection = findField(c.headers, "Connection");
+    if (sp2[8] == '0') {
+        c.keepAlive
+                = connection && !strcasecmp(connection->c_str(), "keep-alive");
+    }
+    else {
+        c.keepAlive = !connection || strcasecmp(connection->c_str(), "close");
+    }
+
+    if (findField(c.headers, "Transfer-Encoding")) {
+        reject(c, 501, "Chunked requests are not supported");
+        return false;
+    }
+    const std::string *length = findField(c.headers, "Content-Length");
+    c.bodyLeft = length ? strtoul(length->c_str(), nullptr, 10) : 0;
+
+    c.route = nullptr;
+    for (const Route &route : routes) {
+        if (match(route, c)) {
+            c.route = &route;
+            break;
+        }
+    }
+
+    // Files in a form go to the route's upload handler piece by piece;
+    // any other body is read and dropped
+    const std::string *type = findField(c.headers, "Content-Type");
+    c.multipart             = false;
+    if (c.route && c.route->upload && type
+            && !strncasecmp(type->c_str(), "multipart/form-data", 19)) {
+        const size_t at = type->find("boundary=");
+        if (at != std::string::npos) {
+            std::string boundary = type->substr(at + 9);
+            boundary = boundary.substr(0, boundary.find(';'));
+            if (boundary.size() > 1 && boundary.front() == '"') {
+                boundary = boundary.substr(1, boundary.size() - 2);
+            }
+            c.multipart = true;
+            c.part      = Part::Data;
+            c.delimiter = "\r\n--" + boundary;
+            c.pending   = "\r\n";  // so the first delimiter matches too
+            c.inFile    = false;
+        }
+    }
+
+    const std::string *expect = findField(c.headers, "Expect");
+    if (expect && !strcasecmp(expect->c_str(), "100-continue")) {
+        c.out += "HTTP/1.1 100 Continue\r\n\r\n";
+    }
+    return true;
+}
+
+bool HttpServer::match(const Route &route, Connection &c) const
+{
+    if (route.method != c.method) {
+        return false;
+    }
+
+    c.pathArgs.clear();
+    const char *p = route.pattern.c_str();
+    const char *u = c.path.c_str();
+    while (*p && *u) {
+        if (p[0] == '{' && p[1] == '}') {
+            const char *end = strchr(u, '/');
+            end             = end ? end : u + strlen(u);
+            if (end == u) {
+                return false;
+            }
+            c.pathArgs.emplace_back(u, end - u);
+            u = end;
+            p += 2;
+        }
+        else if (*p++ != *u++) {
+            return false;
+        }
+    }
+    return !*p && !*u;
+}
+
+// Returns how much of `data` belonged to the body
+size_t HttpServer::feedBody(Connection &c, const char *data, size_t size)
+{
+    const size_t n = std::min(size, c.bodyLeft);
+    if (n && c.multipart) {
+        feedUpload(c, data, n);
+    }
+    c.bodyLeft -= n;
+    return n;
+}
+
+// A delimiter may be split between reads, so its length less one byte
+// is held back until the next read shows whether it was one
+void HttpServer::feedUpload(Connection &c, const char *data, size_t size)
+{
+    std::string &buf  = c.pending;
+    const size_t hold = c.delimiter.size() - 1;
+    size_t       pos  = 0;
+    buf.append(data, size);
+
+    while (c.part != Part::Done) {
+        if (c.part == Part::Data) {
+            const size_t hit = buf.find(c.delimiter, pos);
+            size_t       end = hit;
+            if (hit == std::string::npos) {
+                end = buf.size() > pos + hold ? buf.size() - hold : pos;
+            }
+            if (end > pos && c.inFile) {
+                emitUpload(c, UploadStatus::Write, buf.data() + pos, end - pos);
+            }
+            pos = end;
+            if (hit == std::string::npos) {
+                break;
+            }
+            if (c.inFile) {
+                emitUpload(c, UploadStatus::End, nullptr, 0);
+            }
+            pos += c.delimiter.size();
+            c.part = Part::Boundary;
+        }
+        else if (c.part == Part::Boundary) {
+            while (pos < buf.size() && (buf[pos] == ' ' || buf[pos] == '\t'))
+                ++pos;
+            if (buf.size() - pos < 2) {
+                break;
+            }
+            c.part = buf.compare(pos, 2, "\r\n") ? Part::Done : Part::Headers;
+            pos += 2;
+        }
+        else {
+            const size_t end = buf.compare(pos, 2, "\r\n")
+                                       ? buf.find("\r\n\r\n", pos)
+                                       : pos - 2;
+            if (end == std::string::npos) {
+                if (buf.size() - pos > HTTPD_HEAD_MAX) {
+                    c.part = Part::Done;
+                }
+                break;
+            }
+
+            const std::string block = buf.substr(pos, end + 2 - pos);
+            const std::string file  = quotedParam(block, "filename");
+            pos                     = end + 4;
+            c.part                  = Part::Data;
+            if (!file.empty()) {
+                c.inFile           = true;
+                c.upload.name      = quotedParam(block, "name");
+                c.upload.filename  = file;
+                c.upload.totalSize = 0;
+                emitUpload(c, UploadStatus::Start, nullptr, 0);
+            }
+        }
+    }
+
+    // After the closing delimiter only an epilogue is left to ignore
+    buf.erase(0, c.part == Part::Done ? buf.size() : pos);
+}
+
+void HttpServer::emitUpload(
+        Connection &c, UploadStatus status, const char *data, size_t size)
+{
+    c.upload.status      = status;
+    c.upload.buf         = (const uint8_t *) data;
+    c.upload.currentSize = size;
+    c.upload.totalSize += size;
+    if (status == UploadStatus::End || status == UploadStatus::Aborted) {
+        c.inFile = false;
+    }
+
+    Connection *caller = current;
+    current            = &c;
+    c.route->upload();
+    current = caller;
+}
+
+void HttpServer::dispatch(Connection &c)
+{
+    TRACE_SCOPE(Http, c.route ? c.route->pattern.c_str() : "not found");
+    ++stats.requests;
+    current = &c;
+    if (c.route) {
+        c.route->handler();
+    }
+    else if (notFound) {
+        notFound();
+    }
+    else {
+        send(404, "text/json", "{\"message\":\"Not found\"}");
+    }
+    if (!c.replied) {
+        send(500, "text/json", "{\"message\":\"No answer\"}");
+    }
+    current = nullptr;
+    c.phase = Phase::Reply;
+}
+
+// Errors found before a handler could run end the connection, as the
+// rest of what the client sent cannot be trusted
+void HttpServer::reject(Connection &c, int status, const char *message)
+{
+    ++stats.rejected;
+    c.closeAfter = true;
+    c.phase      = Phase::Reply;
+
+    Connection *caller = current;
+    current            = &c;
+    send(status, "text/json",
+            std::string("{\"message\":\"") + message + "\"}");
+    current = caller;
+}
+
+void HttpServer::startReply(
+        Connection &c, int status, const char *type, size_t length)
+{
+    char line[64];
+    snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status,
+            reasonPhrase(status));
+    c.out += line;
+    if (type) {
+        c.out += "Content-Type: ";
+        c.out += type;
+        c.out += "\r\n";
+    }
+    if (length == HTTPD_UNKNOWN_LENGTH) {
+        c.out += "Transfer-Encoding: chunked\r\n";
+    }
+    else if (status >= 200 && status != 204 && status != 304) {
+        snprintf(line, sizeof(line), "Content-Length: %lu\r\n",
+                (unsigned long) length);
+        c.out += line;
+    }
+    c.out += c.keepAlive && !c.closeAfter ? "Connection: keep-alive\r\n"
+                                          : "Connection: close\r\n";
+    for (const auto &header : c.replyHeaders) {
+        c.out += header.first;
+        c.out += ": ";
+        c.out += header.second;
+        c.out += "\r\n";
+    }
+    c.out += "\r\n";
+    c.replyHeaders.clear();
+    c.replied = true;
+}
+
+// Returns false when the connection is over
+bool HttpServer::transmit(Connection &c)
+{
+    size_t budget = HTTPD_ROUND_BYTES;
+    while (budget) {
+        // Refilled from the body writer only while little is queued
+        while (c.writer && c.out.size() - c.outSent < HTTPD_OUT_LOW) {
+            const size_t before = c.out.size();
+            bool         more;
+            {
+                ChunkedWriter body([&c](const char *data, size_t size) {
+                    if (c.chunked) {
+                        char line[16];
+                        snprintf(line, sizeof(line), "%lx\r\n",
+                                (unsigned long) size);
+                        c.out += line;
+                        c.out.append(data, size);
+                        c.out += "\r\n";
+                        return;
+                    }
+                    size = std::min(size, c.streamLeft);
+                    c.out.append(data, size);
+                    c.streamLeft -= size;
+                });
+                more = c.writer(body);
+            }
+
+            // A body of known length is over once that much was sent
+            if (!more || (!c.chunked && !c.streamLeft)) {
+                c.writer = nullptr;
+                if (c.chunked) {
+                    c.out += "0\r\n\r\n";
+                }
+                else if (c.streamLeft) {
+                    // Fewer bytes than announced: only closing tells
+                    report("HTTP body %lu bytes short\n",
+                            (unsigned long) c.streamLeft);
+                    c.closeAfter = true;
+                }
+            }
+            else if (c.out.size() == before) {
+                break;
+            }
+        }
+
+        const size_t queued = c.out.size() - c.outSent;
+        if (!queued) {
+            break;
+        }
+        const ssize_t n = ::send(
+                c.fd, c.out.data() + c.outSent, queued, MSG_NOSIGNAL);
+        if (n < 0) {
+            return wouldBlock();
+        }
+        c.lastActive = nowMillis();
+        c.outSent += n;
+        stats.bytesOut += n;
+        budget -= std::min(budget, (size_t) n);
+        if (c.outSent == c.out.size()) {
+            c.out.clear();
+            c.outSent = 0;
+        }
+        else if (c.outSent >= HTTPD_OUT_LOW) {
+            c.out.erase(0, c.outSent);
+            c.outSent = 0;
+        }
+    }
+
+    if (c.phase != Phase::Reply || c.writer || c.outSent < c.out.size()) {
+        return true;
+    }
+    if (!c.keepAlive || c.closeAfter) {
+        return false;
+    }
+    finishReply(c);
+    return process(c);
+}
+
+// Ready for the next request on the same connection
+void HttpServer::finishReply(Connection &c)
+{
+    c.phase     = Phase::Head;
+    c.replied   = false;
+    c.route     = nullptr;
+    c.multipart = false;
+    c.pending.clear();
+    c.replyHeaders.clear();
+    c.upload = HttpUpload{};
+}
+
+// ─── The Request Being Handled ──────────────────────────────────────────
+
+HttpMethod HttpServer::method() const
+{
+    return current ? current->method : HttpMethod::Other;
+}
+
+const std::string &HttpServer::uri() const
+{
+    return current ? current->path : none;
+}
+
+bool HttpServer::hasArg(const char *name) const
+{
+    return current && findField(current->args, name);
+}
+
+const std::string &HttpServer::arg(const char *name) const
+{
+    const std::string *value = current ? findField(current->args, name)
+                                       : nullptr;
+    return value ? *value : none;
+}
+
+const std::string &HttpServer::pathArg(size_t index) const
+{
+    return current && index < current->pathArgs.size()
+                   ? current->pathArgs[index]
+                   : none;
+}
+
+const std::string &HttpServer::header(const char *name) const
+{
+    const std::string *value = current ? findField(current->headers, name)
+                                       : nullptr;
+    return value ? *value : none;
+}
+
+HttpUpload &HttpServer::upload()
+{
+    static HttpUpload idle{};
+    return current ? current->upload : idle;
+}
+
+// ─── Answers ────────────────────────────────────────────────────────────
+
+void HttpServer::sendHeader(const char *name, const char *value)
+{
+    if (current && !current->replied) {
+        current->replyHeaders.emplace_back(name, value);
+    }
+}
+
+void HttpServer::send(int status, const char *type, const char *body)
+{
+    send(status, type, body, body ? strlen(body) : 0);
+}
+
+void HttpServer::send(int status, const char *type, const std::string &body)
+{
+    send(status, type, body.data(), body.size());
+}
+
+void HttpServer::send(
+        int status, const char *type, const void *body, size_t size)
+{
+    if (!current || current->replied) {
+        return;
+    }
+    const bool empty = status == 204 || status == 304;
+    startReply(*current, status, empty ? nullptr : type, empty ? 0 : size);
+    if (!empty && current->method != HttpMethod::Head) {
+        current->out.append((const char *) body, size);
+    }
+}
+
+void HttpServer::sendStream(
+        int status, const char *type, BodyWriter writer, size_t length)
+{
+    if (!current || current->replied) {
+        return;
+    }
+    startReply(*current, status, type, length);
+    if (current->method != HttpMethod::Head) {
+        current->writer     = writer;
+        current->chunked    = length == HTTPD_UNKNOWN_LENGTH;
+        current->streamLeft = current->chunked ? 0 : length;
+    }
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+// A blocking loopback client, enough to talk to the server under test
+struct TestClient
+{
+    int         fd = -1;
+    std::string pending;  // read past the last response
+
+    explicit TestClient(uint16_t port)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        // A stuck server fails the test instead of hanging it
+        timeval wait{ 5, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+
+        sockaddr_in addr{};
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port        = htons(port);
+        if (connect(fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    ~TestClient()
+    {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    bool write(const std::string &data)
+    {
+        for (size_t sent = 0; sent < data.size();) {
+            const ssize_t n = ::send(fd, data.data() + sent,
+                    data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    bool fill()
+    {
+        char          buf[512];
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return false;
+        }
+        pending.append(buf, n);
+        return true;
+    }
+
+    bool take(size_t size, std::string &out)
+    {
+        while (pending.size() < size) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        out.append(pending, 0, size);
+        pending.erase(0, size);
+        return true;
+    }
+
+    bool line(std::string &out)
+    {
+        size_t end;
+        while ((end = pending.find("\r\n")) == std::string::npos) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        out = pending.substr(0, end);
+        pending.erase(0, end + 2);
+        return true;
+    }
+
+    // One response, a chunked body decoded; -1 when none arrived
+    int read(std::string &body, std::string *head = nullptr,
+            bool noBody = false)
+    {
+        std::string text, field;
+        if (!line(text)) {
+            return -1;
+        }
+        const int status = atoi(text.c_str() + 9);
+
+        long length  = -1;
+        bool chunked = false;
+        while (line(field) && !field.empty()) {
+            text += "\n" + field;
+            if (!strncasecmp(field.c_str(), "Content-Length:", 15)) {
+                length = atol(field.c_str() + 15);
+            }
+            chunked |= !strcasecmp(field.c_str(), "Transfer-Encoding: chunked");
+        }
+        if (head) {
+            *head = text;
+        }
+
+        body.clear();
+        if (noBody || status < 200 || status == 304) {
+            return status;
+        }
+        if (chunked) {
+            std::string size, crlf;
+            while (line(size)) {
+                const size_t n = strtoul(size.c_str(), nullptr, 16);
+                if (!n) {
+                    return line(crlf) ? status : -1;
+                }
+                if (!take(n, body) || !line(crlf)) {
+                    return -1;
+                }
+            }
+            return -1;
+        }
+        if (length >= 0) {
+            return take(length, body) ? status : -1;
+        }
+        while (fill())
+            ;
+        body = pending;
+        pending.clear();
+        return status;
+    }
+};
+
+// Byte `i` of the test bodies
+static char patternAt(size_t i)
+{
+    return (char) ('a' + (i * 7 + i / 251) % 26);
+}
+
+static bool isPattern(const std::string &body, size_t size)
+{
+    if (body.size() != size) {
+        return false;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        if (body[i] != patternAt(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Serves `size` pattern bytes a kilobyte per call
+static BodyWriter patternWriter(size_t size)
+{
+    auto sent = std::make_shared<size_t>(0);
+    return [sent, size](ChunkedWriter &out) {
+        char   block[1024];
+        size_t n = std::min(sizeof(block), size - *sent);
+        for (size_t i = 0; i < n; ++i)
+            block[i] = patternAt(*sent + i);
+        out.write(block, n);
+        *sent += n;
+        return *sent < size;
+    };
+}
+
+static std::string multipartBody(const std::string &boundary,
+        const std::string &file, const char *filename)
+{
+    return "--" + boundary
+           + "\r\nContent-Disposition: form-data; name=\"note\"\r\n\r\n"
+             "not a file\r\n--"
+           + boundary
+           + "\r\nContent-Disposition: form-data; name=\"file\"; filename=\""
+           + filename + "\"\r\nContent-Type: application/octet-stream\r\n\r\n"
+           + file + "\r\n--" + boundary + "--\r\n";
+}
+
+static std::string uploadRequest(const std::string &body,
+        const std::string &boundary, const char *extra = "",
+        const char *path = "/upload")
+{
+    return std::string("POST ") + path
+           + " HTTP/1.1\r\nHost: test\r\nContent-Type: "
+             "multipart/form-data; boundary="
+           + boundary + "\r\nContent-Length: " + std::to_string(body.size())
+           + "\r\n" + extra + "\r\n";
+}
+
+bool testHttpServer()
+{
+    HttpServer server(0);
+
+    server.on("/hello", HttpMethod::Get, [&] {
+        server.send(200, "text/plain", "hello " + server.arg("name"));
+    });
+    server.on("/items/{}/tags/{}", HttpMethod::Get, [&] {
+        server.send(200, "text/plain",
+                server.pathArg(0) + "," + server.pathArg(1));
+    });
+    server.on("/stream", HttpMethod::Get, [&] {
+        const size_t size = strtoul(server.arg("size").c_str(), nullptr, 10);
+        server.sendStream(200, "application/octet-stream",
+                patternWriter(size),
+                server.hasArg("fixed") ? size : HTTPD_UNKNOWN_LENGTH);
+    });
+    server.on("/stream", HttpMethod::Head, [&] {
+        server.sendStream(200, "application/octet-stream",
+                patternWriter(1000), 1000);
+    });
+
+    // The upload handler sums up what arrives for the done handler
+    std::string      uploaded, uploadName;
+    int              starts = 0, ends = 0;
+    std::atomic<int> aborts{};
+    server.on(
+            "/upload", HttpMethod::Post,
+            [&] {
+                server.send(200, "text/plain",
+                        uploadName + ":" + std::to_string(uploaded.size()));
+            },
+            [&] {
+                HttpUpload &upload = server.upload();
+                switch (upload.status) {
+                    case UploadStatus::Start:
+                        ++starts;
+                        uploaded.clear();
+                        uploadName = upload.filename;
+                        break;
+                    case UploadStatus::Write:
+                        uploaded.append(
+                                (const char *) upload.buf, upload.currentSize);
+                        break;
+                    case UploadStatus::End:
+                        ++ends;
+                        break;
+                    case UploadStatus::Aborted:
+                        ++aborts;
+                        break;
+                }
+            });
+
+    // Counts into each request's own context, taking data only while
+    // the gate is open
+    std::atomic<bool>   gate{ true };
+    std::atomic<size_t> counted{};
+    server.on(
+            "/count", HttpMethod::Post,
+            [&] {
+                auto *count = (size_t *) server.upload().context.get();
+                server.send(200, "text/plain",
+                        std::to_string(count ? *count : 0));
+            },
+            [&] {
+                HttpUpload &upload = server.upload();
+                if (upload.status == UploadStatus::Start) {
+                    upload.context = std::make_shared<size_t>(0);
+                    upload.room    = [&] { return gate ? SIZE_MAX : 0; };
+                }
+                else if (upload.status == UploadStatus::Write) {
+                    *(size_t *) upload.context.get() += upload.currentSize;
+                    counted += upload.currentSize;
+                }
+            });
+    server.onNotFound([&] { server.send(404, "text/plain", "missing"); });
+
+    if (!check(server.begin(), "listen")) {
+        return false;
+    }
+    std::atomic<bool> stop{};
+    std::thread       loop([&] {
+        while (!stop)
+            server.poll(10);
+    });
+
+    bool        ok = true;
+    std::string body, head;
+    {
+        // Pipelined requests on one connection, answered in order
+        TestClient client(server.port());
+        ok &= client.write("GET /hello?name=a%20b+c HTTP/1.1\r\n\r\n"
+                           "GET /items/7/tags/red HTTP/1.1\r\n\r\n"
+                           "GET /nowhere HTTP/1.1\r\n\r\n");
+        ok &= check(client.read(body) == 200 && body == "hello a b c",
+                "query arguments");
+        ok &= check(client.read(body) == 200 && body == "7,red",
+                "path arguments");
+        ok &= check(client.read(body) == 404 && body == "missing", "not found");
+
+        ok &= client.write("HEAD /stream HTTP/1.1\r\n\r\n");
+        ok &= check(client.read(body, &head, true) == 200
+                            && head.find("Content-Length: 1000")
+                                       != std::string::npos,
+                "HEAD headers");
+        ok &= client.write("GET /stream?size=70000 HTTP/1.1\r\n\r\n"
+                           "GET /stream?size=3333&fixed HTTP/1.1\r\n\r\n");
+        ok &= check(client.read(body) == 200 && isPattern(body, 70000),
+                "chunked body");
+        ok &= check(client.read(body) == 200 && isPattern(body, 3333),
+                "body of known length");
+    }
+
+    {
+        // A client that stopped reading a huge body and one that stopped
+        // halfway through its request hold up nobody
+        TestClient stalled(server.port()), partial(server.port());
+        const size_t huge = 32 << 20;
+        ok &= stalled.write("GET /stream?size=" + std::to_string(huge)
+                            + " HTTP/1.1\r\n\r\n");
+        ok &= partial.write("GET /hel");
+
+        const uint32_t start = nowMicros();
+        TestClient     quick(server.port());
+        ok &= quick.write("GET /hello?name=q HTTP/1.1\r\n\r\n");
+        ok &= check(quick.read(body) == 200 && body == "hello q",
+                "answer next to stalled clients");
+        const uint32_t waited = nowMicros() - start;
+        ok &= check(waited < 200000, "answer without waiting");
+
+        ok &= partial.write("lo?name=p HTTP/1.1\r\n\r\n");
+        ok &= check(partial.read(body) == 200 && body == "hello p",
+                "request finished late");
+        ok &= check(stalled.read(body) == 200 && isPattern(body, huge),
+                "huge body once read");
+    }
+
+    {
+        // A file full of near-delimiters, sent in odd pieces
+        const std::string boundary = "----bound4ry";
+        std::string       file;
+        for (size_t i = 0; i < 100000; ++i)
+            file += i % 997 ? std::string(1, patternAt(i))
+                            : "\r\n--" + boundary.substr(0, i % 12) + "!";
+        const std::string body = multipartBody(boundary, file, "frame.bin");
+        const std::string all  = uploadRequest(body, boundary) + body;
+
+        TestClient client(server.port());
+        size_t piece = 1;
+        for (size_t sent = 0; sent < all.size(); sent += piece) {
+            piece = std::min(piece * 3 % 1499 + 1, all.size() - sent);
+            ok &= client.write(all.substr(sent, piece));
+        }
+        std::string answer;
+        const std::string expected = "frame.bin:" + std::to_string(file.size());
+        ok &= check(client.read(answer) == 200 && answer == expected
+                            && uploaded == file && starts == 1 && ends == 1,
+                "multipart upload");
+
+        // curl asks before sending a large body
+        ok &= client.write(uploadRequest(body, boundary,
+                "Expect: 100-continue\r\n"));
+        ok &= check(client.read(answer, nullptr, true) == 100,
+                "100 Continue");
+        ok &= client.write(body);
+        ok &= check(client.read(answer) == 200 && uploaded == file,
+                "upload after 100 Continue");
+
+        // A client that leaves mid-file has its upload aborted
+        {
+            TestClient leaving(server.port());
+            ok &= leaving.write(all.substr(0, all.size() / 2));
+        }
+        for (int i = 0; i < 100 && !aborts; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        ok &= check(aborts == 1, "aborted upload");
+
+        // Two uploads at once keep apart
+        const std::string small = multipartBody(boundary, "abc", "a.bin");
+        const std::string one
+                = uploadRequest(body, boundary, "", "/count") + body;
+        const std::string two
+                = uploadRequest(small, boundary, "", "/count") + small;
+        TestClient first(server.port()), second(server.port());
+        ok &= first.write(one.substr(0, one.size() / 2));
+        ok &= second.write(two.substr(0, two.size() / 2));
+        ok &= first.write(one.substr(one.size() / 2));
+        ok &= second.write(two.substr(two.size() / 2));
+        ok &= check(first.read(answer) == 200
+                            && answer == std::to_string(file.size()),
+                "first of two uploads");
+        ok &= check(second.read(answer) == 200 && answer == "3",
+                "second of two uploads");
+
+        // A handler without room leaves the rest of the body unread
+        gate    = false;
+        counted = 0;
+        ok &= first.write(one);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        const size_t before = counted;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ok &= check(counted == before && before < file.size(),
+                "upload held back");
+        gate = true;
+        ok &= check(first.read(answer) == 200
+                            && answer == std::to_string(file.size()),
+                "upload resumed");
+    }
+
+    {
+        TestClient client(server.port());
+        ok &= client.write("GET /hello HTTP/1.1\r\nX-Big: "
+                           + std::string(HTTPD_HEAD_MAX, 'x') + "\r\n\r\n");
+        ok &= check(client.read(body) == 431, "oversized head");
+        ok &= check(client.read(body) == -1, "closed after an error");
+    }
+
+    stop = true;
+    loop.join();
+    ok &= check(server.lastStats().rejected == 1, "rejection count");
+    server.end();
+
+    report("HTTP server tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+// ─── Benchmark ──────────────────────────────────────────────────────────
+
+static void runClients(uint16_t port, int clients, int requests,
+        std::vector<uint32_t> &latencies)
+{
+    std::vector<std::vector<uint32_t>> perClient(clients);
+    std::vector<std::thread>           threads;
+    for (int i = 0; i < clients; ++i) {
+        threads.emplace_back([&, i] {
+            TestClient  client(port);
+            std::string body;
+            for (int r = 0; r < requests; ++r) {
+                const uint32_t start = nowMicros();
+                if (!client.write("GET /ping HTTP/1.1\r\n\r\n")
+                        || client.read(body) != 200) {
+                    return;
+                }
+                perClient[i].push_back(nowMicros() - start);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    latencies.clear();
+    for (const auto &list : perClient)
+        latencies.insert(latencies.end(), list.begin(), list.end());
+    std::sort(latencies.begin(), latencies.end());
+}
+
+// Keep-alive clients asking for a small JSON answer as fast as they can,
+// alone and next to a download of a large body
+void benchmarkHttpServer(int clients, int requests)
+{
+    // One slot is kept for the download
+    clients = std::max(1, std::min(clients, HTTPD_MAX_CLIENTS - 1));
+
+    HttpServer server(0);
+    server.on("/ping", HttpMethod::Get, [&] {
+        server.send(200, "text/json", "{\"message\":\"pong\"}");
+    });
+    server.on("/bulk", HttpMethod::Get, [&] {
+        server.sendStream(200, "application/octet-stream",
+                patternWriter((size_t) 1 << 30));
+    });
+    if (!server.begin()) {
+        return;
+    }
+    std::atomic<bool> stop{};
+    std::thread       loop([&] {
+        while (!stop)
+            server.poll(10);
+    });
+
+    for (int round = 0; round < 2; ++round) {
+        // The download is read slowly, as a client on Wi-Fi would
+        std::atomic<bool> downloading{ round == 1 };
+        std::thread       download([&] {
+            if (!downloading) {
+                return;
+            }
+            TestClient client(server.port());
+            client.write("GET /bulk HTTP/1.1\r\n\r\n");
+            while (downloading && client.fill()) {
+                client.pending.clear();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+
+        std::vector<uint32_t> latencies;
+        const uint32_t        start = nowMicros();
+        runClients(server.port(), clients, requests, latencies);
+        const uint32_t elapsed = nowMicros() - start;
+        downloading            = false;
+        download.join();
+
+        if (latencies.empty()) {
+            report("No request was answered\n");
+            continue;
+        }
+        const size_t count = latencies.size();
+        report("%d clients x %d requests%s: %lu req/s, p50 %u us, "
+               "p99 %u us, max %u us\n",
+                clients, requests, round ? " beside a download" : "",
+                (unsigned long) ((uint64_t) count * 1000000 / elapsed),
+                (unsigned) latencies[count / 2],
+                (unsigned) latencies[count * 99 / 100],
+                (unsigned) latencies.back());
+    }
+
+    stop = true;
+    loop.join();
+}
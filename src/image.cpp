@@ -0,0 +1,155 @@
+// ====================================================== //
+// ================ RGB Images in memory ================ //
+// ====================================================== //
+
+#include "image.h"
+
+#include <string.h>
+#include <utility>
+
+#include "report.h"
+
+void blit(const ImageView &dst, const ImageView &src)
+{
+    const int w = dst.width < src.width ? dst.width : src.width;
+    const int h = dst.height < src.height ? dst.height : src.height;
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    // Views of the same image may overlap; copy rows in the order that
+    // reads each source row before it is overwritten
+    if (dst.pixels > src.pixels) {
+        for (int y = h - 1; y >= 0; --y)
+            memmove(dst.row(y), src.row(y), w * sizeof(Color));
+    }
+    else {
+        for (int y = 0; y < h; ++y)
+            memmove(dst.row(y), src.row(y), w * sizeof(Color));
+    }
+}
+
+void fill(const ImageView &dst, Color c)
+{
+    for (int y = 0; y < dst.height; ++y) {
+        Color *row = dst.row(y);
+        for (int x = 0; x < dst.width; ++x)
+            row[x] = c;
+    }
+}
+
+void scale(const ImageView &dst, const ImageView &src)
+{
+    if (dst.empty() || src.empty()) {
+        return;
+    }
+
+    // Nearest neighbour, stepping through the source in 16.16 fixed point
+    const uint32_t dx = ((uint32_t) src.width << 16) / dst.width;
+    const uint32_t dy = ((uint32_t) src.height << 16) / dst.height;
+
+    uint32_t v = dy / 2;
+    for (int y = 0; y < dst.height; ++y, v += dy) {
+        const Color *in  = src.row(v >> 16);
+        Color       *out = dst.row(y);
+        uint32_t     u   = dx / 2;
+        for (int x = 0; x < dst.width; ++x, u += dx)
+            out[x] = in[u >> 16];
+    }
+}
+
+// Row `y` of `src` shrunk `factor` times each way, every pixel the rounded
+// average of its `factor` x `factor` block; src.width / factor pixels
+void downscaleRow(const ImageView &src, int factor, int y, Color *out)
+{
+    const int    area  = factor * factor;
+    const int    width = src.width / factor;
+    const Color *top   = src.row(y * factor);
+    for (int x = 0; x < width; ++x) {
+        uint32_t r = 0, g = 0, b = 0;
+        for (int dy = 0; dy < factor; ++dy) {
+            const Color *p = top + dy * src.stride + x * factor;
+            for (int dx = 0; dx < factor; ++dx) {
+                r += p[dx].r;
+                g += p[dx].g;
+                b += p[dx].b;
+            }
+        }
+        out[x] = Color{ (unsigned char) ((r + area / 2) / area),
+            (unsigned char) ((g + area / 2) / area),
+            (unsigned char) ((b + area / 2) / area) };
+    }
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool sameColor(Color a, Color b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+bool testImage()
+{
+    Allocator &heap = heapAllocator(MemoryRegion::Psram);
+    bool       ok   = true;
+
+    // View arithmetic
+    Image     image(16, 8, heap);
+    ImageView whole = image.view();
+    ImageView inner = image.view(4, 2, 8, 4);
+    ok &= check(inner.pixels == image.pixels + 2 * 16 + 4, "sub origin");
+    ok &= check(inner.stride == 16, "sub stride");
+    ok &= check(inner.width == 8 && inner.height == 4, "sub size");
+
+    ImageView nested = inner.sub(2, 1, 100, 100);
+    ok &= check(nested.pixels == image.pixels + 3 * 16 + 6, "nested origin");
+    ok &= check(nested.width == 6 && nested.height == 3, "nested clip");
+
+    ImageView left = whole.sub(-3, -2, 5, 5);
+    ok &= check(left.pixels == image.pixels, "negative origin");
+    ok &= check(left.width == 2 && left.height == 3, "negative clip");
+    ok &= check(whole.sub(16, 0, 4, 4).empty(), "view past the edge");
+
+    fill(whole, Color{ 0, 0, 0 });
+    fill(inner, Color{ 255, 0, 0 });
+    ok &= check(sameColor(image.get(4, 2), Color{ 255, 0, 0 }), "fill inside");
+    ok &= check(sameColor(image.get(3, 2), Color{ 0, 0, 0 }), "fill left");
+    ok &= check(sameColor(image.get(12, 5), Color{ 0, 0, 0 }), "fill right");
+    ok &= check(sameColor(image.get(11, 6), Color{ 0, 0, 0 }), "fill below");
+
+    // Overlapping blit one pixel down and right
+    for (int y = 0; y < 8; ++y)
+        for (int x = 0; x < 16; ++x)
+            image.set(x, y, Color{ (unsigned char) x, (unsigned char) y, 0 });
+    blit(whole.sub(1, 1, 15, 7), whole);
+    ok &= check(sameColor(image.get(5, 4), Color{ 4, 3, 0 }), "overlap blit");
+
+    Image half(8, 4, heap);
+    scale(half.view(), whole.sub(1, 1, 15, 7));
+    ok &= check(sameColor(half.get(0, 0), Color{ 0, 0, 0 }), "scale origin");
+    ok &= check(sameColor(half.get(7, 3), Color{ 14, 6, 0 }), "scale corner");
+
+    // Moves hand the pixels over exactly once
+    const size_t before = heap.used();
+    {
+        Image  a(4, 4, heap);
+        Color *pixels = a.pixels;
+        Image  b(std::move(a));
+        ok &= check(!a.pixels && b.pixels == pixels, "move construct");
+
+        Image c(2, 2, heap);
+        c = std::move(b);
+        ok &= check(!b.pixels && c.pixels == pixels, "move assign");
+        Image &alias = c;
+        c            = std::move(alias);
+        ok &= check(c.pixels == pixels, "self move");
+
+        Color *raw = (Color *) heap.allocate(3 * 3 * sizeof(Color));
+        Image  d   = Image::adopt(3, 3, raw, heap);
+        ok &= check(d.pixels == raw && d.xres == 3, "adopt");
+    }
+    ok &= check(heap.used() == before, "moves leak nothing");
+
+    report("Image tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
@@ -0,0 +1,452 @@
+// ====================================================== //
+// ========== Background filesystem job queue =========== //
+// ====================================================== //
+
+#include "jobs.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "dircache.h"
+#include "report.h"
+#include "walk.h"
+#include "writer.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <SD.h>
+
+static SemaphoreHandle_t jobsMutex = xSemaphoreCreateMutex();
+#define JOBS_LOCK()   xSemaphoreTake(jobsMutex, portMAX_DELAY)
+#define JOBS_UNLOCK() xSemaphoreGive(jobsMutex)
+#else
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+static std::mutex jobsMutex;
+#define JOBS_LOCK()   jobsMutex.lock()
+#define JOBS_UNLOCK() jobsMutex.unlock()
+#endif
+
+// ─── Tree Removal ───────────────────────────────────────────────────────
+
+#ifdef ARDUINO
+static bool removeFile(const char *path)
+{
+    return SD.remove(path);
+}
+
+static bool removeFolder(const char *path)
+{
+    return SD.rmdir(path);
+}
+#else
+static bool removeFile(const char *path)
+{
+    return unlink(path) == 0;
+}
+
+static bool removeFolder(const char *path)
+{
+    return rmdir(path) == 0;
+}
+#endif
+
+static const char *baseName(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    return path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+static void count(bool ok, TreeProgress &progress)
+{
+    ++(ok ? progress.removed : progress.errors);
+}
+
+// Files go while their directory is read, a directory once it comes back
+// to the top of the walk's stack, emptied
+bool removeTree(const char *path, bool keepRoot, const char *keep,
+        TreeProgress &progress)
+{
+    const uint32_t errors = progress.errors;
+    walkTree(path, [&](WalkStep step, const std::string &entry, int depth) {
+        if (progress.cancel && *progress.cancel) {
+            return WalkAction::Stop;
+        }
+        if (depth == 1 && keep && !strcmp(baseName(entry), keep)) {
+            return WalkAction::Skip;
+        }
+        if (step == WalkStep::File) {
+            count(removeFile(entry.c_str()), progress);
+        }
+        else if (step == WalkStep::LeaveDir && (depth || !keepRoot)) {
+            count(removeFolder(entry.c_str()), progress);
+        }
+        return WalkAction::Continue;
+    });
+    return progress.errors == errors
+           && !(progress.cancel && *progress.cancel);
+}
+
+// ─── Job Queue ──────────────────────────────────────────────────────────
+
+struct Job
+{
+    JobStatus         status;  // guarded by the lock
+    uint32_t          start;
+    TreeProgress      progress;
+    std::atomic<bool> cancel{};
+};
+
+// The worker waits on `pending` forever, so it is never destroyed
+static Job         jobs[MAX_JOBS];
+static uint32_t    nextId = 1;
+static IndexQueue &pending = *new IndexQueue;  // slots for the worker
+static bool        workerStarted;
+
+// Copies a slot with the live counters; the caller holds the lock
+static void snapshot(const Job &job, JobStatus &status)
+{
+    status         = job.status;
+    status.removed = job.progress.removed;
+    status.errors  = job.progress.errors;
+    if (status.state == JobState::Running) {
+        status.micros = nowMicros() - job.start;
+    }
+}
+
+static void runJob(Job &job, const char *path, JobKind kind)
+{
+    if (kind == JobKind::Wipe) {
+        removeTree(path, true, WIPE_KEEP, job.progress);
+    }
+    else {
+        removeTree(path, false, nullptr, job.progress);
+    }
+    invalidateDir(path);
+}
+
+// Once a job is finished its slot may be reused, so everything reported
+// afterwards is copied out under the lock
+static void jobWorker(void *args)
+{
+    for (;;) {
+        Job &job = jobs[pending.pop()];
+
+        JOBS_LOCK();
+        char path[JOB_PATH_MAX];
+        strcpy(path, job.status.path);
+        const uint32_t id      = job.status.id;
+        const JobKind  kind    = job.status.kind;
+        const bool     skipped = job.cancel;
+        job.start              = nowMicros();
+        job.status.state = skipped ? JobState::Cancelled : JobState::Running;
+        JOBS_UNLOCK();
+
+        if (skipped) {
+            continue;
+        }
+        report("Job %u started on %s\n", (unsigned) id, path);
+        runJob(job, path, kind);
+
+        JOBS_LOCK();
+        JobStatus status;
+        job.status.micros = nowMicros() - job.start;
+        if (job.cancel) {
+            job.status.state = JobState::Cancelled;
+        }
+        else {
+            job.status.state = job.progress.errors ? JobState::Failed
+                                                   : JobState::Done;
+        }
+        snapshot(job, status);
+        JOBS_UNLOCK();
+        report("Job %u %s: %u removed, %u errors in %u ms\n", (unsigned) id,
+                jobStateName(status.state), (unsigned) status.removed,
+                (unsigned) status.errors, (unsigned) (status.micros / 1000));
+    }
+}
+
+static bool isFinished(JobState state)
+{
+    return state == JobState::Done || state == JobState::Failed
+           || state == JobState::Cancelled;
+}
+
+// Takes a free slot, or the one that finished longest ago
+static uint32_t submit(JobKind kind, const char *path)
+{
+    if (strlen(path) >= JOB_PATH_MAX) {
+        report("Path too long for a job: %s\n", path);
+        return 0;
+    }
+
+    JOBS_LOCK();
+    if (!workerStarted) {
+        pending.create(MAX_JOBS);
+#ifdef ARDUINO
+        xTaskCreatePinnedToCore(
+                jobWorker, "Job Task", 6144, NULL, 1, NULL, 0);
+#else
+        std::thread(jobWorker, nullptr).detach();
+#endif
+        workerStarted = true;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < MAX_JOBS; ++i) {
+        const JobStatus &status = jobs[i].status;
+        if (!status.id) {
+            slot = i;
+            break;
+        }
+        if (isFinished(status.state)
+                && (slot < 0 || status.id < jobs[slot].status.id)) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        JOBS_UNLOCK();
+        report("Every job slot is busy\n");
+        return 0;
+    }
+
+    Job &job             = jobs[slot];
+    job.status           = JobStatus{};
+    job.status.id        = nextId++;
+    job.status.kind      = kind;
+    job.status.state     = JobState::Queued;
+    job.progress.removed = 0;
+    job.progress.errors  = 0;
+    job.progress.cancel  = &job.cancel;
+    job.cancel           = false;
+    strcpy(job.status.path, path);
+    const uint32_t id = job.status.id;
+    JOBS_UNLOCK();
+
+    pending.push(slot);
+    return id;
+}
+
+uint32_t submitDelete(const char *path)
+{
+    return submit(JobKind::Delete, path);
+}
+
+uint32_t submitWipe()
+{
+    return submit(JobKind::Wipe, "/");
+}
+
+bool jobStatus(uint32_t id, JobStatus &status)
+{
+    bool found = false;
+    JOBS_LOCK();
+    for (const Job &job : jobs) {
+        if (id && job.status.id == id) {
+            snapshot(job, status);
+            found = true;
+        }
+    }
+    JOBS_UNLOCK();
+    return found;
+}
+
+size_t listJobs(JobStatus *out, size_t max)
+{
+    size_t n = 0;
+    JOBS_LOCK();
+    for (const Job &job : jobs) {
+        if (job.status.id && n < max) {
+            snapshot(job, out[n++]);
+        }
+    }
+    JOBS_UNLOCK();
+    return n;
+}
+
+// A queued job is skipped when its turn comes, a running one stops
+// before its next entry
+bool cancelJob(uint32_t id)
+{
+    bool found = false;
+    JOBS_LOCK();
+    for (Job &job : jobs) {
+        if (id && job.status.id == id && !isFinished(job.status.state)) {
+            job.cancel = true;
+            found      = true;
+        }
+    }
+    JOBS_UNLOCK();
+    return found;
+}
+
+const char *jobKindName(JobKind kind)
+{
+    return kind == JobKind::Wipe ? "wipe" : "delete";
+}
+
+const char *jobStateName(JobState state)
+{
+    switch (state) {
+        case JobState::Queued:
+            return "queued";
+        case JobState::Running:
+            return "running";
+        case JobState::Done:
+            return "done";
+        case JobState::Failed:
+            return "failed";
+        case JobState::Cancelled:
+            return "cancelled";
+    }
+    return "unknown";
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool makeFolder(const std::string &path)
+{
+#ifdef ARDUINO
+    return SD.mkdir(path.c_str());
+#else
+    return mkdir(path.c_str(), 0755) == 0;
+#endif
+}
+
+static bool makeFile(const std::string &path)
+{
+#ifdef ARDUINO
+    File file = SD.open(path.c_str(), FILE_WRITE);
+    if (!file) {
+        return false;
+    }
+    file.write((const uint8_t *) "x", 1);
+    file.close();
+#else
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    fputc('x', file);
+    fclose(file);
+#endif
+    return true;
+}
+
+// `width` files and folders per level, `depth` levels deep; returns the
+// number of entries made below `root`
+static uint32_t makeTree(const std::string &root, int width, int depth)
+{
+    uint32_t made = 0;
+    for (int i = 0; i < width; ++i) {
+        if (makeFile(root + "/f" + std::to_string(i))) {
+            ++made;
+        }
+    }
+    if (depth > 1) {
+        for (int i = 0; i < width; ++i) {
+            std::string folder = root + "/d" + std::to_string(i);
+            if (makeFolder(folder)) {
+                made += 1 + makeTree(folder, width, depth - 1);
+            }
+        }
+    }
+    return made;
+}
+
+static JobState waitForJob(uint32_t id, JobStatus &status)
+{
+    for (int i = 0; i < 6000; ++i) {
+        if (!jobStatus(id, status) || isFinished(status.state)) {
+            break;
+        }
+        sleepMillis(5);
+    }
+    return status.state;
+}
+
+bool testJobs(const char *dir)
+{
+    const std::string root = std::string(dir) + "/jobs";
+    bool              ok   = true;
+
+    // Emptying a tree in place spares the kept entry
+    makeFolder(root);
+    const uint32_t made = makeTree(root, 4, 3);
+    makeFolder(root + "/keep");
+    makeFile(root + "/keep/inside");
+    TreeProgress progress;
+    ok &= check(removeTree(root.c_str(), true, "keep", progress), "empty");
+    ok &= check(progress.removed == made, "removed count");
+    ok &= check(isDirectory(root.c_str()), "root kept");
+    ok &= check(isDirectory((root + "/keep").c_str()), "kept entry");
+    ok &= check(!isDirectory((root + "/d0").c_str()), "subtree");
+
+    // A job takes a whole tree, root included, in the background
+    const std::string tree = root + "/tree";
+    makeFolder(tree);
+    const uint32_t treeSize = makeTree(tree, 5, 4) + 1;
+    JobStatus      status;
+    uint32_t       id = submitDelete(tree.c_str());
+    ok &= check(id != 0, "submit");
+    ok &= check(waitForJob(id, status) == JobState::Done, "delete job");
+    ok &= check(status.removed == treeSize && !status.errors, "job count");
+    ok &= check(!isDirectory(tree.c_str()), "tree gone");
+
+    // A job cancelled while queued never touches its tree
+    const std::string first = root + "/first", second = root + "/second";
+    makeFolder(first);
+    makeFolder(second);
+    makeTree(first, 6, 4);
+    makeTree(second, 2, 2);
+    uint32_t busy    = submitDelete(first.c_str());
+    uint32_t skipped = submitDelete(second.c_str());
+    ok &= check(cancelJob(skipped), "cancel");
+    ok &= check(waitForJob(skipped, status) == JobState::Cancelled,
+            "cancelled state");
+    ok &= check(isDirectory((second + "/d1").c_str()), "cancelled tree");
+    ok &= check(waitForJob(busy, status) == JobState::Done, "first job");
+
+    // Missing paths fail, finished ids cannot be cancelled
+    id = submitDelete((root + "/missing").c_str());
+    ok &= check(waitForJob(id, status) == JobState::Failed, "missing path");
+    ok &= check(!cancelJob(id) && !cancelJob(0), "cancel finished");
+
+    JobStatus listed[MAX_JOBS];
+    ok &= check(listJobs(listed, MAX_JOBS) == 4, "list");
+
+    TreeProgress cleanup;
+    removeTree(root.c_str(), false, nullptr, cleanup);
+    report("Job tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+void benchmarkJobs(const char *dir, int files)
+{
+    // Frames spread over folders of 100, as uploads tend to be
+    const std::string root = std::string(dir) + "/bench";
+    makeFolder(root);
+    uint32_t made = 0;
+    for (int i = 0; i * 100 < files; ++i) {
+        std::string folder = root + "/set" + std::to_string(i);
+        makeFolder(folder);
+        ++made;
+        for (int j = 0; j < 100 && i * 100 + j < files; ++j) {
+            made += makeFile(folder + "/frame" + std::to_string(j) + ".png");
+        }
+    }
+
+    JobStatus      status;
+    const uint32_t id = submitDelete(root.c_str());
+    waitForJob(id, status);
+
+    const uint32_t ms = status.micros / 1000 ? status.micros / 1000 : 1;
+    report("Deleted %u of %u entries in %u ms: %u entries/s (%s)\n",
+            (unsigned) status.removed, (unsigned) made + 1, (unsigned) ms,
+            (unsigned) (status.removed * 1000ull / ms),
+            jobStateName(status.state));
+}
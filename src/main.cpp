@@ -1,52 +1,75 @@
 #include "filesystem.h"
 #include "server.h"
 #include "vga.h"
+#include "renderer.h"
+#include "prefetch.h"
+#include "mirror.h"
+#include "boot.h"
+#include "metrics.h"
+#include "trace.h"
 
 
-// Server task handle
-TaskHandle_t serverTaskHandle;
+// Phases of the boot, run concurrently once setup() returns
+BootSequence boot;
 
 void setup()
 {
     Serial.begin(115200);
 
-    delay(3000);  // Wait for me to open the serial monitor ;)
+    // ─── Start Render Workers ────────────────────────────────────────────
 
-    // ─── Setup micro SD ───────────────────────────────────────────────────
+    // Core 1 belongs to the scanout and only lends its vertical blanking,
+    // so the server task renders with no helper tasks beside it
+    setupRenderer(1);
 
-    setupSD();
+    // ─── Allocate Scanout Prefetch Ring ──────────────────────────────────
 
-    // ─── Start Server Task ───────────────────────────────────────────────
+    setupPrefetch();
 
-    xTaskCreatePinnedToCore(
-            serverTask, "Server Task", 10000, NULL, 1, &serverTaskHandle, 0);
+    // ─── Start VGA Emulator ──────────────────────────────────────────────
 
-    // ─── Initialize Tft Display ──────────────────────────────────────────
+    // A black frame right away; the snapshot lands in it once the card is up
+    fill(image.view(), Color{ 0, 0, 0 });
+    vga.setup();
 
-    tftInit();
+    // ─── Bring Up Everything Else ────────────────────────────────────────
 
-    // ─── Load Png ────────────────────────────────────────────────────────
+    int sd    = boot.add("sd", setupSD);
+    int frame = boot.add("frame", [] {
+        // Without one the black frame stays up, and the server still
+        // starts so that an image can be uploaded
+        if (!loadSnapshot(SNAPSHOT_PATH, image.view())
+                && !decodePng("/pm.png")) {
+            Serial.println("Failed to load default image /pm.png");
+            return true;
+        }
+        presentImage(&image);
+        mirrorDirty(image.view());
+        boot.frameShown();
+        return true;
+    }, { sd });
+    int wifi  = boot.add("wifi", [] {
+        connectWifi();
+        return true;  // the server listens while the station keeps trying
+    });
+    // After the frame, so that no request decodes into the image while
+    // the first frame is still being loaded into it
+    boot.add("server", startServer, { wifi, sd, frame });
+    // After the card, so the two never set up their SPI buses at once
+    boot.add("display", [] {
+        tftInit();
+        return setupMirror();
+    }, { sd });
+    boot.add("snapshots", setupSnapshots, { frame });
 
-    if (!decodePng("/pm.png")) {
-        Serial.println("Failed to load default image /pm.png");
-    }
-    else {
-        Serial.println("Image loaded");
+    // ─── Register Metrics And Tracing ────────────────────────────────────
 
-        // Start VGA emulator
-        vga.setup();
-    }
+    setupMetrics();
+    setupTrace();
+    boot.run();
 }
 
 void loop()
 {
-    // 4 times as less pixels
-    crtTicks = timerRead(hPixelTimer);
-    if (crtTicks < ticksElapsed)
-        crtTicks += APB_CLK_FREQ / 2;
-
-    if (crtTicks - ticksElapsed >= pixelTicks * 4) {
-        writePixel();
-        ticksElapsed = crtTicks;
-    }
-}
\ No newline at end of file
+    scanoutStep();
+}
@@ -0,0 +1,612 @@
+// ====================================================== //
+// ============= Performance counters export ============ //
+// ====================================================== //
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "report.h"
+
+#ifndef ARDUINO
+#include <thread>
+#endif
+
+#ifdef ARDUINO
+#include "allocator.h"
+#include "prefetch.h"
+#endif
+
+ScanoutCounters scanoutCounters;
+Histogram       decodeMicros;
+
+// ─── Counters And Histograms ────────────────────────────────────────────
+
+uint64_t Counter::value() const
+{
+    uint64_t total = 0;
+    for (const std::atomic<uint32_t> &slot : slots) {
+        total += slot.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint32_t HistogramSnapshot::upperBound(int index)
+{
+    if (index >= HISTOGRAM_BUCKETS - 1) {
+        return UINT32_MAX;
+    }
+    return index ? (1u << index) - 1 : 0;
+}
+
+uint32_t HistogramSnapshot::quantile(double q) const
+{
+    if (!count) {
+        return 0;
+    }
+
+    const uint64_t target = std::max<uint64_t>(1, ceil(q * count));
+    uint64_t       seen   = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return std::min(upperBound(i), max);
+        }
+    }
+    return max;
+}
+
+HistogramSnapshot Histogram::read() const
+{
+    HistogramSnapshot snapshot{};
+    for (const Slot &slot : slots) {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            snapshot.buckets[i] += slot.buckets[i];
+        }
+
+        // The sum is two words the other core may be writing, so read it
+        // until two reads agree
+        uint64_t sum = slot.sum;
+        for (uint64_t again; (again = slot.sum) != sum;) {
+            sum = again;
+        }
+        const uint32_t max = slot.max;
+        snapshot.sum += sum;
+        snapshot.max = std::max(snapshot.max, max);
+    }
+
+    // Counted from the buckets, so the +Inf bucket always equals the count
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        snapshot.count += snapshot.buckets[i];
+    }
+    return snapshot;
+}
+
+double RateMeter::update(uint64_t total, uint32_t nowMicros)
+{
+    if (!started) {
+        started    = true;
+        lastTotal  = total;
+        lastMicros = nowMicros;
+        return 0;
+    }
+
+    const uint32_t elapsed = nowMicros - lastMicros;
+    if (elapsed >= 1000000) {
+        rate       = (total - lastTotal) * 1e6 / elapsed;
+        lastTotal  = total;
+        lastMicros = nowMicros;
+    }
+    return rate;
+}
+
+// ─── Registry ───────────────────────────────────────────────────────────
+
+MetricRegistry &metrics()
+{
+    static MetricRegistry registry;
+    return registry;
+}
+
+bool MetricRegistry::add(const MetricEntry &entry)
+{
+    if (count == METRICS_MAX) {
+        report("Metrics: no room for %s\n", entry.name);
+        return false;
+    }
+    entries[count++] = entry;
+    return true;
+}
+
+bool MetricRegistry::addCounter(const char *name, const char *help,
+        MetricRead read, const char *label, const char *labelValue)
+{
+    return add(MetricEntry{ name, help, MetricKind::Counter, label,
+            labelValue, std::move(read), nullptr, 1 });
+}
+
+bool MetricRegistry::addCounter(
+        const char *name, const char *help, const Counter &counter)
+{
+    return addCounter(name, help, [&counter] {
+        return (double) counter.value();
+    });
+}
+
+bool MetricRegistry::addGauge(const char *name, const char *help,
+        MetricRead read, const char *label, const char *labelValue)
+{
+    return add(MetricEntry{ name, help, MetricKind::Gauge, label, labelValue,
+            std::move(read), nullptr, 1 });
+}
+
+bool MetricRegistry::addHistogram(const char *name, const char *help,
+        const Histogram &histogram, double scale)
+{
+    return add(MetricEntry{ name, help, MetricKind::Histogram, nullptr,
+            nullptr, nullptr, &histogram, scale });
+}
+
+static const char *typeName(MetricKind kind)
+{
+    switch (kind) {
+        case MetricKind::Counter:
+            return "counter";
+        case MetricKind::Gauge:
+            return "gauge";
+        default:
+            return "histogram";
+    }
+}
+
+void MetricRegistry::writePrometheus(std::string &out) const
+{
+    const char *family = nullptr;
+    for (int i = 0; i < count; ++i) {
+        const MetricEntry &entry = entries[i];
+        if (!family || strcmp(family, entry.name)) {
+            appendf(out, "# HELP %s %s\n# TYPE %s %s\n", entry.name,
+                    entry.help, entry.name, typeName(entry.kind));
+            family = entry.name;
+        }
+
+        if (entry.kind != MetricKind::Histogram) {
+            out += entry.name;
+            if (entry.label) {
+                appendf(out, "{%s=\"%s\"}", entry.label, entry.labelValue);
+            }
+            appendf(out, " %.10g\n", entry.read());
+            continue;
+        }
+
+        const HistogramSnapshot snapshot   = entry.histogram->read();
+        unsigned long long      cumulative = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            cumulative += snapshot.buckets[b];
+            if (b == HISTOGRAM_BUCKETS - 1) {
+                appendf(out, "%s_bucket{le=\"+Inf\"} %llu\n", entry.name,
+                        cumulative);
+            }
+            else {
+                appendf(out, "%s_bucket{le=\"%.6g\"} %llu\n", entry.name,
+                        HistogramSnapshot::upperBound(b) * entry.scale,
+                        cumulative);
+            }
+        }
+        appendf(out, "%s_sum %.10g\n%s_count %llu\n", entry.name,
+                snapshot.sum * entry.scale, entry.name,
+                (unsigned long long) snapshot.count);
+    }
+}
+
+void MetricRegistry::writeJson(std::string &out) const
+{
+    out += "{";
+    for (int i = 0; i < count; ++i) {
+        const MetricEntry &entry = entries[i];
+        const MetricEntry *last  = i ? &entries[i - 1] : nullptr;
+
+        if (last && !strcmp(last->name, entry.name)) {
+            out += ",";
+        }
+        else {
+            if (last && last->label) {
+                out += "}";
+            }
+            appendf(out, "%s\"%s\":", last ? "," : "", entry.name);
+            if (entry.label) {
+                out += "{";
+            }
+        }
+        if (entry.label) {
+            appendf(out, "\"%s\":", entry.labelValue);
+        }
+
+        if (entry.kind != MetricKind::Histogram) {
+            appendf(out, "%.10g", entry.read());
+            continue;
+        }
+
+        const HistogramSnapshot snapshot = entry.histogram->read();
+        const double            scale    = entry.scale;
+        appendf(out, "{\"count\":%llu,\"sum\":%.10g,\"max\":%.10g,",
+                (unsigned long long) snapshot.count, snapshot.sum * scale,
+                snapshot.max * scale);
+        appendf(out, "\"p50\":%.10g,\"p90\":%.10g,\"p99\":%.10g}",
+                snapshot.quantile(0.5) * scale,
+                snapshot.quantile(0.9) * scale,
+                snapshot.quantile(0.99) * scale);
+    }
+    if (count && entries[count - 1].label) {
+        out += "}";
+    }
+    out += "}";
+}
+
+// ─── Device Metrics ─────────────────────────────────────────────────────
+
+#ifdef ARDUINO
+
+bool setupMetrics()
+{
+    MetricRegistry  &registry = metrics();
+    ScanoutCounters &scanout  = scanoutCounters;
+    const double     cycle    = 1 / METRICS_CYCLE_HZ;
+    bool             ok       = true;
+
+    ok &= registry.addHistogram("vga_hsync_isr_seconds",
+            "Time spent in the horizontal sync interrupt", scanout.hSyncCycles,
+            cycle);
+    ok &= registry.addHistogram("vga_hsync_jitter_seconds",
+            "How far horizontal sync interrupts come from their period",
+            scanout.hSyncJitter, cycle);
+    ok &= registry.addHistogram("vga_vsync_isr_seconds",
+            "Time spent in the vertical sync interrupt", scanout.vSyncCycles,
+            cycle);
+    ok &= registry.addHistogram("vga_vsync_jitter_seconds",
+            "How far vertical sync interrupts come from their period",
+            scanout.vSyncJitter, cycle);
+    ok &= registry.addCounter(
+            "vga_frames_total", "Frames scanned out", scanout.frames);
+    ok &= registry.addGauge("vga_frame_pixels",
+            "Pixels emitted during the last frame",
+            [] { return (double) scanoutCounters.lastFramePixels; });
+    ok &= registry.addGauge("vga_frame_pixels_expected",
+            "Pixels a frame of the mode has",
+            [] { return (double) scanoutCounters.expectedPixels; });
+    ok &= registry.addCounter("vga_short_frames_total",
+            "Frames with fewer pixels emitted than expected",
+            scanout.shortFrames);
+    ok &= registry.addCounter("vga_missed_pixels_total",
+            "Pixel slots the scanout loop was too late for",
+            scanout.missedPixels);
+    ok &= registry.addCounter("vga_prefetch_hits_total",
+            "Scanlines found waiting in the prefetch ring",
+            [] { return (double) prefetchStats.hits; });
+    ok &= registry.addCounter("vga_prefetch_underruns_total",
+            "Scanlines scanout had to read from PSRAM itself",
+            [] { return (double) prefetchStats.underruns; });
+    ok &= registry.addHistogram("vga_png_decode_seconds",
+            "Time to decode one image", decodeMicros, 1e-6);
+
+    ok &= registry.addGauge("vga_heap_free_bytes", "Free heap", [] {
+        return (double) heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    }, "region", "internal");
+    ok &= registry.addGauge("vga_heap_free_bytes", "Free heap", [] {
+        return (double) heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    }, "region", "psram");
+    ok &= registry.addGauge("vga_heap_min_free_bytes",
+            "Least free heap since boot", [] {
+        return (double) heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    }, "region", "internal");
+    ok &= registry.addGauge("vga_heap_min_free_bytes",
+            "Least free heap since boot", [] {
+        return (double) heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+    }, "region", "psram");
+
+    for (Allocator *a = firstAllocator(); a; a = a->next) {
+        ok &= registry.addGauge("vga_allocator_used_bytes",
+                "Bytes handed out by an allocator",
+                [a] { return (double) a->used(); }, "allocator", a->name);
+    }
+    for (Allocator *a = firstAllocator(); a; a = a->next) {
+        ok &= registry.addGauge("vga_allocator_high_water_bytes",
+                "Most bytes an allocator ever had handed out at once",
+                [a] { return (double) a->highWater(); }, "allocator",
+                a->name);
+    }
+    return ok;
+}
+
+#endif
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool contains(const std::string &text, const char *part)
+{
+    return text.find(part) != std::string::npos;
+}
+
+static int occurrences(const std::string &text, const char *part)
+{
+    int n = 0;
+    for (size_t at = text.find(part); at != std::string::npos;
+            at = text.find(part, at + 1)) {
+        ++n;
+    }
+    return n;
+}
+
+static bool testBuckets()
+{
+    bool ok = true;
+
+    // Bucket i holds (upperBound(i - 1), upperBound(i)]
+    const uint32_t values[]  = { 0, 1, 2, 3, 4, 7, 8, 1u << 21, (1u << 22) - 1,
+         1u << 22, 1u << 31, UINT32_MAX };
+    const int      buckets[] = { 0, 1, 2, 2, 3, 3, 4, 22, 22, 23, 23, 23 };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        ok &= check(Histogram::bucketOf(values[i]) == buckets[i], "bucket",
+                values[i]);
+    }
+
+    // Against a plain search of the bounds, over values of every size
+    std::mt19937 random(7);
+    Histogram    histogram;
+    uint32_t     expected[HISTOGRAM_BUCKETS]{};
+    uint64_t     sum = 0;
+    uint32_t     max = 0;
+    for (int i = 0; i < 20000; ++i) {
+        const uint32_t value = random() >> (random() % 32);
+        int            b     = 0;
+        while (value > HistogramSnapshot::upperBound(b)) {
+            ++b;
+        }
+        ++expected[b];
+        sum += value;
+        max = std::max(max, value);
+        histogram.record(value);
+    }
+
+    const HistogramSnapshot snapshot = histogram.read();
+    for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+        ok &= check(snapshot.buckets[b] == expected[b], "bucket count", b);
+    }
+    ok &= check(snapshot.count == 20000, "count", snapshot.count);
+    ok &= check(snapshot.sum == sum, "sum", 0);
+    ok &= check(snapshot.max == max, "max", 0);
+
+    // Quantiles come out as bucket bounds
+    Histogram small;
+    for (uint32_t value : { 0u, 1u, 2u, 3u, 5u, 100u, 1000u, 1u << 30 }) {
+        small.record(value);
+    }
+    const HistogramSnapshot few = small.read();
+    ok &= check(few.quantile(0.5) == 3, "median", few.quantile(0.5));
+    ok &= check(few.quantile(0.75) == 127, "upper quartile",
+            few.quantile(0.75));
+    ok &= check(few.quantile(1) == 1u << 30, "maximum", few.quantile(1));
+    ok &= check(Histogram().read().quantile(0.5) == 0, "empty", 0);
+    return ok;
+}
+
+#ifndef ARDUINO
+
+// Two threads stand in for the two cores, each with a slot of its own; on
+// the device the slots belong to the cores, which tasks share
+static bool testConcurrency()
+{
+    bool      ok = true;
+    Counter   counter;
+    Histogram histogram;
+
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < 100000; ++i) {
+        sum += 2 * (i & 1023);
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; ++t) {
+        threads.emplace_back([&] {
+            for (uint32_t i = 0; i < 100000; ++i) {
+                counter.add();
+                histogram.record(i & 1023);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    // Counters are atomic, so more threads than slots count right too
+    threads.clear();
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 50000; ++i) {
+                counter.add(2);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    const HistogramSnapshot snapshot = histogram.read();
+    ok &= check(counter.value() == 600000, "counter", counter.value());
+    ok &= check(snapshot.count == 200000, "histogram count", snapshot.count);
+    ok &= check(snapshot.sum == sum, "histogram sum", snapshot.sum);
+    ok &= check(snapshot.max == 1023, "histogram max", snapshot.max);
+    return ok;
+}
+
+#endif
+
+static bool testExport()
+{
+    bool           ok = true;
+    MetricRegistry registry;
+    Counter        events;
+    Histogram      latency;
+
+    events.add(42);
+    for (uint32_t value : { 3u, 3u, 90u, 5000u }) {
+        latency.record(value);
+    }
+
+    ok &= registry.addCounter("test_events_total", "Events seen", events);
+    ok &= registry.addGauge("test_free_bytes", "Free bytes",
+            [] { return 1.0; }, "pool", "a");
+    ok &= registry.addGauge("test_free_bytes", "Free bytes",
+            [] { return 2.5; }, "pool", "b");
+    ok &= registry.addHistogram(
+            "test_latency_seconds", "Latency", latency, 1e-6);
+    ok &= check(ok, "registered", 0);
+
+    std::string text;
+    registry.writePrometheus(text);
+    ok &= check(contains(text,
+                        "# HELP test_events_total Events seen\n"
+                        "# TYPE test_events_total counter\n"
+                        "test_events_total 42\n"),
+            "counter", 0);
+    ok &= check(occurrences(text, "# TYPE test_free_bytes gauge") == 1,
+            "one type line per family", 0);
+    ok &= check(contains(text, "test_free_bytes{pool=\"a\"} 1\n")
+                        && contains(text, "test_free_bytes{pool=\"b\"} 2.5\n"),
+            "labels", 0);
+    ok &= check(contains(text, "test_latency_seconds_bucket{le=\"3e-06\"} 2\n")
+                        && contains(text,
+                                "test_latency_seconds_bucket{le=\"+Inf\"} 4\n")
+                        && contains(text, "test_latency_seconds_count 4\n")
+                        && contains(text,
+                                "test_latency_seconds_sum 0.005096\n"),
+            "histogram", 0);
+    ok &= check(occurrences(text, "test_latency_seconds_bucket")
+                        == HISTOGRAM_BUCKETS,
+            "bucket lines", occurrences(text, "test_latency_seconds_bucket"));
+
+    // Buckets are cumulative
+    unsigned long long previous = 0;
+    for (size_t at = text.find("_bucket{"); at != std::string::npos;
+            at = text.find("_bucket{", at + 1)) {
+        const unsigned long long n
+                = strtoull(text.c_str() + text.find("} ", at) + 2, nullptr, 10);
+        ok &= check(n >= previous, "cumulative", n);
+        previous = n;
+    }
+
+    std::string json;
+    registry.writeJson(json);
+    ok &= check(json.front() == '{' && json.back() == '}', "json object", 0);
+    ok &= check(contains(json,
+                        "{\"test_events_total\":42,"
+                        "\"test_free_bytes\":{\"a\":1,\"b\":2.5},"
+                        "\"test_latency_seconds\":{\"count\":4,"),
+            "json", 0);
+    ok &= check(contains(json, "\"max\":0.005,\"p50\":3e-06,"),
+            "json quantiles", 0);
+    ok &= check(occurrences(json, "{") == occurrences(json, "}"),
+            "json braces", 0);
+
+    // A full registry refuses more
+    MetricRegistry full;
+    for (int i = 0; i < METRICS_MAX; ++i) {
+        full.addCounter("test_total", "Test", events);
+    }
+    ok &= check(!full.addCounter("test_total", "Test", events), "full", 0);
+    return ok;
+}
+
+static bool testRates()
+{
+    bool      ok = true;
+    RateMeter meter;
+
+    ok &= check(meter.update(0, 0xfff00000) == 0, "first read", 0);
+    ok &= check(meter.update(1000, 0xfff80000) == 0, "too soon", 0);
+
+    // Across the microsecond counter wrapping
+    const double rate = meter.update(3000, 0xfff00000 + 2000000);
+    ok &= check(fabs(rate - 1500) < 0.01, "rate", rate);
+    ok &= check(meter.update(9000, 0xfff00000 + 2500000) == rate, "held",
+            0);
+    return ok;
+}
+
+bool testMetrics()
+{
+    bool ok = testBuckets();
+#ifndef ARDUINO
+    ok &= testConcurrency();
+#endif
+    ok &= testExport();
+    ok &= testRates();
+    report("Metrics test %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+// ─── Benchmark ──────────────────────────────────────────────────────────
+
+// Stands in for an interrupt body: a little arithmetic on the stack
+static uint32_t __attribute__((noinline)) syncWork(uint32_t seed)
+{
+    volatile uint32_t x = seed;
+    for (int i = 0; i < 16; ++i) {
+        x = x * 1103515245 + 12345;
+    }
+    return x;
+}
+
+void benchmarkMetrics()
+{
+    const int       rounds = 200000;
+    const char     *unit   = METRICS_CYCLE_HZ == 1e9 ? "ns" : "cycles";
+    Counter         counter;
+    Histogram       histogram;
+    uint32_t        sink = 0;
+    static uint32_t last;
+
+    uint32_t start = cycleCount();
+    for (int i = 0; i < rounds; ++i) {
+        counter.add();
+    }
+    const uint32_t adds = cycleCount() - start;
+
+    start = cycleCount();
+    for (int i = 0; i < rounds; ++i) {
+        histogram.record(i);
+    }
+    const uint32_t records = cycleCount() - start;
+
+    // The same body with and without what hSyncInt adds around it
+    start = cycleCount();
+    for (int i = 0; i < rounds; ++i) {
+        sink += syncWork(i);
+    }
+    const uint32_t bare = cycleCount() - start;
+
+    start = cycleCount();
+    for (int i = 0; i < rounds; ++i) {
+        const uint32_t entry = cycleCount();
+        sink += syncWork(i);
+        const int32_t off = (int32_t) (entry - last) - 6100;
+        histogram.record(off < 0 ? -off : off);
+        last = entry;
+        histogram.record(cycleCount() - entry);
+    }
+    const uint32_t instrumented = cycleCount() - start;
+
+    report("Counter add: %.1f %s, histogram record: %.1f %s\n",
+            (double) adds / rounds, unit, (double) records / rounds, unit);
+    report("Interrupt body: %.1f %s bare, %.1f %s instrumented (+%.1f)\n",
+            (double) bare / rounds, unit, (double) instrumented / rounds,
+            unit, (double) (instrumented - bare) / rounds);
+    if (sink == 1) {
+        report("\n");  // keeps the work from being optimised away
+    }
+}
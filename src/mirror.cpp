@@ -0,0 +1,507 @@
+// ====================================================== //
+// ============ TFT mirror of the framebuffer =========== //
+// ====================================================== //
+
+#include "mirror.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "convert.h"
+#include "report.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+#include "trace.h"
+#include "vga.h"
+
+static portMUX_TYPE mirrorMux = portMUX_INITIALIZER_UNLOCKED;
+#define MIRROR_LOCK()   portENTER_CRITICAL(&mirrorMux)
+#define MIRROR_UNLOCK() portEXIT_CRITICAL(&mirrorMux)
+#else
+#include <mutex>
+
+static std::mutex mirrorMutex;
+#define MIRROR_LOCK()   mirrorMutex.lock()
+#define MIRROR_UNLOCK() mirrorMutex.unlock()
+#endif
+
+// ─── Dirty Rectangles ───────────────────────────────────────────────────
+
+static long rectArea(const DirtyRect &r)
+{
+    return (long) r.w * r.h;
+}
+
+static DirtyRect unite(const DirtyRect &a, const DirtyRect &b)
+{
+    const int x0 = a.x < b.x ? a.x : b.x;
+    const int y0 = a.y < b.y ? a.y : b.y;
+    const int x1 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+    const int y1 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+    return DirtyRect{ x0, y0, x1 - x0, y1 - y0 };
+}
+
+// Overlapping, or sharing part of an edge; touching corners do not count,
+// as their union would mostly be clean
+static bool touches(const DirtyRect &a, const DirtyRect &b)
+{
+    const bool xOverlap = a.x < b.x + b.w && b.x < a.x + a.w;
+    const bool yOverlap = a.y < b.y + b.h && b.y < a.y + a.h;
+    const bool xTouch   = a.x <= b.x + b.w && b.x <= a.x + a.w;
+    const bool yTouch   = a.y <= b.y + b.h && b.y <= a.y + a.h;
+    return (xOverlap && yTouch) || (yOverlap && xTouch);
+}
+
+void DirtyRegion::add(DirtyRect rect)
+{
+    if (rect.w <= 0 || rect.h <= 0) {
+        return;
+    }
+
+    for (;;) {
+        // A merged rectangle may reach ones checked before, start over
+        for (int i = 0; i < count;) {
+            if (touches(rects[i], rect)) {
+                rect     = unite(rects[i], rect);
+                rects[i] = rects[--count];
+                i        = 0;
+            }
+            else {
+                ++i;
+            }
+        }
+        if (count < MIRROR_MAX_RECTS) {
+            break;
+        }
+
+        int  best  = 0;
+        long waste = -1;
+        for (int i = 0; i < count; ++i) {
+            const long w = rectArea(unite(rects[i], rect))
+                           - rectArea(rects[i]) - rectArea(rect);
+            if (waste < 0 || w < waste) {
+                best  = i;
+                waste = w;
+            }
+        }
+        rect        = unite(rects[best], rect);
+        rects[best] = rects[--count];
+    }
+    rects[count++] = rect;
+}
+
+long DirtyRegion::area() const
+{
+    long total = 0;
+    for (int i = 0; i < count; ++i)
+        total += rectArea(rects[i]);
+    return total;
+}
+
+// ─── Mirror ─────────────────────────────────────────────────────────────
+
+FrameMirror::FrameMirror(MirrorSink sink, int scale, size_t bandBytes)
+    : sink(sink),
+      factor(scale < 1 ? 1 : scale),
+      bandPixels(bandBytes / sizeof(uint16_t))
+{
+    // Bands may go out by DMA; the filtered row is only read by the CPU
+    Allocator &dma = heapAllocator(MemoryRegion::InternalDma);
+    bands[0]       = (uint16_t *) dma.allocate(bandBytes);
+    bands[1]       = (uint16_t *) dma.allocate(bandBytes);
+    line           = (Color *) heapAllocator(MemoryRegion::Internal)
+                   .allocate(bandPixels * sizeof(Color));
+    if (!bands[0] || !bands[1] || !line || !bandPixels) {
+        report("Mirror buffers could not be allocated\n");
+    }
+}
+
+FrameMirror::~FrameMirror()
+{
+    heapAllocator(MemoryRegion::InternalDma).deallocate(bands[0]);
+    heapAllocator(MemoryRegion::InternalDma).deallocate(bands[1]);
+    heapAllocator(MemoryRegion::Internal).deallocate(line);
+}
+
+void FrameMirror::markDirty(int x, int y, int w, int h)
+{
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    // Every display pixel the area touches, so merging works on what
+    // will actually be pushed
+    const int x0 = x / factor, x1 = (x + w + factor - 1) / factor;
+    const int y0 = y / factor, y1 = (y + h + factor - 1) / factor;
+    MIRROR_LOCK();
+    pending.add(DirtyRect{ x0, y0, x1 - x0, y1 - y0 });
+    MIRROR_UNLOCK();
+}
+
+void FrameMirror::markAll()
+{
+    MIRROR_LOCK();
+    everything = true;
+    MIRROR_UNLOCK();
+}
+
+size_t FrameMirror::update(const ImageView &source)
+{
+    if (!bands[0] || !bands[1] || !line || !bandPixels) {
+        return 0;
+    }
+    const uint32_t start  = nowMicros();
+    const int      width  = source.width / factor;
+    const int      height = source.height / factor;
+
+    // Marks made from here on wait for the next update
+    DirtyRegion dirty;
+    bool        all;
+    MIRROR_LOCK();
+    dirty      = pending;
+    all        = everything;
+    everything = false;
+    pending.clear();
+    MIRROR_UNLOCK();
+
+    if (source.pixels != shown || source.width != shownWidth
+            || source.height != shownHeight) {
+        shown       = source.pixels;
+        shownWidth  = source.width;
+        shownHeight = source.height;
+        all         = true;
+    }
+    if (all) {
+        dirty.clear();
+        dirty.add(DirtyRect{ 0, 0, width, height });
+    }
+
+    size_t bytes = 0;
+    for (int i = 0; i < dirty.size(); ++i) {
+        DirtyRect r = dirty[i];
+        r.w         = r.x + r.w > width ? width - r.x : r.w;
+        r.h         = r.y + r.h > height ? height - r.y : r.h;
+        if (r.w > 0 && r.h > 0) {
+            bytes += push(source, r);
+            ++stats.rects;
+        }
+    }
+
+    if (bytes) {
+        ++stats.updates;
+        stats.bytes     += bytes;
+        stats.lastBytes  = bytes;
+        stats.lastMicros = nowMicros() - start;
+    }
+    return bytes;
+}
+
+// Box-filtered a row at a time into alternating bands, as many whole
+// rows per push as a band holds
+size_t FrameMirror::push(const ImageView &source, const DirtyRect &rect)
+{
+    const int columns = rect.w < bandPixels ? rect.w : bandPixels;
+    const int right   = rect.x + rect.w;
+    const int bottom  = rect.y + rect.h;
+    size_t    bytes   = 0;
+
+    for (int x = rect.x; x < right; x += columns) {
+        const int       w    = right - x < columns ? right - x : columns;
+        const int       rows = bandPixels / w;
+        const ImageView strip
+                = source.sub(x * factor, 0, w * factor, source.height);
+
+        for (int y = rect.y; y < bottom; y += rows) {
+            const int h   = bottom - y < rows ? bottom - y : rows;
+            uint16_t *out = bands[band];
+            band ^= 1;
+            for (int i = 0; i < h; ++i) {
+                const Color *pixels = line;
+                if (factor == 1) {
+                    pixels = strip.row(y + i);
+                }
+                else {
+                    downscaleRow(strip, factor, y + i, line);
+                }
+                rgb888ToRgb565(pixels, out + i * w, w);
+            }
+            sink(x, y, w, h, out);
+            ++stats.pushes;
+            bytes += 2 * (size_t) w * h;
+        }
+    }
+    return bytes;
+}
+
+// ─── Display ────────────────────────────────────────────────────────────
+
+#ifdef ARDUINO
+
+static FrameMirror *tftMirror;
+static bool         tftDma;
+
+static void pushToTft(int x, int y, int w, int h, uint16_t *pixels)
+{
+    // The DMA push waits for the previous band, then swaps this one's
+    // bytes in place and returns while it goes out
+    if (tftDma) {
+        tft.pushImageDMA(x, y, w, h, pixels);
+    }
+    else {
+        tft.pushImage(x, y, w, h, pixels);
+    }
+}
+
+// Runs on the server's core, never on the one scanning out, and reads the
+// frame through PSRAM like any other task; the prefetch ring keeps
+// scanout ahead of that
+static void mirrorTask(void *args)
+{
+    TRACE_NAME_TRACK("mirror");
+    const TickType_t period = pdMS_TO_TICKS(1000 / MIRROR_FPS);
+    TickType_t       wake   = xTaskGetTickCount();
+    for (;;) {
+        vTaskDelayUntil(&wake, period);
+        tft.startWrite();
+        tftMirror->update(frontImage->view());
+        if (tftDma) {
+            tft.dmaWait();
+        }
+        tft.endWrite();
+    }
+}
+
+bool setupMirror()
+{
+    if (tftMirror) {
+        return true;
+    }
+    tftDma    = tft.initDMA();
+    tftMirror = new FrameMirror(pushToTft);
+    Serial.printf("Mirroring to the TFT with%s DMA\n", tftDma ? "" : "out");
+    return xTaskCreatePinnedToCore(
+                   mirrorTask, "Mirror Task", 4096, nullptr, 1, nullptr, 0)
+           == pdPASS;
+}
+
+void mirrorDirty(const ImageView &region)
+{
+    const Image *front = frontImage;
+    if (!tftMirror || region.empty() || !front->pixels) {
+        return;
+    }
+    const ptrdiff_t offset = region.pixels - front->pixels;
+    if (offset < 0 || offset >= (ptrdiff_t) front->xres * front->yres) {
+        return;
+    }
+    tftMirror->markDirty(offset % front->xres, offset / front->xres,
+            region.width, region.height);
+}
+
+#endif
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool contains(const DirtyRect &outer, const DirtyRect &inner)
+{
+    return inner.x >= outer.x && inner.y >= outer.y
+           && inner.x + inner.w <= outer.x + outer.w
+           && inner.y + inner.h <= outer.y + outer.h;
+}
+
+static bool testDirtyRegion()
+{
+    bool        ok = true;
+    DirtyRegion region;
+
+    region.add(DirtyRect{ 0, 0, 10, 10 });
+    region.add(DirtyRect{ 5, 5, 10, 10 });
+    ok &= check(region.size() == 1 && region.area() == 225, "overlap", 0);
+
+    region.add(DirtyRect{ 15, 0, 4, 15 });
+    ok &= check(region.size() == 1 && region.area() == 19 * 15, "edge", 0);
+
+    region.add(DirtyRect{ 19 + 5, 15 + 5, 3, 3 });
+    region.add(DirtyRect{ 19, 15, 2, 2 });
+    ok &= check(region.size() == 3, "corners and gaps stay apart", 0);
+
+    // A rectangle bridging two others joins all three
+    region.clear();
+    region.add(DirtyRect{ 0, 0, 4, 4 });
+    region.add(DirtyRect{ 10, 0, 4, 4 });
+    region.add(DirtyRect{ 4, 1, 6, 2 });
+    ok &= check(region.size() == 1 && region.area() == 14 * 4, "bridge", 0);
+
+    region.add(DirtyRect{ 3, 3, 0, 5 });
+    ok &= check(region.size() == 1, "empty ignored", 0);
+
+    // Scattered marks are capped, and everything marked stays covered
+    region.clear();
+    std::vector<DirtyRect> marked;
+    uint32_t               seed = 7;
+    for (int i = 0; i < 40; ++i) {
+        seed = seed * 1103515245 + 12345;
+        DirtyRect r{ (int) (seed >> 8) % 150, (int) (seed >> 16) % 110,
+            1 + (int) (seed >> 4) % 6, 1 + (int) (seed >> 12) % 6 };
+        marked.push_back(r);
+        region.add(r);
+        ok &= check(region.size() <= MIRROR_MAX_RECTS, "capped", i);
+    }
+    for (size_t i = 0; i < marked.size(); ++i) {
+        bool covered = false;
+        for (int j = 0; j < region.size(); ++j)
+            covered |= contains(region[j], marked[i]);
+        ok &= check(covered, "covered", i);
+    }
+    for (int i = 0; i < region.size(); ++i)
+        for (int j = i + 1; j < region.size(); ++j)
+            ok &= check(!touches(region[i], region[j]), "disjoint", i);
+    return ok;
+}
+
+// Stands in for the display: keeps what was pushed, and every push
+struct FakeTft
+{
+    int                     width, height;
+    std::vector<uint16_t>   screen;
+    std::vector<DirtyRect>  pushes;
+    std::vector<uint16_t *> buffers;
+
+    FakeTft(int width, int height)
+        : width(width), height(height), screen(width * height, 0xdead)
+    {}
+
+    void push(int x, int y, int w, int h, uint16_t *pixels)
+    {
+        pushes.push_back(DirtyRect{ x, y, w, h });
+        buffers.push_back(pixels);
+        for (int row = 0; row < h; ++row)
+            memcpy(&screen[(y + row) * width + x], pixels + row * w, 2 * w);
+    }
+};
+
+static uint16_t expected565(const ImageView &source, int scale, int x, int y)
+{
+    unsigned sum[3] = {};
+    for (int v = y * scale; v < (y + 1) * scale; ++v) {
+        for (int u = x * scale; u < (x + 1) * scale; ++u) {
+            const Color c = source.get(u, v);
+            sum[0] += c.r;
+            sum[1] += c.g;
+            sum[2] += c.b;
+        }
+    }
+    const unsigned n = scale * scale;
+    const unsigned r = (sum[0] + n / 2) / n, g = (sum[1] + n / 2) / n,
+                   b = (sum[2] + n / 2) / n;
+    return ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+}
+
+static bool sameScreen(const FakeTft &tft, const ImageView &source, int scale)
+{
+    for (int y = 0; y < tft.height; ++y)
+        for (int x = 0; x < tft.width; ++x)
+            if (tft.screen[y * tft.width + x]
+                    != expected565(source, scale, x, y)) {
+                return false;
+            }
+    return true;
+}
+
+static void paint(const ImageView &view, uint32_t seed)
+{
+    for (int y = 0; y < view.height; ++y) {
+        for (int x = 0; x < view.width; ++x) {
+            seed = seed * 1103515245 + 12345;
+            view.set(x, y, Color{ (unsigned char) (seed >> 24),
+                                   (unsigned char) (x * 4),
+                                   (unsigned char) (y * 4) });
+        }
+    }
+}
+
+bool testMirror()
+{
+    Allocator &heap = heapAllocator(MemoryRegion::Psram);
+    bool       ok   = testDirtyRegion();
+
+    // A 160x120 frame on a 40x30 display, four of its rows to a band
+    const int scale = 4, w = 40, h = 30, band = 160, rows = band / w;
+    Image     frame(w * scale, h * scale, heap);
+    Image     other(w * scale, h * scale, heap);
+    paint(frame.view(), 1);
+    paint(other.view(), 2);
+
+    FakeTft     tft(w, h);
+    FrameMirror mirror(
+            [&](int x, int y, int pw, int ph, uint16_t *pixels) {
+                tft.push(x, y, pw, ph, pixels);
+            },
+            scale, band * sizeof(uint16_t));
+
+    // The first image goes out whole, a band at a time
+    ok &= check(mirror.update(frame.view()) == 2 * w * h, "first bytes", 0);
+    ok &= check(sameScreen(tft, frame.view(), scale), "first screen", 0);
+    ok &= check(tft.pushes.size() == (h + rows - 1) / rows, "bands",
+            (long) tft.pushes.size());
+    for (size_t i = 0; i < tft.pushes.size(); ++i) {
+        ok &= check(tft.pushes[i].w * tft.pushes[i].h <= band, "band size",
+                i);
+        ok &= check(!i || tft.buffers[i] != tft.buffers[i - 1],
+                "alternating bands", i);
+    }
+
+    // Nothing marked, nothing pushed
+    tft.pushes.clear();
+    ok &= check(mirror.update(frame.view()) == 0 && tft.pushes.empty(),
+            "clean", 0);
+
+    // A small change goes out as the display pixels it touches
+    paint(frame.view(10, 5, 20, 5), 3);
+    mirror.markDirty(10, 5, 20, 5);
+    ok &= check(mirror.update(frame.view()) == 2 * 6 * 2, "small bytes", 0);
+    ok &= check(sameScreen(tft, frame.view(), scale), "small screen", 0);
+
+    // Two distant changes stay two rectangles, marks past the edge clip
+    tft.pushes.clear();
+    paint(frame.view(0, 0, 4, 4), 4);
+    paint(frame.view(150, 110, 10, 10), 5);
+    mirror.markDirty(0, 0, 4, 4);
+    mirror.markDirty(150, 110, 40, 40);
+    ok &= check(mirror.update(frame.view()) == 2 * (1 + 3 * 3), "two bytes",
+            0);
+    ok &= check(tft.pushes.size() == 2, "two pushes", 0);
+    ok &= check(sameScreen(tft, frame.view(), scale), "two screen", 0);
+
+    // Rows filling a band are pushed together
+    tft.pushes.clear();
+    paint(frame.view(0, 40, 160, 40), 6);
+    for (int y = 40; y < 80; ++y)
+        mirror.markDirty(0, y, 160, 1);
+    ok &= check(mirror.update(frame.view()) == 2 * w * 10, "rows bytes", 0);
+    ok &= check(tft.pushes.size() == (10 + rows - 1) / rows, "rows batched",
+            (long) tft.pushes.size());
+
+    // A flip pushes the new image whole, whatever was marked
+    mirror.markDirty(0, 0, 1, 1);
+    ok &= check(mirror.update(other.view()) == 2 * w * h, "flip bytes", 0);
+    ok &= check(sameScreen(tft, other.view(), scale), "flip screen", 0);
+
+    const MirrorStats &stats = mirror.lastStats();
+    ok &= check(stats.updates == 5 && stats.lastBytes == 2 * w * h, "stats",
+            stats.updates);
+
+    report("Mirror tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
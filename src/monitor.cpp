@@ -0,0 +1,455 @@
+// ====================================================== //
+// ====== Virtual VGA monitor for the native build ====== //
+// ====================================================== //
+
+#include "monitor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "report.h"
+
+#ifndef ARDUINO
+#include <chrono>
+
+#include "capture.h"
+#include "hal.h"
+#include "prefetch.h"
+#endif
+
+double modeLineUs(const VGAMode &mode)
+{
+    return mode.hFrontPorch + mode.hSyncTime + mode.hBackPorch
+         + mode.xres * mode.hPixel;
+}
+
+double modeFrameMs(const VGAMode &mode)
+{
+    return mode.vFrontPorch + mode.vSyncTime + mode.vBackPorch
+         + mode.yres * modeLineUs(mode) / 1000;
+}
+
+void Spread::add(double value)
+{
+    min = count ? std::min(min, value) : value;
+    max = count ? std::max(max, value) : value;
+    sum += value;
+    ++count;
+}
+
+// ─── Decoding ───────────────────────────────────────────────────────────
+
+VirtualMonitor::VirtualMonitor(
+        const MonitorPins &pins, const VGAMode &mode, Allocator &allocator)
+    : pins(pins),
+      mode(mode),
+      canvas(mode.xres, mode.yres, allocator),
+      shown(mode.xres, mode.yres, allocator)
+{
+    fill(canvas.view(), Color{ 0, 0, 0 });
+    fill(shown.view(), Color{ 0, 0, 0 });
+}
+
+// Draws what the DAC put out from the last change up to `until` into the
+// line being drawn. Pixel x shows what is out when the beam is in its
+// middle, lineStart + (x + 0.5) pixels, so a clock a little early or late
+// still lands on its pixel.
+void VirtualMonitor::paint(uint64_t until)
+{
+    if (y >= 0 && until > paintedTo && canvas.pixels) {
+        const double pixelNs = mode.hPixel * 1000;
+        const int    from    = std::max(0.0,
+                std::ceil(((double) paintedTo - lineStart) / pixelNs - 0.5));
+        const int    to      = std::min((double) mode.xres,
+                std::ceil(((double) until - lineStart) / pixelNs - 0.5));
+        const Color  out     = blanked ? Color{ 0, 0, 0 } : dac;
+        Color       *row     = canvas.view().row(y);
+        for (int x = from; x < to; ++x) {
+            row[x] = out;
+        }
+    }
+    paintedTo = until;
+}
+
+void VirtualMonitor::endLine()
+{
+    if (lineOpen) {
+        stats.pixelsPerLine.add(linePixels);
+        lineOpen = false;
+    }
+    y = -1;
+}
+
+void VirtualMonitor::signal(uint64_t at, uint64_t next)
+{
+    paint(at);
+    const uint64_t changed = levels ^ next;
+    levels                 = next;
+
+    auto rose = [&](int pin) { return (changed >> pin & 1) && level(pin); };
+    auto fell = [&](int pin) { return (changed >> pin & 1) && !level(pin); };
+
+    // The latches take the bus, the DAC takes the latches
+    const int latches[3] = { pins.latchR, pins.latchG, pins.latchB };
+    for (int i = 0; i < 3; ++i) {
+        if (rose(latches[i])) {
+            uint8_t byte = 0;
+            for (int bit = 0; bit < 8; ++bit) {
+                byte |= level(pins.bus[bit]) << bit;
+            }
+            latched[i] = byte;
+        }
+    }
+    if (fell(pins.blank)) {
+        blankFall = at;
+    }
+    if (rose(pins.blank)) {
+        if (vsyncLast && seenVsync) {
+            stats.vBackPorch.add((at - vsyncRise) / 1e6);
+        }
+        else if (seenHsync) {
+            stats.hBackPorch.add((at - hsyncRise) / 1e3);
+        }
+    }
+    blanked = !level(pins.blank);
+    if (rose(pins.dacClk)) {
+        dac = Color{ latched[0], latched[1], latched[2] };
+        if (blanked) {
+            ++stats.blankedPixels;
+        }
+        else {
+            ++linePixels;
+            ++framePixels;
+        }
+    }
+
+    // A line starts at hsync, its picture a back porch after
+    if (fell(pins.hsync)) {
+        if (seenHsync) {
+            stats.hsyncPeriod.add((at - hsyncFall) / 1e3);
+        }
+        if (blanked) {
+            stats.hFrontPorch.add((at - blankFall) / 1e3);
+        }
+        endLine();
+        hsyncFall = at;
+        seenHsync = true;
+        vsyncLast = false;
+        ++lines;
+    }
+    if (rose(pins.hsync) && seenHsync) {
+        stats.hsyncWidth.add((at - hsyncFall) / 1e3);
+        hsyncRise  = at;
+        lineStart  = at + mode.hBackPorch * 1e3;
+        lineOpen   = true;
+        linePixels = 0;
+        if (seenVsync && at >= firstLine && nextY < mode.yres) {
+            y = nextY++;
+        }
+    }
+
+    // A frame ends at vsync, and the next one's lines start a back porch
+    // after it
+    if (fell(pins.vsync)) {
+        if (blanked) {
+            stats.vFrontPorch.add((at - blankFall) / 1e6);
+        }
+        endLine();
+        if (seenVsync) {
+            ++stats.frames;
+            stats.vsyncPeriod.add((at - vsyncFall) / 1e6);
+            stats.linesPerFrame.add(lines);
+            stats.pixelsPerFrame.add(framePixels);
+            blit(shown.view(), canvas.view());
+            if (onFrame) {
+                onFrame(shown);
+            }
+        }
+        fill(canvas.view(), Color{ 0, 0, 0 });
+        lines       = 0;
+        framePixels = 0;
+        vsyncFall   = at;
+        seenVsync   = true;
+        vsyncLast   = true;
+    }
+    if (rose(pins.vsync) && seenVsync) {
+        stats.vsyncWidth.add((at - vsyncFall) / 1e6);
+        vsyncRise = at;
+        firstLine = at + mode.vBackPorch * 1e6;
+        nextY     = 0;
+        vsyncLast = true;
+    }
+}
+
+static void reportLine(std::string &out, const char *what, const Spread &s,
+        const char *unit, double nominal)
+{
+    appendf(out, "%-16s %10.3f %-5s (%.3f .. %.3f)  mode %.3f\n", what,
+            s.mean(), unit, s.min, s.max, nominal);
+}
+
+void writeMonitorReport(
+        std::string &out, const MonitorReport &stats, const VGAMode &mode)
+{
+    const int pixels = mode.xres / SCAN_STEP;
+
+    appendf(out, "%-16s %10u\n", "frames", stats.frames);
+    reportLine(out, "hsync period", stats.hsyncPeriod, "us",
+            modeLineUs(mode));
+    reportLine(out, "hsync width", stats.hsyncWidth, "us", mode.hSyncTime);
+    reportLine(
+            out, "h front porch", stats.hFrontPorch, "us", mode.hFrontPorch);
+    reportLine(out, "h back porch", stats.hBackPorch, "us", mode.hBackPorch);
+    reportLine(out, "vsync period", stats.vsyncPeriod, "ms",
+            modeFrameMs(mode));
+    reportLine(out, "vsync width", stats.vsyncWidth, "ms", mode.vSyncTime);
+    reportLine(
+            out, "v front porch", stats.vFrontPorch, "ms", mode.vFrontPorch);
+    reportLine(out, "v back porch", stats.vBackPorch, "ms", mode.vBackPorch);
+    reportLine(out, "lines/frame", stats.linesPerFrame, "", mode.yres);
+    reportLine(out, "pixels/line", stats.pixelsPerLine, "", pixels);
+    reportLine(out, "pixels/frame", stats.pixelsPerFrame, "",
+            pixels * (mode.yres / SCAN_STEP));
+    appendf(out, "%-16s %10u\n", "blanked pixels", stats.blankedPixels);
+}
+
+MonitorPins boardMonitorPins()
+{
+    MonitorPins pins{ hsyncPin, vsyncPin, blankPin, dacClkPin, leRPin, leGPin,
+        leBPin, {} };
+    for (int i = 0; i < 8; ++i) {
+        pins.bus[i] = colorPins[i];
+    }
+    return pins;
+}
+
+// ─── Native Scanout ─────────────────────────────────────────────────────
+
+#ifndef ARDUINO
+bool writePng(const ImageView &image, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    FrameEncoder encoder(image, CaptureFormat::Png);
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            fwrite(data, 1, size, file);
+        });
+        while (encoder.next(out)) {
+        }
+    }
+    return fclose(file) == 0;
+}
+
+MonitorReport simulateScanout(int frames, Image *last)
+{
+    VirtualMonitor monitor(boardMonitorPins(), VGA480p);
+
+    halSimReset();
+    halSimSink([&](uint64_t at, uint64_t levels) {
+        monitor.signal(at, levels);
+    });
+    vga.setup();
+
+    // The first vsync opens the first frame
+    const double frameNs = VGA480p.yres * VGA480p.vLine * 1e6;
+    halSimRun(scanoutStep, (uint64_t) ((frames + 1) * frameNs + 1e6));
+    halSimSink(nullptr);
+
+    if (last) {
+        blit(last->view(), monitor.frame().view());
+    }
+    return monitor.report();
+}
+
+void benchmarkScanout(int frames)
+{
+    const auto          start  = std::chrono::steady_clock::now();
+    const MonitorReport stats  = simulateScanout(frames);
+    const double        millis = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start)
+                                  .count();
+
+    report("Simulated %u frames in %.0f ms (%.1f ms per frame), "
+           "%.0f pixels per frame of %d\n",
+            stats.frames, millis, millis / std::max(1u, stats.frames),
+            stats.pixelsPerFrame.mean(),
+            (VGA480p.xres / SCAN_STEP) * (VGA480p.yres / SCAN_STEP));
+}
+#endif
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool near(double value, double expected, double tolerance)
+{
+    return std::fabs(value - expected) <= tolerance;
+}
+
+// A hand-timed signal of a 4 x 2 mode, all steps 1 µs: the decoded frame
+// and every measured timing are known exactly
+static bool testDecoding()
+{
+    const VGAMode     tiny = { 4, 2, 1, 1, 1, 1, 0.01, 0.01, 0.01, 0.01 };
+    const MonitorPins pins = { 0, 1, 2, 3, 4, 5, 6,
+        { 8, 9, 10, 11, 12, 13, 14, 15 } };
+    const Color       colors[2][4] = {
+        { { 255, 0, 0 }, { 0, 255, 0 }, { 0, 0, 255 }, { 9, 8, 7 } },
+        { { 1, 2, 3 }, { 100, 150, 200 }, { 0, 0, 0 }, { 255, 255, 255 } },
+    };
+
+    bool           ok = true;
+    VirtualMonitor monitor(pins, tiny);
+    int            frames = 0;
+    monitor.onFrame = [&](const Image &) { ++frames; };
+
+    uint64_t levels = 1u << 0 | 1u << 1 | 1u << 2;  // syncs idle, unblanked
+    uint64_t now    = 0;
+    auto     pin    = [&](int n, bool high) {
+        levels = high ? levels | 1ull << n : levels & ~(1ull << n);
+        monitor.signal(now, levels);
+    };
+    auto pulse = [&](int n) {
+        pin(n, true);
+        now += 10;
+        pin(n, false);
+    };
+
+    for (int frame = 0; frame < 3; ++frame) {
+        // Vertical: front porch, sync and back porch, 10 µs each
+        pin(2, false);
+        now += 10000;
+        pin(1, false);
+        now += 10000;
+        pin(1, true);
+        now += 10000;
+        pin(2, true);
+
+        for (int line = 0; line < 2; ++line) {
+            const uint64_t start = now;
+            pin(2, false);
+            now += 1000;
+            pin(0, false);
+            now += 1000;
+            pin(0, true);
+            now += 1000;
+            pin(2, true);
+
+            // Each pixel shortly before the beam gets there
+            for (int x = 0; x < 4; ++x) {
+                now              = start + 3000 + x * 1000 - 200;
+                const Color c    = colors[line][x];
+                const uint8_t rgb[3] = { c.r, c.g, c.b };
+                for (int i = 0; i < 3; ++i) {
+                    levels &= ~0xff00ull;
+                    levels |= (uint64_t) rgb[i] << 8;
+                    monitor.signal(now, levels);
+                    pulse(4 + i);
+                }
+                pulse(3);
+            }
+            now = start + 7000;
+        }
+    }
+    pin(2, false);
+    now += 10000;
+    pin(1, false);
+
+    const MonitorReport &r = monitor.report();
+    ok &= check(frames == 3 && r.frames == 3, "frames", r.frames);
+    for (int y = 0; y < 2; ++y) {
+        for (int x = 0; x < 4; ++x) {
+            const Color got  = monitor.frame().view().get(x, y);
+            const Color want = colors[y][x];
+            ok &= check(got.r == want.r && got.g == want.g && got.b == want.b,
+                    "pixel", y * 4 + x);
+        }
+    }
+    ok &= check(near(r.hsyncWidth.mean(), 1, 1e-9), "hsync width",
+            r.hsyncWidth.mean());
+    ok &= check(near(r.hFrontPorch.mean(), 1, 1e-9)
+                        && near(r.hBackPorch.mean(), 1, 1e-9),
+            "h porches", r.hBackPorch.mean());
+    ok &= check(near(r.hsyncPeriod.min, 7, 1e-9), "hsync period",
+            r.hsyncPeriod.min);
+    ok &= check(near(r.vsyncWidth.mean(), 0.01, 1e-9)
+                        && near(r.vFrontPorch.mean(), 0.01, 1e-9)
+                        && near(r.vBackPorch.mean(), 0.01, 1e-9),
+            "v timings", r.vsyncWidth.mean());
+    ok &= check(near(r.vsyncPeriod.mean(), 0.044, 1e-9), "vsync period",
+            r.vsyncPeriod.mean());
+    ok &= check(r.linesPerFrame.min == 2 && r.linesPerFrame.max == 2,
+            "lines", r.linesPerFrame.max);
+    ok &= check(r.pixelsPerLine.min == 4 && r.pixelsPerLine.max == 4,
+            "pixels per line", r.pixelsPerLine.min);
+    ok &= check(r.blankedPixels == 0, "blanked pixels", r.blankedPixels);
+
+    std::string text;
+    writeMonitorReport(text, r, tiny);
+    ok &= check(text.find("hsync width") != std::string::npos, "report", 0);
+    return ok;
+}
+
+#ifndef ARDUINO
+static void solidLine(
+        Color *line, int y, int width, int height, uint32_t, int step)
+{
+    for (int i = 0; i * step < width; ++i) {
+        line[i] = Color{ 200, 100, 50 };
+    }
+}
+
+// The real scanout through the simulated HAL, against the mode it runs
+static bool testScanout()
+{
+    bool  ok = true;
+    Image last(VGA480p.xres, VGA480p.yres, heapAllocator(MemoryRegion::Psram));
+
+    const LineGenerator previous = scanoutGenerator;
+    scanoutGenerator             = solidLine;
+    const MonitorReport r        = simulateScanout(2, &last);
+    scanoutGenerator             = previous;
+
+    ok &= check(r.frames == 2, "scanout frames", r.frames);
+    ok &= check(near(r.vsyncPeriod.mean(), VGA480p.yres * VGA480p.vLine, 0.01),
+            "scanout vsync period", r.vsyncPeriod.mean());
+    // vsync holds hsync off for its whole pulse, so lines are measured by
+    // the shortest period
+    ok &= check(near(r.hsyncPeriod.min, VGA480p.xres * VGA480p.hPixel, 0.2),
+            "scanout hsync period", r.hsyncPeriod.min);
+    ok &= check(near(r.hsyncWidth.mean(), VGA480p.hSyncTime, 0.2),
+            "scanout hsync width", r.hsyncWidth.mean());
+    ok &= check(near(r.vsyncWidth.mean(), VGA480p.vSyncTime, 0.01),
+            "scanout vsync width", r.vsyncWidth.mean());
+    ok &= check(r.pixelsPerLine.max > 0, "scanout pixels", 0);
+
+    // Every pixel the beam drew is the generator's colour or blanking
+    int lit = 0, wrong = 0;
+    for (int y = 0; y < last.yres; ++y) {
+        for (int x = 0; x < last.xres; ++x) {
+            const Color c = last.view().get(x, y);
+            if (c.r == 200 && c.g == 100 && c.b == 50) {
+                ++lit;
+            }
+            else if (c.r || c.g || c.b) {
+                ++wrong;
+            }
+        }
+    }
+    ok &= check(lit > last.xres * last.yres / 2, "scanout lit", lit);
+    ok &= check(!wrong, "scanout colours", wrong);
+    return ok;
+}
+#endif
+
+bool testMonitor()
+{
+    bool ok = testDecoding();
+#ifndef ARDUINO
+    ok &= testScanout();
+#endif
+    report("Monitor test %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
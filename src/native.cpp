@@ -0,0 +1,212 @@
+// ====================================================== //
+// ========= Native build: scanout on a desktop ========= //
+// ====================================================== //
+
+// `pio run -e native -t exec` runs every module's self-test, the scanout
+// against the virtual monitor with its timing report, then the
+// benchmarks, and exits non-zero when a test failed; with arguments,
+// `program [frames] [out.png]` also saves the last frame the monitor
+// showed. `program test` runs the self-tests alone.
+//
+// `program analyze <capture.vcd|.csv> [hsync=D0,...,rate=24e6] [out.png]`
+// reports on a logic-analyzer capture of the board instead, and `program
+// capture <out.vcd|.csv> [frames]` writes the simulated scanout as one.
+
+#ifndef ARDUINO
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "affine.h"
+#include "allocator.h"
+#include "analyzer.h"
+#include "boot.h"
+#include "capture.h"
+#include "compositor.h"
+#include "convert.h"
+#include "dircache.h"
+#include "generators.h"
+#include "http.h"
+#include "httpd.h"
+#include "image.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "monitor.h"
+#include "playlist.h"
+#include "prefetch.h"
+#include "renderer.h"
+#include "report.h"
+#include "rle.h"
+#include "stream.h"
+#include "tar.h"
+#include "trace.h"
+#include "vga.h"
+#include "writer.h"
+
+static int analyze(int argc, char **argv)
+{
+    LogicChannels channels = defaultLogicChannels();
+    if (argc > 3 && !parseLogicChannels(argv[3], channels)) {
+        fprintf(stderr, "Bad channel list %s\n", argv[3]);
+        return 2;
+    }
+
+    std::string text;
+    Image       last(VGA480p.xres, VGA480p.yres);
+    if (!analyzeCaptureFile(argv[2], channels, VGA480p, text, &last)) {
+        return 1;
+    }
+    fputs(text.c_str(), stdout);
+    if (argc > 4 && !writePng(last.view(), argv[4])) {
+        fprintf(stderr, "Could not write %s\n", argv[4]);
+        return 1;
+    }
+    return 0;
+}
+
+static void testCard()
+{
+    // Colour bars over a grey ramp, so smearing and tearing show
+    static const Color bars[8] = { { 255, 255, 255 }, { 255, 255, 0 },
+        { 0, 255, 255 }, { 0, 255, 0 }, { 255, 0, 255 }, { 255, 0, 0 },
+        { 0, 0, 255 }, { 0, 0, 0 } };
+    for (int y = 0; y < image.yres; ++y) {
+        for (int x = 0; x < image.xres; ++x) {
+            const uint8_t grey = x * 255 / (image.xres - 1);
+            image.set(x, y,
+                    y < image.yres * 3 / 4 ? bars[x * 8 / image.xres]
+                                           : Color{ grey, grey, grey });
+        }
+    }
+}
+
+// The tests that touch files share a fresh folder under /tmp each run,
+// removed again at the end
+static std::string scratchFolder()
+{
+    char path[] = "/tmp/vga-native-XXXXXX";
+    return mkdtemp(path) ? path : "";
+}
+
+static void removeFolder(const std::string &dir)
+{
+    TreeProgress progress;
+    if (!dir.empty()) {
+        removeTree(dir.c_str(), false, nullptr, progress);
+    }
+}
+
+// Every module's self-test that builds on the host, the plain data
+// structures before what is built on them; false when any failed
+static bool runTests(const std::string &dir)
+{
+    bool ok = testAllocator(10000);
+    ok &= testImage();
+    ok &= testCapture();
+    ok &= testConvert();
+    ok &= testMetrics();
+    ok &= testTrace();
+    ok &= testStream((dir + "/stream.bin").c_str());
+    ok &= testChunkedWriter();
+    ok &= testRevalidate();
+    ok &= testHttpRanges(dir.c_str());
+    ok &= testHttpServer();
+    ok &= testWriteBehind();
+    ok &= testDirCache(dir.c_str());
+    ok &= testTar(dir.c_str());
+    ok &= testJobs(dir.c_str());
+    ok &= testBoot(dir.c_str());
+    ok &= testMirror();
+    ok &= testPlaylist();
+    ok &= testPrefetch();
+    ok &= testRenderer();
+    ok &= testAffine();
+    ok &= testCompositor();
+    ok &= testRle();
+    ok &= testGenerators();
+    ok &= testMonitor();
+    ok &= testAnalyzer();
+    return ok;
+}
+
+static void runBenchmarks(const std::string &dir, int frames)
+{
+    benchmarkCapture(image.view());
+    benchmarkConvert();
+    benchmarkMetrics();
+    benchmarkTrace();
+    benchmarkStream((dir + "/stream-bench.bin").c_str());
+    benchmarkHttpServer(4, 200);
+    benchmarkDirCache((dir + "/listing").c_str(), 1000);
+    benchmarkTar(dir.c_str(), 50, 20000);
+    benchmarkJobs(dir.c_str(), 1000);
+    benchmarkRenderer(4);
+    benchmarkAffine(image, VGA480p);
+    benchmarkCompositor(VGA480p);
+
+    // The bars alone: the grey ramp under them changes colour every pixel
+    Image bars(image.xres, image.yres);
+    scale(bars.view(), image.view(0, 0, image.xres, image.yres / 2));
+    benchmarkRle(bars, VGA480p);
+
+    // Generators that scan out state get some: the bars run-length
+    // encoded, and a crossfade from the card to them that is halfway at
+    // frame 0, which is the frame the benchmark draws
+    RleImage rle(bars.xres, bars.yres, 32768);
+    rleFrame = rle.encode(bars.view()) ? &rle : nullptr;
+    beginTransition(&image, &bars, Transition::Crossfade, UINT32_MAX, 2);
+    benchmarkGenerators(VGA480p);
+    beginTransition(nullptr, nullptr, Transition::Crossfade, 0, 0);
+    rleFrame = nullptr;
+
+    benchmarkScanout(frames);
+    benchmarkAnalyzer();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2 && !strcmp(argv[1], "analyze")) {
+        return analyze(argc, argv);
+    }
+    if (argc > 2 && !strcmp(argv[1], "capture")) {
+        testCard();
+        return writeScanoutCapture(argv[2], argc > 3 ? atoi(argv[3]) : 2)
+                     ? 0
+                     : 1;
+    }
+
+    const std::string dir = scratchFolder();
+    if (dir.empty()) {
+        fprintf(stderr, "Could not make a folder under /tmp\n");
+        return 1;
+    }
+    bool ok = runTests(dir);
+    if (argc > 1 && !strcmp(argv[1], "test")) {
+        removeFolder(dir);
+        report("Self-tests %s\n", ok ? "passed" : "FAILED");
+        return ok ? 0 : 1;
+    }
+
+    const int   frames = argc > 1 ? atoi(argv[1]) : 4;
+    const char *path   = argc > 2 ? argv[2] : nullptr;
+    testCard();
+
+    Image               last(image.xres, image.yres);
+    const MonitorReport stats = simulateScanout(frames, &last);
+
+    std::string text;
+    writeMonitorReport(text, stats, VGA480p);
+    fputs(text.c_str(), stdout);
+
+    if (path && !writePng(last.view(), path)) {
+        fprintf(stderr, "Could not write %s\n", path);
+        ok = false;
+    }
+    runBenchmarks(dir, frames);
+    removeFolder(dir);
+    report("Self-tests %s\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,717 @@
+// ====================================================== //
+// ============= Slideshows of images on SD ============= //
+// ====================================================== //
+
+#include "playlist.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "report.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+#include "generators.h"
+#include "vga.h"
+#endif
+
+// ─── Player ─────────────────────────────────────────────────────────────
+
+PlaylistPlayer::PlaylistPlayer(
+        PlaylistHost host, int width, int height, Allocator &allocator)
+    : host(std::move(host)),
+      buffers{ { width, height, allocator }, { width, height, allocator } }
+{}
+
+void PlaylistPlayer::note(PlaylistEventKind kind, int index)
+{
+    if (onEvent) {
+        onEvent(PlaylistEvent{ kind, index, host.now() });
+    }
+}
+
+bool PlaylistPlayer::prefetch(
+        const PlaylistItem &item, int index, Image &target)
+{
+    note(PlaylistEventKind::DecodeStart, index);
+    const uint32_t begin = host.now();
+
+    // A smaller image must not leave the one before showing around it
+    fill(target.view(), Color{ 0, 0, 0 });
+    const bool ok = host.decode(item.path.c_str(), target.view());
+
+    stats.lastDecodeMs = host.now() - begin;
+    if (!ok) {
+        ++stats.failed;
+        report("Playlist: failed to decode %s, skipped\n", item.path.c_str());
+    }
+    note(ok ? PlaylistEventKind::DecodeEnd : PlaylistEventKind::DecodeFailed,
+            index);
+    return ok;
+}
+
+// Sleeps in slices so a stop request is noticed; false when stopped
+bool PlaylistPlayer::sleepUntil(uint32_t dueMs)
+{
+    while (!stopping) {
+        const int32_t left = dueMs - host.now();
+        if (left <= 0) {
+            return true;
+        }
+        host.sleep(left < PLAYLIST_POLL_MS ? left : PLAYLIST_POLL_MS);
+    }
+    return false;
+}
+
+bool PlaylistPlayer::play(const std::vector<PlaylistItem> &items, bool loop)
+{
+    stats    = PlaylistStats{};
+    stopping = false;
+    if (items.empty() || !buffers[0].pixels || !buffers[1].pixels) {
+        return false;
+    }
+
+    // A single item stays up anyway, there is nothing to loop through
+    loop &= items.size() > 1;
+
+    // The player outlives its runs, and the last one may have left either
+    // buffer on screen; the first decode goes into the other
+    const Image *shown    = host.shown ? host.shown() : nullptr;
+    const int    count    = items.size();
+    const Image *front    = nullptr;  // none of this run's on screen yet
+    Image       *back     = shown == &buffers[0] ? &buffers[1] : &buffers[0];
+    int          index    = 0;
+    int          failures = 0;  // in a row, to give up on a dead card
+    uint32_t     due      = 0;  // when the next switch should start
+
+    while (!stopping) {
+        const PlaylistItem &item = items[index];
+
+        // Decoding while the item before is on screen, the switch only
+        // waits if this takes longer than that item is shown
+        if (prefetch(item, index, *back)) {
+            failures = 0;
+
+            const uint32_t ready = host.now();
+            if (!front) {
+                due = ready;
+            }
+            else if ((int32_t) (ready - due) > 0) {
+                ++stats.late;
+                if (ready - due > stats.maxLateMs) {
+                    stats.maxLateMs = ready - due;
+                }
+            }
+            if (!sleepUntil(due)) {
+                break;
+            }
+
+            const uint32_t   start = host.now();
+            const Transition kind  = front ? item.transition : Transition::Cut;
+            const uint32_t   ms
+                    = kind == Transition::Cut ? 0 : item.transitionMs;
+            note(PlaylistEventKind::Switch, index);
+            host.transition(front, back, kind, ms);
+            ++stats.switches;
+
+            due   = start + ms + item.showMs;
+            front = back;
+            back  = back == &buffers[0] ? &buffers[1] : &buffers[0];
+        }
+        else if (++failures == count) {
+            break;
+        }
+
+        if (++index == count) {
+            if (!loop) {
+                break;
+            }
+            index = 0;
+        }
+    }
+
+    // The last item still gets its time on screen
+    if (front && !stopping) {
+        sleepUntil(due);
+    }
+    return front && !stopping;
+}
+
+void PlaylistPlayer::stop()
+{
+    stopping = true;
+}
+
+// ─── Parsing ────────────────────────────────────────────────────────────
+
+static bool parseSeconds(const std::string &text, uint32_t &ms)
+{
+    char        *end;
+    const double seconds = strtod(text.c_str(), &end);
+    if (end == text.c_str() || *end || seconds < 0 || seconds > 86400) {
+        return false;
+    }
+    ms = seconds * 1000 + 0.5;
+    return true;
+}
+
+static bool parseTransition(const std::string &name, Transition &kind)
+{
+    if (name == "cut") {
+        kind = Transition::Cut;
+    }
+    else if (name == "fade" || name == "crossfade") {
+        kind = Transition::Crossfade;
+    }
+    else if (name == "wipe") {
+        kind = Transition::Wipe;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+const char *transitionName(Transition kind)
+{
+    switch (kind) {
+        case Transition::Crossfade:
+            return "fade";
+        case Transition::Wipe:
+            return "wipe";
+        default:
+            return "cut";
+    }
+}
+
+bool parsePlaylist(const char *text, std::vector<PlaylistItem> &items)
+{
+    items.clear();
+
+    while (*text) {
+        const size_t length = strcspn(text, ",\n");
+        std::string  entry(text, length);
+        text += length + (text[length] != '\0');
+
+        // Surrounding blanks and the \r of CRLF files
+        const size_t first = entry.find_first_not_of(" \t\r");
+        if (first == std::string::npos) {
+            continue;
+        }
+        const size_t last = entry.find_last_not_of(" \t\r");
+        entry             = entry.substr(first, last + 1 - first);
+
+        std::vector<std::string> fields;
+        size_t                   at = 0;
+        for (;;) {
+            const size_t colon = entry.find(':', at);
+            fields.push_back(entry.substr(at, colon - at));
+            if (colon == std::string::npos) {
+                break;
+            }
+            at = colon + 1;
+        }
+
+        PlaylistItem item{ fields[0], PLAYLIST_SHOW_MS, Transition::Cut, 0 };
+        if (item.path.empty() || fields.size() > 4
+                || items.size() == PLAYLIST_MAX_ITEMS) {
+            return false;
+        }
+        if (fields.size() > 1 && !fields[1].empty()
+                && !parseSeconds(fields[1], item.showMs)) {
+            return false;
+        }
+        if (fields.size() > 2) {
+            if (!parseTransition(fields[2], item.transition)) {
+                return false;
+            }
+            if (item.transition != Transition::Cut) {
+                item.transitionMs = PLAYLIST_FADE_MS;
+            }
+        }
+        if (fields.size() > 3 && !fields[3].empty()
+                && !parseSeconds(fields[3], item.transitionMs)) {
+            return false;
+        }
+        items.push_back(std::move(item));
+    }
+    return !items.empty();
+}
+
+// ─── Transitions ────────────────────────────────────────────────────────
+
+struct TransitionState
+{
+    const Image *from;
+    const Image *to;
+    Transition   kind;
+    uint32_t     startFrame;
+    uint32_t     frames;
+};
+
+// Set before the generator is selected, only read during scanout
+static TransitionState transition;
+
+void beginTransition(const Image *from, const Image *to, Transition kind,
+        uint32_t startFrame, uint32_t frames)
+{
+    transition = TransitionState{ from, to, kind, startFrame,
+        frames ? frames : 1 };
+}
+
+void transitionLine(Color *line, int y, int width, int height, uint32_t frame,
+        int step)
+{
+    const TransitionState &t     = transition;
+    const int              count = (width + step - 1) / step;
+    if (!t.from || !t.to || y >= t.from->yres || y >= t.to->yres) {
+        memset(line, 0, count * sizeof(Color));
+        return;
+    }
+
+    // Progress in 8.8 fixed point, frames before the start count as 0
+    const int32_t  elapsed = frame - t.startFrame;
+    const uint32_t a       = elapsed <= 0 ? 0
+                             : (uint32_t) elapsed >= t.frames
+                                     ? 256
+                                     : ((uint32_t) elapsed << 8) / t.frames;
+
+    const int    w    = std::min(width, std::min(t.from->xres, t.to->xres));
+    const Color *from = t.from->pixels + y * t.from->xres;
+    const Color *to   = t.to->pixels + y * t.to->xres;
+    int          i    = 0;
+
+    if (step > 1) {
+        // Sampled for scanout: one pixel in `step`, no runs to copy
+        const int edge = t.kind == Transition::Wipe ? (w * a) >> 8 : 0;
+        for (int x = 0; x < w; ++i, x += step) {
+            if (t.kind == Transition::Wipe) {
+                line[i] = x < edge ? to[x] : from[x];
+            }
+            else {
+                line[i] = from[x];
+                blendPixel(line[i], to[x], a);
+            }
+        }
+    }
+    else {
+        if (t.kind == Transition::Wipe) {
+            const int edge = (w * a) >> 8;
+            memcpy(line, to, edge * sizeof(Color));
+            memcpy(line + edge, from + edge, (w - edge) * sizeof(Color));
+        }
+        else if (a == 0 || a == 256) {
+            memcpy(line, a ? to : from, w * sizeof(Color));
+        }
+        else {
+            for (int x = 0; x < w; ++x) {
+                line[x] = from[x];
+                blendPixel(line[x], to[x], a);
+            }
+        }
+        i = w;
+    }
+    if (i < count) {
+        memset(line + i, 0, (count - i) * sizeof(Color));
+    }
+}
+
+// ─── Device Player ──────────────────────────────────────────────────────
+
+#ifdef ARDUINO
+
+static PlaylistPlayer            *player;
+static std::vector<PlaylistItem>  queued;
+static bool                       queuedLoop;
+static volatile bool              playing;
+
+static double frameMillis()
+{
+    return VGA480p.yres * VGA480p.vLine + VGA480p.vFrontPorch
+           + VGA480p.vSyncTime + VGA480p.vBackPorch;
+}
+
+// Scanout runs the blend from the frame count, this only starts it and
+// flips to the new image once it is complete
+static void scanoutTransition(
+        const Image *from, Image *to, Transition kind, uint32_t ms)
+{
+    if (!from || kind == Transition::Cut || !ms) {
+        selectGenerator("none");
+        presentImage(to);
+        waitForVsync();
+        return;
+    }
+
+    const uint32_t frames = std::max(1L, lround(ms / frameMillis()));
+    const uint32_t start  = frameCount + 1;
+    beginTransition(from, to, kind, start, frames);
+    selectGenerator("transition");
+    while ((int32_t) (frameCount - (start + frames)) < 0) {
+        if (!waitForVsync(100)) {
+            break;  // the signal stopped
+        }
+    }
+
+    // The last frames showed `to` alone, so handing it to plain scanout
+    // changes nothing on screen
+    presentImage(to);
+    waitForVsync();
+    selectGenerator("none");
+}
+
+static void playlistTask(void *args)
+{
+    player->play(queued, queuedLoop);
+
+    const PlaylistStats &stats = player->lastStats();
+    Serial.printf("Playlist ended: %u switches, %u late (worst %u ms), "
+                  "%u failed\n",
+            stats.switches, stats.late, stats.maxLateMs, stats.failed);
+    playing = false;
+    vTaskDelete(nullptr);
+}
+
+bool startPlaylist(const std::vector<PlaylistItem> &items, bool loop)
+{
+    stopPlaylist();
+    if (!player) {
+        player = new PlaylistPlayer(PlaylistHost{
+                [] { return (uint32_t) millis(); },
+                [](uint32_t ms) { vTaskDelay(pdMS_TO_TICKS(ms)); },
+                [](const char *path, const ImageView &target) {
+                    return decodePng(path, target);
+                },
+                scanoutTransition,
+                [] { return (const Image *) frontImage; } });
+    }
+
+    queued     = items;
+    queuedLoop = loop;
+    playing    = true;
+    vga.setup();
+    if (xTaskCreatePinnedToCore(
+                playlistTask, "Playlist Task", 8192, nullptr, 1, nullptr, 0)
+            != pdPASS) {
+        playing = false;
+        return false;
+    }
+    return true;
+}
+
+// Waits for the player to notice, which may take the rest of a decode
+void stopPlaylist()
+{
+    if (!player) {
+        return;
+    }
+    player->stop();
+    while (playing) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
+bool playlistRunning()
+{
+    return playing;
+}
+
+PlaylistStats playlistStats()
+{
+    return player ? player->lastStats() : PlaylistStats{};
+}
+
+#endif
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+#define SIM_FRAME_MS 20  // simulated vsync period
+
+// A clock that only moves when the player sleeps, decodes or transitions;
+// decoding `path` costs `costs[path[1] - 'a']` ms and paints the image a
+// colour of its own, paths starting with "/x" fail
+struct PlaylistSimulation
+{
+    uint32_t                   clock{};
+    uint32_t                   costs[26]{};
+    std::vector<PlaylistEvent> events;
+    const Image               *shown{};
+    bool                       handoffOk{ true };
+    bool                       contentOk{ true };
+    int                        stopAfter{};  // switches, 0 for never
+    PlaylistPlayer            *player{};
+
+    static Color colorOf(const char *path)
+    {
+        return Color{ (uint8_t) path[1], (uint8_t) strlen(path), 77 };
+    }
+
+    PlaylistHost host()
+    {
+        return PlaylistHost{ [this] { return clock; },
+            [this](uint32_t ms) { clock += ms; },
+            [this](const char *path, const ImageView &target) {
+                if (path[1] == 'x') {
+                    clock += 10;
+                    return false;
+                }
+                contentOk &= !shown || target.pixels != shown->pixels;
+                clock += costs[(path[1] - 'a') % 26];
+                fill(target, colorOf(path));
+                return true;
+            },
+            [this](const Image *from, Image *to, Transition kind,
+                    uint32_t ms) {
+                // Starts at a vsync and lasts whole frames
+                clock = (clock + SIM_FRAME_MS - 1) / SIM_FRAME_MS
+                        * SIM_FRAME_MS;
+                clock += (ms + SIM_FRAME_MS - 1) / SIM_FRAME_MS * SIM_FRAME_MS;
+                handoffOk &= (from ? from == shown : kind == Transition::Cut)
+                             && to != shown;
+                shown = to;
+            },
+            [this] { return shown; } };
+    }
+
+    void attach(PlaylistPlayer &playing)
+    {
+        player          = &playing;
+        playing.onEvent = [this](const PlaylistEvent &event) {
+            events.push_back(event);
+            if (event.kind != PlaylistEventKind::Switch || !stopAfter) {
+                return;
+            }
+            int switches = 0;
+            for (const PlaylistEvent &e : events) {
+                switches += e.kind == PlaylistEventKind::Switch;
+            }
+            if (switches == stopAfter) {
+                player->stop();
+            }
+        };
+    }
+
+    // When `kind` happened to item `index`, the `nth` time
+    long at(PlaylistEventKind kind, int index, int nth = 0) const
+    {
+        for (const PlaylistEvent &e : events) {
+            if (e.kind == kind && e.index == index && !nth--) {
+                return e.atMs;
+            }
+        }
+        return -1;
+    }
+};
+
+static bool testTimings()
+{
+    Allocator &heap = heapAllocator(MemoryRegion::Psram);
+    bool       ok   = true;
+
+    // Switches land exactly on schedule, each decode overlapping the item
+    // before it on screen
+    {
+        PlaylistSimulation sim;
+        sim.costs[0] = sim.costs[1] = sim.costs[2] = 100;
+        PlaylistPlayer player(sim.host(), 16, 8, heap);
+        sim.attach(player);
+
+        std::vector<PlaylistItem> items = {
+            { "/a.png", 1000, Transition::Cut, 0 },
+            { "/b.png", 1000, Transition::Crossfade, 200 },
+            { "/c.png", 500, Transition::Wipe, 300 },
+        };
+        ok &= check(player.play(items, false), "played", 0);
+
+        const auto switched = PlaylistEventKind::Switch;
+        const auto started  = PlaylistEventKind::DecodeStart;
+        const auto decoded  = PlaylistEventKind::DecodeEnd;
+        ok &= check(sim.at(switched, 0) == 100, "first switch",
+                sim.at(switched, 0));
+        ok &= check(sim.at(switched, 1) == 1100, "second switch",
+                sim.at(switched, 1));
+        ok &= check(sim.at(switched, 2) == 2300, "third switch",
+                sim.at(switched, 2));
+        ok &= check(sim.clock == 3100, "last item shown", sim.clock);
+        for (int i = 1; i < 3; ++i) {
+            ok &= check(sim.at(started, i) >= sim.at(switched, i - 1)
+                                && sim.at(decoded, i) <= sim.at(switched, i),
+                    "decode overlaps the item before", i);
+        }
+        ok &= check(sim.at(started, 1) == 100, "prefetch after a cut",
+                sim.at(started, 1));
+        ok &= check(sim.at(started, 2) == 1300, "prefetch after a fade",
+                sim.at(started, 2));
+        ok &= check(player.lastStats().switches == 3, "switches", 0);
+        ok &= check(player.lastStats().late == 0, "nothing late",
+                player.lastStats().late);
+        ok &= check(sim.handoffOk, "buffers handed over", 0);
+        ok &= check(sim.shown && sim.shown->get(3, 3).r == 'c', "last image",
+                0);
+    }
+
+    // A decode slower than the item before is shown holds up that switch
+    // and shifts the rest, a failing one is skipped
+    {
+        PlaylistSimulation sim;
+        sim.costs[0] = 100;
+        sim.costs[1] = 1500;
+        sim.costs[2] = 100;
+        PlaylistPlayer player(sim.host(), 16, 8, heap);
+        sim.attach(player);
+
+        std::vector<PlaylistItem> items = {
+            { "/a.png", 1000, Transition::Cut, 0 },
+            { "/b.png", 1000, Transition::Cut, 0 },
+            { "/x.png", 1000, Transition::Cut, 0 },
+            { "/c.png", 1000, Transition::Cut, 0 },
+        };
+        ok &= check(player.play(items, false), "played slow", 0);
+
+        const auto switched = PlaylistEventKind::Switch;
+        ok &= check(sim.at(switched, 1) == 1600, "late switch",
+                sim.at(switched, 1));
+        ok &= check(sim.at(switched, 2) == -1, "failed item shown", 0);
+        ok &= check(sim.at(switched, 3) == 2600, "switch after a failure",
+                sim.at(switched, 3));
+        ok &= check(player.lastStats().late == 1, "one late",
+                player.lastStats().late);
+        ok &= check(player.lastStats().maxLateMs == 500, "lateness",
+                player.lastStats().maxLateMs);
+        ok &= check(player.lastStats().failed == 1, "one failed", 0);
+    }
+
+    // A loop runs until stopped, alternating between the two buffers
+    {
+        PlaylistSimulation sim;
+        sim.costs[0] = sim.costs[1] = 50;
+        sim.stopAfter = 5;
+        PlaylistPlayer player(sim.host(), 16, 8, heap);
+        sim.attach(player);
+
+        std::vector<PlaylistItem> items = {
+            { "/a.png", 300, Transition::Crossfade, 100 },
+            { "/b.png", 300, Transition::Wipe, 100 },
+        };
+        ok &= check(!player.play(items, true), "stopped loop", 0);
+        ok &= check(player.lastStats().switches == 5, "loop switches",
+                player.lastStats().switches);
+        ok &= check(sim.at(PlaylistEventKind::Switch, 0, 2) == 1550,
+                "third pass", sim.at(PlaylistEventKind::Switch, 0, 2));
+        ok &= check(sim.handoffOk, "loop buffers", 0);
+    }
+
+    // Runs one after the other decode around what the run before left on
+    // screen, whichever buffer that is
+    {
+        PlaylistSimulation sim;
+        sim.costs[0] = sim.costs[1] = 100;
+        PlaylistPlayer player(sim.host(), 16, 8, heap);
+        sim.attach(player);
+
+        std::vector<PlaylistItem> one = {
+            { "/a.png", 500, Transition::Cut, 0 },
+        };
+        std::vector<PlaylistItem> two = {
+            { "/b.png", 500, Transition::Cut, 0 },
+            { "/a.png", 500, Transition::Crossfade, 100 },
+        };
+        ok &= check(player.play(one, false), "first run", 0);
+        ok &= check(player.play(two, false), "second run", 0);
+        ok &= check(player.play(one, false), "third run", 0);
+        ok &= check(sim.handoffOk, "buffers across runs", 0);
+        ok &= check(sim.contentOk, "decoded into the image on screen", 0);
+    }
+
+    // Nothing decodes, nothing is shown and the player gives up
+    {
+        PlaylistSimulation sim;
+        PlaylistPlayer     player(sim.host(), 16, 8, heap);
+        std::vector<PlaylistItem> items = {
+            { "/x.png", 1000, Transition::Cut, 0 },
+            { "/xx.png", 1000, Transition::Cut, 0 },
+        };
+        ok &= check(!player.play(items, true), "all failed", 0);
+        ok &= check(player.lastStats().failed == 2, "failures counted",
+                player.lastStats().failed);
+    }
+    return ok;
+}
+
+static bool testBlend()
+{
+    bool           ok   = true;
+    Allocator     &heap = heapAllocator(MemoryRegion::Psram);
+    Image          from(8, 2, heap);
+    Image          to(8, 2, heap);
+    Color          line[10];
+    const uint32_t start = 0xfffffffe;  // wraps while blending
+
+    fill(from.view(), Color{ 200, 0, 40 });
+    fill(to.view(), Color{ 0, 100, 240 });
+
+    beginTransition(&from, &to, Transition::Crossfade, start, 4);
+    transitionLine(line, 1, 10, 2, start - 1, 1);
+    ok &= check(line[0].r == 200 && line[7].b == 40, "before start", 0);
+    transitionLine(line, 1, 10, 2, start + 2, 1);
+    ok &= check(line[3].r == 100 && line[3].g == 50 && line[3].b == 140,
+            "halfway", line[3].r);
+    ok &= check(line[8].r == 0 && line[9].g == 0, "beyond the image", 0);
+    transitionLine(line, 1, 10, 2, start + 4, 1);
+    ok &= check(line[0].g == 100 && line[7].b == 240, "end", 0);
+    transitionLine(line, 0, 10, 2, start + 9, 1);
+    ok &= check(line[5].g == 100, "after the end", 0);
+
+    beginTransition(&from, &to, Transition::Wipe, start, 4);
+    transitionLine(line, 0, 8, 2, start + 1, 1);
+    ok &= check(line[1].g == 100 && line[2].r == 200, "quarter wipe", 0);
+    transitionLine(line, 0, 8, 2, start + 3, 1);
+    ok &= check(line[5].g == 100 && line[6].r == 200, "three quarter wipe",
+            0);
+
+    // The images go with this frame, so the generator must not keep them
+    beginTransition(nullptr, nullptr, Transition::Crossfade, 0, 0);
+    return ok;
+}
+
+static bool testParse()
+{
+    bool                      ok = true;
+    std::vector<PlaylistItem> items;
+
+    ok &= check(parsePlaylist(" /a.png:2.5:fade:0.5,/b.png\r\n/c.png::wipe\n",
+                        items)
+                        && items.size() == 3,
+            "parse", items.size());
+    if (ok) {
+        ok &= check(items[0].path == "/a.png" && items[0].showMs == 2500
+                            && items[0].transition == Transition::Crossfade
+                            && items[0].transitionMs == 500,
+                "first item", items[0].showMs);
+        ok &= check(items[1].path == "/b.png"
+                            && items[1].showMs == PLAYLIST_SHOW_MS
+                            && items[1].transition == Transition::Cut
+                            && items[1].transitionMs == 0,
+                "defaults", items[1].showMs);
+        ok &= check(items[2].transition == Transition::Wipe
+                            && items[2].transitionMs == PLAYLIST_FADE_MS,
+                "default transition time", items[2].transitionMs);
+    }
+    ok &= check(!parsePlaylist("/a.png:x", items), "bad duration", 0);
+    ok &= check(!parsePlaylist("/a.png:1:spin", items), "bad transition", 0);
+    ok &= check(!parsePlaylist("/a.png:1:cut:1:2", items), "extra field", 0);
+    ok &= check(!parsePlaylist(" , \n", items), "empty", 0);
+    return ok;
+}
+
+bool testPlaylist()
+{
+    bool ok = testParse();
+    ok &= testBlend();
+    ok &= testTimings();
+    report("Playlist test %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
@@ -0,0 +1,265 @@
+// ====================================================== //
+// ======== PSRAM line prefetch into internal SRAM ====== //
+// ====================================================== //
+
+#include "prefetch.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "report.h"
+
+#if PREFETCH_GDMA
+#include <esp_async_memcpy.h>
+#include <esp32s3/rom/cache.h>
+#endif
+
+// Ring protocol: row y lives in slot (y / SCAN_STEP) % PREFETCH_LINES.
+// hSyncInt and vSyncInt issue the copies while the signal is blanked,
+// for the rows after the one being drawn; scanout only acquires, and
+// copies a row itself when it finds it missing. Both run on core 1, so
+// nothing writes the slot scanout is drawing from, which issuing skips,
+// and a slot is never reused while a DMA copy into it is in flight.
+struct PrefetchSlot
+{
+    Color        *pixels;
+    int           step;  // between sampled pixels in `pixels`
+    volatile int  y;
+    volatile bool ready;  // pixels hold row y
+    volatile bool busy;   // a DMA copy into pixels is in flight
+};
+
+PrefetchStats                prefetchStats;
+static PrefetchSlot          slots[PREFETCH_LINES];
+static PrefetchSlot *volatile drawing;  // acquired last by scanout
+static bool                  prefetchReady;
+
+#if PREFETCH_GDMA
+static async_memcpy_t dmaDriver;
+
+static IRAM_ATTR bool copyDone(
+        async_memcpy_t driver, async_memcpy_event_t *event, void *args)
+{
+    PrefetchSlot *slot = (PrefetchSlot *) args;
+    slot->ready        = true;
+    slot->busy         = false;
+    return false;
+}
+#endif
+
+bool setupPrefetch()
+{
+    if (prefetchReady) {
+        return true;
+    }
+
+    for (int i = 0; i < PREFETCH_LINES; ++i) {
+        slots[i].pixels = (Color *) lineAllocator().allocate(
+                SCANLINE_MAX * sizeof(Color));
+        if (!slots[i].pixels) {
+            report("Failed to allocate the prefetch ring\n");
+            return false;
+        }
+        slots[i].y = -1;
+    }
+
+#if PREFETCH_GDMA
+    async_memcpy_config_t config = ASYNC_MEMCPY_DEFAULT_CONFIG();
+    config.backlog               = PREFETCH_LINES;
+    if (esp_async_memcpy_install(&config, &dmaDriver) != ESP_OK) {
+        report("GDMA unavailable, prefetching with the CPU\n");
+        dmaDriver = nullptr;
+    }
+#endif
+
+    prefetchReady = true;
+    report("Prefetching %d lines ahead\n", PREFETCH_LINES - 1);
+    return true;
+}
+
+void IRAM_ATTR prefetchInvalidate()
+{
+    // Called on a page flip: the next frame comes from another image
+    for (int i = 0; i < PREFETCH_LINES; ++i)
+        slots[i].y = -1;
+}
+
+// Only the pixels scanout samples: a quarter of the copying, packed at
+// the front of the slot
+static void IRAM_ATTR gatherLine(Color *dst, const Image &source, int y)
+{
+    const Color *src   = source.pixels + y * source.xres;
+    const int    width = std::min(source.xres, SCANLINE_MAX);
+    for (int x = 0; x < width; x += SCAN_STEP)
+        *dst++ = src[x];
+}
+
+static void IRAM_ATTR queueLine(PrefetchSlot &slot, const Image &source, int y)
+{
+    slot.ready = false;
+    slot.y     = y;
+
+#if PREFETCH_GDMA
+    if (dmaDriver) {
+        // DMA reads PSRAM behind the cache, flush what the CPU wrote
+        const Color *src  = source.pixels + y * source.xres;
+        const size_t size = std::min(source.xres, SCANLINE_MAX) * sizeof(Color);
+        Cache_WriteBack_Addr((uint32_t) src, size);
+        slot.step = SCAN_STEP;
+        slot.busy = true;
+        if (esp_async_memcpy(dmaDriver, slot.pixels, (void *) src, size,
+                    copyDone, &slot)
+                == ESP_OK) {
+            ++prefetchStats.dmaCopies;
+            return;
+        }
+        slot.busy = false;
+    }
+#endif
+
+    gatherLine(slot.pixels, source, y);
+    slot.step  = 1;
+    slot.ready = true;
+    ++prefetchStats.cpuCopies;
+}
+
+void IRAM_ATTR prefetchIssue(const Image &source, int y, int lines)
+{
+    if (!prefetchReady) {
+        return;
+    }
+
+    // Rows after the last one wrap into the next frame
+    const int rows = (source.yres + SCAN_STEP - 1) / SCAN_STEP;
+    for (int k = 0; k < PREFETCH_LINES - 1 && lines > 0; ++k) {
+        const int     row  = (y / SCAN_STEP + k) % rows;
+        const int     next = row * SCAN_STEP;
+        PrefetchSlot &slot = slots[row % PREFETCH_LINES];
+        if (&slot != drawing && slot.y != next && !slot.busy) {
+            queueLine(slot, source, next);
+            --lines;
+        }
+    }
+}
+
+const Color *IRAM_ATTR prefetchAcquire(const Image &source, int y, int &step)
+{
+    if (!prefetchReady) {
+        step = SCAN_STEP;
+        return source.pixels + y * source.xres;
+    }
+
+    // Claimed before it is looked at, so an hsync in between leaves it be
+    PrefetchSlot &slot = slots[(y / SCAN_STEP) % PREFETCH_LINES];
+    drawing            = &slot;
+    if (slot.y == y && slot.ready) {
+        ++prefetchStats.hits;
+        step = slot.step;
+        return slot.pixels;
+    }
+
+    // Underrun: read PSRAM now, into the scanline buffer if a copy is
+    // still landing in the slot
+    ++prefetchStats.underruns;
+    Color *dst = slot.busy ? scanLine : slot.pixels;
+    gatherLine(dst, source, y);
+    if (!slot.busy) {
+        slot.step  = 1;
+        slot.y     = y;
+        slot.ready = true;
+    }
+    step = 1;
+    return dst;
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static Color probe(int x, int y)
+{
+    return Color{ (unsigned char) x, (unsigned char) y,
+        (unsigned char) (x ^ y) };
+}
+
+// Plays the scanout against the ring: a row is acquired when the beam
+// reaches it and read pixel by pixel, with the hsync landing anywhere in
+// it, as it does on the device. A height that is not a multiple of the
+// ring wraps rows of two frames onto the slot being drawn.
+static bool scanFrames(const Image &source, int frames, bool dropHsyncs,
+        uint32_t &seed)
+{
+    bool ok = true;
+    for (int frame = 0; frame < frames; ++frame) {
+        prefetchIssue(source, 0, PREFETCH_LINES - 1);
+
+        for (int y = 0; y < source.yres; y += SCAN_STEP) {
+            seed            = seed * 1103515245 + 12345;
+            const int  sync = (seed >> 16) % (source.xres / SCAN_STEP + 1);
+            const bool drop = dropHsyncs && (seed >> 8) % 3 == 0;
+
+            int          step;
+            const Color *line = prefetchAcquire(source, y, step);
+            for (int x = 0, i = 0; x < source.xres; x += SCAN_STEP, ++i) {
+                if (i == sync && !drop) {
+                    prefetchIssue(source, y + SCAN_STEP, 1);
+                }
+                const Color want = source.get(x, y);
+                const Color got  = line[x / SCAN_STEP * step];
+                ok &= check(got.r == want.r && got.g == want.g
+                                    && got.b == want.b,
+                        "pixel", y * source.xres + x);
+                if (!ok) {
+                    return false;
+                }
+            }
+            if (sync == source.xres / SCAN_STEP && !drop) {
+                prefetchIssue(source, y + SCAN_STEP, 1);
+            }
+        }
+    }
+    return ok;
+}
+
+bool testPrefetch()
+{
+    bool ok = check(setupPrefetch(), "setup", 0);
+    if (!ok) {
+        return false;
+    }
+
+    Image source(SCANLINE_MAX, 30 * SCAN_STEP + 2, heapAllocator(
+            MemoryRegion::Psram));
+    for (int y = 0; y < source.yres; ++y)
+        for (int x = 0; x < source.xres; ++x)
+            source.set(x, y, probe(x, y));
+
+    // An hsync on every line keeps the ring ahead of the beam
+    uint32_t seed = 7;
+    prefetchInvalidate();
+    ok &= scanFrames(source, 1, false, seed);
+    const PrefetchStats warm = prefetchStats;
+    ok &= scanFrames(source, 3, false, seed);
+    ok &= check(prefetchStats.underruns == warm.underruns, "underrun",
+            prefetchStats.underruns - warm.underruns);
+    ok &= check(prefetchStats.hits > warm.hits, "hits", prefetchStats.hits);
+
+    // Missed ones make scanout copy rows itself, never show stale ones
+    const PrefetchStats before = prefetchStats;
+    ok &= scanFrames(source, 4, true, seed);
+    ok &= check(prefetchStats.underruns > before.underruns, "dropped hsyncs",
+            0);
+
+    // A page flip drops every row of the old image
+    Image other(SCANLINE_MAX, source.yres, heapAllocator(MemoryRegion::Psram));
+    for (int y = 0; y < other.yres; ++y)
+        for (int x = 0; x < other.xres; ++x)
+            other.set(x, y, probe(x + 1, y));
+    prefetchInvalidate();
+    ok &= scanFrames(other, 1, false, seed);
+
+    prefetchInvalidate();
+    report("Prefetch tests %s: %u hits, %u underruns\n",
+            ok ? "passed" : "failed", (unsigned) prefetchStats.hits,
+            (unsigned) prefetchStats.underruns);
+    return ok;
+}
@@ -0,0 +1,413 @@
+// ====================================================== //
+// ============ Parallel tile-based renderer ============ //
+// ====================================================== //
+
+#include "renderer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "hal.h"
+#include "metrics.h"
+#include "report.h"
+#include "trace.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+static SemaphoreHandle_t renderMutex = xSemaphoreCreateMutex();
+#define RENDER_LOCK()   xSemaphoreTake(renderMutex, portMAX_DELAY)
+#define RENDER_UNLOCK() xSemaphoreGive(renderMutex)
+#else
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static std::mutex renderMutex;
+#define RENDER_LOCK()   renderMutex.lock()
+#define RENDER_UNLOCK() renderMutex.unlock()
+#endif
+
+#define MAX_WORKERS 4
+
+// One frame per call: the tiles are claimed off a shared atomic counter,
+// so a worker that finishes early steals the tiles a slower one has not
+// reached yet. Calls take turns, since the workers serve one at a time.
+struct RenderJob
+{
+    Image                *target;
+    TileFunction          render;
+    const void           *kernel;
+    int                   tilesX;
+    int                   tileCount;
+    std::atomic<int>      nextTile{};
+    std::atomic<uint32_t> slowestTile{};  // cycles, 0 until one is done
+    std::atomic<int>      lentTiles{};    // rendered in scanout blanking
+};
+
+static int workerCount = 1;
+
+// The job the scanout core may take tiles of; whoever works on it holds
+// the pointer, so the caller knows the scanout is done once it gets it
+// back
+static std::atomic<RenderJob *> lentJob{};
+
+// Claims and renders the next tile, false once there are none left
+static bool IRAM_ATTR runTile(RenderJob &job)
+{
+    const int i = job.nextTile.fetch_add(1);
+    if (i >= job.tileCount) {
+        return false;
+    }
+
+    TRACE_SCOPE(Render, "tile");
+    const uint32_t start = cycleCount();
+    Tile           tile;
+    tile.x      = (i % job.tilesX) * TILE_SIZE;
+    tile.y      = (i / job.tilesX) * TILE_SIZE;
+    tile.width  = job.target->xres - tile.x;
+    tile.height = job.target->yres - tile.y;
+    if (tile.width > TILE_SIZE)
+        tile.width = TILE_SIZE;
+    if (tile.height > TILE_SIZE)
+        tile.height = TILE_SIZE;
+
+    job.render(job.kernel, *job.target, tile);
+
+    const uint32_t cycles  = cycleCount() - start;
+    uint32_t       slowest = job.slowestTile.load();
+    while (cycles > slowest
+            && !job.slowestTile.compare_exchange_weak(slowest, cycles)) {}
+    return true;
+}
+
+static void runTiles(RenderJob &job)
+{
+    while (runTile(job)) {}
+}
+
+void IRAM_ATTR lendRenderTime(uint32_t cycles)
+{
+    RenderJob *job = lentJob.exchange(nullptr);
+    if (!job) {
+        return;
+    }
+
+    // Tiles of one frame cost about the same, so twice the slowest so far
+    // leaves room for one that is worse; nothing is started before the
+    // workers have timed a tile
+    const uint32_t start = cycleCount();
+    for (;;) {
+        const uint32_t slowest = job->slowestTile.load();
+        if (!slowest || cycleCount() - start + 2 * slowest > cycles
+                || !runTile(*job)) {
+            break;
+        }
+        job->lentTiles.fetch_add(1);
+    }
+    lentJob.store(job);
+}
+
+// Sets up a job for `target` and offers it to the scanout core
+static void beginJob(
+        RenderJob &job, Image &target, TileFunction render, const void *kernel)
+{
+    job.target    = &target;
+    job.render    = render;
+    job.kernel    = kernel;
+    job.tilesX    = (target.xres + TILE_SIZE - 1) / TILE_SIZE;
+    job.tileCount = job.tilesX * ((target.yres + TILE_SIZE - 1) / TILE_SIZE);
+    lentJob.store(&job);
+}
+
+// Takes the job back, waiting out a tile the scanout core is still on;
+// that lasts no longer than the blanking it was lent
+static int endJob(RenderJob &job)
+{
+    while (lentJob.exchange(nullptr) != &job) {
+        sleepMillis(1);
+    }
+    return job.lentTiles;
+}
+
+#ifdef ARDUINO
+
+// ─── FreeRTOS Workers ───────────────────────────────────────────────────
+
+static TaskHandle_t      helpers[MAX_WORKERS - 1]{};
+static SemaphoreHandle_t tilesDone;
+static RenderJob        *helperJob;  // set under the render lock
+
+static void helperTask(void *args)
+{
+    TRACE_NAME_TRACK("render helper");
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        runTiles(*helperJob);
+        xSemaphoreGive(tilesDone);
+    }
+}
+
+void setupRenderer(int workers)
+{
+    if (workers < 1)
+        workers = 1;
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+
+    RENDER_LOCK();
+    if (!tilesDone) {
+        tilesDone = xSemaphoreCreateCounting(MAX_WORKERS, 0);
+    }
+
+    // The caller renders too. Helpers stay on core 0: core 1 busy-loops
+    // the scanout, and a task of the same priority there would be
+    // time-sliced with it, dropping whole milliseconds of lines. Core 1
+    // takes tiles in its vertical blanking instead, see lendRenderTime().
+    for (int i = 0; i < workers - 1; ++i) {
+        if (!helpers[i]) {
+            xTaskCreatePinnedToCore(helperTask, "Render Task", 4096, NULL, 1,
+                    &helpers[i], 0);
+        }
+    }
+
+    workerCount = workers;
+    RENDER_UNLOCK();
+    report("Renderer running on %d workers\n", workerCount);
+}
+
+int renderTiles(Image &target, TileFunction render, const void *kernel)
+{
+    TRACE_SCOPE(Render, "render");
+    RenderJob job;
+    RENDER_LOCK();
+    beginJob(job, target, render, kernel);
+
+    helperJob = &job;
+    for (int i = 0; i < workerCount - 1; ++i)
+        xTaskNotifyGive(helpers[i]);
+
+    runTiles(job);
+
+    // Completion barrier: every helper checks in once it runs out of tiles
+    for (int i = 0; i < workerCount - 1; ++i)
+        xSemaphoreTake(tilesDone, portMAX_DELAY);
+
+    const int lent = endJob(job);
+    RENDER_UNLOCK();
+    return lent;
+}
+
+#else
+
+// ─── Host Workers ───────────────────────────────────────────────────────
+
+void setupRenderer(int workers)
+{
+    if (workers < 1)
+        workers = 1;
+    RENDER_LOCK();
+    workerCount = workers;
+    RENDER_UNLOCK();
+}
+
+int renderTiles(Image &target, TileFunction render, const void *kernel)
+{
+    TRACE_SCOPE(Render, "render");
+    RenderJob job;
+    RENDER_LOCK();
+    beginJob(job, target, render, kernel);
+
+    std::vector<std::thread> helpers;
+    for (int i = 0; i < workerCount - 1; ++i)
+        helpers.emplace_back([&job] { runTiles(job); });
+
+    runTiles(job);
+
+    // Completion barrier
+    for (auto &helper : helpers)
+        helper.join();
+
+    const int lent = endJob(job);
+    RENDER_UNLOCK();
+    return lent;
+}
+
+#endif
+
+int rendererWorkers()
+{
+    return workerCount;
+}
+
+// ─── Shaders ────────────────────────────────────────────────────────────
+
+// Escape time fractal with 12 fractional bits, which keeps every square
+// within 32 bits up to the escape radius
+struct Mandelbrot
+{
+    int xres, yres;
+
+    Color operator()(int x, int y) const
+    {
+        const int32_t cx = -10240 + x * 14336 / xres;  // [-2.5, 1.0)
+        const int32_t cy = -4915 + y * 9830 / yres;    // [-1.2, 1.2)
+        int32_t       zx = 0, zy = 0;
+        int           i  = 0;
+        for (; i < 32; ++i) {
+            int32_t zx2 = (zx * zx) >> 12;
+            int32_t zy2 = (zy * zy) >> 12;
+            if (zx2 + zy2 > 4 << 12)
+                break;
+            zy = ((zx * zy) >> 11) + cy;
+            zx = zx2 - zy2 + cx;
+        }
+        if (i == 32)
+            return Color{ 0, 0, 0 };
+        return Color{ (unsigned char) (i * 8), (unsigned char) (i * 4),
+            (unsigned char) (255 - i * 6) };
+    }
+};
+
+// Concentric rings moving outwards from the centre
+struct Rings
+{
+    int      xres, yres;
+    unsigned time;
+
+    Color operator()(int x, int y) const
+    {
+        const int      dx = x - xres / 2, dy = y - yres / 2;
+        const unsigned d  = ((dx * dx + dy * dy) >> 7) - time * 4;
+        return Color{ (unsigned char) d, (unsigned char) (d >> 1),
+            (unsigned char) ~d };
+    }
+};
+
+bool renderShader(const char *name, Image &target, unsigned time)
+{
+    if (!strcmp(name, "mandelbrot")) {
+        renderFrame(target, Mandelbrot{ target.xres, target.yres });
+        return true;
+    }
+    if (!strcmp(name, "rings")) {
+        renderFrame(target, Rings{ target.xres, target.yres, time });
+        return true;
+    }
+    return false;
+}
+
+// ─── Self-test ──────────────────────────────────────────────────────────
+
+// Mandelbrot that, at the first pixel of tile `lendAt`, plays the scanout
+// core and takes every tile it has time for, so the hand-over can be
+// tested without a scanout or a second CPU
+struct LendingMandelbrot
+{
+    Mandelbrot fractal;
+    int        lendAt;
+
+    Color operator()(int x, int y) const
+    {
+        if (x == lendAt * TILE_SIZE && y == 0) {
+            lendRenderTime(METRICS_CYCLE_HZ);
+        }
+        return fractal(x, y);
+    }
+};
+
+static bool sameImage(const Image &a, const Image &b)
+{
+    return !memcmp(a.pixels, b.pixels, a.xres * a.yres * sizeof(Color));
+}
+
+bool testRenderer()
+{
+    Allocator &heap     = heapAllocator(MemoryRegion::Psram);
+    const int  previous = workerCount;
+    const int  tiles    = (200 / TILE_SIZE + 1) * (120 / TILE_SIZE + 1);
+    Image      expected(200, 120, heap);
+    Image      target(200, 120, heap);
+    bool       ok = true;
+
+    setupRenderer(1);
+    ok &= check(renderFrame(expected, Mandelbrot{ 200, 120 }) == 0,
+            "nothing lent");
+
+    // The scanout waits for a timed tile, then takes all the rest while
+    // the worker is still in the second
+    int lent = renderFrame(target, LendingMandelbrot{ { 200, 120 }, 0 });
+    ok &= check(lent == 0 && sameImage(target, expected), "untimed", lent);
+    fill(target.view(), Color{});
+    lent = renderFrame(target, LendingMandelbrot{ { 200, 120 }, 1 });
+    ok &= check(lent == tiles - 2 && sameImage(target, expected), "lent",
+            lent);
+
+    // No budget, no tiles
+    fill(target.view(), Color{});
+    struct Starved
+    {
+        Mandelbrot fractal;
+
+        Color operator()(int x, int y) const
+        {
+            lendRenderTime(0);
+            return fractal(x, y);
+        }
+    };
+    lent = renderFrame(target, Starved{ { 200, 120 } });
+    ok &= check(lent == 0 && sameImage(target, expected), "starved", lent);
+
+#ifndef ARDUINO
+    // Callers on several tasks take turns, each getting its own frame
+    setupRenderer(3);
+    Image                    targets[3] = { { 200, 120, heap },
+        { 200, 120, heap }, { 200, 120, heap } };
+    std::vector<std::thread> callers;
+    for (Image &each : targets) {
+        callers.emplace_back([&each] {
+            for (int i = 0; i < 20; ++i) {
+                fill(each.view(), Color{});
+                renderFrame(each, Mandelbrot{ 200, 120 });
+            }
+        });
+    }
+    for (auto &caller : callers)
+        caller.join();
+    for (const Image &each : targets)
+        ok &= check(sameImage(each, expected), "concurrent callers");
+#endif
+
+    setupRenderer(previous);
+    report("Renderer tests %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+void benchmarkRenderer(int maxWorkers)
+{
+    Image    target;
+    int      previous = workerCount;
+    uint32_t single   = 0;
+
+    // Tiles lent by core 1 show up while the scanout runs; on the host
+    // nothing scans out, so that column stays 0
+    for (int workers = 1; workers <= maxWorkers; ++workers) {
+        setupRenderer(workers);
+
+        uint32_t  start = nowMicros();
+        const int lent  = renderFrame(
+                target, Mandelbrot{ target.xres, target.yres });
+        uint32_t elapsed = nowMicros() - start;
+        if (workers == 1)
+            single = elapsed;
+
+        report("%d worker(s): %6u us/frame, speedup %u.%02ux, %d tiles in "
+               "blanking\n",
+                workers, elapsed, single / elapsed,
+                single * 100 / elapsed % 100, lent);
+    }
+
+    setupRenderer(previous);
+}
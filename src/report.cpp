@@ -0,0 +1,72 @@
+// ====================================================== //
+// ======== Console output, clocks and self-tests ======= //
+// ====================================================== //
+
+#include "report.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <chrono>
+#include <thread>
+#endif
+
+void report(const char *format, ...)
+{
+    char    buf[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+#ifdef ARDUINO
+    Serial.print(buf);
+#else
+    fputs(buf, stdout);
+#endif
+}
+
+void appendf(std::string &out, const char *format, ...)
+{
+    char    buf[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    out += buf;
+}
+
+uint32_t nowMicros()
+{
+#ifdef ARDUINO
+    return micros();
+#else
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+}
+
+void sleepMillis(uint32_t ms)
+{
+#ifdef ARDUINO
+    vTaskDelay(pdMS_TO_TICKS(ms));
+#else
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+#endif
+}
+
+bool check(bool condition, const char *what, double at)
+{
+    if (!condition) {
+        if (isnan(at)) {
+            report("Check failed: %s\n", what);
+        }
+        else {
+            report("Check failed: %s at %.15g\n", what, at);
+        }
+    }
+    return condition;
+}
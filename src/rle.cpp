@@ -0,0 +1,453 @@
+// ====================================================== //
+// ========= Run-length compressed framebuffer ========== //
+// ====================================================== //
+
+#include "rle.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "metrics.h"
+#include "report.h"
+
+RleImage *rleFrame{};
+
+static Allocator &spanAllocator()
+{
+    return heapAllocator(MemoryRegion::Psram);
+}
+
+static inline bool sameColor(Color a, Color b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+// Appends a run, merging it into the previous one when the colour matches
+static inline void pushRun(std::vector<RleSpan> &runs, int length, Color c)
+{
+    if (length <= 0) {
+        return;
+    }
+    if (!runs.empty() && sameColor(runs.back().color, c)) {
+        runs.back().length += length;
+        return;
+    }
+    runs.push_back(RleSpan{ (uint16_t) length, c });
+}
+
+RleImage::RleImage(int xres, int yres, size_t capacity)
+    : lines(yres),
+      spans((RleSpan *) spanAllocator().allocate(capacity * sizeof(RleSpan))),
+      capacity(spans ? capacity : 0),
+      used(0),
+      xres(xres),
+      yres(yres)
+{
+    clear(Color{ 0, 0, 0 });
+}
+
+RleImage::~RleImage()
+{
+    spanAllocator().deallocate(spans);
+}
+
+bool RleImage::onScreen() const
+{
+    return this == rleFrame;
+}
+
+bool RleImage::storeLine(int y, const RleSpan *runs, size_t count)
+{
+    // Spans go in before the count grows, so scanout never reads a span
+    // that is not written yet
+    LineSlot &slot = lines[y];
+    if (count <= slot.capacity) {
+        memcpy(spans + slot.offset, runs, count * sizeof(RleSpan));
+        slot.count = count;
+        return true;
+    }
+
+    // Compacting moves the lines scanout is reading, so not on screen
+    if (used + count > capacity && !onScreen()) {
+        compact();
+    }
+    if (used + count > capacity) {
+        report("RLE pool full, line %d needs %u spans\n", y,
+                (unsigned) count);
+        return false;
+    }
+
+    memcpy(spans + used, runs, count * sizeof(RleSpan));
+    lines[y] = LineSlot{ (uint32_t) used, (uint16_t) count, (uint16_t) count };
+    used += count;
+    return true;
+}
+
+void RleImage::compact()
+{
+    // Slide every line down over the slack left by moved lines, in pool
+    // order so that a line never overwrites one not yet moved
+    std::vector<int> order(yres);
+    for (int y = 0; y < yres; ++y)
+        order[y] = y;
+    std::sort(order.begin(), order.end(),
+            [this](int a, int b) { return lines[a].offset < lines[b].offset; });
+
+    size_t write = 0;
+    for (int y : order) {
+        LineSlot &slot = lines[y];
+        memmove(spans + write, spans + slot.offset,
+                slot.count * sizeof(RleSpan));
+        slot.offset   = write;
+        slot.capacity = slot.count;
+        write += slot.count;
+    }
+    used = write;
+}
+
+bool RleImage::encode(const ImageView &source)
+{
+    if (onScreen()) {
+        report("Cannot encode into the RLE frame on screen\n");
+        return false;
+    }
+    if (source.width != xres || source.height != yres) {
+        report("Cannot encode a %dx%d image into a %dx%d frame\n",
+                source.width, source.height, xres, yres);
+        return false;
+    }
+
+    // Count first, so a frame that does not fit leaves this one intact
+    size_t total = 0;
+    for (int y = 0; y < yres; ++y) {
+        const Color *row = source.row(y);
+        total += 1;
+        for (int x = 1; x < xres; ++x)
+            total += !sameColor(row[x], row[x - 1]);
+    }
+    if (total > capacity) {
+        report("Image needs %u spans, the pool holds %u\n", (unsigned) total,
+                (unsigned) capacity);
+        return false;
+    }
+
+    used = 0;
+    std::vector<RleSpan> runs;
+    for (int y = 0; y < yres; ++y) {
+        const Color *row = source.row(y);
+        runs.clear();
+        for (int x = 0; x < xres; ++x)
+            pushRun(runs, 1, row[x]);
+
+        memcpy(spans + used, runs.data(), runs.size() * sizeof(RleSpan));
+        lines[y] = LineSlot{ (uint32_t) used, (uint16_t) runs.size(),
+            (uint16_t) runs.size() };
+        used += runs.size();
+    }
+    return true;
+}
+
+bool RleImage::clear(Color c)
+{
+    if (onScreen() || (size_t) yres > capacity) {
+        report("Cannot clear the RLE frame %s\n",
+                onScreen() ? "on screen" : "without a pool");
+        return false;
+    }
+
+    used = 0;
+    for (int y = 0; y < yres; ++y) {
+        spans[used] = RleSpan{ (uint16_t) xres, c };
+        lines[y]    = LineSlot{ (uint32_t) used, 1, 1 };
+        ++used;
+    }
+    return true;
+}
+
+bool RleImage::hline(int x, int y, int w, Color c)
+{
+    if (y < 0 || y >= yres) {
+        return true;
+    }
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (x + w > xres) {
+        w = xres - x;
+    }
+    if (w <= 0) {
+        return true;
+    }
+
+    // Keep what is left and right of the new run, merging equal colours
+    const LineSlot       slot = lines[y];
+    const RleSpan       *line = spans + slot.offset;
+    std::vector<RleSpan> runs;
+    runs.reserve(slot.count + 2);
+
+    int start = 0;
+    for (size_t i = 0; i < slot.count && start < x; start += line[i++].length)
+        pushRun(runs, std::min(start + (int) line[i].length, x) - start,
+                line[i].color);
+
+    pushRun(runs, w, c);
+
+    start = 0;
+    for (size_t i = 0; i < slot.count; start += line[i++].length) {
+        int end = start + line[i].length;
+        if (end > x + w)
+            pushRun(runs, end - std::max(start, x + w), line[i].color);
+    }
+
+    return storeLine(y, runs.data(), runs.size());
+}
+
+bool RleImage::fillRect(int x, int y, int w, int h, Color c)
+{
+    bool success = true;
+    for (int row = y; row < y + h; ++row) {
+        if (!hline(x, row, w, c))
+            success = false;
+    }
+    return success;
+}
+
+bool RleImage::vline(int x, int y, int h, Color c)
+{
+    return fillRect(x, y, 1, h, c);
+}
+
+bool RleImage::set(int x, int y, Color c)
+{
+    return hline(x, y, 1, c);
+}
+
+void RleImage::expandLine(int y, Color *line, int width, int step) const
+{
+    // Bounded by `width` and the pool, so a line being rewritten
+    // concurrently can only show wrong colours for one scanline. `x` is
+    // the next column sampled, `end` where the current span stops
+    const LineSlot slot = lines[y];
+    int            x    = 0;
+    Color         *out  = line;
+    if (slot.offset + slot.count <= capacity) {
+        const RleSpan *span = spans + slot.offset;
+        const RleSpan *last = span + slot.count;
+        int            end  = 0;
+        for (; span < last && x < width; ++span) {
+            const Color c = span->color;
+            end           = std::min(end + (int) span->length, width);
+            for (; x < end; x += step)
+                *out++ = c;
+        }
+    }
+    for (; x < width; x += step)
+        *out++ = Color{ 0, 0, 0 };
+}
+
+size_t RleImage::spanCount(int y) const
+{
+    return lines[y].count;
+}
+
+size_t RleImage::bytes() const
+{
+    return used * sizeof(RleSpan) + lines.size() * sizeof(LineSlot);
+}
+
+void rleLine(Color *line, int y, int width, int height, uint32_t frame,
+        int step)
+{
+    if (!rleFrame || y >= rleFrame->yres) {
+        memset(line, 0, (width + step - 1) / step * sizeof(Color));
+        return;
+    }
+    rleFrame->expandLine(y, line, width, step);
+}
+
+// ─── Self-test ──────────────────────────────────────────────────────────
+
+static uint32_t randomState = 0x6b8b4567;
+
+static uint32_t nextRandom()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// One of four colours, so neighbouring runs often match and must merge
+static Color randomColor()
+{
+    const uint8_t v = nextRandom() % 4 * 85;
+    return Color{ v, (uint8_t) (255 - v), 0 };
+}
+
+// hline() on an uncompressed image, clipped the same way
+static void referenceHline(Image &image, int x, int y, int w, Color c)
+{
+    for (int i = std::max(x, 0); i < std::min(x + w, image.xres); ++i) {
+        if (y >= 0 && y < image.yres)
+            image.set(i, y, c);
+    }
+}
+
+// Every line expands to the reference, as the fewest spans that can hold
+// it: each colour change starts a span and nothing else does
+static bool sameAs(const RleImage &rle, const Image &reference, int at)
+{
+    static Color line[SCANLINE_MAX];
+    bool         ok = true;
+    for (int y = 0; y < rle.yres; ++y) {
+        rle.expandLine(y, line, rle.xres);
+        const Color *row  = reference.view().row(y);
+        size_t       runs = 1;
+        for (int x = 1; x < rle.xres; ++x)
+            runs += !sameColor(row[x], row[x - 1]);
+        ok &= check(!memcmp(line, row, rle.xres * sizeof(Color)), "pixels",
+                at);
+        ok &= check(rle.spanCount(y) == runs, "spans", at);
+
+        // and every SCAN_STEP-th pixel of it when sampled for scanout
+        rle.expandLine(y, line, rle.xres, SCAN_STEP);
+        bool same = true;
+        for (int i = 0; i * SCAN_STEP < rle.xres; ++i)
+            same &= sameColor(line[i], row[i * SCAN_STEP]);
+        ok &= check(same, "sampled", at);
+    }
+    return ok;
+}
+
+bool testRle()
+{
+    const int xres = 64, yres = 16;
+    Image     source(xres, yres, heapAllocator(MemoryRegion::Internal));
+    Image     reference(xres, yres, heapAllocator(MemoryRegion::Internal));
+    bool      ok = true;
+
+    // Encoding round-trips blocky rows and ones with no two pixels alike
+    for (int y = 0; y < yres; ++y) {
+        for (int x = 0; x < xres; ++x) {
+            source.set(x, y,
+                    y % 4 ? randomColor()
+                          : Color{ (uint8_t) x, (uint8_t) y, 0 });
+        }
+    }
+    RleImage rle(xres, yres, xres * yres);
+    ok &= check(rle.encode(source.view()), "encode");
+    ok &= sameAs(rle, source, -1);
+
+    // A frame that does not fit leaves the previous one in place
+    RleImage small(xres, yres, yres * 2);
+    small.clear(Color{ 1, 2, 3 });
+    fill(reference.view(), Color{ 1, 2, 3 });
+    ok &= check(!small.encode(source.view()), "encode too large");
+    ok &= sameAs(small, reference, -2);
+
+    // Splitting lines fills the pool; the edit it has no room for leaves
+    // its line untouched
+    int y = 0;
+    for (; y < yres && small.hline(10, y, 5, Color{}); ++y)
+        referenceHline(reference, 10, y, 5, Color{});
+    ok &= check(y > 0 && y < yres, "edits until full", y);
+    ok &= sameAs(small, reference, -3);
+
+    // Random edits, clipped at every edge; lines outgrow their slots and
+    // move, and the slack they leave forces compaction in a pool only a
+    // little larger than the most spans the frame can need
+    RleImage edited(xres, yres, xres * yres + xres);
+    fill(reference.view(), Color{ 0, 0, 0 });
+    for (int round = 0; round < 4000 && ok; ++round) {
+        const Color c = randomColor();
+        const int   x = (int) (nextRandom() % (xres + 16)) - 8;
+        const int   y = (int) (nextRandom() % (yres + 4)) - 2;
+        const int   w = nextRandom() % 12;
+        const int   h = nextRandom() % 6;
+        switch (nextRandom() % 4) {
+            case 0:
+                ok &= check(edited.hline(x, y, w, c), "hline", round);
+                referenceHline(reference, x, y, w, c);
+                break;
+            case 1:
+                ok &= check(edited.vline(x, y, h, c), "vline", round);
+                for (int i = y; i < y + h; ++i)
+                    referenceHline(reference, x, i, 1, c);
+                break;
+            case 2:
+                ok &= check(edited.fillRect(x, y, w, h, c), "rect", round);
+                for (int i = y; i < y + h; ++i)
+                    referenceHline(reference, x, i, w, c);
+                break;
+            default:
+                ok &= check(edited.set(x, y, c), "set", round);
+                referenceHline(reference, x, y, 1, c);
+        }
+        ok &= sameAs(edited, reference, round);
+    }
+
+    // On screen nothing may move the lines scanout reads: encode() and
+    // clear() refuse, and an edit that needs the pool compacted fails
+    // until the image is off screen again
+    RleImage        shown(xres, yres, yres + 5);
+    RleImage *const saved = rleFrame;
+    const Color     grey  = { 9, 9, 9 };
+    rleFrame              = &shown;
+    ok &= check(!shown.encode(source.view()), "encode on screen");
+    ok &= check(!shown.clear(grey), "clear on screen");
+    ok &= check(shown.hline(10, 0, 5, grey), "edit on screen");
+    ok &= check(!shown.hline(10, 1, 5, grey), "compact on screen");
+    rleFrame = saved;
+    ok &= check(shown.hline(10, 1, 5, grey), "compact off screen");
+
+    // Expansion stops at the line width and pads a short frame with black
+    static Color line[SCANLINE_MAX];
+    rle.expandLine(0, line, xres / 2);
+    ok &= check(!memcmp(line, source.view().row(0), xres / 2 * sizeof(Color)),
+            "narrow line");
+    rle.expandLine(0, line, xres + 8);
+    ok &= check(line[xres].r == 0 && line[xres + 7].g == 0, "wide line");
+
+    report("RLE tests %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+void benchmarkRle(const Image &source, const VGAMode &mode)
+{
+    static Color   line[SCANLINE_MAX];
+    const int      width  = std::min(mode.xres, SCANLINE_MAX);
+    const char    *unit   = METRICS_CYCLE_HZ == 1e9 ? "ns" : "cycles";
+    const uint32_t budget = mode.vLine * (METRICS_CYCLE_HZ / 1e3);
+
+    RleImage rle(source.xres, source.yres, 32768);
+    uint32_t start = cycleCount();
+    if (!rle.encode(source.view())) {
+        report("Image too detailed to run-length encode\n");
+        return;
+    }
+    uint32_t encodeCycles = cycleCount() - start;
+
+    uint32_t worst = 0, worstY = 0, total = 0;
+    for (int y = 0; y < rle.yres; ++y) {
+        start = cycleCount();
+        rle.expandLine(y, line, width, SCAN_STEP);
+        uint32_t cycles = cycleCount() - start;
+        total += cycles;
+        if (cycles > worst) {
+            worst  = cycles;
+            worstY = y;
+        }
+    }
+
+    const size_t raw = source.xres * source.yres * sizeof(Color);
+    report("RLE: %u bytes vs %u raw (%u.%02u:1), encoded in %.0f us\n",
+            (unsigned) rle.bytes(), (unsigned) raw,
+            (unsigned) (raw / rle.bytes()),
+            (unsigned) (raw * 100 / rle.bytes() % 100),
+            encodeCycles / (METRICS_CYCLE_HZ / 1e6));
+    report("Expansion: %u %s/line average, worst %u on line %u (%u spans, "
+           "%u%% of line period)\n",
+            total / rle.yres, unit, worst, worstY,
+            (unsigned) rle.spanCount(worstY), worst * 100 / budget);
+}
@@ -5,55 +5,127 @@
 #include <Arduino.h>
 #include <SD.h>
 #include <WiFi.h>
-#include <WebServer.h>
+#include <memory>
 
 #include "server.h"
 #include "filesystem.h"
-#include "webpage.h"
+#include "webpage_gz.h"
 #include "vga.h"
+#include "generators.h"
+#include "renderer.h"
+#include "affine.h"
+#include "compositor.h"
+#include "rle.h"
+#include "prefetch.h"
+#include "writer.h"
+#include "http.h"
+#include "httpd.h"
+#include "tar.h"
+#include "capture.h"
+#include "boot.h"
+#include "playlist.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define LIST_PAGE 32  // entries per piece of a streamed listing
 
 // WiFi and WebServer
-const char *ssid     = "nurof3n";
-const char *password = "nuamchef";
-WebServer   server(80);
-const int   maxUploadIter = 5;  // used to slow down the upload speed to
-                                // avoid watchdog reset
+const char  *ssid     = "nurof3n";
+const char  *password = "nuamchef";
+HttpServer   server(80);
+
+// Each connection's upload keeps its own state in its context, as the
+// server takes several at once
+struct FileUpload
+{
+    WriteBehind writer;
+    bool        failed{};
+};
+
+struct ArchiveUpload
+{
+    TarExtractor extractor;
+    bool         failed{};
+};
+
+long intArg(const char *name, long fallback)
+{
+    return server.hasArg(name) ? atol(server.arg(name).c_str()) : fallback;
+}
+
+double doubleArg(const char *name, double fallback)
+{
+    return server.hasArg(name) ? atof(server.arg(name).c_str()) : fallback;
+}
 
+// The page is gzipped at build time; browsers keep it and only ask
+// again whether it changed, which costs a 304 and no body
+void handleRoot()
+{
+    server.sendHeader("ETag", WEBPAGE_ETAG);
+    server.sendHeader("Cache-Control", "no-cache");
+    if (revalidate(WEBPAGE_ETAG, server.header("If-None-Match").c_str())
+            == 304) {
+        server.send(304);
+        return;
+    }
+    server.sendHeader("Content-Encoding", "gzip");
+    server.send(200, "text/html", webpage_gz, webpage_gz_len);
+}
+
+// Pages through ?offset=&limit= in ?sort=name|size|type order (&desc
+// reverses it); the total goes out in X-Total-Count
 void handleListDir()
 {
     String dirname = "/";
     if (server.hasArg("dir")) {
-        dirname = server.arg("dir");
+        dirname = server.arg("dir").c_str();
     }
 
-    if (dirname != "/" && dirname.endsWith("/")) {
-        dirname.remove(dirname.length() - 1);
-    }
+    // Missing or negative numbers list from the start, without a limit
+    const long    offset = max(0L, intArg("offset", 0));
+    const long    limit  = max(0L, intArg("limit", 0));
+    const DirSort sort   = parseDirSort(server.arg("sort").c_str());
+    const bool    desc   = server.hasArg("desc");
 
     Serial.printf("Listing directory: %s\n", dirname.c_str());
 
-    auto listing = listDir(dirname.c_str());
-    if (listing.empty()) {
+    const long total = dirEntryCount(dirname.c_str());
+    if (total < 0) {
         server.send(404, "text/json", "{\"message\":\"Directory not found\"}");
         return;
     }
 
-    String output = "[";
-    for (const auto &file : listing) {
-        if (output != "[") {
-            output += ',';
-        }
-        output += "{\"type\":\"";
-        output += (file.isDir) ? "dir" : "file";
-        output += "\",\"name\":\"";
-        output += file.name;
-        output += "\",\"size\":";
-        output += sizeInKbytes(file.size);
-        output += "}";
-    }
+    // Sent a page of entries at a time as the client drains them, so
+    // even thousands of entries never sit in RAM
+    struct Listing
+    {
+        std::string path;
+        size_t      first;
+        size_t      next;
+        size_t      end;
+    };
+    const long end     = limit ? min(total, offset + limit) : total;
+    auto       listing = std::make_shared<Listing>(Listing{
+            dirname.c_str(), (size_t) offset, (size_t) offset, (size_t) end });
 
-    output += "]";
-    server.send(200, "text/json", output);
+    server.sendHeader("X-Total-Count", String(total).c_str());
+    server.sendStream(200, "text/json", [=](ChunkedWriter &out) {
+        const bool first = listing->next == listing->first;
+        if (first) {
+            out.print("[");
+        }
+        if (listing->next >= listing->end) {
+            out.print("]");
+            return false;
+        }
+        const size_t count
+                = min((size_t) LIST_PAGE, listing->end - listing->next);
+        writeDirEntries(out, listing->path.c_str(), sort, desc, listing->next,
+                count, first);
+        listing->next += count;
+        return true;
+    });
 }
 
 void handleCreateDir()
@@ -64,7 +136,7 @@ void handleCreateDir()
         return;
     }
 
-    String dirname = server.arg("dir");
+    String dirname = server.arg("dir").c_str();
     Serial.printf("Creating directory: %s\n", dirname.c_str());
 
     if (!createDir(dirname.c_str())) {
@@ -84,11 +156,16 @@ void handleDraw()
         return;
     }
 
-    String filename = server.arg("file");
+    String filename = server.arg("file").c_str();
     Serial.printf("Drawing file: %s\n", filename.c_str());
 
-    // Load png
-    if (!decodePng(filename.c_str())) {
+    // Load png, optionally into a window of the frame
+    int x = intArg("x", 0);
+    int y = intArg("y", 0);
+    stopPlaylist();
+    selectGenerator("none");
+    if (!decodePng(filename.c_str(),
+                image.view(x, y, image.xres - x, image.yres - y))) {
         Serial.println("Failed to load image");
         server.send(500, "text/json", "{\"message\":\"Failed to load image\"}");
         return;
@@ -97,12 +174,459 @@ void handleDraw()
         Serial.println("Image loaded");
 
         // Start VGA emulator
+        presentImage(&image);
         vga.setup();
+        requestSnapshot();
     }
 
     server.send(200, "text/json", "{\"message\":\"Image loaded\"}");
 }
 
+void handleGenerator()
+{
+    // Without a name, list the available generators
+    if (!server.hasArg("name")) {
+        String output = "{\"active\":\"";
+        output += activeGeneratorName();
+        output += "\",\"generators\":[\"none\"";
+        for (size_t i = 0; i < generatorCount; ++i) {
+            output += ",\"";
+            output += generators[i].name;
+            output += "\"";
+        }
+        output += "]}";
+        server.send(200, "text/json", output.c_str());
+        return;
+    }
+
+    String name = server.arg("name").c_str();
+    Serial.printf("Selecting generator: %s\n", name.c_str());
+
+    stopPlaylist();
+    if (!selectGenerator(name.c_str())) {
+        server.send(404, "text/json", "{\"message\":\"Unknown generator\"}");
+        return;
+    }
+
+    // Generators need no image, make sure the signal is running
+    vga.setup();
+    server.send(200, "text/json", "{\"message\":\"Generator selected\"}");
+}
+
+// Frames come from the PSRAM pool, falling back to the heap; when both
+// are spent the request gets a 503 and the image is not kept
+static bool allocateFrame(Image *&target)
+{
+    if (!target) {
+        target = new Image();
+    }
+    if (target->pixels) {
+        return true;
+    }
+    delete target;
+    target = nullptr;
+    server.send(503, "text/json", "{\"message\":\"Out of frame memory\"}");
+    return false;
+}
+
+void handleRender()
+{
+    static Image   *renderBuffers[2]{};
+    static unsigned renderCount = 0;
+
+    if (!server.hasArg("shader")) {
+        server.send(
+                404, "text/json", "{\"message\":\"Shader not specified\"}");
+        return;
+    }
+
+    // Render into whichever buffer is not on screen, then flip at vsync
+    stopPlaylist();
+    Image *&target = renderBuffers[frontImage == renderBuffers[0]];
+    if (!allocateFrame(target)) {
+        return;
+    }
+
+    String   shader = server.arg("shader").c_str();
+    uint32_t start  = millis();
+    if (!renderShader(shader.c_str(), *target, renderCount++)) {
+        server.send(404, "text/json", "{\"message\":\"Unknown shader\"}");
+        return;
+    }
+    Serial.printf("Rendered %s on %d workers in %u ms\n", shader.c_str(),
+            rendererWorkers(), millis() - start);
+
+    selectGenerator("none");
+    presentImage(target);
+    vga.setup();
+    requestSnapshot();
+    server.send(200, "text/json", "{\"message\":\"Frame rendered\"}");
+}
+
+void handleAffine()
+{
+    // Rotate and zoom whatever is on screen when the layer is switched on
+    stopPlaylist();
+    bool switching = scanoutGenerator != affineLine;
+    if (switching) {
+        affineLayer.source = frontImage;
+    }
+    const Image &source = *affineLayer.source;
+
+    AffineMatrix m;
+    if (server.hasArg("a")) {
+        // Raw matrix, converted to 16.16 fixed point
+        m.a  = lround(doubleArg("a", 1.0) * 65536.0);
+        m.b  = lround(doubleArg("b", 0.0) * 65536.0);
+        m.c  = lround(doubleArg("c", 0.0) * 65536.0);
+        m.d  = lround(doubleArg("d", 1.0) * 65536.0);
+        m.tx = lround(doubleArg("tx", 0.0) * 65536.0);
+        m.ty = lround(doubleArg("ty", 0.0) * 65536.0);
+    }
+    else {
+        double zoom = doubleArg("zoom", 1.0);
+        if (zoom <= 0.0) {
+            server.send(400, "text/json", "{\"message\":\"Invalid zoom\"}");
+            return;
+        }
+        m = affineRotateZoom(doubleArg("angle", 0.0) * PI / 180.0, zoom,
+                doubleArg("cx", source.xres / 2.0),
+                doubleArg("cy", source.yres / 2.0), VGA480p.xres / 2.0,
+                VGA480p.yres / 2.0);
+    }
+
+    affineLayer.edge     = server.arg("edge") == "clamp" ? AffineEdge::Clamp
+                                                         : AffineEdge::Wrap;
+    affineLayer.lineHook = server.arg("perspective") == "1" ? affinePerspective
+                                                            : nullptr;
+    setAffineMatrix(m);
+
+    if (switching) {
+        selectGenerator("affine");
+        vga.setup();
+    }
+    server.send(200, "text/json", "{\"message\":\"Matrix updated\"}");
+}
+
+void handleLayer()
+{
+    static Image *layerImages[MAX_LAYERS]{};
+
+    int index = intArg("index", -1);
+    if (index < 0 || index >= MAX_LAYERS) {
+        server.send(404, "text/json", "{\"message\":\"Invalid layer\"}");
+        return;
+    }
+    Layer &layer = layers[index];
+
+    // Decode into the layer's own image, the others stay untouched
+    stopPlaylist();
+    if (server.hasArg("file")) {
+        String filename = server.arg("file").c_str();
+        Serial.printf("Loading layer %d from %s\n", index, filename.c_str());
+
+        if (index && !allocateFrame(layerImages[index])) {
+            return;
+        }
+        Image *target = index ? layerImages[index] : &image;
+        if (!decodePng(filename.c_str(), target->view())) {
+            server.send(
+                    500, "text/json", "{\"message\":\"Failed to load image\"}");
+            return;
+        }
+        setLayer(index, target, layer.image ? layer.alpha : 255);
+    }
+
+    if (server.hasArg("mask")) {
+        MaskFormat format = server.arg("maskbits") == "1" ? MaskFormat::Bits1
+                                                          : MaskFormat::Bits4;
+        if (!loadLayerMask(index, server.arg("mask").c_str(), format)) {
+            server.send(
+                    500, "text/json", "{\"message\":\"Failed to load mask\"}");
+            return;
+        }
+    }
+
+    if (server.hasArg("alpha")) {
+        layer.alpha = constrain(intArg("alpha", 0), 0, 255);
+    }
+    if (server.hasArg("enabled")) {
+        layer.enabled = server.arg("enabled") != "0" && layer.image;
+    }
+
+    if (scanoutGenerator != compositeLine) {
+        selectGenerator("layers");
+        vga.setup();
+    }
+    server.send(200, "text/json", "{\"message\":\"Layer updated\"}");
+}
+
+void handleRle()
+{
+    // Compress whatever is on screen, unless asked for a blank frame, into
+    // a new image; the one scanout may be reading is freed a frame later
+    stopPlaylist();
+    RleImage *next = new RleImage(VGA480p.xres, VGA480p.yres);
+    if (server.arg("clear") != "1" && !next->encode(frontImage->view())) {
+        delete next;
+        server.send(500, "text/json",
+                "{\"message\":\"Image too detailed to compress\"}");
+        return;
+    }
+    RleImage *old = rleFrame;
+    rleFrame      = next;
+    if (old) {
+        waitForVsync();
+        delete old;
+    }
+
+    if (scanoutGenerator != rleLine) {
+        selectGenerator("rle");
+        vga.setup();
+    }
+    server.send(200, "text/json",
+            ("{\"bytes\":" + String(rleFrame->bytes()) + ",\"raw\":"
+                    + String(frontImage->xres * frontImage->yres * 3) + "}")
+                    .c_str());
+}
+
+void handleRleRect()
+{
+    if (!rleFrame || !server.hasArg("x") || !server.hasArg("y")
+            || !server.hasArg("w") || !server.hasArg("h")) {
+        server.send(404, "text/json",
+                "{\"message\":\"Rectangle not fully specified\"}");
+        return;
+    }
+
+    // Color as rrggbb hex
+    uint32_t rgb = strtoul(server.arg("color").c_str(), nullptr, 16);
+    Color    c   = { (unsigned char) (rgb >> 16), (unsigned char) (rgb >> 8),
+             (unsigned char) rgb };
+
+    if (!rleFrame->fillRect(intArg("x", 0), intArg("y", 0), intArg("w", 0),
+                intArg("h", 0), c)) {
+        server.send(500, "text/json", "{\"message\":\"RLE pool full\"}");
+        return;
+    }
+    server.send(200, "text/json",
+            ("{\"bytes\":" + String(rleFrame->bytes()) + "}").c_str());
+}
+
+// Plays `items`, or the items listed in `file`, as a slideshow; `loop=1`
+// repeats it and `stop=1` stops it. Without arguments, reports on it.
+void handlePlaylist()
+{
+    if (server.hasArg("stop")) {
+        stopPlaylist();
+        server.send(200, "text/json", "{\"message\":\"Playlist stopped\"}");
+        return;
+    }
+
+    std::string text;
+    if (server.hasArg("items")) {
+        text = server.arg("items");
+    }
+    else if (server.hasArg("file")) {
+        size_t   size  = 0;
+        uint8_t *bytes = readFile(
+                server.arg("file").c_str(), scratchArena(), &size);
+        if (!bytes) {
+            server.send(
+                    404, "text/json", "{\"message\":\"Playlist not found\"}");
+            return;
+        }
+        text.assign((const char *) bytes, size);
+    }
+    else {
+        PlaylistStats stats  = playlistStats();
+        String        output = "{\"playing\":";
+        output += playlistRunning() ? "true" : "false";
+        output += ",\"switches\":";
+        output += stats.switches;
+        output += ",\"late\":";
+        output += stats.late;
+        output += ",\"maxLateMs\":";
+        output += stats.maxLateMs;
+        output += ",\"failed\":";
+        output += stats.failed;
+        output += ",\"lastDecodeMs\":";
+        output += stats.lastDecodeMs;
+        output += "}";
+        server.send(200, "text/json", output.c_str());
+        return;
+    }
+
+    std::vector<PlaylistItem> items;
+    if (!parsePlaylist(text.c_str(), items)) {
+        server.send(400, "text/json", "{\"message\":\"Invalid playlist\"}");
+        return;
+    }
+    if (!startPlaylist(items, server.arg("loop") == "1")) {
+        server.send(500, "text/json",
+                "{\"message\":\"Failed to start the playlist\"}");
+        return;
+    }
+    Serial.printf("Playing %u items\n", items.size());
+    server.send(200, "text/json", "{\"message\":\"Playlist started\"}");
+}
+
+void handleScreenshot()
+{
+    CaptureFormat format;
+    if (!parseCaptureFormat(server.arg("format").c_str(), format)) {
+        server.send(400, "text/json", "{\"message\":\"Unknown format\"}");
+        return;
+    }
+
+    // What is on screen, or one layer of the compositor
+    const Image *source = frontImage;
+    if (server.hasArg("layer")) {
+        long index = intArg("layer", -1);
+        if (index < 0 || index >= MAX_LAYERS || !layers[index].image) {
+            server.send(404, "text/json", "{\"message\":\"Invalid layer\"}");
+            return;
+        }
+        source = layers[index].image;
+    }
+
+    long scale = intArg("scale", 1);
+    if (scale < 1 || scale > CAPTURE_MAX_SCALE) {
+        server.send(400, "text/json", "{\"message\":\"Invalid scale\"}");
+        return;
+    }
+    PngDeflate deflate = server.arg("deflate") == "store" ? PngDeflate::Store
+                                                          : PngDeflate::Fast;
+
+    auto encoder = std::make_shared<FrameEncoder>(
+            source->view(), format, scale, deflate);
+    if (!encoder->width()) {
+        server.send(400, "text/json", "{\"message\":\"Nothing to capture\"}");
+        return;
+    }
+    Serial.printf("Screenshot %dx%d as %s\n", encoder->width(),
+            encoder->height(), captureMimeType(format));
+
+    // Encoded a row at a time from the frame itself as the client reads
+    size_t length = encoder->length();
+    server.sendHeader("X-Width", String(encoder->width()).c_str());
+    server.sendHeader("X-Height", String(encoder->height()).c_str());
+    server.sendHeader("Cache-Control", "no-store");
+    server.sendStream(200, captureMimeType(format),
+            [encoder](ChunkedWriter &out) { return encoder->next(out); },
+            length ? length : HTTPD_UNKNOWN_LENGTH);
+}
+
+void handlePrefetchStats()
+{
+    String output = "{";
+    output += "\"hits\":";
+    output += prefetchStats.hits;
+    output += ",\"underruns\":";
+    output += prefetchStats.underruns;
+    output += ",\"dmaCopies\":";
+    output += prefetchStats.dmaCopies;
+    output += ",\"cpuCopies\":";
+    output += prefetchStats.cpuCopies;
+    output += "}";
+    server.send(200, "text/json", output.c_str());
+}
+
+void handleHeap()
+{
+    static const char *regions[] = { "psram", "internal", "dma" };
+
+    String output = "{\"allocators\":[";
+    for (Allocator *a = firstAllocator(); a; a = a->next) {
+        output += "{\"name\":\"";
+        output += a->name;
+        output += "\",\"region\":\"";
+        output += regions[(int) a->region];
+        output += "\",\"capacity\":";
+        output += a->capacity();
+        output += ",\"used\":";
+        output += a->used();
+        output += ",\"highWater\":";
+        output += a->highWater();
+        output += a->next ? "}," : "}";
+    }
+    output += "],\"internalFree\":";
+    output += heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    output += ",\"internalMinFree\":";
+    output += heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    output += ",\"psramFree\":";
+    output += heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    output += ",\"psramMinFree\":";
+    output += heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+    output += "}";
+    server.send(200, "text/json", output.c_str());
+}
+
+// Prometheus text by default, ?format=json for the same series as JSON
+void handleMetrics()
+{
+    std::string output;
+    if (server.arg("format") == "json") {
+        metrics().writeJson(output);
+        server.send(200, "text/json", output);
+    }
+    else {
+        metrics().writePrometheus(output);
+        server.send(200, "text/plain; version=0.0.4", output);
+    }
+}
+
+// The rings as Chrome trace JSON, for ui.perfetto.dev or chrome://tracing;
+// ?categories=vsync,render,... clears them and records those from now on
+void handleTrace()
+{
+    if (server.hasArg("categories")) {
+        uint32_t mask;
+        if (!parseTraceMask(server.arg("categories").c_str(), mask)) {
+            server.send(400, "text/json",
+                    "{\"message\":\"Unknown trace category\"}");
+            return;
+        }
+        tracer.clear();
+        tracer.mask = mask;
+        server.send(200, "text/json", "{\"message\":\"Tracing\"}");
+        return;
+    }
+
+    // Paused while copied out, so the rings hold still
+    const uint32_t mask = tracer.mask.exchange(0);
+    std::string    output;
+    tracer.writeChrome(output);
+    tracer.mask = mask;
+    server.send(200, "text/json", output);
+}
+
+// The server's own series, registered once it exists
+static void registerHttpMetrics()
+{
+    static RateMeter received, sent;
+
+    MetricRegistry &registry = metrics();
+    registry.addCounter("vga_http_requests_total", "HTTP requests served",
+            [] { return (double) server.lastStats().requests; });
+    registry.addCounter("vga_http_received_bytes_total",
+            "Bytes read from HTTP clients",
+            [] { return (double) server.lastStats().bytesIn; });
+    registry.addCounter("vga_http_sent_bytes_total",
+            "Bytes written to HTTP clients",
+            [] { return (double) server.lastStats().bytesOut; });
+    registry.addGauge("vga_http_receive_bytes_per_second",
+            "Receive rate since the scrape before, a second apart at least",
+            [] {
+                return received.update(server.lastStats().bytesIn, micros());
+            });
+    registry.addGauge("vga_http_send_bytes_per_second",
+            "Send rate since the scrape before, a second apart at least",
+            [] {
+                return sent.update(server.lastStats().bytesOut, micros());
+            });
+}
+
 void handleRename()
 {
     if (!server.hasArg("old") || !server.hasArg("new")) {
@@ -111,8 +635,8 @@ void handleRename()
         return;
     }
 
-    String oldName = server.arg("old");
-    String newName = server.arg("new");
+    String oldName = server.arg("old").c_str();
+    String newName = server.arg("new").c_str();
     Serial.printf(
             "Renaming file: %s to %s\n", oldName.c_str(), newName.c_str());
 
@@ -132,58 +656,192 @@ void handleStorageDetails()
     output += ",\"used\":";
     output += sizeInKbytes(SD.usedBytes());
     output += "}";
-    server.send(200, "text/json", output);
+    server.send(200, "text/json", output.c_str());
 }
 
 void handleUpload()
 {
-    static int  iteration = 0;  // used to slow down for watchdog
-    static File uploadFile;
-    HTTPUpload &upload = server.upload();
+    HttpUpload &upload = server.upload();
 
     if (!server.hasArg("dir")) {
         server.send(404, "text/json",
                 "{\"message\":\"Directory not fully specified\"}");
         return;
     }
-    String filepath = server.arg("dir") + upload.filename;
-
-    if (upload.status == UPLOAD_FILE_START) {
-        iteration = 0;
+    String filepath = server.arg("dir").c_str();
+    filepath += upload.filename.c_str();
 
+    if (upload.status == UploadStatus::Start) {
         if (SD.exists(filepath.c_str())) {
             SD.remove(filepath.c_str());
         }
 
-        uploadFile = SD.open(filepath.c_str(), FILE_WRITE);
-        if (!uploadFile) {
+        // Writes land on SD from the writer task while the next fragments
+        // arrive; while its queue is full the server stops reading this
+        // client, so a slow card throttles only its own upload
+        auto job       = std::make_shared<FileUpload>();
+        upload.context = job;
+        upload.room    = [job] { return job->writer.room(); };
+        job->failed    = !job->writer.open(filepath.c_str());
+        if (job->failed) {
             server.send(
                     500, "text/json", "{\"message\":\"File creation failed\"}");
             return;
         }
 
+        invalidateDir(filepath.c_str());
         Serial.println("Upload started for: " + filepath);
+        return;
     }
-    else if (upload.status == UPLOAD_FILE_WRITE) {
-        if (uploadFile) {
-            uploadFile.write(upload.buf, upload.currentSize);
-        }
 
-        if (++iteration % maxUploadIter == 0) {
-            Serial.printf("Uploaded %d Kbytes so far\n",
-                    sizeInKbytes(upload.totalSize));
-            vTaskDelay(1);
+    FileUpload *job = (FileUpload *) upload.context.get();
+    if (!job) {
+        return;
+    }
+    if (upload.status == UploadStatus::Write) {
+        if (job->writer.isRunning()
+                && !job->writer.write(upload.buf, upload.currentSize)) {
+            job->failed = true;
         }
-
-        iteration %= maxUploadIter;
     }
-    else if (upload.status == UPLOAD_FILE_END) {
-        if (uploadFile) {
-            uploadFile.close();
+    else if (upload.status == UploadStatus::End) {
+        if (job->writer.isRunning()) {
+            job->failed |= !job->writer.finish();
+            invalidateDir(filepath.c_str());
             Serial.println(
                     "Upload finished: " + String(upload.totalSize) + " bytes");
         }
     }
+    else if (upload.status == UploadStatus::Aborted) {
+        job->writer.finish();
+        job->failed = true;
+        SD.remove(filepath.c_str());
+        invalidateDir(filepath.c_str());
+    }
+}
+
+void handleUploadDone()
+{
+    const FileUpload *job = (FileUpload *) server.upload().context.get();
+    if (!job || job->failed) {
+        server.send(500, "text/json", "{\"message\":\"Upload failed\"}");
+        return;
+    }
+
+    const WriteStats &stats = job->writer.lastStats();
+    const uint32_t    ms    = stats.micros / 1000 ? stats.micros / 1000 : 1;
+
+    String output = "{\"message\":\"Upload successful\"";
+    output += ",\"bytes\":";
+    output += stats.bytes;
+    output += ",\"ms\":";
+    output += ms;
+    output += ",\"kbps\":";
+    output += (uint32_t) ((uint64_t) stats.bytes * 1000 / 1024 / ms);
+    output += ",\"stalls\":";
+    output += stats.stalls;
+    output += "}";
+    server.send(200, "text/json", output.c_str());
+}
+
+// The tar file arrives as a multipart upload, like /update, so the web
+// server hands it over in pieces instead of buffering the body
+void handleArchiveUpload()
+{
+    HttpUpload &upload = server.upload();
+
+    if (upload.status == UploadStatus::Start) {
+        String dir     = server.hasArg("dir") ? server.arg("dir").c_str() : "/";
+        auto   job     = std::make_shared<ArchiveUpload>();
+        upload.context = job;
+        upload.room    = [job] { return job->extractor.room(); };
+        job->failed    = !job->extractor.begin(dir.c_str());
+        Serial.printf("Extracting %s into %s\n", upload.filename.c_str(),
+                dir.c_str());
+        return;
+    }
+
+    ArchiveUpload *job = (ArchiveUpload *) upload.context.get();
+    if (!job) {
+        return;
+    }
+    if (upload.status == UploadStatus::Write) {
+        if (job->extractor.isRunning()
+                && !job->extractor.write(upload.buf, upload.currentSize)) {
+            job->failed = true;
+        }
+    }
+    else if (upload.status == UploadStatus::End) {
+        if (job->extractor.isRunning()) {
+            job->failed |= !job->extractor.finish();
+        }
+    }
+    else if (upload.status == UploadStatus::Aborted) {
+        job->extractor.abort();
+        job->failed = true;
+    }
+}
+
+void handleArchiveDone()
+{
+    const ArchiveUpload *job = (ArchiveUpload *) server.upload().context.get();
+    if (!job || job->failed) {
+        server.send(500, "text/json", "{\"message\":\"Extraction failed\"}");
+        return;
+    }
+
+    const TarStats &stats = job->extractor.lastStats();
+    const uint32_t  ms    = stats.micros / 1000 ? stats.micros / 1000 : 1;
+
+    String output = "{\"message\":\"Archive extracted\"";
+    output += ",\"files\":";
+    output += stats.files;
+    output += ",\"dirs\":";
+    output += stats.dirs;
+    output += ",\"skipped\":";
+    output += stats.skipped;
+    output += ",\"bytes\":";
+    output += stats.bytes;
+    output += ",\"ms\":";
+    output += ms;
+    output += ",\"kbps\":";
+    output += (uint32_t) ((uint64_t) stats.bytes * 1000 / 1024 / ms);
+    output += "}";
+    server.send(200, "text/json", output.c_str());
+}
+
+void handleArchiveDownload()
+{
+    String dir = server.hasArg("dir") ? server.arg("dir").c_str() : "/";
+    while (dir.length() > 1 && dir.endsWith("/")) {
+        dir.remove(dir.length() - 1);
+    }
+    if (!isDirectory(dir.c_str())) {
+        server.send(404, "text/json", "{\"message\":\"Directory not found\"}");
+        return;
+    }
+    Serial.printf("Archiving directory: %s\n", dir.c_str());
+
+    String name = dir.substring(dir.lastIndexOf('/') + 1);
+    String disposition = "attachment; filename=\""
+                         + (name.length() ? name : String("sd")) + ".tar\"";
+    server.sendHeader("Content-Disposition", disposition.c_str());
+
+    // Pulled a header or a file chunk at a time as the client takes it;
+    // whether it got everything is told once the writer is dropped
+    std::shared_ptr<TarWriter> tar(
+            new TarWriter(dir.c_str()), [](TarWriter *tar) {
+                const TarStats &stats = tar->lastStats();
+                Serial.printf("%s %u files, %u KB in %u ms\n",
+                        tar->isDone() && tar->succeeded()
+                                ? "Archived"
+                                : "Archive stopped after",
+                        (unsigned) stats.files, sizeInKbytes(stats.bytes),
+                        (unsigned) (stats.micros / 1000));
+                delete tar;
+            });
+    server.sendStream(200, "application/x-tar",
+            [tar](ChunkedWriter &out) { return tar->next(out); });
 }
 
 void handleDownload()
@@ -193,7 +851,7 @@ void handleDownload()
         return;
     }
 
-    String filename = server.arg("file");
+    String filename = server.arg("file").c_str();
     Serial.printf("Download: %s\n", filename.c_str());
 
     File file = SD.open(filename.c_str());
@@ -201,22 +859,105 @@ void handleDownload()
         server.send(404, "text/json", "{\"message\":\"File not found\"}");
         return;
     }
-
-    if (file.isDirectory()) {
+    bool   isDir    = file.isDirectory();
+    time_t modified = file.getLastWrite();
+    file.close();
+    if (isDir) {
         server.send(403, "text/json",
                 "{\"message\":\"Cannot download a directory\"}");
+        return;
+    }
+
+    auto reader = std::make_shared<FileReader>(DOWNLOAD_CHUNK);
+    if (!reader->open(filename.c_str())) {
+        server.send(500, "text/json", "{\"message\":\"Failed to open file\"}");
+        return;
     }
-    else if (server.streamFile(file, "application/octet-stream")
-             != file.size()) {
-        Serial.println("Sent less data than expected!");
-        server.send(500, "text/json", "{\"message\":\"Download incomplete\"}");
+
+    Validators validators;
+    makeValidators(validators, reader->size(), modified);
+    DownloadPlan plan = planDownload(reader->size(), validators,
+            server.header("Range").c_str(), server.header("If-Range").c_str(),
+            server.header("If-None-Match").c_str());
+
+    server.sendHeader("Accept-Ranges", "bytes");
+    server.sendHeader("ETag", validators.etag);
+    server.sendHeader("Last-Modified", validators.lastModified);
+    if (plan.status == 304) {
+        server.send(304);
+        return;
     }
-    else {
-        Serial.println("File sent successfully");
-        server.send(200, "text/json", "{\"message\":\"Download successful\"}");
+    if (plan.status == 416) {
+        server.sendHeader("Content-Range",
+                ("bytes */" + String(reader->size())).c_str());
+        server.send(416, "text/json",
+                "{\"message\":\"Range not satisfiable\"}");
+        return;
+    }
+    if (plan.status == 206) {
+        server.sendHeader("Content-Range",
+                ("bytes " + String(plan.range.first) + "-"
+                        + String(plan.range.last) + "/"
+                        + String(reader->size()))
+                        .c_str());
     }
 
-    file.close();
+    // A chunk goes out whenever the client has taken the last one, the
+    // next is read meanwhile; HEAD requests get the headers alone
+    auto remaining = std::make_shared<size_t>(plan.length);
+    reader->seek(plan.range.first);
+    server.sendStream(
+            plan.status, "application/octet-stream",
+            [reader, remaining](ChunkedWriter &out) {
+                Chunk chunk;
+                if (!reader->next(chunk)) {
+                    Serial.printf(
+                            "Download stopped %u bytes short\n", *remaining);
+                    return false;
+                }
+                size_t n = chunk.size < *remaining ? chunk.size : *remaining;
+                out.write((const char *) chunk.data, n);
+                *remaining -= n;
+                if (!*remaining) {
+                    Serial.println("File sent successfully");
+                }
+                return *remaining > 0;
+            },
+            plan.length);
+}
+
+String jobJson(const JobStatus &status)
+{
+    String output = "{\"id\":";
+    output += status.id;
+    output += ",\"kind\":\"";
+    output += jobKindName(status.kind);
+    output += "\",\"state\":\"";
+    output += jobStateName(status.state);
+    output += "\",\"path\":\"";
+    output += status.path;
+    output += "\",\"removed\":";
+    output += status.removed;
+    output += ",\"errors\":";
+    output += status.errors;
+    output += ",\"ms\":";
+    output += status.micros / 1000;
+    output += "}";
+    return output;
+}
+
+// Answers 202 with the job to poll at /jobs/<id>
+void sendJobStarted(uint32_t id, const char *message)
+{
+    if (!id) {
+        server.send(503, "text/json", "{\"message\":\"Too many jobs\"}");
+        return;
+    }
+    server.sendHeader("Location", ("/jobs/" + String(id)).c_str());
+    server.send(202, "text/json",
+            ("{\"message\":\"" + String(message) + "\",\"job\":"
+                    + String(id) + "}")
+                    .c_str());
 }
 
 void handleDelete()
@@ -226,19 +967,26 @@ void handleDelete()
         return;
     }
 
-    String filename = server.arg("file");
+    String filename = server.arg("file").c_str();
     Serial.printf("Delete: %s\n", filename.c_str());
 
-    if (SD.exists(filename.c_str())) {
-        if (deleteItem(filename)) {
-            server.send(200, "text/json", "{\"message\":\"File deleted\"}");
-        }
-        else {
-            server.send(500, "text/plain", "{\"message\":\"Delete failed\"}");
-        }
+    File file = SD.open(filename);
+    if (!file) {
+        server.send(404, "text/plain", "{\"message\":\"File not found\"}");
+        return;
+    }
+
+    // A file goes right away, a directory in the background
+    const bool isDir = file.isDirectory();
+    file.close();
+    if (isDir) {
+        sendJobStarted(submitDelete(filename.c_str()), "Delete started");
+    }
+    else if (deleteFile(filename.c_str())) {
+        server.send(200, "text/json", "{\"message\":\"File deleted\"}");
     }
     else {
-        server.send(404, "text/plain", "{\"message\":\"File not found\"}");
+        server.send(500, "text/plain", "{\"message\":\"Delete failed\"}");
     }
 }
 
@@ -246,14 +994,39 @@ void handleWipe()
 {
     // Wipe everything from the SD card
     Serial.println("Wipe SD card");
+    sendJobStarted(submitWipe(), "Wipe started");
+}
 
-    auto listing = listDir("/");
-    for (auto &item : listing)
-        if (item.name != "System Volume Information") {
-            deleteItem("/" + item.name);
-        }
+void handleJobs()
+{
+    JobStatus jobs[MAX_JOBS];
+    size_t    count = listJobs(jobs, MAX_JOBS);
+
+    String output = "[";
+    for (size_t i = 0; i < count; ++i) {
+        output += i ? "," : "";
+        output += jobJson(jobs[i]);
+    }
+    output += "]";
+    server.send(200, "text/json", output.c_str());
+}
 
-    server.send(200, "text/json", "{\"message\":\"SD card wiped\"}");
+// GET reports progress, DELETE cancels
+void handleJob()
+{
+    uint32_t  id = strtoul(server.pathArg(0).c_str(), nullptr, 10);
+    JobStatus status;
+
+    if (server.method() == HttpMethod::Delete && !cancelJob(id)) {
+        server.send(409, "text/json",
+                "{\"message\":\"Job not found or already finished\"}");
+        return;
+    }
+    if (!jobStatus(id, status)) {
+        server.send(404, "text/json", "{\"message\":\"Job not found\"}");
+        return;
+    }
+    server.send(200, "text/json", jobJson(status).c_str());
 }
 
 void handleGetMonitorDetails()
@@ -261,54 +1034,85 @@ void handleGetMonitorDetails()
     int width = 0, height = 0;
     vga.getMonitorResolution(&width, &height);
     server.send(200, "text/json",
-            "{\"width\":" + String(width) + ",\"height\":" + String(height)
-                    + "}");
+            ("{\"width\":" + String(width) + ",\"height\":" + String(height)
+                    + "}")
+                    .c_str());
 }
 
-void serverTask(void *args)
+bool connectWifi(uint32_t timeoutMs)
 {
-    // ─── Connect To Wifi Network ─────────────────────────────────────────
-
     Serial.print("Connecting to ");
     Serial.println(ssid);
 
     WiFi.begin(ssid, password);
+    uint32_t start = millis();
     while (WiFi.status() != WL_CONNECTED) {
-        delay(500);
-        Serial.print(".");
+        if (millis() - start >= timeoutMs) {
+            Serial.println("WiFi not connected yet, still trying");
+            return false;
+        }
+        delay(100);
     }
 
-    Serial.print("\nConnected to WiFi. IP address: ");
+    Serial.print("Connected to WiFi. IP address: ");
     Serial.println(WiFi.localIP());
+    return true;
+}
 
-    // ─── Start Server ────────────────────────────────────────────────────
-
-    server.on("/", HTTP_GET, []() { server.send(200, "text/html", webpage); });
-    server.on("/listDir", HTTP_GET, handleListDir);
-    server.on("/createDir", HTTP_GET, handleCreateDir);
-    server.on("/draw", HTTP_GET, handleDraw);
-    server.on("/rename", HTTP_GET, handleRename);
-    server.on("/storage", HTTP_GET, handleStorageDetails);
-    server.on("/monitor", HTTP_GET, handleGetMonitorDetails);
-    server.on(
-            "/update", HTTP_POST,
-            []() {
-                server.send(200, "text/json",
-                        "{\"message\":\"Upload successful\"}");
-            },
-            handleUpload);
-    server.on("/download", HTTP_GET, handleDownload);
-    server.on("/delete", HTTP_GET, handleDelete);
-    server.on("/wipe", HTTP_GET, handleWipe);
+bool startServer()
+{
+    server.on("/", HttpMethod::Get, handleRoot);
+    server.on("/listDir", HttpMethod::Get, handleListDir);
+    server.on("/createDir", HttpMethod::Get, handleCreateDir);
+    server.on("/draw", HttpMethod::Get, handleDraw);
+    server.on("/generator", HttpMethod::Get, handleGenerator);
+    server.on("/render", HttpMethod::Get, handleRender);
+    server.on("/affine", HttpMethod::Get, handleAffine);
+    server.on("/layer", HttpMethod::Get, handleLayer);
+    server.on("/rle", HttpMethod::Get, handleRle);
+    server.on("/rle/rect", HttpMethod::Get, handleRleRect);
+    server.on("/screenshot", HttpMethod::Get, handleScreenshot);
+    server.on("/playlist", HttpMethod::Get, handlePlaylist);
+    server.on("/prefetch", HttpMethod::Get, handlePrefetchStats);
+    server.on("/heap", HttpMethod::Get, handleHeap);
+    server.on("/metrics", HttpMethod::Get, handleMetrics);
+    server.on("/trace", HttpMethod::Get, handleTrace);
+    server.on("/rename", HttpMethod::Get, handleRename);
+    server.on("/storage", HttpMethod::Get, handleStorageDetails);
+    server.on("/monitor", HttpMethod::Get, handleGetMonitorDetails);
+    server.on("/update", HttpMethod::Post, handleUploadDone, handleUpload);
+    server.on("/download", HttpMethod::Get, handleDownload);
+    server.on("/download", HttpMethod::Head, handleDownload);
+    server.on("/archive", HttpMethod::Post, handleArchiveDone,
+            handleArchiveUpload);
+    server.on("/archive", HttpMethod::Get, handleArchiveDownload);
+    server.on("/delete", HttpMethod::Get, handleDelete);
+    server.on("/wipe", HttpMethod::Get, handleWipe);
+    server.on("/jobs", HttpMethod::Get, handleJobs);
+    server.on("/jobs/{}", HttpMethod::Get, handleJob);
+    server.on("/jobs/{}", HttpMethod::Delete, handleJob);
     server.onNotFound([]() {
         server.send(404, "text/json", "{\"message\":\"Not found\"}");
     });
-    server.begin();
 
+    while (!server.begin()) {
+        delay(1000);
+    }
+    registerHttpMetrics();
+
+    return xTaskCreatePinnedToCore(
+                   serverTask, "Server Task", 10000, NULL, 1, NULL, 0)
+           == pdPASS;
+}
+
+void serverTask(void *args)
+{
     // ─── Server Loop ─────────────────────────────────────────────────────
 
+    // select() sleeps until a client needs something, other tasks run
+    TRACE_NAME_TRACK("server");
     for (;;) {
-        server.handleClient();
-        vTaskDelay(1);
+        server.poll(10);
+        scratchArena().reset();
     }
 }
\ No newline at end of file
@@ -0,0 +1,539 @@
+// ====================================================== //
+// ============ Chunked streaming file reads ============ //
+// ====================================================== //
+
+#include "stream.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "report.h"
+
+#ifndef ARDUINO
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#endif
+
+// ─── Read-ahead ─────────────────────────────────────────────────────────
+
+#ifdef ARDUINO
+// One task serves the read-ahead of every open reader, so SD reads stay
+// in the order they were queued
+static QueueHandle_t readQueue;
+
+void FileReader::readerTask(void *args)
+{
+    FileReader *reader;
+    for (;;) {
+        if (xQueueReceive(readQueue, &reader, portMAX_DELAY) == pdTRUE) {
+            reader->aheadSize = reader->load(
+                    reader->buffers[reader->current ^ 1], reader->aheadSize);
+            xSemaphoreGive(reader->done);
+        }
+    }
+}
+#else
+// As on the device, one thread that lives as long as the program serves
+// every reader; never freed, so it can still be waiting at exit
+struct ReadAhead
+{
+    std::mutex               mutex;
+    std::condition_variable  queued;
+    std::condition_variable  loaded;
+    std::deque<FileReader *> readers;
+};
+static ReadAhead     *readWorker;
+static std::once_flag readWorkerStarted;
+
+void FileReader::readerThread()
+{
+    std::unique_lock<std::mutex> lock(readWorker->mutex);
+    for (;;) {
+        readWorker->queued.wait(
+                lock, [] { return !readWorker->readers.empty(); });
+        FileReader *reader = readWorker->readers.front();
+        readWorker->readers.pop_front();
+
+        lock.unlock();
+        const size_t size = reader->load(
+                reader->buffers[reader->current ^ 1], reader->aheadSize);
+        lock.lock();
+
+        reader->aheadSize = size;
+        reader->loaded    = true;
+        readWorker->loaded.notify_all();
+    }
+}
+#endif
+
+// Reads until `size` bytes arrived or the file ended
+size_t FileReader::load(uint8_t *buf, size_t size)
+{
+    size_t len = 0;
+    while (len < size) {
+#ifdef ARDUINO
+        size_t n = file.read(buf + len, size - len);
+#else
+        ssize_t n = ::read(fd, buf + len, size - len);
+        if (n < 0) {
+            break;
+        }
+#endif
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
+
+// Starts reading the chunk at filePos into the buffer not handed out
+void FileReader::startRead()
+{
+    aheadOffset = filePos;
+    aheadSize   = fileSize - filePos < chunkSize ? fileSize - filePos
+                                                 : chunkSize;
+    filePos += aheadSize;
+    inFlight = true;
+
+    if (!readAhead || !aheadSize) {
+        aheadSize = load(buffers[current ^ 1], aheadSize);
+        return;
+    }
+
+#ifdef ARDUINO
+    FileReader *self = this;
+    if (xQueueSend(readQueue, &self, 0) != pdTRUE) {
+        aheadSize = load(buffers[current ^ 1], aheadSize);
+        xSemaphoreGive(done);
+    }
+#else
+    std::lock_guard<std::mutex> lock(readWorker->mutex);
+    loaded = false;
+    readWorker->readers.push_back(this);
+    readWorker->queued.notify_one();
+#endif
+}
+
+// Waits for the read started last and returns its length
+size_t FileReader::finishRead()
+{
+    inFlight = false;
+    if (!readAhead || aheadOffset == fileSize) {
+        return aheadSize;
+    }
+
+#ifdef ARDUINO
+    xSemaphoreTake(done, portMAX_DELAY);
+#else
+    std::unique_lock<std::mutex> lock(readWorker->mutex);
+    readWorker->loaded.wait(lock, [this] { return loaded; });
+#endif
+    return aheadSize;
+}
+
+// ─── Reader ─────────────────────────────────────────────────────────────
+
+FileReader::FileReader(size_t chunkSize, bool readAhead)
+    : chunkSize(chunkSize), readAhead(readAhead)
+{}
+
+FileReader::~FileReader()
+{
+    close();
+#ifdef ARDUINO
+    if (done) {
+        vSemaphoreDelete(done);
+    }
+#endif
+}
+
+bool FileReader::open(const char *path)
+{
+    close();
+
+#ifdef ARDUINO
+    file = SD.open(path);
+    if (!file || file.isDirectory()) {
+        Serial.printf("Failed to open file %s for reading\n", path);
+        file.close();
+        return false;
+    }
+    fileSize     = file.size();
+    fileModified = file.getLastWrite();
+
+    if (readAhead && !readQueue) {
+        readQueue = xQueueCreate(4, sizeof(FileReader *));
+        xTaskCreatePinnedToCore(
+                readerTask, "Read Ahead Task", 4096, NULL, 1, NULL, 0);
+    }
+    if (readAhead && !done) {
+        done = xSemaphoreCreateBinary();
+    }
+#else
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        report("Failed to open file %s for reading\n", path);
+        return false;
+    }
+    fileSize = lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET);
+
+    struct stat info;
+    fileModified = fstat(fd, &info) == 0 ? info.st_mtime : 0;
+
+    if (readAhead) {
+        std::call_once(readWorkerStarted, [] {
+            readWorker = new ReadAhead;
+            std::thread(readerThread).detach();
+        });
+    }
+#endif
+
+    buffers[0] = (uint8_t *) chunkAllocator(chunkSize).allocate(chunkSize, 64);
+    buffers[1] = (uint8_t *) chunkAllocator(chunkSize).allocate(chunkSize, 64);
+    if (!buffers[0] || !buffers[1]) {
+        close();
+        return false;
+    }
+
+    current = 0;
+    filePos = 0;
+    chunk   = Chunk{ buffers[0], 0, 0 };
+    cursor  = 0;
+    return true;
+}
+
+void FileReader::close()
+{
+    if (inFlight) {
+        finishRead();
+    }
+
+#ifdef ARDUINO
+    if (file) {
+        file.close();
+    }
+#else
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+
+    chunkAllocator(chunkSize).deallocate(buffers[0]);
+    chunkAllocator(chunkSize).deallocate(buffers[1]);
+    buffers[0] = buffers[1] = nullptr;
+    fileSize                = 0;
+    chunk                   = Chunk{};
+    cursor                  = 0;
+}
+
+bool FileReader::isOpen() const
+{
+    return buffers[0] != nullptr;
+}
+
+size_t FileReader::size() const
+{
+    return fileSize;
+}
+
+time_t FileReader::lastWrite() const
+{
+    return fileModified;
+}
+
+size_t FileReader::position() const
+{
+    return chunk.offset + cursor;
+}
+
+// Moves `chunk` on to the next one, queueing the one after it
+bool FileReader::advance()
+{
+    if (!isOpen()) {
+        return false;
+    }
+    if (!inFlight) {
+        startRead();
+    }
+
+    const size_t offset = aheadOffset;
+    const size_t size   = finishRead();
+    if (!size) {
+        chunk.offset += chunk.size;
+        chunk.size = 0;
+        cursor     = 0;
+        return false;
+    }
+
+    current = current ^ 1;
+    chunk   = Chunk{ buffers[current], size, offset };
+    cursor  = 0;
+
+    if (readAhead && filePos < fileSize) {
+        startRead();
+    }
+    return true;
+}
+
+bool FileReader::next(Chunk &out)
+{
+    // What read() or seek() left of the current chunk goes out first
+    if (cursor < chunk.size) {
+        out    = Chunk{ chunk.data + cursor, chunk.size - cursor,
+               chunk.offset + cursor };
+        cursor = chunk.size;
+        return true;
+    }
+    if (!advance()) {
+        return false;
+    }
+    cursor = chunk.size;
+    out    = chunk;
+    return true;
+}
+
+size_t FileReader::read(uint8_t *dst, size_t size)
+{
+    size_t copied = 0;
+    while (copied < size) {
+        if (cursor == chunk.size && !advance()) {
+            break;
+        }
+        size_t take = chunk.size - cursor;
+        if (take > size - copied) {
+            take = size - copied;
+        }
+        memcpy(dst + copied, chunk.data + cursor, take);
+        cursor += take;
+        copied += take;
+    }
+    return copied;
+}
+
+bool FileReader::seek(size_t offset)
+{
+    if (!isOpen() || offset > fileSize) {
+        return false;
+    }
+
+    // Within the chunk at hand nothing has to be read again
+    if (offset >= chunk.offset && offset <= chunk.offset + chunk.size) {
+        cursor = offset - chunk.offset;
+        return true;
+    }
+
+    if (inFlight) {
+        finishRead();
+    }
+
+    // Keep chunks aligned to the chunk size
+    const size_t aligned = offset - offset % chunkSize;
+#ifdef ARDUINO
+    file.seek(aligned);
+#else
+    lseek(fd, aligned, SEEK_SET);
+#endif
+    filePos = aligned;
+    chunk   = Chunk{ buffers[current], 0, aligned };
+    cursor  = 0;
+    if (offset > aligned) {
+        advance();
+        cursor = offset - aligned < chunk.size ? offset - aligned : chunk.size;
+    }
+    return true;
+}
+
+bool readChunks(const char *path,
+        const std::function<bool(const Chunk &)> &consume, size_t chunkSize)
+{
+    FileReader reader(chunkSize);
+    if (!reader.open(path)) {
+        return false;
+    }
+
+    Chunk chunk{};
+    while (reader.next(chunk)) {
+        if (!consume(chunk)) {
+            return false;
+        }
+    }
+    return reader.position() == reader.size();
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static uint8_t patternByte(size_t offset)
+{
+    return (offset * 131 + (offset >> 8) * 7) & 0xff;
+}
+
+static bool writePattern(const char *path, size_t size)
+{
+    uint8_t buf[256];
+#ifdef ARDUINO
+    File file = SD.open(path, FILE_WRITE);
+#else
+    FILE *file = fopen(path, "wb");
+#endif
+    if (!file) {
+        return false;
+    }
+
+    for (size_t offset = 0; offset < size; offset += sizeof(buf)) {
+        size_t n = size - offset < sizeof(buf) ? size - offset : sizeof(buf);
+        for (size_t i = 0; i < n; ++i)
+            buf[i] = patternByte(offset + i);
+#ifdef ARDUINO
+        file.write(buf, n);
+#else
+        fwrite(buf, 1, n, file);
+#endif
+    }
+
+#ifdef ARDUINO
+    file.close();
+#else
+    fclose(file);
+#endif
+    return true;
+}
+
+static bool matches(const uint8_t *data, size_t size, size_t offset)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] != patternByte(offset + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool testStream(const char *path)
+{
+    const size_t fileSize = 3 * STREAM_CHUNK + 123;
+    if (!writePattern(path, fileSize)) {
+        report("Could not write %s\n", path);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t chunkSize : { (size_t) 512, (size_t) STREAM_CHUNK }) {
+        for (bool ahead : { false, true }) {
+            FileReader reader(chunkSize, ahead);
+            ok &= check(reader.open(path), "open", 0);
+            ok &= check(reader.size() == fileSize, "size", reader.size());
+
+            // Whole chunks, in order and aligned
+            Chunk  chunk{};
+            size_t expected = 0;
+            while (reader.next(chunk)) {
+                ok &= check(chunk.offset == expected, "chunk offset", expected);
+                ok &= check(chunk.offset % chunkSize == 0, "alignment",
+                        chunk.offset);
+                ok &= check(chunk.size <= chunkSize, "chunk size", chunk.size);
+                ok &= check(matches(chunk.data, chunk.size, chunk.offset),
+                        "chunk data", chunk.offset);
+                expected += chunk.size;
+            }
+            ok &= check(expected == fileSize, "chunks cover the file",
+                    expected);
+
+            // Odd-sized reads across chunk boundaries
+            static uint8_t buf[1000];
+            ok &= check(reader.seek(0), "rewind", 0);
+            size_t offset = 0;
+            for (size_t n = 7; offset < fileSize; n = n * 3 % 997 + 1) {
+                size_t len = reader.read(buf, n);
+                ok &= check(len == (n < fileSize - offset ? n
+                                                          : fileSize - offset),
+                        "read length", offset);
+                ok &= check(matches(buf, len, offset), "read data", offset);
+                offset += len;
+            }
+            ok &= check(reader.read(buf, 1) == 0, "read past the end", offset);
+
+            // Seeks backwards, forwards and inside the current chunk
+            const size_t seeks[] = { 5, fileSize - 1, chunkSize + 3, 17,
+                2 * chunkSize, fileSize };
+            for (size_t target : seeks) {
+                ok &= check(reader.seek(target), "seek", target);
+                ok &= check(reader.position() == target, "position", target);
+                size_t len = reader.read(buf, 100);
+                ok &= check(matches(buf, len, target), "data after seek",
+                        target);
+                ok &= check(len == (fileSize - target < 100 ? fileSize - target
+                                                            : 100),
+                        "length after seek", target);
+            }
+            ok &= check(!reader.seek(fileSize + 1), "seek past the end", 0);
+
+            // After a seek, next() starts at the seek target
+            ok &= check(reader.seek(chunkSize + 3), "seek for next", 0);
+            bool resumed = reader.next(chunk)
+                           && chunk.offset == chunkSize + 3
+                           && chunk.size == chunkSize - 3;
+            resumed &= matches(chunk.data, chunk.size, chunk.offset);
+            ok &= check(resumed, "next after seek", chunk.offset);
+        }
+    }
+
+    size_t total = 0;
+    ok &= check(readChunks(path,
+                        [&](const Chunk &chunk) {
+                            total += chunk.size;
+                            return true;
+                        }),
+            "readChunks", 0);
+    ok &= check(total == fileSize, "readChunks total", total);
+
+    report("Stream tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+// ─── Benchmark ──────────────────────────────────────────────────────────
+
+// Writes `size` bytes to `path`, then reads them with and without
+// read-ahead while a checksum stands in for the work a consumer does on
+// every chunk. A few megabytes, so that the timing is not one of a
+// handful of chunks
+void benchmarkStream(const char *path, size_t size)
+{
+    if (!writePattern(path, size)) {
+        report("Could not write %s\n", path);
+        return;
+    }
+
+    for (bool ahead : { false, true }) {
+        FileReader reader(STREAM_CHUNK, ahead);
+        if (!reader.open(path)) {
+            return;
+        }
+
+        uint32_t checksum = 0;
+        uint32_t start    = nowMicros();
+        Chunk    chunk{};
+        while (reader.next(chunk)) {
+            for (size_t i = 0; i < chunk.size; ++i)
+                checksum = (checksum << 1 | checksum >> 31) ^ chunk.data[i];
+        }
+        uint32_t elapsed = nowMicros() - start;
+        if (!elapsed) {
+            elapsed = 1;
+        }
+
+        report("%s read-ahead: %u bytes in %u us, %u KB/s (checksum %08x)\n",
+                ahead ? "with" : "without", (unsigned) reader.size(),
+                (unsigned) elapsed,
+                (unsigned) ((uint64_t) reader.size() * 1000000 / 1024
+                            / elapsed),
+                (unsigned) checksum);
+    }
+}
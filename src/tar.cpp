@@ -0,0 +1,764 @@
+// ====================================================== //
+// ============ Streaming tar archive transfer ========== //
+// ====================================================== //
+
+#include "tar.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <time.h>
+
+#include "dircache.h"
+#include "http.h"
+#include "report.h"
+#include "stream.h"
+#include "walk.h"
+
+#ifdef ARDUINO
+#include "filesystem.h"
+#else
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static bool makeFolder(const char *path)
+{
+    if (isDirectory(path)) {
+        return true;
+    }
+#ifdef ARDUINO
+    return createDir(path);
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+static void removePartial(const char *path)
+{
+#ifdef ARDUINO
+    SD.remove(path);
+#else
+    unlink(path);
+#endif
+}
+
+// ─── Headers ────────────────────────────────────────────────────────────
+
+// Octal digits, optionally padded with spaces or NULs on either side
+static bool parseOctal(const uint8_t *field, size_t width, size_t &value)
+{
+    size_t i = 0;
+    while (i < width && field[i] == ' ')
+        ++i;
+    value = 0;
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; ++i)
+        value = value * 8 + (field[i] - '0');
+    for (; i < width; ++i) {
+        if (field[i] != ' ' && field[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static unsigned headerSum(const uint8_t *header)
+{
+    unsigned sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i)
+        sum += i >= 148 && i < 156 ? ' ' : header[i];
+    return sum;
+}
+
+static bool isZeroBlock(const uint8_t *block)
+{
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        if (block[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void writeZeros(ChunkedWriter &out, size_t size)
+{
+    static const char zeros[TAR_BLOCK] = {};
+    while (size) {
+        size_t n = size < TAR_BLOCK ? size : TAR_BLOCK;
+        out.write(zeros, n);
+        size -= n;
+    }
+}
+
+static size_t paddingFor(size_t size)
+{
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+// Names longer than the header holds go first in a GNU long name record
+static void writeHeader(ChunkedWriter &out, const char *name, char type,
+        size_t size, time_t modified)
+{
+    const size_t length = strlen(name);
+    if (length > 100) {
+        writeHeader(out, "././@LongLink", 'L', length + 1, 0);
+        out.write(name, length + 1);
+        writeZeros(out, paddingFor(length + 1));
+    }
+
+    char header[TAR_BLOCK] = {};
+    memcpy(header, name, length < 100 ? length : 100);
+    snprintf(header + 100, 8, "%07o", type == '5' ? 0755 : 0644);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    snprintf(header + 124, 12, "%011lo", (unsigned long) size);
+    snprintf(header + 136, 12, "%011lo", (unsigned long) modified);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    snprintf(header + 148, 8, "%06o", headerSum((const uint8_t *) header));
+    header[155] = ' ';
+    out.write(header, TAR_BLOCK);
+}
+
+// ─── Extraction ─────────────────────────────────────────────────────────
+
+TarExtractor::~TarExtractor()
+{
+    abort();
+}
+
+bool TarExtractor::begin(const char *dir)
+{
+    abort();
+
+    // "/" joins as "" + "/name"
+    size_t length = strlen(dir);
+    while (length && dir[length - 1] == '/')
+        --length;
+    if (length >= TAR_PATH_MAX) {
+        report("Archive target %s is too long\n", dir);
+        return false;
+    }
+    memcpy(root, dir, length);
+    root[length] = 0;
+    if (length && !makeFolder(root)) {
+        report("Could not create %s\n", root);
+        return false;
+    }
+
+    state        = State::Header;
+    headerUsed   = 0;
+    nextNameUsed = 0;
+    nextName[0]  = 0;
+    badName      = false;
+    lastDir[0]   = 0;
+    stats        = TarStats{};
+    start        = nowMicros();
+    active       = true;
+    return true;
+}
+
+// Joins `name` to the root one component at a time, dropping "." and
+// leading slashes; false when it climbs out with ".." or is empty
+bool TarExtractor::resolve(const char *name, char *out)
+{
+    size_t length = strlen(root);
+    memcpy(out, root, length + 1);
+
+    for (const char *p = name; *p;) {
+        const char *end = strchr(p, '/');
+        size_t      n   = end ? end - p : strlen(p);
+        if (n == 2 && p[0] == '.' && p[1] == '.') {
+            return false;
+        }
+        if (n && !(n == 1 && p[0] == '.')) {
+            if (length + 1 + n >= TAR_PATH_MAX) {
+                return false;
+            }
+            out[length++] = '/';
+            memcpy(out + length, p, n);
+            length += n;
+            out[length] = 0;
+        }
+        p += end ? n + 1 : n;
+    }
+    return length > strlen(root);
+}
+
+// Archives need not list every folder before its files
+bool TarExtractor::makeParents(const char *target)
+{
+    const char *slash = strrchr(target, '/');
+    size_t      end   = slash ? slash - target : 0;
+    if (!end || (!strncmp(lastDir, target, end) && !lastDir[end])) {
+        return true;
+    }
+
+    char dir[TAR_PATH_MAX];
+    memcpy(dir, target, end);
+    dir[end] = 0;
+    for (size_t i = strlen(root) + 1; i <= end; ++i) {
+        if (dir[i] == '/' || !dir[i]) {
+            const char saved = dir[i];
+            dir[i]           = 0;
+            if (!makeFolder(dir)) {
+                return false;
+            }
+            dir[i] = saved;
+        }
+    }
+    strcpy(lastDir, dir);
+    return true;
+}
+
+bool TarExtractor::fail(const char *why)
+{
+    if (state == State::Body && body == Body::File) {
+        file.finish();
+        removePartial(path);
+    }
+    report("Archive extraction failed: %s\n", why);
+    state = State::Error;
+    return false;
+}
+
+static bool isTopFolder(const char *name)
+{
+    for (const char *p = name; *p; ++p) {
+        if (*p == '.' && (p[1] == '.' || (p != name && p[-1] == '.'))) {
+            return false;
+        }
+        if (*p != '.' && *p != '/') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TarExtractor::parseHeader()
+{
+    if (isZeroBlock(header)) {
+        state = State::End;
+        return true;
+    }
+
+    size_t size, sum;
+    if (!parseOctal(header + 148, 8, sum) || sum != headerSum(header)) {
+        return fail("bad header checksum");
+    }
+    if (!parseOctal(header + 124, 12, size)) {
+        return fail("bad entry size");
+    }
+    remaining = size;
+    padding   = paddingFor(size);
+
+    // The name comes from a preceding long name record, or from the
+    // ustar prefix and name fields
+    char name[TAR_PATH_MAX];
+    if (nextNameUsed || badName) {
+        strcpy(name, nextName);
+    }
+    else {
+        size_t length = 0;
+        if (!memcmp(header + 257, "ustar", 5) && header[345]) {
+            length = strnlen((const char *) header + 345, 155);
+            memcpy(name, header + 345, length);
+            name[length++] = '/';
+        }
+        size_t n = strnlen((const char *) header, 100);
+        memcpy(name + length, header, n);
+        name[length + n] = 0;
+    }
+    const bool nameOk = !badName;
+
+    const char type = header[156];
+    if (type == 'L' || type == 'x') {
+        body         = type == 'L' ? Body::LongName : Body::Pax;
+        nextNameUsed = 0;
+        paxUsed      = 0;
+        badName      = false;
+    }
+    else {
+        nextNameUsed = 0;
+        nextName[0]  = 0;
+        badName      = false;
+        body         = Body::Skip;
+
+        if (type == '0' || type == '7' || type == 0 || type == '5') {
+            if (!nameOk || !resolve(name, path)) {
+                // The archive's own top folder, "./", is not worth a count
+                if (!nameOk || type != '5' || !isTopFolder(name)) {
+                    report("Skipping %s\n", name);
+                    ++stats.skipped;
+                }
+            }
+            else if (type == '5') {
+                if (!makeFolder(path)) {
+                    return fail("could not create a folder");
+                }
+                ++stats.dirs;
+            }
+            else {
+                if (!makeParents(path) || !file.open(path)) {
+                    return fail("could not create a file");
+                }
+                body = Body::File;
+            }
+        }
+        else if (type != 'g') {
+            ++stats.skipped;  // links, devices and fifos
+        }
+    }
+
+    state = State::Body;
+    return remaining ? true : endBody();
+}
+
+bool TarExtractor::endBody()
+{
+    switch (body) {
+        case Body::File:
+            if (!file.finish()) {
+                state = State::Error;
+                removePartial(path);
+                report("Archive extraction failed: could not write %s\n",
+                        path);
+                return false;
+            }
+            ++stats.files;
+            break;
+        case Body::LongName:
+            nextName[nextNameUsed < TAR_PATH_MAX ? nextNameUsed
+                                                 : TAR_PATH_MAX - 1]
+                    = 0;
+            break;
+        case Body::Pax:
+            // Records read "<length> <key>=<value>\n"; only the path is used
+            for (size_t i = 0; i < paxUsed;) {
+                char  *record = pax + i;
+                size_t length = strtoul(record, nullptr, 10);
+                char  *key    = (char *) memchr(record, ' ', paxUsed - i);
+                if (!length || !key || i + length > paxUsed) {
+                    break;
+                }
+                ++key;
+                const size_t value = record + length - 1 - (key + 5);
+                if (!strncmp(key, "path=", 5) && record[length - 1] == '\n') {
+                    badName = value >= TAR_PATH_MAX;
+                    if (!badName) {
+                        memcpy(nextName, key + 5, value);
+                        nextName[value] = 0;
+                        nextNameUsed    = value;
+                    }
+                }
+                i += length;
+            }
+            break;
+        case Body::Skip:
+            break;
+    }
+
+    state      = padding ? State::Padding : State::Header;
+    headerUsed = 0;
+    return true;
+}
+
+bool TarExtractor::write(const uint8_t *data, size_t size)
+{
+    while (size) {
+        size_t n = 0;
+        switch (state) {
+            case State::Header:
+                n = TAR_BLOCK - headerUsed < size ? TAR_BLOCK - headerUsed
+                                                  : size;
+                memcpy(header + headerUsed, data, n);
+                headerUsed += n;
+                if (headerUsed == TAR_BLOCK && !parseHeader()) {
+                    return false;
+                }
+                break;
+
+            case State::Body:
+                n = remaining < size ? remaining : size;
+                if (body == Body::File) {
+                    if (!file.write(data, n)) {
+                        return fail("write failed");
+                    }
+                    stats.bytes += n;
+                }
+                else if (body == Body::LongName) {
+                    for (size_t i = 0; i < n; ++i, ++nextNameUsed) {
+                        if (nextNameUsed < TAR_PATH_MAX) {
+                            nextName[nextNameUsed] = data[i];
+                        }
+                    }
+                    badName = nextNameUsed >= TAR_PATH_MAX;
+                }
+                else if (body == Body::Pax) {
+                    size_t take = TAR_BLOCK - paxUsed < n ? TAR_BLOCK - paxUsed
+                                                          : n;
+                    memcpy(pax + paxUsed, data, take);
+                    paxUsed += take;
+                }
+                remaining -= n;
+                if (!remaining && !endBody()) {
+                    return false;
+                }
+                break;
+
+            case State::Padding:
+                n = padding < size ? padding : size;
+                padding -= n;
+                if (!padding) {
+                    state = State::Header;
+                }
+                break;
+
+            case State::End:
+                return true;  // the rest pads the archive to a record
+
+            case State::Error:
+                return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// A stream that stops between entries counts as complete, even without
+// the two zero blocks tar ends with
+bool TarExtractor::finish()
+{
+    if (!active) {
+        return false;
+    }
+    bool ok = state == State::End
+              || (state == State::Header && headerUsed == 0);
+    if (!ok && state != State::Error) {
+        fail("archive ended early");
+    }
+
+    active       = false;
+    state        = ok ? State::End : State::Error;
+    stats.micros = nowMicros() - start;
+    invalidateDir(root[0] ? root : "/");
+    return ok;
+}
+
+void TarExtractor::abort()
+{
+    if (!active) {
+        return;
+    }
+    if (state != State::Error) {
+        fail("aborted");
+    }
+    active = false;
+    invalidateDir(root[0] ? root : "/");
+}
+
+// ─── Archiving ──────────────────────────────────────────────────────────
+
+TarWriter::TarWriter(const char *dir)
+    : walker(dir), reader(DOWNLOAD_CHUNK), start(nowMicros())
+{
+    // Entries are named relative to `dir`
+    skip = strlen(dir);
+    while (skip && dir[skip - 1] == '/')
+        --skip;
+    ++skip;
+}
+
+bool TarWriter::next(ChunkedWriter &out)
+{
+    if (done) {
+        return false;
+    }
+
+    if (copying) {
+        Chunk chunk;
+        if (reader.next(chunk)) {
+            out.write((const char *) chunk.data, chunk.size);
+            sent += chunk.size;
+            stats.micros = nowMicros() - start;
+            return true;
+        }
+
+        // The header promised this many bytes, so a short read cannot
+        // be papered over
+        copying = false;
+        if (sent != reader.size()) {
+            report("Short read of a file after %u bytes\n", (unsigned) sent);
+            reader.close();
+            ok = false;
+            done = true;
+            return false;
+        }
+        reader.close();
+        writeZeros(out, paddingFor(sent));
+        stats.bytes += sent;
+        ++stats.files;
+        return true;
+    }
+
+    WalkStep    step;
+    std::string path;
+    int         depth;
+    while (walker.next(step, path, depth)) {
+        if (!depth || step == WalkStep::LeaveDir) {
+            continue;
+        }
+
+        const char *name = path.c_str() + skip;
+        if (step == WalkStep::EnterDir) {
+            writeHeader(out, (std::string(name) + "/").c_str(), '5', 0,
+                    time(nullptr));
+            ++stats.dirs;
+            return true;
+        }
+
+        if (!reader.open(path.c_str())) {
+            ++stats.skipped;
+            ok = false;
+            continue;
+        }
+        writeHeader(out, name, '0', reader.size(), reader.lastWrite());
+        copying = true;
+        sent    = 0;
+        return true;
+    }
+
+    // An unreadable folder leaves the archive without its end marker
+    if (walker.succeeded()) {
+        writeZeros(out, 2 * TAR_BLOCK);
+    }
+    ok &= walker.succeeded();
+    done         = true;
+    stats.micros = nowMicros() - start;
+    return false;
+}
+
+bool writeTar(const char *dir, ChunkedWriter &out, TarStats &stats,
+        const std::function<bool()> &stop)
+{
+    stats = TarStats{};
+    if (!isDirectory(dir)) {
+        return false;
+    }
+
+    TarWriter tar(dir);
+    bool      stopped = false;
+    while (!stopped && tar.next(out)) {
+        stopped = stop && stop();
+    }
+    out.flush();
+    stats = tar.lastStats();
+    return !stopped && tar.succeeded();
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static bool makeFile(const std::string &path, size_t size, int seed)
+{
+    std::string data(size, 0);
+    for (size_t i = 0; i < size; ++i)
+        data[i] = (char) (i * 7 + seed + (i >> 8));
+#ifdef ARDUINO
+    File file = SD.open(path.c_str(), FILE_WRITE);
+    if (!file) {
+        return false;
+    }
+    file.write((const uint8_t *) data.data(), size);
+    file.close();
+#else
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    fwrite(data.data(), 1, size, file);
+    fclose(file);
+#endif
+    return true;
+}
+
+static bool sameContents(const std::string &a, const std::string &b)
+{
+    FileReader readerA(STREAM_CHUNK, false), readerB(STREAM_CHUNK, false);
+    if (!readerA.open(a.c_str()) || !readerB.open(b.c_str())
+            || readerA.size() != readerB.size()) {
+        return false;
+    }
+    uint8_t bufA[512], bufB[512];
+    size_t  n;
+    while ((n = readerA.read(bufA, sizeof(bufA)))) {
+        if (readerB.read(bufB, n) != n || memcmp(bufA, bufB, n)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Feeds `archive` in the uneven pieces an upload arrives in
+static bool extract(const std::string &archive, const char *dir,
+        TarExtractor &extractor, size_t piece)
+{
+    bool ok = extractor.begin(dir);
+    for (size_t i = 0; ok && i < archive.size(); i += piece) {
+        size_t n = archive.size() - i < piece ? archive.size() - i : piece;
+        ok       = extractor.write((const uint8_t *) archive.data() + i, n);
+    }
+    return extractor.finish() && ok;
+}
+
+bool testTar(const char *dir)
+{
+    const std::string src = std::string(dir) + "/tar-src";
+    const std::string dst = std::string(dir) + "/tar-dst";
+    const std::string deep
+            = "/a-rather-long-folder-name-to-push-paths-past-the-ustar-"
+              "limit/and-another-one-below-it";
+    const size_t sizes[] = { 0, 1, 511, 512, 513, 70000 };
+
+    bool ok = makeFolder(src.c_str());
+    ok &= makeFolder((src + "/empty").c_str());
+    ok &= makeFolder((src + "/a-rather-long-folder-name-to-push-paths-past-"
+                            "the-ustar-limit")
+                             .c_str());
+    ok &= makeFolder((src + deep).c_str());
+    for (int i = 0; i < 6; ++i) {
+        ok &= makeFile(src + "/f" + std::to_string(i), sizes[i], i);
+        ok &= makeFile(src + deep + "/g" + std::to_string(i), sizes[5 - i], i);
+    }
+    if (!check(ok, "setup")) {
+        return false;
+    }
+
+    // Round trip through an archive held in memory
+    std::string archive;
+    TarStats    written;
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            archive.append(data, size);
+        });
+        ok &= check(writeTar(src.c_str(), out, written), "write");
+    }
+    ok &= check(archive.size() % TAR_BLOCK == 0, "block multiple");
+    ok &= check(written.files == 12 && written.dirs == 3, "write stats");
+
+    TarExtractor extractor;
+    ok &= check(extract(archive, dst.c_str(), extractor, 1436), "extract");
+    const TarStats &read = extractor.lastStats();
+    ok &= check(read.files == 12 && read.dirs == 3 && !read.skipped,
+            "extract stats");
+    ok &= check(read.bytes == written.bytes, "byte count");
+    ok &= check(isDirectory((dst + "/empty").c_str()), "empty folder");
+    walkTree(src.c_str(), [&](WalkStep step, const std::string &path, int) {
+        if (step == WalkStep::File) {
+            ok &= check(sameContents(path, dst + path.substr(src.size())),
+                    path.c_str());
+        }
+        return WalkAction::Continue;
+    });
+
+    // Unsafe and unsupported entries are skipped, absolute paths land
+    // inside the target, pax paths are honoured
+    std::string crafted;
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            crafted.append(data, size);
+        });
+        writeHeader(out, "../escape", '0', 3, 0);
+        out.write("bad", 3);
+        writeZeros(out, paddingFor(3));
+        writeHeader(out, "/absolute/inside", '0', 2, 0);
+        out.write("ok", 2);
+        writeZeros(out, paddingFor(2));
+        writeHeader(out, "link", '2', 0, 0);
+        const char record[] = "22 path=pax/long-name\n";
+        writeHeader(out, "PaxHeader", 'x', sizeof(record) - 1, 0);
+        out.write(record, sizeof(record) - 1);
+        writeZeros(out, paddingFor(sizeof(record) - 1));
+        writeHeader(out, "short", '0', 1, 0);
+        out.write("p", 1);
+        writeZeros(out, paddingFor(1) + 2 * TAR_BLOCK);
+    }
+    ok &= check(extract(crafted, dst.c_str(), extractor, 1), "crafted");
+    ok &= check(extractor.lastStats().skipped == 2, "skipped entries");
+    ok &= check(!isDirectory((std::string(dir) + "/escape").c_str())
+                        && !FileReader().open((std::string(dir) + "/escape")
+                                                      .c_str()),
+            "escape");
+    FileReader inside;
+    ok &= check(inside.open((dst + "/absolute/inside").c_str()), "absolute");
+    ok &= check(inside.open((dst + "/pax/long-name").c_str()), "pax path");
+
+    // Damage is reported and no partial file is left behind
+    std::string cut = archive.substr(0, archive.size() / 2);
+    ok &= check(!extract(cut, (dst + "/cut").c_str(), extractor, 4096),
+            "truncated");
+    std::string corrupt = archive;
+    corrupt[148] ^= 1;
+    ok &= check(!extract(corrupt, (dst + "/bad").c_str(), extractor, 4096),
+            "checksum");
+
+    report("Tar tests %s\n", ok ? "passed" : "failed");
+    return ok;
+}
+
+// Per-file uploads against one archive, both fed in upload-sized pieces.
+// Only the SD side is measured: an archive also saves a request and a
+// multipart parse per file, which this cannot see.
+void benchmarkTar(const char *dir, int files, size_t fileSize)
+{
+    const std::string src = std::string(dir) + "/bench-src";
+    makeFolder(src.c_str());
+    for (int i = 0; i < files; ++i)
+        makeFile(src + "/tile" + std::to_string(i) + ".png", fileSize, i);
+
+    // Each file read and written on its own, as one upload apiece
+    const size_t      piece = 1436;
+    const std::string each  = std::string(dir) + "/bench-files";
+    makeFolder(each.c_str());
+    uint32_t    start = nowMicros();
+    WriteBehind writer;
+    for (int i = 0; i < files; ++i) {
+        const std::string name = "/tile" + std::to_string(i) + ".png";
+        writer.open((each + name).c_str());
+        readChunks((src + name).c_str(), [&](const Chunk &chunk) {
+            for (size_t at = 0; at < chunk.size; at += piece)
+                writer.write(chunk.data + at,
+                        chunk.size - at < piece ? chunk.size - at : piece);
+            return true;
+        });
+        writer.finish();
+    }
+    const uint32_t perFile = nowMicros() - start;
+
+    // Straight from one tree into another, as a download fed to an upload
+    TarExtractor extractor;
+    TarStats     stats;
+    start = nowMicros();
+    extractor.begin((std::string(dir) + "/bench-tar").c_str());
+    {
+        ChunkedWriter out([&](const char *data, size_t size) {
+            for (size_t at = 0; at < size; at += piece)
+                extractor.write((const uint8_t *) data + at,
+                        size - at < piece ? size - at : piece);
+        });
+        writeTar(src.c_str(), out, stats);
+    }
+    extractor.finish();
+    const uint32_t archived = nowMicros() - start;
+
+    const size_t total = (size_t) files * fileSize;
+    report("%d files of %u bytes\n", files, (unsigned) fileSize);
+    report("  per-file writes %7u us, %u KB/s\n", (unsigned) perFile,
+            (unsigned) (total * 1000000ull / (perFile ? perFile : 1) / 1024));
+    report("  archive         %7u us, %u KB/s, %u files extracted\n",
+            (unsigned) archived,
+            (unsigned) (total * 1000000ull / (archived ? archived : 1) / 1024),
+            (unsigned) extractor.lastStats().files);
+}
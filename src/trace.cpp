@@ -0,0 +1,464 @@
+// ====================================================== //
+// ============ Event tracer, Chrome trace JSON ========= //
+// ====================================================== //
+
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "report.h"
+
+#ifndef ARDUINO
+#include <thread>
+#endif
+
+static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0,
+        "ring indices must stay in step as the head wraps");
+
+Tracer tracer;
+
+// ─── Clocks ─────────────────────────────────────────────────────────────
+
+// Each core's cycle counter minus the common clock, so one core's events
+// can be placed against the other's. The two count at the same rate but
+// did not start together.
+static uint32_t cycleOffset[METRICS_CORES];
+
+// The common clock in cycles: esp_timer on the device, which both cores
+// read alike; on the host cycleCount() is this clock already
+static uint64_t commonCycles()
+{
+#ifdef ARDUINO
+    return esp_timer_get_time() * (uint64_t) (METRICS_CYCLE_HZ / 1e6);
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+}
+
+#ifdef ARDUINO
+static void calibrateTask(void *args)
+{
+    const int core    = metricsCore();
+    cycleOffset[core] = cycleCount() - (uint32_t) commonCycles();
+    vTaskDelete(NULL);
+}
+#endif
+
+// ─── Rings ──────────────────────────────────────────────────────────────
+
+void Tracer::nameTrack(const char *name)
+{
+    const uint32_t index = trackCount.load();
+    if (index < TRACE_TRACKS) {
+        tracks[index].track = traceTrack();
+        tracks[index].name  = name;
+        trackCount.store(index + 1);
+    }
+}
+
+void Tracer::clear()
+{
+    for (TraceRing &ring : rings) {
+        ring.head.store(0);
+    }
+}
+
+// An event with its time on the common clock
+struct TimedEvent
+{
+    uint64_t    at;
+    const char *name;
+    uint32_t    track;
+    int         core;
+};
+
+// Names are code's own strings, but a route pattern could hold anything
+static void appendName(std::string &out, const char *name)
+{
+    out += '"';
+    for (const char *c = name; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+        }
+        out += (unsigned char) *c < 0x20 ? ' ' : *c;
+    }
+    out += '"';
+}
+
+void Tracer::writeChrome(std::string &out, uint64_t now,
+        const uint32_t coreNow[METRICS_CORES]) const
+{
+    // Walk each ring back from its newest event, stepping by the signed
+    // distance between neighbours: the counters wrap every 18 s, and an
+    // interrupt can record between another event's timestamp and slot
+    std::vector<TimedEvent> events;
+    for (int core = 0; core < METRICS_CORES; ++core) {
+        const TraceRing &ring  = rings[core];
+        const uint32_t   head  = ring.head.load(std::memory_order_acquire);
+        const uint32_t   count = std::min<uint32_t>(head, TRACE_EVENTS);
+        const size_t     first = events.size();
+        events.resize(first + count);
+
+        uint64_t at    = now;
+        uint32_t later = coreNow[core];
+        for (uint32_t i = 0; i < count; ++i) {
+            const TraceEvent &event
+                    = ring.events[(head - 1 - i) % TRACE_EVENTS];
+            at -= (int64_t) (int32_t) (later - event.cycles);
+            later = event.cycles;
+            events[first + count - 1 - i]
+                    = { at, event.name, event.track, core };
+        }
+    }
+
+    uint64_t start = now;
+    for (const TimedEvent &event : events) {
+        start = std::min(start, event.at);
+    }
+    const double cyclesPerMicro = METRICS_CYCLE_HZ / 1e6;
+
+    // Tracks seen, with how deep their scopes are open; an end whose begin
+    // the ring has already overwritten is left out
+    struct Depth
+    {
+        uint32_t track;
+        int      core;
+        int      depth;
+    };
+    std::vector<Depth> depths;
+
+    out += "{\"traceEvents\":[";
+    bool separate = false;
+    for (const TimedEvent &event : events) {
+        const uint32_t   track = event.track & ~3u;
+        const TracePhase phase = (TracePhase) (event.track & 3u);
+        auto             found = std::find_if(
+                depths.begin(), depths.end(), [&](const Depth &d) {
+                    return d.track == track && d.core == event.core;
+                });
+        if (found == depths.end()) {
+            depths.push_back({ track, event.core, 0 });
+            found = depths.end() - 1;
+        }
+        if (phase == TracePhase::Begin) {
+            ++found->depth;
+        }
+        else if (phase == TracePhase::End) {
+            if (!found->depth) {
+                continue;
+            }
+            --found->depth;
+        }
+
+        out += separate ? ",{\"name\":" : "{\"name\":";
+        appendName(out, event.name);
+        appendf(out, ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%lu}",
+                phase == TracePhase::Begin   ? "B"
+                : phase == TracePhase::End ? "E"
+                                           : "i\",\"s\":\"t",
+                (event.at - start) / cyclesPerMicro, event.core,
+                (unsigned long) track);
+        separate = true;
+    }
+
+    // Names for the cores and for the tracks that recorded anything
+    const uint32_t named
+            = std::min<uint32_t>(trackCount.load(), TRACE_TRACKS);
+    for (int core = 0; core < METRICS_CORES; ++core) {
+        appendf(out,
+                "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"args\":{\"name\":\"core %d\"}}",
+                separate ? "," : "", core, core);
+        separate = true;
+    }
+    for (const Depth &depth : depths) {
+        const char *name = depth.track ? nullptr : "interrupts";
+        for (uint32_t i = 0; i < named; ++i) {
+            if (tracks[i].track == depth.track) {
+                name = tracks[i].name;
+            }
+        }
+        if (!name) {
+            continue;
+        }
+        appendf(out,
+                ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%lu,\"args\":{\"name\":",
+                depth.core, (unsigned long) depth.track);
+        appendName(out, name);
+        out += "}}";
+    }
+    out += "],\"displayTimeUnit\":\"ns\"}";
+}
+
+void Tracer::writeChrome(std::string &out) const
+{
+    uint32_t       coreNow[METRICS_CORES];
+    const uint64_t now = commonCycles();
+    for (int core = 0; core < METRICS_CORES; ++core) {
+        coreNow[core] = (uint32_t) now + cycleOffset[core];
+    }
+    writeChrome(out, now, coreNow);
+}
+
+bool parseTraceMask(const char *text, uint32_t &mask)
+{
+    static const struct
+    {
+        const char *name;
+        uint32_t    bits;
+    } names[] = {
+        { "hsync", (uint32_t) TraceCategory::Hsync },
+        { "vsync", (uint32_t) TraceCategory::Vsync },
+        { "render", (uint32_t) TraceCategory::Render },
+        { "decode", (uint32_t) TraceCategory::Decode },
+        { "http", (uint32_t) TraceCategory::Http },
+        { "all", (uint32_t) TraceCategory::All },
+        { "none", 0 },
+    };
+
+    mask = 0;
+    while (*text) {
+        const char  *end    = strchr(text, ',');
+        const size_t length = end ? end - text : strlen(text);
+        bool         known  = false;
+        for (const auto &entry : names) {
+            if (strlen(entry.name) == length
+                    && !strncmp(entry.name, text, length)) {
+                mask |= entry.bits;
+                known = true;
+            }
+        }
+        if (!known) {
+            return false;
+        }
+        text += end ? length + 1 : length;
+    }
+    return true;
+}
+
+bool setupTrace()
+{
+#ifdef ARDUINO
+    // A counter can only be read from its own core
+    for (int core = 0; core < METRICS_CORES; ++core) {
+        if (xTaskCreatePinnedToCore(calibrateTask, "Trace Clock", 2048, NULL,
+                    1, NULL, core)
+                != pdPASS) {
+            return false;
+        }
+    }
+#endif
+    TRACE_NAME_TRACK("setup");
+    return true;
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+static int occurrences(const std::string &text, const char *part)
+{
+    int count = 0;
+    for (size_t at = text.find(part); at != std::string::npos;
+            at = text.find(part, at + 1)) {
+        ++count;
+    }
+    return count;
+}
+
+static std::vector<double> timestamps(const std::string &text)
+{
+    std::vector<double> values;
+    for (size_t at = text.find("\"ts\":"); at != std::string::npos;
+            at = text.find("\"ts\":", at + 1)) {
+        values.push_back(strtod(text.c_str() + at + 5, nullptr));
+    }
+    return values;
+}
+
+static bool testWraparound(Tracer &t)
+{
+    bool           ok    = true;
+    const uint32_t micro = METRICS_CYCLE_HZ / 1e6;
+    uint32_t       coreNow[METRICS_CORES]{};
+    std::string    out;
+
+    // One and a half rings of events a microsecond apart: the oldest
+    // half ring is gone, and what is left starts on a begin
+    const int total = TRACE_EVENTS + TRACE_EVENTS / 2;
+    for (int i = 0; i < total; ++i) {
+        t.put(0, "a", i & 1 ? TracePhase::End : TracePhase::Begin, 4,
+                i * micro);
+    }
+    coreNow[0] = total * micro;
+    t.writeChrome(out, 1000000000000ull, coreNow);
+    ok &= check(occurrences(out, "\"ph\":\"B\"") == TRACE_EVENTS / 2,
+            "begins kept", occurrences(out, "\"ph\":\"B\""));
+    ok &= check(occurrences(out, "\"ph\":\"E\"") == TRACE_EVENTS / 2,
+            "ends kept", occurrences(out, "\"ph\":\"E\""));
+    std::vector<double> ts = timestamps(out);
+    ok &= check(ts.size() == TRACE_EVENTS && ts.front() == 0
+                        && ts.back() == TRACE_EVENTS - 1,
+            "ring times", ts.size());
+
+    // An end whose begin was overwritten is left out
+    t.clear();
+    t.put(0, "orphan", TracePhase::End, 4, 0);
+    t.put(0, "b", TracePhase::Begin, 4, 10);
+    t.put(0, "b", TracePhase::End, 4, 20);
+    out.clear();
+    t.writeChrome(out, 1000000, coreNow);
+    ok &= check(out.find("orphan") == std::string::npos
+                        && occurrences(out, "\"ph\":\"E\"") == 1,
+            "orphan end", 0);
+
+    // Across the cycle counter wrapping, 128 cycles at a time
+    t.clear();
+    for (uint32_t i = 0; i < 8; ++i) {
+        t.put(1, "w", TracePhase::Instant, 4, 0xffffff00u + i * 128);
+    }
+    coreNow[1] = 0xffffff00u + 8 * 128;
+    out.clear();
+    t.writeChrome(out, 1000000, coreNow);
+    ts = timestamps(out);
+    bool steady = ts.size() == 8;
+    for (size_t i = 1; steady && i < ts.size(); ++i) {
+        const double step = ts[i] - ts[i - 1];
+        steady = step > 0.999 * 128 / (METRICS_CYCLE_HZ / 1e6)
+              && step < 1.001 * 128 / (METRICS_CYCLE_HZ / 1e6);
+    }
+    ok &= check(steady, "counter wrap", ts.size());
+
+    // Cores with unrelated counters line up on the common clock
+    t.clear();
+    coreNow[0] = 5000000;
+    coreNow[1] = 123;
+    t.put(0, "c0", TracePhase::Instant, 4, coreNow[0] - 1000);
+    t.put(1, "c1", TracePhase::Instant, 4, coreNow[1] - 1000);
+    out.clear();
+    t.writeChrome(out, 1000000, coreNow);
+    ts = timestamps(out);
+    ok &= check(ts.size() == 2 && ts[0] == 0 && ts[1] == 0, "core clocks",
+            ts.size());
+    return ok;
+}
+
+static bool testOutput(Tracer &t)
+{
+    bool ok = true;
+    t.clear();
+    t.nameTrack("test \"thread\"");
+    t.mask = (uint32_t) TraceCategory::Render;
+    t.record(TraceCategory::Decode, "masked", TracePhase::Begin);
+    t.record(TraceCategory::Render, "frame", TracePhase::Begin);
+    t.record(TraceCategory::Render, "frame", TracePhase::End);
+    t.put(0, "isr", TracePhase::Begin, 0, 1);
+
+    std::string out;
+    t.writeChrome(out);
+    ok &= check(out.compare(0, 16, "{\"traceEvents\":[") == 0
+                        && out.back() == '}',
+            "document", 0);
+    ok &= check(occurrences(out, "{") == occurrences(out, "}")
+                        && occurrences(out, "[") == occurrences(out, "]"),
+            "brackets", 0);
+    ok &= check(out.find("masked") == std::string::npos, "mask", 0);
+    ok &= check(occurrences(out, "\"name\":\"frame\"") == 2, "events", 0);
+    ok &= check(out.find("\"name\":\"frame\",\"ph\":\"B\",\"ts\":")
+                        != std::string::npos,
+            "event fields", 0);
+    ok &= check(out.find("\"args\":{\"name\":\"core 1\"}") != std::string::npos,
+            "core names", 0);
+    ok &= check(out.find("\"args\":{\"name\":\"test \\\"thread\\\"\"}")
+                        != std::string::npos,
+            "track name", 0);
+    ok &= check(out.find("\"tid\":0,\"args\":{\"name\":\"interrupts\"}")
+                        != std::string::npos,
+            "interrupt track", 0);
+
+    uint32_t mask;
+    ok &= check(parseTraceMask("vsync,http", mask)
+                        && mask
+                                   == ((uint32_t) TraceCategory::Vsync
+                                           | (uint32_t) TraceCategory::Http),
+            "parse mask", mask);
+    ok &= check(parseTraceMask("none", mask) && !mask, "parse none", mask);
+    ok &= check(!parseTraceMask("vsync,frames", mask), "unknown category",
+            0);
+    return ok;
+}
+
+#ifndef ARDUINO
+// A thread per core, as on the device, where only an interrupt can come
+// between a core's own records
+static bool testConcurrency(Tracer &t)
+{
+    t.clear();
+
+    std::vector<std::thread> threads;
+    for (int core = 0; core < METRICS_CORES; ++core) {
+        threads.emplace_back([&t, core] {
+            const uint32_t track = traceTrack();
+            for (int i = 0; i < 20000; ++i) {
+                t.put(core, "x", TracePhase::Begin, track, cycleCount());
+                t.put(core, "x", TracePhase::End, track, cycleCount());
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    std::string out;
+    t.writeChrome(out);
+    const int events = occurrences(out, "\"name\":\"x\"");
+    return check(events == METRICS_CORES * TRACE_EVENTS, "concurrent events",
+            events);
+}
+#endif
+
+bool testTrace()
+{
+    // Too big for a task's stack
+    std::unique_ptr<Tracer> t(new Tracer);
+
+    bool ok = testWraparound(*t);
+    ok &= testOutput(*t);
+#ifndef ARDUINO
+    ok &= testConcurrency(*t);
+#endif
+    report("Trace test %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+// ─── Benchmark ──────────────────────────────────────────────────────────
+
+void benchmarkTrace()
+{
+    const int               rounds = 200000;
+    const char             *unit   = METRICS_CYCLE_HZ == 1e9 ? "ns" : "cycles";
+    std::unique_ptr<Tracer> t(new Tracer);
+
+    t->mask        = (uint32_t) TraceCategory::All;
+    uint32_t start = cycleCount();
+    for (int i = 0; i < rounds; ++i) {
+        t->record(TraceCategory::Render, "bench", TracePhase::Instant);
+    }
+    const uint32_t enabled = cycleCount() - start;
+
+    t->mask = 0;
+    start   = cycleCount();
+    for (int i = 0; i < rounds; ++i) {
+        t->record(TraceCategory::Render, "bench", TracePhase::Instant);
+    }
+    const uint32_t masked = cycleCount() - start;
+
+    report("Trace event: %.1f %s recorded, %.1f %s masked out\n",
+            (double) enabled / rounds, unit, (double) masked / rounds, unit);
+}
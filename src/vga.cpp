@@ -1,5 +1,18 @@
 #include "vga.h"
+
+#include "report.h"
+#include "prefetch.h"
+#include "renderer.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <cstdio>
+
+#ifdef ARDUINO
 #include "filesystem.h"
+#include "convert.h"
+#include "mirror.h"
+#endif
 
 const int      hsyncPin      = 1;
 const int      vsyncPin      = 2;
@@ -15,140 +28,369 @@ const int      colorPins[8]  = { 16, 17, 18, 8, 9, 10, 11, 12 };
 const int      colorPinsMask = 0b1110001111100000000;
 int            xres, xcrt;
 int            yres, ycrt;
-int            dacClk;
+uint32_t       frameCount;
+LineGenerator  scanoutGenerator{};
+Color          scanLine[SCANLINE_MAX];
+int            scanLineY = -1;
+const Color   *scanPixels{};
+int            scanPixelStep;  // between sampled pixels in scanPixels
 const uint64_t pixelTicks = 40.0 * VGA480p.hPixel;
 uint64_t       crtTicks;
 uint64_t       ticksElapsed;
-hw_timer_t    *hPixelTimer{};
-hw_timer_t    *hSyncTimer{};
-hw_timer_t    *vSyncTimer{};
+HalTimer      *hPixelTimer{};
+HalTimer      *hSyncTimer{};
+HalTimer      *vSyncTimer{};
 
 const VGAMode VGA480p = { 640, 480, 25.422045680238 / 640.0, 0.63555114200596,
     0.63555114200596, 1.9066534260179, 15.253227408143 / 480.0,
     0.31777557100298, 0.31777557100298, 1.0486593843098 };
+
+// CPU cycles between sync interrupts as the timers are set, for jitter
+static const int32_t hSyncPeriodCycles
+        = VGA480p.xres * VGA480p.hPixel * (METRICS_CYCLE_HZ / 1e6);
+static const int32_t vSyncPeriodCycles
+        = VGA480p.yres * VGA480p.vLine * (METRICS_CYCLE_HZ / 1e3);
+
+// Rows from the generator, two so that hSyncInt can fill the next one
+// while scanout still draws the other; row y goes in (y / SCAN_STEP) & 1
+struct GeneratedRow
+{
+    Color         pixels[SCANLINE_MAX / SCAN_STEP];
+    int           y = -1;
+    uint32_t      frame;
+    LineGenerator generator;
+};
+static GeneratedRow generatedRows[2];
+
 Image         image;
+Image *volatile frontImage = &image;
+Image *volatile pendingImage{};
 VGASignal     vga;
-TFT_eSPI      tft = TFT_eSPI();
-PNG           pngdec;
-File          pngFile;
 
+#ifdef ARDUINO
+TFT_eSPI   tft = TFT_eSPI();
+PNG        pngdec;
+FileReader pngReader;
+ImageView  pngTarget;
+Color     *pngLine{};  // line pool blocks held for one decode
+uint16_t  *pngLine565{};
+
+// The decoder and the globals above serve one decode at a time; the
+// playlist task and the HTTP handlers both decode
+static SemaphoreHandle_t pngMutex = xSemaphoreCreateMutex();
+#define PNG_LOCK()   xSemaphoreTake(pngMutex, portMAX_DELAY)
+#define PNG_UNLOCK() xSemaphoreGive(pngMutex)
+#endif
+
+void VGASignal::setup()
+{
+    // Scan out the whole mode
+    xres      = VGA480p.xres;
+    yres      = VGA480p.yres;
+    scanLineY = -1;
+    prefetchInvalidate();
+
+    // Reset signals, syncs idle high
+    halPinWrite(hsyncPin, true);
+    halPinWrite(vsyncPin, true);
+    halPinWrite(blankPin, true);
+    halPinWrite(dacClkPin, false);
+    halPinWrite(leBPin, false);
+    halPinWrite(leGPin, false);
+    halPinWrite(leRPin, false);
+
+    // Pixel clock interrupt
+    if (!hPixelTimer) {
+        hPixelTimer = halTimerBegin(1);
+        report("Pixel clock timer started\n");
+    }
+
+    // Horizontal sync interrupt
+    if (!hSyncTimer) {
+        hSyncTimer = halTimerBegin(3);
+        halTimerAlarm(hSyncTimer, &hSyncInt,
+                HAL_TIMER_HZ / 1e6 * VGA480p.xres * VGA480p.hPixel);
+        report("Horizontal sync timer started\n");
+    }
+
+    // Vertical sync interrupt
+    if (!vSyncTimer) {
+        vSyncTimer = halTimerBegin(2);
+        halTimerAlarm(vSyncTimer, &vSyncInt,
+                HAL_TIMER_HZ / 1e3 * VGA480p.yres * VGA480p.vLine);
+        report("Vertical sync timer started\n");
+    }
+
+    // Reset timers
+    halTimerRestart(hSyncTimer);
+    halTimerRestart(vSyncTimer);
+    halTimerRestart(hPixelTimer);
+    ticksElapsed = crtTicks = 0;
+}
 
 void IRAM_ATTR writeByteToRegister(int latch, unsigned char byte)
 {
     unsigned int mask = 0;
     for (int i = 0; i < 8; ++i, byte >>= 1) {
-        mask |= (1u << colorPins[i]) & (byte & 1u);
+        mask |= (byte & 1u) << colorPins[i];
     }
 
-    REG_WRITE(GPIO_OUT_W1TC_REG, colorPinsMask);
-    REG_WRITE(GPIO_OUT_W1TS_REG, mask & colorPinsMask);
+    halGpioClear(colorPinsMask);
+    halGpioSet(mask & colorPinsMask);
 
     // busy wait
     // for (int i = 0; i < 3; ++i)
     //     ;
-    REG_WRITE(GPIO_OUT_W1TS_REG, 1u << latch);
+    halGpioSet(1ull << latch);
 
     // busy wait
     // for (int i = 0; i < 3; ++i)
     //     ;
-    REG_WRITE(GPIO_OUT_W1TC_REG, 1u << latch);
+    halGpioClear(1ull << latch);
+}
+
+// Generates row `y` of `frame` unless it is there already; only the
+// pixels scanout samples are made
+static void IRAM_ATTR generateRow(int y, uint32_t frame)
+{
+    const LineGenerator generator = scanoutGenerator;
+    GeneratedRow       &row       = generatedRows[(y / SCAN_STEP) & 1];
+    if (!generator
+            || (row.y == y && row.frame == frame
+                    && row.generator == generator)) {
+        return;
+    }
+    generator(row.pixels, y, xres, yres, frame, SCAN_STEP);
+    row.y         = y;
+    row.frame     = frame;
+    row.generator = generator;
 }
 
 void IRAM_ATTR writePixel()
 {
-    Color pixel = image.get(xcrt, ycrt);
+    scanoutCounters.pixels = scanoutCounters.pixels + 1;
+
+    // fetch a line the first time the beam reaches it: the syncs have
+    // generated it or copied it into the prefetch ring while blanked, so
+    // scanout neither runs a generator nor waits on PSRAM unless they fell
+    // behind
+    if (scanLineY != ycrt) {
+        if (scanoutGenerator) {
+            generateRow(ycrt, frameCount);
+            scanPixels    = generatedRows[(ycrt / SCAN_STEP) & 1].pixels;
+            scanPixelStep = 1;
+        }
+        else {
+            scanPixels = prefetchAcquire(*frontImage, ycrt, scanPixelStep);
+        }
+        scanLineY = ycrt;
+    }
+
+    Color pixel = scanPixels[xcrt / SCAN_STEP * scanPixelStep];
     writeByteToRegister(leRPin, pixel.r);
     writeByteToRegister(leGPin, pixel.g);
     writeByteToRegister(leBPin, pixel.b);
 
-    // advance to next pixel
-    if ((ycrt += 4) >= yres) {
+    // advance to next pixel, in row order so that a whole line is consumed
+    // before the next one is needed
+    if ((xcrt += SCAN_STEP) >= xres) {
         // line ended
-        xcrt += 4, ycrt = 0;
-        if (xcrt >= xres) {
+        xcrt = 0;
+        if ((ycrt += SCAN_STEP) >= yres) {
             // frame ended
-            xcrt = 0;
+            ycrt = 0;
         }
     }
 
     // write to DAC
-    REG_WRITE(GPIO_OUT_W1TS_REG, 1u << dacClk);
+    halGpioSet(1ull << dacClkPin);
 
     // busy wait
     // for (int i = 0; i < 3; ++i)
     //     ;
-    REG_WRITE(GPIO_OUT_W1TC_REG, 1u << dacClk);
+    halGpioClear(1ull << dacClkPin);
+}
+
+void IRAM_ATTR scanoutStep()
+{
+    // SCAN_STEP times as less pixels
+    crtTicks = halTimerRead(hPixelTimer);
+    if (crtTicks < ticksElapsed)
+        crtTicks += APB_CLK_FREQ / 2;
+
+    const uint64_t late = crtTicks - ticksElapsed;
+    if (late >= pixelTicks * SCAN_STEP) {
+        // More than one slot gone by means the pixels between were lost;
+        // vSyncInt zeroes ticksElapsed, so the first pixel of a frame is
+        // measured from nothing
+        if (ticksElapsed && late >= 2 * pixelTicks * SCAN_STEP) {
+            scanoutCounters.missedPixels.add(
+                    late / (pixelTicks * SCAN_STEP) - 1);
+        }
+        writePixel();
+        ticksElapsed = crtTicks;
+    }
 }
 
 void IRAM_ATTR hSyncInt()
 {
+    TRACE_SCOPE(Hsync, "hsync");
+    static uint32_t lastEntry;
+    const uint32_t  entry = cycleCount();
+
     uint64_t       ticksElapsed{};
     const uint64_t ticksFrontPorch = 40.0 * VGA480p.hFrontPorch;
     const uint64_t ticksSync       = ticksFrontPorch + 40.0 * VGA480p.hSyncTime;
     const uint64_t ticksBackPorch  = ticksSync + 40.0 * VGA480p.hBackPorch;
 
     // write blank
-    REG_WRITE(GPIO_OUT_W1TC_REG, 1u << blankPin);
+    halGpioClear(1ull << blankPin);
 
     // front porch
     do {
-        ticksElapsed = timerRead(hSyncTimer);
+        ticksElapsed = halTimerRead(hSyncTimer);
     } while (ticksElapsed < ticksFrontPorch);
 
-    // sync
-    digitalWrite(hsyncPin, LOW);
+    // sync, in which the next image row is copied in; the copy only has to
+    // be done by the end of the back porch
+    halPinWrite(hsyncPin, false);
+    const int next = scanLineY == ycrt ? ycrt + SCAN_STEP : ycrt;
+    if (!scanoutGenerator) {
+        prefetchIssue(*frontImage, next, 1);
+    }
     do {
-        ticksElapsed = timerRead(hSyncTimer);
+        ticksElapsed = halTimerRead(hSyncTimer);
     } while (ticksElapsed < ticksSync);
 
-    // back porch
-    REG_WRITE(GPIO_OUT_W1TS_REG, 1u << hsyncPin);
+    // back porch, in which a generator makes the next row; one that runs
+    // over only holds the blank longer, the sync pulse keeps its width
+    halGpioSet(1ull << hsyncPin);
+    if (scanoutGenerator && next < yres) {
+        generateRow(next, frameCount);
+    }
     do {
-        ticksElapsed = timerRead(hSyncTimer);
+        ticksElapsed = halTimerRead(hSyncTimer);
     } while (ticksElapsed < ticksBackPorch);
 
     // unset blank
-    REG_WRITE(GPIO_OUT_W1TS_REG, 1u << blankPin);
+    halGpioSet(1ull << blankPin);
+
+    const int32_t off = (int32_t) (entry - lastEntry) - hSyncPeriodCycles;
+    scanoutCounters.hSyncJitter.record(off < 0 ? -off : off);
+    scanoutCounters.hSyncCycles.record(cycleCount() - entry);
+    lastEntry = entry;
+}
+
+// Vertical blanking is the one stretch core 1 is not scanning out, so the
+// time left until `ticks` of the vsync timer renders tiles instead
+static void IRAM_ATTR lendBlanking(uint64_t ticks)
+{
+    const uint64_t now = halTimerRead(vSyncTimer);
+    if (now < ticks) {
+        lendRenderTime((ticks - now) * (METRICS_CYCLE_HZ / HAL_TIMER_HZ));
+    }
 }
 
 void IRAM_ATTR vSyncInt()
 {
+    TRACE_SCOPE(Vsync, "vsync");
+    static uint32_t lastEntry;
+    static uint32_t lastPixels;
+    const uint32_t  entry = cycleCount();
+
     uint64_t       ticksElapsed{};
     const uint64_t ticksFrontPorch = 40000.0 * VGA480p.vFrontPorch;
     const uint64_t ticksSync = ticksFrontPorch + 40000.0 * VGA480p.vSyncTime;
     const uint64_t ticksBackPorch = ticksSync + 40000.0 * VGA480p.vBackPorch;
 
     // write blank
-    REG_WRITE(GPIO_OUT_W1TC_REG, 1u << blankPin);
+    halGpioClear(1ull << blankPin);
+
+    // page flip, and the first rows of the next frame generated or on
+    // their way into the prefetch ring
+    if (pendingImage) {
+        frontImage   = pendingImage;
+        pendingImage = nullptr;
+        prefetchInvalidate();
+    }
+    if (scanoutGenerator) {
+        generateRow(0, frameCount + 1);
+    }
+    else {
+        prefetchIssue(*frontImage, 0, PREFETCH_LINES - 1);
+    }
 
-    // front porch
+    // front porch; here and below the wait goes to the renderer first
+    lendBlanking(ticksFrontPorch);
     do {
-        ticksElapsed = timerRead(vSyncTimer);
+        ticksElapsed = halTimerRead(vSyncTimer);
     } while (ticksElapsed < ticksFrontPorch);
 
     // sync
-    REG_WRITE(GPIO_OUT_W1TC_REG, 1u << vsyncPin);
+    halGpioClear(1ull << vsyncPin);
+    lendBlanking(ticksSync);
     do {
-        ticksElapsed = timerRead(vSyncTimer);
+        ticksElapsed = halTimerRead(vSyncTimer);
     } while (ticksElapsed < ticksSync);
 
     // back porch
-    REG_WRITE(GPIO_OUT_W1TS_REG, 1u << vsyncPin);
+    halGpioSet(1ull << vsyncPin);
+    lendBlanking(ticksBackPorch);
     do {
-        ticksElapsed = timerRead(vSyncTimer);
+        ticksElapsed = halTimerRead(vSyncTimer);
     } while (ticksElapsed < ticksBackPorch);
 
     // unset blank
-    REG_WRITE(GPIO_OUT_W1TS_REG, 1u << blankPin);
+    halGpioSet(1ull << blankPin);
 
     // reset pixel
     xcrt = ycrt = 0;
+    scanLineY   = -1;
+    ++frameCount;
 
     // reset timer
-    timerWrite(hSyncTimer, 0);
+    halTimerWrite(hSyncTimer, 0);
     ticksElapsed = crtTicks = 0;
+
+    // pixels loop() got out this frame against what the mode has
+    ScanoutCounters &counters = scanoutCounters;
+    const uint32_t   pixels   = counters.pixels;
+    counters.lastFramePixels  = pixels - lastPixels;
+    counters.expectedPixels   = (xres / SCAN_STEP) * (yres / SCAN_STEP);
+    lastPixels                = pixels;
+    if (counters.lastFramePixels < counters.expectedPixels) {
+        counters.shortFrames.add();
+    }
+    counters.frames.add();
+
+    const int32_t off = (int32_t) (entry - lastEntry) - vSyncPeriodCycles;
+    counters.vSyncJitter.record(off < 0 ? -off : off);
+    counters.vSyncCycles.record(cycleCount() - entry);
+    lastEntry = entry;
 }
 
+void presentImage(Image *next)
+{
+    // Swapped in by vSyncInt, so the frame never tears
+    pendingImage = next;
+}
+
+bool waitForVsync(uint32_t timeoutMs)
+{
+    // Gives up if the signal is not running
+    uint32_t frame = frameCount;
+    uint32_t start = nowMicros();
+    while (frameCount == frame) {
+        if (nowMicros() - start >= timeoutMs * 1000) {
+            return false;
+        }
+        sleepMillis(1);
+    }
+    return true;
+}
+
+#ifdef ARDUINO
+
 void tftInit()
 {
     // ─── Initialize Display ──────────────────────────────────────────────
@@ -162,81 +404,116 @@ void tftInit()
 void *pngOpen(const char *filepath, int32_t *size)
 {
     Serial.printf("Opening file %s\n", filepath);
-    pngFile = SD.open(filepath);
-    if (!pngFile) {
-        Serial.println("Failed to open file for reading");
+    if (!pngReader.open(filepath)) {
         return nullptr;
     }
-    *size = pngFile.size();
-    return (void *) &pngFile;
+    *size = pngReader.size();
+    return (void *) &pngReader;
 }
 
 void pngClose(void *pHandle)
 {
-    if (pngFile) {
-        pngFile.close();
-    }
+    pngReader.close();
 }
 
 int32_t pngRead(PNGFILE *pHandle, uint8_t *pBuf, int32_t bufSize)
 {
-    if (!pngFile) {
-        return 0;
-    }
-    return pngFile.read(pBuf, bufSize);
+    return pngReader.read(pBuf, bufSize);
 }
 
 int32_t pngSeek(PNGFILE *pHandle, int32_t offset)
 {
-    if (!pngFile) {
-        return 0;
-    }
-    return pngFile.seek(offset);
+    return pngReader.seek(offset) ? offset : -1;
 }
 
-void drawPng(PNGDRAW *pDraw)
+// Converts a decoded PNG row to RGB888; 8-bit formats go straight through
+// the conversion kernels, anything else through the decoder's RGB565 path
+static void pngRowToRgb888(PNGDRAW *pDraw, Color *dst, int n)
 {
-    // draw on tft every 4th line
-    if (pDraw->y % 4 == 0) {
-        uint16_t usPixels[640];
-        pngdec.getLineAsRGB565(
-                pDraw, usPixels, PNG_RGB565_LITTLE_ENDIAN, 0xffffffff);
-
-        // resize to 160
-        for (int i = 0; i < 160; ++i) {
-            usPixels[i] = usPixels[i * 4];
+    if (pDraw->iBpp == 8) {
+        switch (pDraw->iPixelType) {
+            case PNG_PIXEL_TRUECOLOR:
+                memcpy(dst, pDraw->pPixels, n * sizeof(Color));
+                return;
+            case PNG_PIXEL_TRUECOLOR_ALPHA:
+                premultiplyRgba(pDraw->pPixels, dst, n);
+                return;
+            case PNG_PIXEL_INDEXED:
+                indexedToRgb888(pDraw->pPixels,
+                        (const Color *) pDraw->pPalette, dst, n);
+                return;
+            case PNG_PIXEL_GRAYSCALE:
+                grayToRgb888(pDraw->pPixels, dst, n);
+                return;
         }
-
-        tft.pushImage(0, pDraw->y / 4, 160, 1, usPixels);
     }
 
-    // update image for vga
-    for (int i = 0; i < 640; i++) {
-        image.set(i, pDraw->y,
-                Color{ (unsigned char) ((pDraw->pPixels[i] >> 16) & 0xff),
-                        (unsigned char) ((pDraw->pPixels[i] >> 8) & 0xff),
-                        (unsigned char) (pDraw->pPixels[i] & 0xff) });
+    pngdec.getLineAsRGB565(pDraw, pngLine565, PNG_RGB565_LITTLE_ENDIAN, 0);
+    rgb565ToRgb888(pngLine565, dst, n);
+}
+
+void drawPng(PNGDRAW *pDraw)
+{
+    const int width = min(pDraw->iWidth, SCANLINE_MAX);
+    pngRowToRgb888(pDraw, pngLine, width);
+
+    // update image for vga, clipped to the target window; the TFT mirror
+    // picks the row up if it is on screen
+    if (pDraw->y < pngTarget.height) {
+        memcpy(pngTarget.row(pDraw->y), pngLine,
+                min(width, pngTarget.width) * sizeof(Color));
+        mirrorDirty(pngTarget.sub(0, pDraw->y, width, 1));
     }
 }
 
-bool decodePng(const char *filepath)
+static bool decodePngLocked(const char *filepath, const ImageView &target)
 {
-    if (pngdec.open(filepath, pngOpen, pngClose, pngRead, pngSeek, drawPng)
-            == PNG_SUCCESS) {
+    TRACE_SCOPE(Decode, "decode png");
+    const uint32_t start = micros();
+    pngTarget            = target;
+
+    TRACE_BEGIN(Decode, "png open");
+    const int opened = pngdec.open(
+            filepath, pngOpen, pngClose, pngRead, pngSeek, drawPng);
+    TRACE_END(Decode, "png open");
+    if (opened == PNG_SUCCESS) {
         Serial.printf("Image specs: (%d x %d), %d bpp, pixel type: %d\n",
                 pngdec.getWidth(), pngdec.getHeight(), pngdec.getBpp(),
                 pngdec.getPixelType());
 
-        if (pngdec.decode(NULL, 0) != PNG_SUCCESS) {
+        pngLine    = (Color *) lineAllocator().allocate(
+                SCANLINE_MAX * sizeof(Color));
+        pngLine565 = (uint16_t *) lineAllocator().allocate(
+                SCANLINE_MAX * sizeof(uint16_t));
+
+        TRACE_BEGIN(Decode, "png inflate");
+        bool success = pngLine && pngLine565
+                       && pngdec.decode(NULL, 0) == PNG_SUCCESS;
+        TRACE_END(Decode, "png inflate");
+        lineAllocator().deallocate(pngLine);
+        lineAllocator().deallocate(pngLine565);
+        pngLine    = nullptr;
+        pngLine565 = nullptr;
+        pngdec.close();
+        if (!success) {
             Serial.println("Failed to decode PNG");
-            return false;
         }
-
-        pngdec.close();
-        return true;
+        else {
+            decodeMicros.record(micros() - start);
+        }
+        return success;
     }
     else {
         Serial.println("Failed to open PNG");
         return false;
     }
-}
\ No newline at end of file
+}
+
+bool decodePng(const char *filepath, const ImageView &target)
+{
+    PNG_LOCK();
+    const bool success = decodePngLocked(filepath, target);
+    PNG_UNLOCK();
+    return success;
+}
+#endif
@@ -0,0 +1,193 @@
+// ====================================================== //
+// ============ Iterative directory tree walk =========== //
+// ====================================================== //
+
+#include "walk.h"
+
+#include <cstring>
+
+#ifndef ARDUINO
+#include <sys/stat.h>
+#endif
+
+// ─── Directory Access ───────────────────────────────────────────────────
+
+#ifdef ARDUINO
+typedef File DirHandle;
+
+static bool openDir(DirHandle &dir, const char *path)
+{
+    dir = SD.open(path);
+    return dir && dir.isDirectory();
+}
+
+// getNextFileName() reads the directory without opening every entry
+static bool nextEntry(DirHandle &dir, const std::string &parent,
+        std::string &path, bool &isDir)
+{
+    String next = dir.getNextFileName(&isDir);
+    if (!next.length()) {
+        return false;
+    }
+    path = next.c_str();
+    return true;
+}
+
+static void closeDir(DirHandle &dir)
+{
+    dir.close();
+}
+
+bool isDirectory(const char *path)
+{
+    File file = SD.open(path);
+    return file && file.isDirectory();
+}
+#else
+typedef DIR *DirHandle;
+
+static bool openDir(DirHandle &dir, const char *path)
+{
+    dir = opendir(path);
+    return dir != nullptr;
+}
+
+static bool nextEntry(DirHandle &dir, const std::string &parent,
+        std::string &path, bool &isDir)
+{
+    dirent *entry;
+    do {
+        entry = readdir(dir);
+    } while (entry && (!strcmp(entry->d_name, ".")
+                     || !strcmp(entry->d_name, "..")));
+    if (!entry) {
+        return false;
+    }
+
+    path = parent;
+    if (path.empty() || path.back() != '/') {
+        path += '/';
+    }
+    path += entry->d_name;
+
+    struct stat info;
+    isDir = entry->d_type == DT_DIR
+            || (entry->d_type == DT_UNKNOWN
+                    && lstat(path.c_str(), &info) == 0
+                    && S_ISDIR(info.st_mode));
+    return true;
+}
+
+static void closeDir(DirHandle &dir)
+{
+    closedir(dir);
+}
+
+bool isDirectory(const char *path)
+{
+    struct stat info;
+    return lstat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+#endif
+
+// ─── Walk ───────────────────────────────────────────────────────────────
+
+TreeWalker::TreeWalker(const char *root)
+{
+    if (isDirectory(root)) {
+        stack.push_back({ root, 0, false });
+    }
+    else {
+        parent = root;
+        single = true;
+    }
+}
+
+TreeWalker::~TreeWalker()
+{
+    if (dirOpen) {
+        closeDir(dir);
+    }
+}
+
+bool TreeWalker::next(WalkStep &step, std::string &path, int &depth)
+{
+    if (single) {
+        single = false;
+        step   = WalkStep::File;
+        path   = parent;
+        depth  = 0;
+        return true;
+    }
+
+    if (pendingOpen) {
+        pendingOpen  = false;
+        Frame &top   = stack.back();
+        top.expanded = true;
+        parent       = top.path;
+        childDepth   = top.depth + 1;
+        dirOpen      = openDir(dir, parent.c_str());
+        ok &= dirOpen;
+    }
+
+    // Files come while their directory is open, folders go on the stack
+    bool isDir;
+    while (dirOpen) {
+        if (!nextEntry(dir, parent, path, isDir)) {
+            closeDir(dir);
+            dirOpen = false;
+        }
+        else if (isDir) {
+            stack.push_back({ path, childDepth, false });
+        }
+        else {
+            step  = WalkStep::File;
+            depth = childDepth;
+            return true;
+        }
+    }
+
+    if (stack.empty()) {
+        return false;
+    }
+    Frame &top = stack.back();
+    path       = top.path;
+    depth      = top.depth;
+    if (top.expanded) {
+        step = WalkStep::LeaveDir;
+        stack.pop_back();
+    }
+    else {
+        step        = WalkStep::EnterDir;
+        pendingOpen = true;
+    }
+    return true;
+}
+
+void TreeWalker::skip()
+{
+    if (pendingOpen) {
+        pendingOpen = false;
+        stack.pop_back();
+    }
+}
+
+bool walkTree(const char *root, const WalkVisitor &visit)
+{
+    TreeWalker  walker(root);
+    WalkStep    step;
+    std::string path;
+    int         depth;
+    while (walker.next(step, path, depth)) {
+        switch (visit(step, path, depth)) {
+            case WalkAction::Stop:
+                return false;
+            case WalkAction::Skip:
+                walker.skip();
+                break;
+            case WalkAction::Continue:
+                break;
+        }
+    }
+    return walker.succeeded();
+}
@@ -0,0 +1,366 @@
+// ====================================================== //
+// ========== Write-behind buffered file writes ========= //
+// ====================================================== //
+
+#include "writer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "report.h"
+
+#define STOP -1  // queued after the last buffer, echoed back when done
+
+// ─── Index Queue ────────────────────────────────────────────────────────
+
+#ifdef ARDUINO
+void IndexQueue::create(int depth)
+{
+    queue = xQueueCreate(depth, sizeof(int));
+}
+
+void IndexQueue::destroy()
+{
+    if (queue) {
+        vQueueDelete(queue);
+        queue = nullptr;
+    }
+}
+
+void IndexQueue::push(int index)
+{
+    xQueueSend(queue, &index, portMAX_DELAY);
+}
+
+int IndexQueue::pop()
+{
+    int index;
+    xQueueReceive(queue, &index, portMAX_DELAY);
+    return index;
+}
+
+bool IndexQueue::tryPop(int &index)
+{
+    return xQueueReceive(queue, &index, 0) == pdTRUE;
+}
+
+int IndexQueue::count()
+{
+    return uxQueueMessagesWaiting(queue);
+}
+#else
+void IndexQueue::create(int depth)
+{
+    items.clear();
+}
+
+void IndexQueue::destroy()
+{
+    items.clear();
+}
+
+void IndexQueue::push(int index)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        items.push_back(index);
+    }
+    ready.notify_one();
+}
+
+int IndexQueue::pop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return !items.empty(); });
+    int index = items.front();
+    items.pop_front();
+    return index;
+}
+
+bool IndexQueue::tryPop(int &index)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (items.empty()) {
+        return false;
+    }
+    index = items.front();
+    items.pop_front();
+    return true;
+}
+
+int IndexQueue::count()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.size();
+}
+#endif
+
+// ─── Write Behind ───────────────────────────────────────────────────────
+
+void WriteBehind::workerLoop(void *args)
+{
+    WriteBehind *writer = (WriteBehind *) args;
+    for (;;) {
+        int index = writer->fullBuffers.pop();
+        if (index == STOP) {
+            break;
+        }
+        const uint8_t *data = writer->buffers[index];
+        if (!writer->failed && !writer->sink(data, writer->sizes[index])) {
+            writer->failed = true;
+        }
+        writer->freeBuffers.push(index);
+    }
+
+    writer->freeBuffers.push(STOP);
+#ifdef ARDUINO
+    vTaskDelete(NULL);
+#endif
+}
+
+WriteBehind::~WriteBehind()
+{
+    finish();
+}
+
+bool WriteBehind::begin(WriteSink sink)
+{
+    finish();
+
+    // Internal DMA-capable memory lets the SD driver skip its bounce
+    // buffer; PSRAM still beats not buffering at all
+    for (int i = 0; i < WRITE_BUFFERS; ++i) {
+        owners[i]  = &heapAllocator(MemoryRegion::InternalDma);
+        buffers[i] = (uint8_t *) owners[i]->allocate(WRITE_BUFFER, 64);
+        if (!buffers[i]) {
+            owners[i]  = &heapAllocator(MemoryRegion::Psram);
+            buffers[i] = (uint8_t *) owners[i]->allocate(WRITE_BUFFER, 64);
+        }
+        if (!buffers[i]) {
+            report("No memory for write buffers\n");
+            for (int j = 0; j < i; ++j) {
+                owners[j]->deallocate(buffers[j]);
+                buffers[j] = nullptr;
+            }
+            return false;
+        }
+    }
+
+    this->sink = sink;
+    failed     = false;
+    stats      = WriteStats{};
+    start      = nowMicros();
+    filling    = -1;
+
+    freeBuffers.create(WRITE_BUFFERS + 1);
+    fullBuffers.create(WRITE_BUFFERS + 1);
+    for (int i = 0; i < WRITE_BUFFERS; ++i)
+        freeBuffers.push(i);
+
+#ifdef ARDUINO
+    if (xTaskCreatePinnedToCore(
+                workerLoop, "Write Behind Task", 4096, this, 1, NULL, 0)
+            != pdPASS) {
+        report("Failed to start the writer task\n");
+        for (int i = 0; i < WRITE_BUFFERS; ++i) {
+            owners[i]->deallocate(buffers[i]);
+            buffers[i] = nullptr;
+        }
+        freeBuffers.destroy();
+        fullBuffers.destroy();
+        return false;
+    }
+#else
+    worker = std::thread(workerLoop, this);
+#endif
+    running = true;
+    return true;
+}
+
+bool WriteBehind::open(const char *path)
+{
+#ifdef ARDUINO
+    file = SD.open(path, FILE_WRITE);
+#else
+    file = fopen(path, "wb");
+#endif
+    if (!file) {
+        report("Failed to open file %s for writing\n", path);
+        return false;
+    }
+
+    bool started = begin([this](const uint8_t *data, size_t size) {
+#ifdef ARDUINO
+        return file.write(data, size) == size;
+#else
+        return fwrite(data, 1, size, file) == size;
+#endif
+    });
+    if (!started) {
+#ifdef ARDUINO
+        file.close();
+#else
+        fclose(file);
+        file = nullptr;
+#endif
+    }
+    return started;
+}
+
+bool WriteBehind::write(const uint8_t *data, size_t size)
+{
+    if (!running || failed) {
+        return false;
+    }
+
+    while (size) {
+        if (filling < 0) {
+            // Back-pressure: wait for the sink to hand a buffer back
+            if (!freeBuffers.tryPop(filling)) {
+                ++stats.stalls;
+                filling = freeBuffers.pop();
+            }
+            sizes[filling] = 0;
+        }
+
+        size_t take = WRITE_BUFFER - sizes[filling];
+        if (take > size) {
+            take = size;
+        }
+        memcpy(buffers[filling] + sizes[filling], data, take);
+        sizes[filling] += take;
+        data += take;
+        size -= take;
+        stats.bytes += take;
+
+        if (sizes[filling] == WRITE_BUFFER) {
+            fullBuffers.push(filling);
+            filling = -1;
+        }
+    }
+    return !failed;
+}
+
+bool WriteBehind::finish()
+{
+    if (!running) {
+        return false;
+    }
+
+    if (filling >= 0 && sizes[filling]) {
+        fullBuffers.push(filling);
+    }
+    fullBuffers.push(STOP);
+    while (freeBuffers.pop() != STOP) {
+    }
+#ifndef ARDUINO
+    worker.join();
+#endif
+
+    for (int i = 0; i < WRITE_BUFFERS; ++i) {
+        owners[i]->deallocate(buffers[i]);
+        buffers[i] = nullptr;
+    }
+    freeBuffers.destroy();
+    fullBuffers.destroy();
+
+#ifdef ARDUINO
+    if (file) {
+        file.close();
+    }
+#else
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+#endif
+
+    stats.micros = nowMicros() - start;
+    running      = false;
+    filling      = -1;
+    return !failed;
+}
+
+bool WriteBehind::isRunning() const
+{
+    return running;
+}
+
+size_t WriteBehind::room()
+{
+    if (!running) {
+        return SIZE_MAX;  // write() fails straight away
+    }
+    const size_t left = filling >= 0 ? WRITE_BUFFER - sizes[filling] : 0;
+    return left + freeBuffers.count() * WRITE_BUFFER;
+}
+
+// ─── Self Test ──────────────────────────────────────────────────────────
+
+bool testWriteBehind()
+{
+    const size_t         total = 5 * WRITE_BUFFER + 1234;
+    std::vector<uint8_t> received;
+    std::vector<size_t>  writes;
+    bool                 ok = true;
+
+    // A sink much slower than the producer, as the SD card is to WiFi
+    WriteBehind writer;
+    ok &= check(writer.begin([&](const uint8_t *data, size_t size) {
+        sleepMillis(20);
+        received.insert(received.end(), data, data + size);
+        writes.push_back(size);
+        return true;
+    }),
+            "begin", 0);
+    ok &= check(writer.room() == WRITE_BUFFERS * WRITE_BUFFER, "room",
+            writer.room());
+
+    uint8_t fragment[1436];
+    size_t  sent = 0;
+    for (size_t n = 1; sent < total; n = n * 7 % sizeof(fragment) + 1) {
+        if (n > total - sent) {
+            n = total - sent;
+        }
+        for (size_t i = 0; i < n; ++i)
+            fragment[i] = (sent + i) * 13;
+        // What room() promises is taken without a stall
+        const size_t   room   = writer.room();
+        const uint32_t stalls = writer.lastStats().stalls;
+        ok &= check(writer.write(fragment, n), "write", sent);
+        ok &= check(room < n || writer.lastStats().stalls == stalls,
+                "stall within room", sent);
+        sent += n;
+    }
+    ok &= check(writer.finish(), "finish", 0);
+
+    // Everything arrived, in order, in whole buffers but the last
+    ok &= check(received.size() == total, "size", received.size());
+    for (size_t i = 0; i < received.size() && ok; ++i)
+        ok &= check(received[i] == (uint8_t) (i * 13), "order", i);
+    for (size_t i = 0; i + 1 < writes.size(); ++i)
+        ok &= check(writes[i] == WRITE_BUFFER, "buffer size", i);
+
+    // The producer had to wait on the sink instead of piling up memory
+    const WriteStats stats = writer.lastStats();
+    ok &= check(stats.stalls > 0, "back-pressure", stats.stalls);
+    ok &= check(stats.bytes == total, "stats", stats.bytes);
+
+    // A failing sink surfaces in write() and finish()
+    std::atomic<int> calls{ 0 };
+    ok &= check(writer.begin([&](const uint8_t *data, size_t size) {
+        return ++calls < 2;
+    }),
+            "begin failing", 0);
+    static uint8_t block[WRITE_BUFFER];
+    bool           accepted = true;
+    for (int i = 0; i < 8 && accepted; ++i)
+        accepted = writer.write(block, sizeof(block));
+    ok &= check(!accepted, "write after failure", 0);
+    ok &= check(!writer.finish(), "finish after failure", calls);
+
+    report("Write-behind tests %s (%u stalls)\n", ok ? "passed" : "failed",
+            (unsigned) stats.stalls);
+    return ok;
+}